@@ -20,6 +20,9 @@ typedef struct
 
     uint32_t (*ack_int)();
     void (*end_of_int)(uint32_t iar);
+
+    uint32_t (*cpu_target)(); // Target mask of the calling CPU's interface.
+    void (*send_sgi)(uint32_t intid, uint32_t targets);
 }
 aarch64_gic_t;
 
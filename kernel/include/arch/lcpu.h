@@ -1,16 +1,53 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+typedef struct smp_cpu smp_cpu_t;
 
 void arch_lcpu_halt();
 
+/**
+ * @brief Halt until an interrupt arrives or, where the CPU can monitor memory,
+ * until `*wake` is written.
+ *
+ * Called with interrupts masked, returns with them enabled. Returns right
+ * away if `*wake` is already set.
+ */
+void arch_lcpu_wait(volatile bool *wake);
+
+/**
+ * @brief Get `cpu` out of `arch_lcpu_wait` once its wake flag is set, with an
+ * IPI unless writing the flag already did it.
+ */
+void arch_lcpu_wake(smp_cpu_t *cpu);
+
+/**
+ * @brief Send the reschedule IPI to `cpu`.
+ */
+void arch_lcpu_send_ipi(smp_cpu_t *cpu);
+
+/**
+ * @brief Register the handler of the reschedule IPI.
+ */
+void arch_lcpu_set_ipi_handler(void (*handler)());
+
 void arch_lcpu_int_mask();
 void arch_lcpu_int_unmask();
 bool arch_lcpu_int_enabled();
 
 void arch_lcpu_relax();
 
-size_t arch_lcpu_thread_reg_read();
-void arch_lcpu_thread_reg_write(size_t t);
+/**
+ * @brief Read a free-running cycle counter of the current CPU: the TSC on
+ * x86_64, the virtual counter on aarch64. Only differences are meaningful.
+ */
+uint64_t arch_lcpu_cycles();
+
+/**
+ * @brief Point the per-CPU base register of the current CPU at `cpu`, see
+ * `proc/percpu.h`.
+ */
+void arch_lcpu_percpu_init(smp_cpu_t *cpu);
 
 void arch_lcpu_init();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "proc/cpumask.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -7,14 +8,49 @@ typedef struct arch_paging_map arch_paging_map_t;
 
 // Mapping and unmapping
 
+/**
+ * @brief Map `paddr` at `vaddr`, allocating the page tables on the way.
+ *
+ * @return 0, or -1 if a page table could not be allocated, in which case the
+ * map is left as it was.
+ */
 int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t size, int prot);
 
 int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr);
 
+/**
+ * @brief Move the last-level table mapping the 2 MiB block at `old_vaddr` so
+ * that it maps the block at `new_vaddr` instead.
+ *
+ * Both addresses must be 2 MiB aligned and nothing may be mapped in the new
+ * block. An empty table already in place there is swapped with the old one.
+ *
+ * @return false if the table could not be moved, nothing changed in that case.
+ */
+bool arch_paging_move_table(arch_paging_map_t *map, uintptr_t old_vaddr, uintptr_t new_vaddr);
+
+/**
+ * @brief Drop the translations of `[vaddr, vaddr + length)` from the TLBs of
+ * the CPUs in `cpus`, after `arch_paging_unmap_page` or
+ * `arch_paging_move_table` changed them. Those only flush the current CPU.
+ *
+ * Returns once every CPU is done, so the pages that were mapped there can be
+ * reused. Must not be called from an interrupt handler.
+ */
+void arch_paging_shootdown(const cpumask_t *cpus, uintptr_t vaddr, size_t length);
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr);
 
+/**
+ * @brief Test and clear the accessed bit of the base page mapped at `vaddr`.
+ *
+ * @return true if the page was accessed since the last call. Architectures
+ * that do not track accesses in hardware always return false.
+ */
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr);
+
 // Map creation and destruction
 
 arch_paging_map_t *arch_paging_map_create();
@@ -6,17 +6,32 @@
 typedef struct arch_thread_context
 {
 #if defined(__x86_64__)
-    struct arch_thread_context *self;
     uint64_t fs, gs;
     void *fpu_area;
 #elif defined(__aarch64__)
 #endif
     uint64_t rsp;
     uint64_t kernel_stack;
-    uint64_t syscall_stack;
+#if defined(__x86_64__)
+    struct smp_cpu *fpu_cpu; // CPU whose registers last held the state in `fpu_area`.
+    uint8_t fpu_streak;      // Runs in a row that used the FPU.
+#endif
 }
 __attribute__((packed))
 arch_thread_context_t;
 
-void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry);
+/**
+ * @brief Set up the context of a new thread starting at `entry`.
+ *
+ * @return false if out of memory, with nothing left allocated.
+ */
+bool arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry);
+
+/**
+ * @brief Release what `arch_thread_context_init` allocated in the kernel.
+ *
+ * The thread must have stopped running for good. The user stack stays with the
+ * address space.
+ */
+void arch_thread_context_fini(arch_thread_context_t *context);
 void arch_thread_context_switch(arch_thread_context_t *curr, arch_thread_context_t *next);
@@ -7,6 +7,7 @@ typedef struct
     uint32_t eax;
     enum
     {
+        EBX,
         ECX,
         EDX
     }
@@ -87,7 +88,8 @@ x86_64_cpuid_response_t;
 #define X86_64_CPUID_FEATURE_RDRND        ((x86_64_cpuid_feature_t) {1, ECX, 30})
 #define X86_64_CPUID_FEATURE_HYPERVISOR   ((x86_64_cpuid_feature_t) {1, ECX, 31})
 
-#define X86_64_CPUID_FEATURE_AVX512       ((x86_64_cpuid_feature_t) {7, EBX, 16}
+#define X86_64_CPUID_FEATURE_FSGSBASE     ((x86_64_cpuid_feature_t) {7, EBX, 0})
+#define X86_64_CPUID_FEATURE_AVX512       ((x86_64_cpuid_feature_t) {7, EBX, 16})
 
 x86_64_cpuid_response_t x86_64_cpuid(uint32_t eax, uint32_t ecx);
 
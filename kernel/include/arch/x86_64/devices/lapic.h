@@ -2,6 +2,12 @@
 
 #include <stdint.h>
 
+#define X86_64_LAPIC_TIMER_IRQ 64
+#define X86_64_LAPIC_IPI_IRQ 65
+#define X86_64_LAPIC_TLB_IRQ 66
+
+uint32_t x86_64_lapic_id();
+
 void x86_64_lapic_send_eoi();
 
 void x86_64_lapic_ipi(uint32_t lapic_id, uint32_t vec);
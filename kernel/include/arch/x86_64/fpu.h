@@ -1,11 +1,30 @@
 #pragma once
 
+#include "arch/thread.h"
 #include <stddef.h>
 
 extern size_t x86_64_fpu_area_size;
 extern void (*x86_64_fpu_save)(void *area);
 extern void (*x86_64_fpu_restore)(void *area);
 
+/**
+ * @brief Fill a new save area with the initial FPU state.
+ */
+void x86_64_fpu_init_area(void *area);
+
+/**
+ * @brief Save the FPU state of `curr` if it used the FPU, and leave the FPU
+ * for `next` to trap on, or load it right away if `next` uses it regularly.
+ */
+void x86_64_fpu_switch(arch_thread_context_t *curr, arch_thread_context_t *next);
+
+/**
+ * @brief Handle #NM, raised by the first FPU instruction of a thread.
+ *
+ * @return false if the FPU was already in use and the exception is genuine.
+ */
+bool x86_64_fpu_trap();
+
 void x86_64_fpu_init();
 
 void x86_64_fpu_init_cpu();
@@ -0,0 +1,11 @@
+#pragma once
+
+/**
+ * @brief Flush the range of the TLB shootdown in progress if it is aimed at
+ * the current CPU, and tell the initiator.
+ *
+ * Called from the shootdown IPI, and from `arch_lcpu_relax`, so that a CPU
+ * spinning with interrupts masked, maybe on a lock the initiator holds, still
+ * answers.
+ */
+void x86_64_paging_shootdown_poll();
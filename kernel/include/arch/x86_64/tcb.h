@@ -0,0 +1,55 @@
+#pragma once
+
+#include "arch/x86_64/msr.h"
+#include <stdint.h>
+
+/*
+ * FS and GS base access. With FSGSBASE the bases are read and written
+ * directly instead of through their much slower MSRs, and userspace may set
+ * its own thread pointer with `wrfsbase`: it is enabled whenever CPUID
+ * reports it.
+ *
+ * In the kernel, GS holds the per-CPU data area, see `proc/percpu.h`, and the
+ * user GS base sits in KERNEL_GS_BASE until `swapgs`. The user GS helpers must be called with
+ * interrupts masked.
+ */
+
+extern bool x86_64_tcb_fsgsbase;
+
+static inline uint64_t x86_64_tcb_fs_read()
+{
+    if (!x86_64_tcb_fsgsbase)
+        return x86_64_msr_read(X86_64_MSR_FS_BASE);
+
+    uint64_t base;
+    asm volatile("rdfsbase %0" : "=r"(base));
+    return base;
+}
+
+static inline void x86_64_tcb_fs_write(uint64_t base)
+{
+    if (!x86_64_tcb_fsgsbase)
+        x86_64_msr_write(X86_64_MSR_FS_BASE, base);
+    else
+        asm volatile("wrfsbase %0" : : "r"(base) : "memory");
+}
+
+static inline uint64_t x86_64_tcb_user_gs_read()
+{
+    if (!x86_64_tcb_fsgsbase)
+        return x86_64_msr_read(X86_64_MSR_KERNEL_GS_BASE);
+
+    uint64_t base;
+    asm volatile("swapgs; rdgsbase %0; swapgs" : "=r"(base));
+    return base;
+}
+
+static inline void x86_64_tcb_user_gs_write(uint64_t base)
+{
+    if (!x86_64_tcb_fsgsbase)
+        x86_64_msr_write(X86_64_MSR_KERNEL_GS_BASE, base);
+    else
+        asm volatile("swapgs; wrgsbase %0; swapgs" : : "r"(base) : "memory");
+}
+
+void x86_64_tcb_init_cpu();
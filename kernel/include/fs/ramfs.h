@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fs/vfs.h"
+#include "sync/rcu.h"
 
 typedef struct ramfs_node ramfs_node_t;
 
@@ -9,11 +10,12 @@ struct ramfs_node
     vnode_t vn;
     ramfs_node_t *parent;
 
-    list_t children;
+    list_t children; // Walked under RCU, changed under the ramfs tree lock.
     xarray_t pages;
     size_t page_count;
 
     list_node_t list_node;
+    rcu_head_t rcu;
 };
 
 vfs_t *ramfs_create();
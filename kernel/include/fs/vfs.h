@@ -1,6 +1,7 @@
 #pragma once
 
 #include "mm/pm.h"
+#include "mm/reclaim.h"
 #include "sync/spinlock.h"
 #include "utils/list.h"
 #include "utils/xarray.h"
@@ -77,7 +78,7 @@ struct vnode
 
     // Misc
     atomic_uint refcount;
-    spinlock_t slock;
+    spinlock_t slock; // Protects the page cache.
 };
 
 struct vfs_dirent
@@ -87,6 +88,30 @@ struct vfs_dirent
     // TODO: Add other fields
 };
 
+struct vnode_ops
+{
+    // Read/Write
+    int (*read) (vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
+                 uint64_t *out_bytes_read);
+    int (*write)(vnode_t *vn, const void *buffer, uint64_t offset, uint64_t count,
+                 uint64_t *out_bytes_written);
+    int (*truncate)(vnode_t *vn, uint64_t size);
+    // Directory
+    int (*lookup) (vnode_t *vn, const char *name, vnode_t **out_vn);
+    int (*create) (vnode_t *vn, const char *name, vnode_type_t type, vnode_t **out_vn);
+    int (*remove) (vnode_t *vn, const char *name);
+    int (*mkdir)  (vnode_t *vn, const char *name, vnode_t **out_vn);
+    int (*rmdir)  (vnode_t *vn, const char *name);
+    int (*readdir)(vnode_t *vn, vfs_dirent_t **out_entries, size_t *out_count);
+    // Misc
+    int (*ioctl)(vnode_t *vn, uint64_t cmd, void *args);
+    int (*mmap) (vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
+                 int prot, int flags, uint64_t offset);
+    // Memory-backed vnodes
+    int (*get_page)(vnode_t *vn, uint64_t pg_idx, page_t **out); // Bypasses the page cache.
+    void (*release)(vnode_t *vn); // Called once the last reference is dropped.
+};
+
 /**
  * @brief Increment vnode reference count.
  *
@@ -113,40 +138,57 @@ static inline bool vnode_unref(vnode_t *vn)
 {
     if (atomic_fetch_sub_explicit(&vn->refcount, 1, memory_order_acq_rel) == 1)
     {
-        // TODO: run vnode destructor
+        // TODO: run a destructor for every vnode type
+        if (vn->ops && vn->ops->release)
+            vn->ops->release(vn);
         return true;
     }
     return false;
 }
 
-struct vnode_ops
-{
-    // Read/Write
-    int (*read) (vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
-                 uint64_t *out_bytes_read);
-    int (*write)(vnode_t *vn, const void *buffer, uint64_t offset, uint64_t count,
-                 uint64_t *out_bytes_written);
-    // Directory
-    int (*lookup) (vnode_t *vn, const char *name, vnode_t **out_vn);
-    int (*create) (vnode_t *vn, const char *name, vnode_type_t type, vnode_t **out_vn);
-    int (*remove) (vnode_t *vn, const char *name);
-    int (*mkdir)  (vnode_t *vn, const char *name, vnode_t **out_vn);
-    int (*rmdir)  (vnode_t *vn, const char *name);
-    int (*readdir)(vnode_t *vn, vfs_dirent_t **out_entries, size_t *out_count);
-    // Misc
-    int (*ioctl)(vnode_t *vn, uint64_t cmd, void *args);
-    int (*mmap) (vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
-                 int prot, int flags, uint64_t offset);
-};
-
 /*
  * Veneer layer.
 */
 
+// Page cache
+
+/**
+ * @brief Get the page cache page holding page `pg_idx` of a file, reading it
+ * in if it is not cached yet. Vnodes with a `get_page` operation hand out
+ * their own pages instead.
+ *
+ * The page is returned with a reference held, which keeps it from being
+ * reclaimed. Drop it with `pm_page_refcount_dec` once done.
+ */
+[[nodiscard]] int vfs_get_page(vnode_t *vn, uint64_t pg_idx, page_t **out);
+
+/**
+ * @brief Drop page `pg_idx` from the page cache if it is clean and unused.
+ *
+ * Called by reclaim with `vn->slock` held.
+ */
+reclaim_result_t vfs_evict_page(vnode_t *vn, uint64_t pg_idx, page_t *page);
+
+/**
+ * @brief Mark page `pg_idx` of the page cache dirty, as writes to a shared
+ * mapping of it do not go through `vfs_write`. The caller holds a reference
+ * to `page`.
+ */
+void vfs_dirty_page(vnode_t *vn, uint64_t pg_idx, page_t *page);
+
+/**
+ * @brief Pull up to `count` pages starting at `pg_idx` into the page cache,
+ * stopping at the end of the file or at the first error.
+ */
+void vfs_readahead(vnode_t *vn, uint64_t pg_idx, size_t count);
+
 // Read/Write
 [[nodiscard]] int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count, uint64_t *out_bytes_read);
 [[nodiscard]] int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count, uint64_t *out_bytes_written);
+[[nodiscard]] int vfs_truncate(vnode_t *vn, uint64_t size);
 // Directory
+// The vnodes handed out by `vfs_lookup` and `vfs_create`, and by the `lookup`
+// and `create` operations, come with a reference for the caller to drop.
 [[nodiscard]] int vfs_lookup(const char *path, vnode_t **out_vn);
 [[nodiscard]] int vfs_create(const char *path, vnode_type_t type, vnode_t **out_vn);
 [[nodiscard]] int vfs_remove(const char *path);
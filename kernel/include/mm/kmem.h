@@ -6,7 +6,7 @@
 
 #define MAG_SIZE 32
 #define SLAB_SIZE 0x1000
-#define MAX_CPUS 32
+#define MAX_CPUS 32 // CPUs brought up at most, see `smp_init`.
 
 typedef struct
 {
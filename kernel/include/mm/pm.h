@@ -3,12 +3,19 @@
 #include "arch/types.h"
 #include "utils/list.h"
 #include <stdatomic.h>
-#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define PM_MAX_PAGE_ORDER 10
 
+typedef enum
+{
+    PM_LRU_NONE,
+    PM_LRU_ACTIVE,
+    PM_LRU_INACTIVE
+}
+pm_lru_t;
+
 typedef struct
 {
     uintptr_t addr;
@@ -18,7 +25,14 @@ typedef struct
     atomic_uint mapcount;
     atomic_uint refcount;
 
-    list_node_t list_elem;
+    // Reclaim state, see `mm/reclaim.h`.
+    pm_lru_t lru;
+    bool anon;       // Anonymous page, swapped out rather than dropped.
+    bool referenced; // Page cache page looked up since the last scan.
+    void *owner;     // Address space or vnode the page belongs to.
+    uint64_t index;  // Virtual address or page index inside `owner`.
+
+    list_node_t list_elem; // Free list while free, LRU list while allocated.
 }
 page_t;
 
@@ -60,6 +74,16 @@ page_t *pm_phys_to_page(uintptr_t phys);
 page_t *pm_alloc(uint8_t order);
 void pm_free(page_t *page);
 
+/**
+ * @brief Number of free pages right now.
+ */
+size_t pm_free_page_count();
+
+/**
+ * @brief Number of pages managed by the allocator.
+ */
+size_t pm_total_page_count();
+
 // Initialization
 
 void pm_init();
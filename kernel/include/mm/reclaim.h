@@ -0,0 +1,65 @@
+#pragma once
+
+#include "mm/pm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Page reclaim.
+ *
+ * Pages that can be given back under memory pressure sit on an active and an
+ * inactive list. A clock hand sweeps the head of the inactive list: pages that
+ * were used since the last pass move to the active list, the others are
+ * evicted by their owner. Clean page cache pages are simply dropped, anonymous
+ * pages are written to swap first. The active list is aged into the inactive
+ * one so that both stay about the same length.
+ *
+ * A background thread keeps the free page count above a low watermark, and
+ * allocations of reclaimable memory reclaim directly once it falls below a
+ * minimum.
+ */
+
+typedef enum
+{
+    RECLAIM_EVICTED,  // The page was freed.
+    RECLAIM_ACTIVATE, // The page is in use, give it another round.
+    RECLAIM_RETRY     // The page could not be looked at right now.
+}
+reclaim_result_t;
+
+/**
+ * @brief Put a page on the inactive list.
+ *
+ * @param owner Address space for anonymous pages, vnode for page cache pages.
+ * @param index Virtual address or page index inside `owner`.
+ * @param anon Whether the page is anonymous.
+ */
+void reclaim_lru_add(page_t *page, void *owner, uint64_t index, bool anon);
+
+/**
+ * @brief Take a page off the LRU lists, if it is on one.
+ *
+ * Must be called before the owner frees a page it added.
+ */
+void reclaim_lru_remove(page_t *page);
+
+/**
+ * @brief Try to free `count` pages.
+ *
+ * @return Number of pages actually freed.
+ */
+size_t reclaim_pages(size_t count);
+
+/**
+ * @brief Allocate a page of reclaimable memory, reclaiming first if free
+ * memory is below the minimum watermark.
+ *
+ * Reclaim only try-locks the owners of the pages it evicts, so the lock of an
+ * address space may be held, as the fault path does. No other spinlock may
+ * be: eviction takes `pt_slock` and the LRU lock, and may wait for swap I/O.
+ */
+page_t *reclaim_alloc_page();
+
+// Initialization
+
+void reclaim_init();
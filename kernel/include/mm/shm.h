@@ -0,0 +1,34 @@
+#pragma once
+
+#include "fs/vfs.h"
+#include "sync/spinlock.h"
+#include "utils/xarray.h"
+
+/*
+ * Shared memory objects.
+ *
+ * An object is a memory-backed vnode. Its pages live in an xarray of its own
+ * instead of the page cache, are allocated zeroed on first use and are never
+ * reclaimed. Every `VM_MAP_SHARED` mapping of an object maps the very same
+ * pages, whatever the address space, so processes exchange data through it
+ * without copying. Objects are resized with `vfs_truncate` and freed once the
+ * last file descriptor and mapping are gone.
+ */
+
+typedef struct
+{
+    vnode_t vn;
+
+    xarray_t pages;
+    spinlock_t slock; // Protects `pages` and `vn.size`.
+}
+shm_t;
+
+/**
+ * @brief Create an empty shared memory object.
+ *
+ * @param name Only used for debugging, objects are not part of any filesystem.
+ *
+ * @return The object's vnode with one reference held, or NULL.
+ */
+vnode_t *shm_create(const char *name);
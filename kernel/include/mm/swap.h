@@ -0,0 +1,32 @@
+#pragma once
+
+#include "fs/vfs.h"
+#include "mm/pm.h"
+#include <stddef.h>
+
+/*
+ * Swap area.
+ *
+ * Anonymous pages evicted by reclaim are written to page-sized slots of a
+ * single swap device, which can be any vnode with read and write operations.
+ */
+
+/**
+ * @brief Start swapping to `vn`, using all of its `size` bytes.
+ *
+ * @return EBUSY if a swap device is already active.
+ */
+int swap_activate(vnode_t *vn);
+
+/**
+ * @brief Reserve a free slot.
+ *
+ * @return false if there is no swap device or it is full.
+ */
+bool swap_alloc(size_t *out_slot);
+
+void swap_free(size_t slot);
+
+int swap_write(size_t slot, page_t *page);
+
+int swap_read(size_t slot, page_t *page);
@@ -1,8 +1,12 @@
 #pragma once
 
 #include "arch/paging.h"
+#include "mm/reclaim.h"
+#include "mm/vmem.h"
+#include "sync/rwlock.h"
 #include "sync/spinlock.h"
 #include "utils/list.h"
+#include "utils/xarray.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -15,6 +19,17 @@ typedef struct vnode vnode_t;
 #define VM_MAP_FIXED_NOREPLACE 0x10
 #define VM_MAP_POPULATE        0x20
 
+#define VM_REMAP_MAYMOVE 0x01
+
+// Access hints, see `vm_advise`.
+#define VM_ADVICE_NORMAL     0
+#define VM_ADVICE_RANDOM     1
+#define VM_ADVICE_SEQUENTIAL 2
+#define VM_ADVICE_WILLNEED   3
+#define VM_ADVICE_DONTNEED   4
+#define VM_ADVICE_HUGEPAGE   5
+#define VM_ADVICE_NOHUGEPAGE 6
+
 typedef struct
 {
     uintptr_t start;
@@ -26,6 +41,9 @@ typedef struct
     vnode_t *vn; // Vnode backing this segment.
     uint64_t offset; // Offset into the vnode where this segment starts.
 
+    int advice;    // VM_ADVICE_NORMAL, _RANDOM or _SEQUENTIAL; steers readahead.
+    bool hugepage; // Fault in whole huge-page-sized blocks at once.
+
     list_node_t list_node;
 }
 vm_segment_t;
@@ -37,13 +55,25 @@ typedef struct vm_addrspace
     uintptr_t limit_low;
     uintptr_t limit_high;
 
-    spinlock_t slock;
+    // Taken shared by page faults and lookups, exclusively by anything that
+    // changes the segment list. PTE installs additionally hold `pt_slock`, so
+    // faults on different pages only serialize for the install itself.
+    rwlock_t lock;
+    spinlock_t pt_slock; // Serializes modifications of `page_map` and `swap_map`.
+
+    xarray_t swap_map; // Swap slot + 1 of every swapped out page, by page number.
+
+    // CPUs that loaded `page_map` and may cache its translations, which TLB
+    // shootdowns go to. Bits are never cleared, user translations are global
+    // on x86_64 and outlive a switch to another map.
+    cpumask_t cpus;
 }
 vm_addrspace_t;
 
 // Global data
 
 extern vm_addrspace_t *vm_kernel_as;
+extern vmem_t vm_kernel_arena; // Kernel virtual ranges handed out by `vm_alloc`.
 
 // Mapping and unmapping
 
@@ -53,9 +83,58 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
            uintptr_t *out);
 int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length);
 
+/**
+ * @brief Resize the mapping of `old_length` bytes at `vaddr`.
+ *
+ * Mappings shrink and grow in place when they can. Otherwise, with
+ * VM_REMAP_MAYMOVE, the page table entries are moved to a free range, whole
+ * page tables at a time where both ranges line up; the pages themselves are
+ * never copied.
+ *
+ * @return ENOENT if `vaddr` does not start a mapping of `old_length` bytes,
+ * EINVAL for device mappings that would have to grow, ENOMEM if there is no
+ * room for the new size.
+ */
+int vm_remap(vm_addrspace_t *as, uintptr_t vaddr, size_t old_length, size_t new_length,
+             int flags, uintptr_t *out);
+
+/**
+ * @brief Apply an access hint to a range of mappings.
+ *
+ * NORMAL, RANDOM, SEQUENTIAL, HUGEPAGE and NOHUGEPAGE are remembered by the
+ * segments covering the range, splitting them if needed. WILLNEED queues the
+ * range to be faulted in in the background and DONTNEED drops its pages right
+ * away; anonymous memory reads back as zero afterwards.
+ *
+ * @return EINVAL for a bad range or hint, ENOMEM if part of the range is not
+ * mapped.
+ */
+int vm_advise(vm_addrspace_t *as, uintptr_t vaddr, size_t length, int advice);
+
+// Page faults
+
+/**
+ * @brief Resolve a fault on a non-present page.
+ *
+ * Anonymous segments are populated on first touch, so this is what actually
+ * backs them with memory. Writes to the zero page are also resolved here.
+ *
+ * @return true if the faulting access can be retried, false if it is invalid.
+ */
+bool vm_page_fault(vm_addrspace_t *as, uintptr_t vaddr, bool write);
+
+/**
+ * @brief Swap out an anonymous page of `as` mapped at `vaddr`.
+ *
+ * Called by reclaim with `as->lock` held for reading. The page is freed if it
+ * is evicted.
+ */
+reclaim_result_t vm_evict_page(vm_addrspace_t *as, uintptr_t vaddr, page_t *page);
+
 // Memory allocation
 
 void *vm_alloc(size_t size);
+void *vm_alloc_prot(size_t size, int prot);
 void vm_free(void *obj);
 
 // Userspace utils
@@ -64,6 +143,25 @@ size_t vm_copy_to_user(vm_addrspace_t *dest_as, uintptr_t dest, const void *src,
 size_t vm_copy_from_user(vm_addrspace_t *src_as, void *dest, uintptr_t src, size_t count);
 size_t vm_zero_out_user(vm_addrspace_t *dest_as, uintptr_t dest, size_t count);
 
+/**
+ * @brief Physical address `vaddr` maps to, faulting the page in, for writing
+ * if `write` is set, should it not be yet.
+ *
+ * @return false if `vaddr` is not mapped or does not allow the access.
+ */
+bool vm_user_to_phys(vm_addrspace_t *as, uintptr_t vaddr, bool write, uintptr_t *out);
+
+/**
+ * @brief Read the aligned 32-bit word at `vaddr` if its page is mapped, never
+ * faulting, so that it may be called under spinlocks. The page can not be
+ * freed while it is read.
+ *
+ * @param out_phys Physical address the word was read from.
+ *
+ * @return false if the page is not mapped.
+ */
+bool vm_user_load_u32(vm_addrspace_t *as, uintptr_t vaddr, uint32_t *out, uintptr_t *out_phys);
+
 // Address space creation and destruction
 
 vm_addrspace_t *vm_addrspace_create();
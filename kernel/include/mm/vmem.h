@@ -0,0 +1,101 @@
+#pragma once
+
+#include "mm/kmem.h"
+#include "sync/spinlock.h"
+#include "utils/list.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Resource arena allocator in the style of Bonwick's vmem.
+ *
+ * An arena manages an integer range (usually kernel virtual addresses) split
+ * into segments described by boundary tags. Free segments live on
+ * power-of-two freelists so allocation is an instant fit, allocated segments
+ * are hashed by their base so that frees find their tag in O(1), and small
+ * allocations are served by per-CPU quantum caches without touching the arena
+ * lock at all.
+ */
+
+#define VMEM_FREELISTS 64
+#define VMEM_HASH_SIZE 256
+#define VMEM_QCACHE_MAX 8   // Largest quantum cache, in quanta.
+#define VMEM_QCACHE_SIZE 16 // Ranges held by one per-CPU quantum cache.
+
+typedef enum
+{
+    VMEM_BTAG_SPAN,
+    VMEM_BTAG_FREE,
+    VMEM_BTAG_ALLOC
+}
+vmem_btag_type_t;
+
+typedef struct
+{
+    vmem_btag_type_t type;
+    uintptr_t base;
+    size_t size;
+
+    list_node_t seg_node;  // Arena segment list, sorted by address.
+    list_node_t list_node; // Freelist or hash chain, depending on type.
+}
+vmem_btag_t;
+
+typedef struct
+{
+    size_t count;
+    uintptr_t ranges[VMEM_QCACHE_SIZE];
+}
+vmem_qcache_t;
+
+typedef struct
+{
+    const char *name;
+    size_t quantum;
+    size_t qcache_max; // Allocations up to this many bytes go through the quantum caches.
+
+    list_t segments;
+    list_t freelists[VMEM_FREELISTS];
+    uint64_t freemap; // Bit N set if freelists[N] is not empty.
+    list_t hash[VMEM_HASH_SIZE];
+    spinlock_t slock;
+
+    size_t in_use;
+    size_t total;
+
+    vmem_qcache_t qcache[MAX_CPUS][VMEM_QCACHE_MAX];
+}
+vmem_t;
+
+/**
+ * @brief Initialize an arena, optionally with an initial span.
+ *
+ * @param quantum Allocation granularity; must be a power of two.
+ * @param qcache_max Largest size served by the quantum caches, 0 to disable them.
+ */
+void vmem_init(vmem_t *arena, const char *name, uintptr_t base, size_t size,
+               size_t quantum, size_t qcache_max);
+
+/**
+ * @brief Add a span of free resource to the arena.
+ */
+bool vmem_add(vmem_t *arena, uintptr_t base, size_t size);
+
+/**
+ * @brief Allocate `size` bytes of resource.
+ *
+ * @return Base of the allocated range or 0 on failure.
+ */
+uintptr_t vmem_alloc(vmem_t *arena, size_t size);
+
+/**
+ * @brief Return a range obtained with `vmem_alloc` to the arena.
+ */
+void vmem_free(vmem_t *arena, uintptr_t base, size_t size);
+
+/**
+ * @brief Look up the size of an allocated range.
+ *
+ * @return Size of the allocation starting at `base` or 0 if there is none.
+ */
+size_t vmem_size(vmem_t *arena, uintptr_t base);
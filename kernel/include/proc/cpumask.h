@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Set of CPUs, by `smp_cpu_t.id`.
+ */
+
+#define CPUMASK_MAX_CPUS 256
+
+typedef struct
+{
+    uint64_t bits[CPUMASK_MAX_CPUS / 64];
+}
+cpumask_t;
+
+#define CPUMASK_ALL ((cpumask_t) {.bits = { [0 ... CPUMASK_MAX_CPUS / 64 - 1] = UINT64_MAX } })
+
+static inline bool cpumask_test(const cpumask_t *mask, size_t cpu)
+{
+    return cpu < CPUMASK_MAX_CPUS && (mask->bits[cpu / 64] & (1ull << (cpu % 64)));
+}
+
+static inline void cpumask_set(cpumask_t *mask, size_t cpu)
+{
+    if (cpu < CPUMASK_MAX_CPUS)
+        mask->bits[cpu / 64] |= 1ull << (cpu % 64);
+}
+
+static inline bool cpumask_is_empty(const cpumask_t *mask)
+{
+    for (size_t i = 0; i < CPUMASK_MAX_CPUS / 64; i++)
+        if (mask->bits[i])
+            return false;
+    return true;
+}
+
+// Atomic variants, for masks that CPUs update while others read them.
+
+static inline bool cpumask_test_atomic(const cpumask_t *mask, size_t cpu)
+{
+    return cpu < CPUMASK_MAX_CPUS
+        && (__atomic_load_n(&mask->bits[cpu / 64], __ATOMIC_ACQUIRE) & (1ull << (cpu % 64)));
+}
+
+static inline void cpumask_set_atomic(cpumask_t *mask, size_t cpu)
+{
+    if (cpu < CPUMASK_MAX_CPUS)
+        __atomic_fetch_or(&mask->bits[cpu / 64], 1ull << (cpu % 64), __ATOMIC_SEQ_CST);
+}
+
+static inline void cpumask_clear_atomic(cpumask_t *mask, size_t cpu)
+{
+    if (cpu < CPUMASK_MAX_CPUS)
+        __atomic_fetch_and(&mask->bits[cpu / 64], ~(1ull << (cpu % 64)), __ATOMIC_RELEASE);
+}
@@ -2,7 +2,7 @@
 
 #include <stddef.h>
 #include "fs/vfs.h"
-#include "sync/spinlock.h"
+#include "sync/mutex.h"
 #include <stdatomic.h>
 
 #define MAX_FD_COUNT 16
@@ -29,7 +29,7 @@ typedef struct fd_table
 {
     fd_entry_t *fds;
     size_t capacity;
-    spinlock_t lock;
+    mutex_t lock;
 }
 fd_table_t;
 
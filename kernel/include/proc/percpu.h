@@ -0,0 +1,101 @@
+#pragma once
+
+#include "proc/smp.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-CPU data.
+ *
+ * Each CPU's `smp_cpu_t` is its per-CPU data area, pointed at by a base
+ * register from the moment the CPU comes up: the kernel GS base on x86_64,
+ * TPIDR_EL1 on aarch64. The `this_cpu_*` ops reach a field of the current
+ * CPU's area without going through the running thread. On x86_64 each op is
+ * a single `%gs`-relative instruction; aarch64 has no segment addressing and
+ * reads TPIDR_EL1 first.
+ *
+ * Unless interrupts are masked the thread may be moved to another CPU between
+ * two ops, so what one op reads is only a hint of the CPU it ran on. Each op
+ * is safe on its own though: `this_cpu_write` and `this_cpu_add` never land
+ * in the area of a CPU the thread was just moved away from. That takes one
+ * instruction on x86_64, which an interrupt can not split, and masking
+ * interrupts around the access on aarch64. They are not atomic against other
+ * CPUs, which may only read the fields.
+ *
+ * `FIELD` is a member designator of `smp_cpu_t` with constant indices, such
+ * as `runqueue.steals`.
+ */
+
+#define PERCPU_OFFSET(FIELD) offsetof(smp_cpu_t, FIELD)
+#define PERCPU_TYPE(FIELD) typeof(((smp_cpu_t *)0)->FIELD)
+
+#if defined(__x86_64__)
+
+static inline smp_cpu_t *this_cpu_ptr()
+{
+    smp_cpu_t *cpu;
+    asm volatile("mov %%gs:%c1, %0" : "=r"(cpu) : "i"(PERCPU_OFFSET(self)) : "memory");
+    return cpu;
+}
+
+#define this_cpu_read(FIELD) ({                                         \
+    PERCPU_TYPE(FIELD) _pcpu_v;                                         \
+    asm volatile("mov %%gs:%c1, %0"                                     \
+                 : "=r"(_pcpu_v) : "i"(PERCPU_OFFSET(FIELD)) : "memory"); \
+    _pcpu_v;                                                            \
+})
+
+#define this_cpu_write(FIELD, V) ({                                     \
+    PERCPU_TYPE(FIELD) _pcpu_v = (V);                                   \
+    asm volatile("mov %1, %%gs:%c0"                                     \
+                 : : "i"(PERCPU_OFFSET(FIELD)), "r"(_pcpu_v) : "memory"); \
+})
+
+#define this_cpu_add(FIELD, V) ({                                       \
+    PERCPU_TYPE(FIELD) _pcpu_v = (V);                                   \
+    asm volatile("add %1, %%gs:%c0"                                     \
+                 : : "i"(PERCPU_OFFSET(FIELD)), "r"(_pcpu_v) : "memory"); \
+})
+
+#elif defined(__aarch64__)
+
+static inline smp_cpu_t *this_cpu_ptr()
+{
+    smp_cpu_t *cpu;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(cpu) : : "memory");
+    return cpu;
+}
+
+// Masks IRQs only, which is all that preempts a thread.
+static inline uint64_t percpu_irq_save()
+{
+    uint64_t daif;
+    asm volatile("mrs %0, daif; msr daifset, #0b0010" : "=r"(daif) : : "memory");
+    return daif;
+}
+
+static inline void percpu_irq_restore(uint64_t daif)
+{
+    asm volatile("msr daif, %0" : : "r"(daif) : "memory");
+}
+
+#define this_cpu_read(FIELD) \
+    (*(volatile PERCPU_TYPE(FIELD) *)&this_cpu_ptr()->FIELD)
+
+#define this_cpu_write(FIELD, V) ({                \
+    PERCPU_TYPE(FIELD) _pcpu_v = (V);              \
+    uint64_t _pcpu_daif = percpu_irq_save();       \
+    this_cpu_ptr()->FIELD = _pcpu_v;               \
+    percpu_irq_restore(_pcpu_daif);                \
+})
+
+#define this_cpu_add(FIELD, V) ({                  \
+    PERCPU_TYPE(FIELD) _pcpu_v = (V);              \
+    uint64_t _pcpu_daif = percpu_irq_save();       \
+    this_cpu_ptr()->FIELD += _pcpu_v;              \
+    percpu_irq_restore(_pcpu_daif);                \
+})
+
+#endif
+
+#define this_cpu_inc(FIELD) this_cpu_add(FIELD, 1)
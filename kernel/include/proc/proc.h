@@ -3,6 +3,7 @@
 #include "mm/vm.h"
 #include "utils/list.h"
 #include "proc/fd.h"
+#include "proc/sched_class.h"
 #include "sync/spinlock.h"
 
 typedef enum
@@ -22,6 +23,9 @@ typedef struct proc
     vm_addrspace_t *as;
     list_t threads;
 
+    sched_policy_t sched_policy;
+    int64_t sched_param; // See `sched_policy_t`.
+
     fd_table_t *fd_table;
     const char *cwd;
 
@@ -1,12 +1,107 @@
 #pragma once
 
+#include "proc/percpu.h"
 #include "proc/proc.h"
 #include "proc/smp.h"
 #include "proc/thread.h"
 
 void sched_enqueue(thread_t *t);
 
-thread_t *sched_get_curr_thread();
+static inline thread_t *sched_get_curr_thread()
+{
+    return this_cpu_read(curr_thread);
+}
 
 void sched_preemt();
+
+/**
+ * @brief Preempt the calling thread as soon as possible, for a preemption put
+ * off while it was in an RCU read-side section.
+ */
+void sched_resched_deferred();
 void sched_yield(thread_status_t status);
+
+/**
+ * @brief Start a wait of the calling thread, to be followed by `sched_block`.
+ *
+ * `sched_wake` ends the wait from here on, even before the thread blocks, so a
+ * thread may put itself on a wait queue and drop the queue's lock before
+ * blocking without missing its wake-up.
+ */
+void sched_prepare_block();
+
+/**
+ * @brief Block the calling thread until `sched_wake` ends its wait, or until
+ * `deadline` in uptime ns, `UINT64_MAX` for none. Returns right away if the
+ * wait is over already.
+ *
+ * Whether the thread was woken or timed out is up to the caller to tell, for
+ * instance by whether it is still on its wait queue. Timed waits may also end
+ * early if memory is short.
+ */
+void sched_block(uint64_t deadline);
+
+/**
+ * @brief End the current wait of `t` and queue it again.
+ *
+ * The caller must know that `t` is waiting, as a wait queue holding it does.
+ *
+ * @return false if the wait had ended already, timed out or woken by someone
+ * else.
+ */
+bool sched_wake(thread_t *t);
+
+/**
+ * @brief Run `t` in the class of rank `rank` or above until `sched_unboost`,
+ * for priority inheritance. Ranks below the thread's own or a current boost
+ * are ignored.
+ *
+ * A queued thread moves right away, others the next time they are queued.
+ */
+void sched_boost(thread_t *t, size_t rank);
+
+/**
+ * @brief Drop the boost of the calling thread, yielding if it has to go back
+ * to a lower class.
+ */
+void sched_unboost();
+
+/**
+ * @brief Body of the idle threads: run whatever the CPU gets, halt while there
+ * is nothing.
+ *
+ * Time halted and the latency of wake-ups are reported in `/dev/schedstat`.
+ */
+[[noreturn]] void sched_idle();
+
+/**
+ * @brief Choose the scheduling class of the threads of a process.
+ *
+ * Threads move to the new class the next time they are queued.
+ *
+ * @param param See `sched_policy_t`.
+ *
+ * @return EOK, or EINVAL for an unknown policy or a parameter out of range.
+ */
+int sched_set_policy(proc_t *proc, sched_policy_t policy, int64_t param);
+
+/**
+ * @brief Restrict the CPUs a thread may run on.
+ *
+ * The calling thread and queued threads move right away if they have to,
+ * running ones the next time they stop running.
+ *
+ * @return EOK, or EINVAL if the mask holds none of the CPUs.
+ */
+int sched_set_affinity(thread_t *t, const cpumask_t *mask);
+
+void sched_get_affinity(thread_t *t, cpumask_t *out);
+
+/**
+ * @brief Set up the per-CPU run queues once `smp_cpus` is populated.
+ *
+ * Threads enqueued before that are spread over the CPUs here. Per-CPU queue
+ * lengths, steal, migration and MLFQ boost counts are reported in
+ * `/dev/schedstat`.
+ */
+void sched_init();
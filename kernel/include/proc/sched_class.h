@@ -0,0 +1,94 @@
+#pragma once
+
+#include "utils/list.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct smp_runqueue smp_runqueue_t;
+typedef struct thread thread_t;
+
+/*
+ * Scheduling classes.
+ *
+ * Every CPU's run queue keeps a queue per class, and a class is only asked for
+ * a thread when all classes ranked above it have none, so a real-time thread
+ * always runs before the others. MLFQ and fair share the rank below and split
+ * the CPU between them by how many threads each has ready. Processes choose
+ * their class through their policy; threads follow it the next time they are
+ * queued.
+ */
+
+typedef enum
+{
+    SCHED_POLICY_MLFQ, // Multilevel feedback queue, the default.
+    SCHED_POLICY_FAIR, // Weighted fair share. The parameter is a nice value, -20 to 19.
+    SCHED_POLICY_RT,   // Real-time FIFO. The parameter is a relative deadline in ns, or 0.
+}
+sched_policy_t;
+
+typedef struct sched_class
+{
+    const char *name;
+    size_t id;   // Index of the class's counters in the run queue.
+    size_t rank; // Position in the order classes are asked for threads, 0 first.
+
+    // Queue a ready thread. `wakeup` is set if the thread was not on this run
+    // queue before, either new, woken up, moved from another CPU or from
+    // another class. The queue lock must be held.
+    void (*enqueue)(smp_runqueue_t *rq, thread_t *t, bool wakeup);
+
+    // Remove a queued thread. The queue lock must be held.
+    void (*dequeue)(smp_runqueue_t *rq, thread_t *t);
+
+    // The queued thread that should run next, or NULL. The thread is left on
+    // the queue. Only called by the CPU owning the queue, with its lock held.
+    thread_t *(*pick_next)(smp_runqueue_t *rq);
+
+    // A queued thread that CPU `cpu` could take, which its affinity must
+    // allow, or NULL. The queue lock must be held.
+    thread_t *(*pick_steal)(smp_runqueue_t *rq, size_t cpu);
+
+    // Charge `ran` ns to the running thread and return how much longer it may
+    // run before it is preempted, `UINT64_MAX` if there is no limit. Called on
+    // the owning CPU with the queue lock held.
+    uint64_t (*tick)(smp_runqueue_t *rq, thread_t *t, uint64_t ran);
+
+    // The running thread stops running, `stays` is set if it remains ready on
+    // this CPU. Optional. The queue lock must be held.
+    void (*yield)(smp_runqueue_t *rq, thread_t *t, bool stays);
+}
+sched_class_t;
+
+#define SCHED_CLASS_COUNT 3
+
+// Per-CPU queues of each class.
+
+#define SCHED_MLFQ_LEVELS 16
+
+typedef struct
+{
+    list_t levels[SCHED_MLFQ_LEVELS];
+    uint32_t level_mask; // Bit N is set if level N is not empty.
+    uint64_t next_boost; // When every thread goes back to the top level.
+    size_t boosts;
+}
+sched_mlfq_rq_t;
+
+typedef struct
+{
+    list_t queue;   // By virtual deadline.
+    uint64_t load;  // Sum of the weights of the queued threads.
+    uint64_t base;  // Virtual time `vsum` is relative to.
+    int64_t vsum;   // Sum of weight * (vruntime - base) over the queued threads.
+}
+sched_fair_rq_t;
+
+typedef struct
+{
+    list_t queue; // By deadline, then FIFO.
+}
+sched_rt_rq_t;
+
+extern const sched_class_t sched_class_rt;
+extern const sched_class_t sched_class_mlfq;
+extern const sched_class_t sched_class_fair;
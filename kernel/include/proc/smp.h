@@ -1,17 +1,150 @@
 #pragma once
 
+#include "proc/sched_class.h"
+#include "sync/spinlock.h"
 #include "thread.h"
 #include "utils/list.h"
 
+#if defined(__x86_64__)
+#include "arch/x86_64/tables/tss.h"
+#endif
+
 typedef struct smp_cpu smp_cpu_t;
 typedef struct proc proc_t;
 typedef struct thread thread_t;
 
+// Where a CPU sits in the machine. IDs are only meaningful for comparing CPUs:
+// equal IDs mean a shared package, core or cache.
+typedef struct
+{
+    uint32_t package;
+    uint32_t core;
+    uint32_t thread; // SMT sibling within the core.
+    uint32_t l2;
+    uint32_t llc;    // Last-level cache.
+}
+smp_topology_t;
+
+// A timed wait in the sleepers heap. The thread may have been woken and moved
+// on since, which `wait` tells, it is referenced until the entry is due.
+typedef struct
+{
+    uint64_t until;
+    thread_t *thread;
+    uint64_t wait;
+}
+smp_sleeper_t;
+
+// Threads ready to run on one CPU, by scheduling class, and the ones sleeping
+// on it. See `proc/sched.c`.
+typedef struct smp_runqueue
+{
+    sched_rt_rq_t rt;
+    sched_mlfq_rq_t mlfq;
+    sched_fair_rq_t fair;
+    size_t length;       // Threads in all classes, read without the lock when looking for work to steal.
+    size_t class_length[SCHED_CLASS_COUNT]; // Threads queued in each class.
+    uint64_t class_vtime[SCHED_CLASS_COUNT]; // Time each class ran, divided among its threads.
+    size_t steals;       // Threads this CPU took from other run queues.
+    size_t migrations;   // Threads that came here from another CPU, stolen or placed.
+    size_t curr_rank;    // Rank of the running thread's class, `SIZE_MAX` while idle.
+    bool need_resched;   // A thread of a higher class than the running one is queued.
+    spinlock_t slock;
+
+    // Min-heap of timed waits by deadline. Only ever touched by the owning
+    // CPU with interrupts masked, so it needs no lock.
+    smp_sleeper_t *sleepers;
+    size_t sleeper_count;
+    size_t sleeper_capacity;
+
+    bool ticking;        // Whether the timer is armed.
+    uint64_t run_start;  // When the running thread was last charged for its time.
+    uint64_t slice_end;  // When the running thread's quantum is used up.
+
+    // Idle state, see `sched_idle`.
+    bool idle;                    // Halted, waiting for an interrupt or `wake`.
+    bool wake;                    // Set by whoever gives an idle CPU work.
+    uint64_t idle_start;
+    uint64_t wake_sent;
+    uint64_t idle_ns;             // Total time halted.
+    size_t wakeups;               // Wake-ups through `wake`.
+    uint64_t wake_latency_ns;     // Sum over `wakeups`, from `wake_sent` to running again.
+    uint64_t wake_latency_max_ns;
+}
+smp_runqueue_t;
+
+// Blocks of pages freed by exiting threads, kept for the next ones created on
+// the same CPU so that neither has to go through the PMM.
+
+#define SMP_PAGE_CACHE_SIZE 16
+
+typedef enum
+{
+    SMP_PAGE_CACHE_STACK, // Kernel stacks.
+    SMP_PAGE_CACHE_FPU,   // FPU save areas.
+    SMP_PAGE_CACHE_COUNT
+}
+smp_page_cache_id_t;
+
+typedef struct
+{
+    uintptr_t blocks[SMP_PAGE_CACHE_SIZE]; // HHDM addresses, all of one order.
+    size_t count;
+}
+smp_page_cache_t;
+
+// Read-mostly global structures, each guarded by a `percpu_rwlock` whose
+// reader counts live in the CPUs, see `sync/percpu_rwlock.h`.
+
+typedef enum
+{
+    SMP_RWLOCK_BUSES,  // Bus list.
+    SMP_RWLOCK_PROCS,  // Process list.
+    SMP_RWLOCK_COUNT
+}
+smp_rwlock_id_t;
+
+// RCU state of a CPU, see `sync/rcu.c`. The callback lists are only touched
+// by the owning CPU with interrupts masked.
+typedef struct
+{
+    bool online;      // Taking part in grace periods, under the grace period lock.
+    bool need_qs;     // The current grace period waits for this CPU, likewise.
+    list_t next;      // Callbacks queued since `wait` was handed over.
+    list_t wait;      // Callbacks waiting for grace period `wait_gp` to end.
+    uint64_t wait_gp;
+}
+smp_rcu_t;
+
+// The per-CPU data area of a CPU, see `proc/percpu.h`. The fields up to `id`
+// are at fixed offsets, which the system call entry depends on.
 typedef struct smp_cpu
 {
+    struct smp_cpu *self;
+    thread_t *curr_thread;  // Only a hint when read from other CPUs.
+    uintptr_t kernel_stack; // Top of the running thread's kernel stack, for system calls.
+    uintptr_t user_sp;      // User stack pointer, for a moment on system call entry.
     size_t id;
     thread_t *idle_thread;
-    thread_t *curr_thread;
+    smp_runqueue_t runqueue;
+    smp_topology_t topology; // Filled in by `arch_lcpu_init`.
+#if defined(__x86_64__)
+    tss_t *tss;        // Points interrupts from user mode at the running thread's kernel stack.
+    uint32_t lapic_id; // Destination of IPIs.
+    arch_thread_context_t *fpu_owner; // Thread whose state the FPU registers hold.
+    bool fpu_active;                  // Whether the running thread has the FPU, CR0.TS clear.
+#elif defined(__aarch64__)
+    uint32_t gic_target; // GIC CPU interface mask, destination of SGIs.
+#endif
+
+    size_t int_mask_depth; // Nesting level of `smp_int_mask_push`.
+    bool int_mask_prev;    // Interrupt state before the outermost push.
+    spinlock_node_t spin_node; // Queue node while waiting for a spinlock.
+
+    smp_page_cache_t page_caches[SMP_PAGE_CACHE_COUNT];
+    size_t rwlock_readers[SMP_RWLOCK_COUNT]; // Readers inside each `percpu_rwlock` on this CPU.
+    smp_rcu_t rcu;
+    struct workqueue_pool *wq_pool; // Pool of the bound workqueues, see `proc/workqueue.c`.
 
     list_node_t cpu_list_node;
 }
@@ -19,4 +152,34 @@ smp_cpu_t;
 
 extern list_t smp_cpus;
 
+/**
+ * @brief Mask interrupts on the current CPU, remembering whether they were
+ * enabled before the outermost call.
+ *
+ * Calls nest; interrupts are only restored once every push has been matched
+ * by a `smp_int_mask_pop`.
+ */
+void smp_int_mask_push();
+
+/**
+ * @brief Undo one `smp_int_mask_push`.
+ */
+void smp_int_mask_pop();
+
+/**
+ * @brief Take a block of `2^order` pages from a cache of the current CPU, or
+ * from the PMM if the cache is empty.
+ *
+ * @return The HHDM address of the block, or 0 if out of memory.
+ */
+uintptr_t smp_page_cache_alloc(smp_page_cache_id_t id, uint8_t order);
+
+/**
+ * @brief Give a block from `smp_page_cache_alloc` back to the cache of the
+ * current CPU, or to the PMM if the cache is full.
+ *
+ * Every block of a cache must have the same order.
+ */
+void smp_page_cache_free(smp_page_cache_id_t id, uintptr_t addr, uint8_t order);
+
 void smp_init();
@@ -2,6 +2,10 @@
 
 #include "arch/thread.h"
 #include "proc.h"
+#include "proc/cpumask.h"
+#include "proc/sched_class.h"
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
 #include "utils/list.h"
 #include <stdint.h>
 
@@ -20,6 +24,15 @@ typedef enum
 }
 thread_status_t;
 
+// Progress of a thread's current wait, see `sched_block`. `wait_state` holds
+// the number of the wait, counting up, above the stage.
+#define THREAD_WAIT_BLOCKING 0 // About to block, still on its CPU.
+#define THREAD_WAIT_PARKED   1 // Off the CPU until woken or due.
+#define THREAD_WAIT_WOKEN    2 // Over, or not waiting at all.
+
+#define THREAD_WAIT_STAGE(state)  ((state) & 3)
+#define THREAD_WAIT_NUMBER(state) ((state) >> 2)
+
 struct thread
 {
     arch_thread_context_t context;
@@ -27,16 +40,74 @@ struct thread
     size_t tid;
     proc_t *owner;
 
-    size_t priority;
     thread_status_t status;
     uint64_t last_ran;
-    uint64_t sleep_until;
+    uint64_t sleep_until; // Deadline of the current wait, `UINT64_MAX` if none.
+    uint64_t wait_state;
     cpu_t *assigned_cpu;
+    cpumask_t affinity; // CPUs the thread may run on.
+
+    // Scheduling class state, see `proc/sched_class.h`.
+    const sched_class_t *sched_class;
+    size_t priority;      // MLFQ level.
+    uint64_t slice_used;  // MLFQ: time run at the current level, in ns.
+    uint64_t weight;      // Fair: CPU share relative to other fair threads.
+    uint64_t vruntime;    // Fair: weighted time received.
+    uint64_t vdeadline;   // Fair: virtual time by which the current slice is due.
+    int64_t lag;          // Fair: virtual time owed, kept while off the run queue.
+    uint64_t rt_deadline; // Real-time: absolute deadline, `UINT64_MAX` if none.
+    size_t boost_rank;    // Class rank inherited through mutexes, `SIZE_MAX` if none.
+    size_t pi_held;       // Priority-inheriting mutexes held.
+    bool on_rq;           // Queued on a run queue, under its lock.
+
+    size_t rcu_nesting; // Depth of RCU read-side sections, see `sync/rcu.h`.
+    bool rcu_resched;   // A preemption was put off until the outermost one ends.
+
+    struct workqueue_worker *worker; // Set in workqueue workers, see `proc/workqueue.c`.
 
     list_node_t proc_thread_list_node;
     list_node_t sched_thread_list_node;
+    bool reaped; // Exited and no longer running, its stacks are gone.
+    spinlock_t join_slock;
+    waitqueue_t joiners;
     size_t ref_count;
 };
 
+/**
+ * @brief Create a thread of `proc`, referenced once by the scheduler.
+ *
+ * Whoever wants to join the thread or keep using it must take a reference of
+ * their own before the thread is enqueued.
+ *
+ * @return NULL if out of memory.
+ */
 thread_t *thread_create(proc_t *proc, uintptr_t entry);
+
+void thread_ref(thread_t *thread);
+
+/**
+ * @brief Drop a reference, destroying the thread with the last one.
+ */
+void thread_unref(thread_t *thread);
+
+/**
+ * @brief Release the stacks of an exited thread that stopped running and drop
+ * the scheduler's reference. Called by the scheduler.
+ */
+void thread_reap(thread_t *thread);
+
+/**
+ * @brief Wait for a thread to exit and drop the caller's reference.
+ */
+void thread_join(thread_t *thread);
+
 void thread_destroy(thread_t *thread);
+
+/**
+ * @brief Whether wait number `wait` of `thread` is still going on.
+ */
+static inline bool thread_in_wait(thread_t *thread, uint64_t wait)
+{
+    uint64_t state = __atomic_load_n(&thread->wait_state, __ATOMIC_ACQUIRE);
+    return THREAD_WAIT_NUMBER(state) == wait && THREAD_WAIT_STAGE(state) != THREAD_WAIT_WOKEN;
+}
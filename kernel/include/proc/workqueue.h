@@ -0,0 +1,102 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include "utils/list.h"
+#include <stdint.h>
+
+typedef struct thread thread_t;
+
+/*
+ * Deferred work.
+ *
+ * Work queued from interrupt handlers or under spinlocks runs later in a
+ * kernel worker thread, where it may block. Bound queues run work on the CPU
+ * that queued it, through a pool of workers per CPU, and the unbound queue
+ * runs it on any CPU. Delayed work joins its queue once its time has come.
+ *
+ * A pool lets one worker per CPU it covers run work at a time. When a worker
+ * blocks in the middle of a work item, another one takes over what is left,
+ * and a pool grows a worker whenever its last idle one is put to work.
+ *
+ * A work item is queued at most once at a time: queueing it again before it
+ * has started running does nothing. Once it runs it may be queued again, also
+ * from its own function, which may as well free it.
+ */
+
+typedef struct work work_t;
+typedef struct workqueue_pool workqueue_pool_t;
+
+typedef void (*work_func_t)(work_t *work);
+
+typedef struct workqueue
+{
+    const char *name;
+    bool unbound;       // Run work on any CPU rather than the one queueing it.
+    size_t in_flight;   // Work queued, delayed or running, under `slock`.
+    spinlock_t slock;
+    waitqueue_t flushers;
+}
+workqueue_t;
+
+struct work
+{
+    work_func_t func;
+    bool pending;            // Queued or delayed, not started yet.
+    uint64_t due;            // While delayed: uptime in ns at which it is queued.
+    workqueue_t *wq;
+    workqueue_pool_t *pool;  // Where it is pending, under the pool's lock.
+    list_node_t list_node;
+};
+
+#define WORKQUEUE_INIT(NAME, UNBOUND) ((workqueue_t) {.name = (NAME), .unbound = (UNBOUND), .in_flight = 0, .slock = SPINLOCK_INIT, .flushers = WAITQUEUE_INIT })
+#define WORK_INIT(FUNC) ((work_t) {.func = (FUNC), .pending = false, .due = 0, .wq = NULL, .pool = NULL, .list_node = LIST_NODE_INIT })
+
+extern workqueue_t workqueue_system;  // Bound, for short work items.
+extern workqueue_t workqueue_unbound; // Any CPU, for long-running work.
+
+/**
+ * @brief Queue `work` to run on `wq`. May be called from interrupt handlers
+ * and with spinlocks held.
+ *
+ * @return false if `work` was pending already.
+ */
+bool workqueue_queue(workqueue_t *wq, work_t *work);
+
+/**
+ * @brief Queue `work` on `wq` once `delay_ns` have passed, like
+ * `workqueue_queue` otherwise.
+ */
+bool workqueue_queue_delayed(workqueue_t *wq, work_t *work, uint64_t delay_ns);
+
+/**
+ * @brief Take `work` off its queue if it has not started running yet. It may
+ * still be running when this returns.
+ *
+ * @return true if `work` was pending.
+ */
+bool workqueue_cancel(work_t *work);
+
+/**
+ * @brief Block until `wq` has no work queued, delayed or running. Work that
+ * keeps queueing itself again holds this up for good.
+ */
+void workqueue_flush(workqueue_t *wq);
+
+/**
+ * @brief Scheduler hooks: a worker thread is about to block, or runs again
+ * after blocking. Only workers inside a work item count.
+ */
+void workqueue_worker_sleeping(thread_t *t);
+void workqueue_worker_running(thread_t *t);
+
+/**
+ * @brief Set up the unbound pool, work can be queued from here on. Bound work
+ * runs on the unbound pool until `workqueue_init_cpus`.
+ */
+void workqueue_init();
+
+/**
+ * @brief Set up a pool for each CPU once `smp_cpus` is populated.
+ */
+void workqueue_init_cpus();
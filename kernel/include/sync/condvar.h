@@ -0,0 +1,40 @@
+#pragma once
+
+#include "sync/mutex.h"
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stdint.h>
+
+/*
+ * Condition variable, used with a mutex guarding the condition. Waits may end
+ * without a signal, callers check the condition in a loop.
+ */
+
+typedef struct
+{
+    uint64_t seq; // Signals so far.
+    spinlock_t slock;
+    waitqueue_t waiters;
+}
+condvar_t;
+
+#define CONDVAR_INIT ((condvar_t) {.seq = 0, .slock = SPINLOCK_INIT, .waiters = WAITQUEUE_INIT })
+
+/**
+ * @brief Release `mutex`, wait for a signal and take `mutex` again.
+ */
+void condvar_wait(condvar_t *cv, mutex_t *mutex);
+
+/**
+ * @brief Like `condvar_wait`, giving up at `deadline` in uptime ns.
+ *
+ * @return false if the deadline passed first.
+ */
+bool condvar_wait_until(condvar_t *cv, mutex_t *mutex, uint64_t deadline);
+
+/**
+ * @brief Wake the thread that has waited longest.
+ */
+void condvar_signal(condvar_t *cv);
+
+void condvar_broadcast(condvar_t *cv);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "mm/vm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Futexes: wait queues on 32-bit words in user memory, for userspace locks and
+ * condition variables to block on while contended. Private futexes are told
+ * apart by address space and virtual address; shared ones by physical
+ * address, so that processes mapping the same memory at different addresses
+ * meet on it.
+ */
+
+/**
+ * @brief Block on the futex at `uaddr` if it still holds `val`.
+ *
+ * @param timeout_ns Relative, `UINT64_MAX` to wait until woken.
+ *
+ * @return EOK once woken, EAGAIN if the futex did not hold `val`, ETIMEDOUT,
+ * EINVAL if `uaddr` is misaligned or EFAULT if it is not mapped.
+ */
+int futex_wait(vm_addrspace_t *as, uintptr_t uaddr, uint32_t val, uint64_t timeout_ns, bool shared);
+
+/**
+ * @brief Wake up to `count` threads waiting on the futex at `uaddr`, in the
+ * order they started waiting.
+ *
+ * @return EOK, EINVAL or EFAULT.
+ */
+int futex_wake(vm_addrspace_t *as, uintptr_t uaddr, size_t count, bool shared, size_t *out_woken);
+
+/**
+ * @brief Wake up to `count` threads waiting on the futex at `uaddr` and move
+ * up to `requeue` of the others to the futex at `uaddr2`, if the first still
+ * holds `val`.
+ *
+ * A condition variable broadcast can so wake a single waiter and hand the
+ * others to the mutex, rather than have them all race for it.
+ *
+ * @param out_moved Threads woken or moved.
+ *
+ * @return EOK, EAGAIN if the futex did not hold `val`, EINVAL or EFAULT.
+ */
+int futex_requeue(vm_addrspace_t *as, uintptr_t uaddr, size_t count, uintptr_t uaddr2, size_t requeue,
+                  uint32_t val, bool shared, size_t *out_moved);
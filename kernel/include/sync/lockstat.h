@@ -0,0 +1,55 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include <stdint.h>
+
+/*
+ * Spinlock contention statistics, only built with `LOCKSTAT`.
+ *
+ * Locks initialized with `SPINLOCK_INIT_NAMED` count, per CPU and name, how
+ * often they were taken, how often that meant waiting, the cycles spent
+ * waiting and the longest hold, in `arch_lcpu_cycles`. Locks of the same name
+ * share their counters. `/dev/lockstat` lists the names with the most
+ * contended acquisitions first.
+ *
+ * Unnamed locks only pay for checking the name; without `LOCKSTAT` nothing
+ * changes at all.
+ */
+
+#define LOCKSTAT_MAX_NAMES 64
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_TRACKED(SLOCK) ((SLOCK)->stat_name != NULL)
+
+/**
+ * @brief Account for taking a named lock, with interrupts masked.
+ *
+ * @param spin_cycles Cycles spent waiting, if `contended`.
+ */
+void lockstat_acquired(volatile spinlock_t *slock, bool contended, uint64_t spin_cycles);
+
+/**
+ * @brief Account for the hold of a named lock, right before releasing it.
+ */
+void lockstat_released(volatile spinlock_t *slock);
+
+void lockstat_init();
+
+#else
+
+#define LOCKSTAT_TRACKED(SLOCK) false
+
+static inline void lockstat_acquired(volatile spinlock_t *slock, bool contended, uint64_t spin_cycles)
+{
+}
+
+static inline void lockstat_released(volatile spinlock_t *slock)
+{
+}
+
+static inline void lockstat_init()
+{
+}
+
+#endif
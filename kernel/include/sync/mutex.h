@@ -0,0 +1,48 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stdint.h>
+
+typedef struct smp_cpu smp_cpu_t;
+
+/*
+ * Adaptive mutex.
+ *
+ * Unlike spinlocks, mutexes may be held across blocking and leave interrupts
+ * alone. A thread that finds the mutex taken spins while the owner is running
+ * on a CPU, as it will likely release soon, and sleeps otherwise. Sleepers
+ * get the mutex handed over in the order they came.
+ *
+ * With priority inheritance, the owner runs in the class of its most urgent
+ * waiter until it releases the last such mutex it holds. Boosts do not follow
+ * chains of owners waiting on other mutexes.
+ *
+ * Mutexes must not be taken with interrupts masked or spinlocks held.
+ */
+
+typedef struct
+{
+    uintptr_t owner;      // Owning thread, with `MUTEX_WAITERS` set if anyone sleeps.
+    smp_cpu_t *owner_cpu; // Where the owner took the mutex, for spinners to watch.
+    bool pi;              // Priority inheritance.
+    spinlock_t slock;     // Guards `waiters`.
+    waitqueue_t waiters;
+}
+mutex_t;
+
+#define MUTEX_WAITERS ((uintptr_t)1)
+
+#define MUTEX_INIT ((mutex_t) {.owner = 0, .owner_cpu = NULL, .pi = false, .slock = SPINLOCK_INIT_NAMED("mutex"), .waiters = WAITQUEUE_INIT })
+#define MUTEX_INIT_PI ((mutex_t) {.owner = 0, .owner_cpu = NULL, .pi = true, .slock = SPINLOCK_INIT_NAMED("mutex"), .waiters = WAITQUEUE_INIT })
+
+void mutex_acquire(mutex_t *mutex);
+
+/**
+ * @brief Acquire the mutex only if it is free.
+ *
+ * @return true if the mutex was acquired.
+ */
+bool mutex_try_acquire(mutex_t *mutex);
+
+void mutex_release(mutex_t *mutex);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "proc/smp.h"
+
+/*
+ * Reader/writer spinlock with per-CPU reader counts.
+ *
+ * For global structures read on hot paths and rarely written. A reader only
+ * bumps a count in its own CPU and reads the writer flag, which stays shared
+ * in every cache until a writer comes, so readers on different CPUs never
+ * contend. Writers are serialized, raise the flag to keep new readers out,
+ * and then wait for the count of every CPU to drain, which makes writing
+ * slow in proportion to the number of CPUs.
+ *
+ * Each lock is named by a `smp_rwlock_id_t`. Interrupts stay masked while the
+ * lock is held. Read sections may nest; a CPU holding the lock for reading
+ * must not try to take it for writing.
+ */
+
+void percpu_rwlock_acquire_read(smp_rwlock_id_t id);
+
+void percpu_rwlock_release_read(smp_rwlock_id_t id);
+
+void percpu_rwlock_acquire_write(smp_rwlock_id_t id);
+
+void percpu_rwlock_release_write(smp_rwlock_id_t id);
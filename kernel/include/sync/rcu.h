@@ -0,0 +1,100 @@
+#pragma once
+
+#include "proc/sched.h"
+#include "proc/thread.h"
+#include "utils/list.h"
+
+/*
+ * Read-copy-update.
+ *
+ * Readers of a structure updated under RCU take no lock: a read-side section
+ * only counts its nesting in the running thread. Writers, serialized among
+ * themselves by other means, publish new versions of the data and hand the
+ * old ones to `call_rcu`, which calls back once every read-side section that
+ * could still see them is over, after a grace period.
+ *
+ * Read-side sections may nest and may be entered from interrupts, but must
+ * not block or yield: the scheduler puts off preempting a thread inside one
+ * until the outermost `rcu_read_unlock`. Callbacks run on the CPU that
+ * queued them, from an interrupt, and must not block either.
+ */
+
+typedef struct rcu_head rcu_head_t;
+
+struct rcu_head
+{
+    list_node_t list_node;
+    void (*func)(rcu_head_t *head);
+};
+
+static inline void rcu_read_lock()
+{
+    sched_get_curr_thread()->rcu_nesting++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock()
+{
+    thread_t *curr = sched_get_curr_thread();
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (--curr->rcu_nesting == 0 && __atomic_load_n(&curr->rcu_resched, __ATOMIC_RELAXED))
+        sched_resched_deferred();
+}
+
+/**
+ * @brief Load a pointer published with `rcu_assign_pointer`, inside a
+ * read-side section.
+ */
+#define rcu_dereference(P) __atomic_load_n(&(P), __ATOMIC_CONSUME)
+
+/**
+ * @brief Publish `V` to readers, after everything written to it before.
+ */
+#define rcu_assign_pointer(P, V) __atomic_store_n(&(P), (V), __ATOMIC_RELEASE)
+
+/**
+ * @brief Walk a list that writers change with `rcu_list_append` and
+ * `list_remove`, inside a read-side section.
+ */
+#define RCU_FOREACH(NODE, LIST) for (list_node_t *NODE = rcu_dereference((LIST).head); NODE != NULL; NODE = rcu_dereference(NODE->next))
+
+/**
+ * @brief Append to a list walked with `RCU_FOREACH`, after everything written
+ * to the node's container before. Removed nodes must only be freed through
+ * `call_rcu`.
+ */
+static inline void rcu_list_append(list_t *list, list_node_t *node)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    list_append(list, node);
+}
+
+/**
+ * @brief Call `func` with `head` once every read-side section now going on,
+ * on any CPU, is over.
+ */
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+
+/**
+ * @brief Wait until every read-side section now going on, on any CPU, is
+ * over. Must not be called with interrupts masked or spinlocks held.
+ */
+void synchronize_rcu();
+
+/**
+ * @brief Report a quiescent state of the current CPU, which must be outside
+ * any read-side section with interrupts masked. Called by the scheduler.
+ */
+void rcu_quiescent();
+
+/**
+ * @brief Run the callbacks of the current CPU whose grace period is over.
+ * Called by the scheduler from interrupts, never while switching threads.
+ */
+void rcu_run_callbacks();
+
+/**
+ * @brief Have the current CPU take part in grace periods. Called once per
+ * CPU as it starts.
+ */
+void rcu_cpu_online();
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Spinning reader/writer lock.
+ *
+ * Any number of readers may hold the lock at once, writers get it exclusively.
+ * Waiting writers keep new readers out so that a steady stream of readers can
+ * not starve them. Like spinlocks, interrupts stay masked while the lock is
+ * held; the previous interrupt state is tracked per CPU since several readers
+ * share one lock.
+ */
+
+typedef struct
+{
+    uint32_t state;           // Reader count, plus `RWLOCK_WRITER` if write-held.
+    uint32_t writers_waiting;
+}
+rwlock_t;
+
+#define RWLOCK_WRITER (1u << 31)
+
+#define RWLOCK_INIT ((rwlock_t) {.state = 0, .writers_waiting = 0 })
+
+void rwlock_acquire_read(volatile rwlock_t *rwlock);
+
+/**
+ * @brief Acquire the lock for reading only if that does not require waiting.
+ *
+ * @return true if the lock was acquired.
+ */
+bool rwlock_try_acquire_read(volatile rwlock_t *rwlock);
+
+void rwlock_release_read(volatile rwlock_t *rwlock);
+
+void rwlock_acquire_write(volatile rwlock_t *rwlock);
+
+void rwlock_release_write(volatile rwlock_t *rwlock);
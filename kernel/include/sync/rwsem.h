@@ -0,0 +1,35 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stddef.h>
+
+/*
+ * Sleeping reader/writer semaphore, the blocking counterpart of `rwlock_t`.
+ *
+ * Any number of readers may hold it at once, writers get it exclusively.
+ * Waiting writers keep new readers out so that a steady stream of readers can
+ * not starve them. Must not be taken with interrupts masked or spinlocks held.
+ */
+
+typedef struct
+{
+    size_t readers;
+    bool writer;
+    size_t writers_waiting;
+    spinlock_t slock;
+    waitqueue_t read_waiters;
+    waitqueue_t write_waiters;
+}
+rwsem_t;
+
+#define RWSEM_INIT ((rwsem_t) {.readers = 0, .writer = false, .writers_waiting = 0, .slock = SPINLOCK_INIT, \
+                               .read_waiters = WAITQUEUE_INIT, .write_waiters = WAITQUEUE_INIT })
+
+void rwsem_down_read(rwsem_t *sem);
+
+void rwsem_up_read(rwsem_t *sem);
+
+void rwsem_down_write(rwsem_t *sem);
+
+void rwsem_up_write(rwsem_t *sem);
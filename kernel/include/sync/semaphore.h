@@ -0,0 +1,31 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stddef.h>
+
+/*
+ * Counting semaphore. Threads taking it while the count is zero sleep until
+ * someone puts one back.
+ */
+
+typedef struct
+{
+    size_t count;
+    spinlock_t slock;
+    waitqueue_t waiters;
+}
+semaphore_t;
+
+#define SEMAPHORE_INIT(COUNT) ((semaphore_t) {.count = (COUNT), .slock = SPINLOCK_INIT, .waiters = WAITQUEUE_INIT })
+
+void semaphore_down(semaphore_t *sem);
+
+/**
+ * @brief Take one from the count only if that does not require waiting.
+ *
+ * @return true if the count was taken from.
+ */
+bool semaphore_try_down(semaphore_t *sem);
+
+void semaphore_up(semaphore_t *sem);
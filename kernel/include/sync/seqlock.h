@@ -0,0 +1,93 @@
+#pragma once
+
+#include "arch/lcpu.h"
+#include "sync/spinlock.h"
+#include <stdint.h>
+
+/*
+ * Sequence counters and locks.
+ *
+ * For small data read far more often than written. Readers take no lock and
+ * write nothing shared: they note the sequence number, copy the data, and
+ * retry if a writer came by in the meantime. The count is odd while a write
+ * is in progress. Readers must copy the data with atomic loads, relaxed
+ * suffices, and must not follow pointers out of it before the retry check.
+ *
+ * A bare `seqcount_t` leaves serializing writers to the caller; a `seqlock_t`
+ * pairs one with a spinlock for them.
+ */
+
+typedef struct
+{
+    uint32_t seq;
+}
+seqcount_t;
+
+typedef struct
+{
+    seqcount_t seqcount;
+    spinlock_t slock; // Serializes writers.
+}
+seqlock_t;
+
+#define SEQCOUNT_INIT ((seqcount_t) {.seq = 0 })
+#define SEQLOCK_INIT ((seqlock_t) {.seqcount = { .seq = 0 }, .slock = { .lock = 0, .tail = NULL } })
+
+// Sequence counters
+
+/**
+ * @brief Wait for any write in progress to finish and note the sequence
+ * number for `seqcount_read_retry`.
+ */
+static inline uint32_t seqcount_read_begin(const seqcount_t *sc)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sc->seq, __ATOMIC_ACQUIRE)) & 1)
+        arch_lcpu_relax();
+    return seq;
+}
+
+/**
+ * @return true if the data read since `seqcount_read_begin` returned `seq`
+ * may be torn and has to be read again.
+ */
+static inline bool seqcount_read_retry(const seqcount_t *sc, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sc->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqcount_write_begin(seqcount_t *sc)
+{
+    __atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(seqcount_t *sc)
+{
+    __atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Sequence locks
+
+static inline uint32_t seqlock_read_begin(const seqlock_t *sl)
+{
+    return seqcount_read_begin(&sl->seqcount);
+}
+
+static inline bool seqlock_read_retry(const seqlock_t *sl, uint32_t seq)
+{
+    return seqcount_read_retry(&sl->seqcount, seq);
+}
+
+static inline void seqlock_write_lock(seqlock_t *sl)
+{
+    spinlock_acquire(&sl->slock);
+    seqcount_write_begin(&sl->seqcount);
+}
+
+static inline void seqlock_write_unlock(seqlock_t *sl)
+{
+    seqcount_write_end(&sl->seqcount);
+    spinlock_release(&sl->slock);
+}
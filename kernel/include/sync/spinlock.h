@@ -2,19 +2,65 @@
 
 #include <stdint.h>
 
+/*
+ * Queued spinlock.
+ *
+ * A free lock is taken with a single atomic operation. Under contention,
+ * CPUs line up in an MCS queue and each spins on a node of its own; only the
+ * one at the head of the queue watches the lock itself, so waiters get the
+ * lock in the order they came and a release only touches one other CPU.
+ *
+ * Interrupts stay masked from the start of `spinlock_acquire` until the
+ * matching release, through the per-CPU nesting of `smp_int_mask_push`, so
+ * locks may be released in any order.
+ *
+ * Built with `LOCKSTAT`, locks initialized with `SPINLOCK_INIT_NAMED` keep
+ * contention statistics under their name, see `sync/lockstat.h`. Without it
+ * the name is dropped.
+ */
+
+typedef struct spinlock_node
+{
+    struct spinlock_node *next;
+    bool head; // Set by the predecessor once this CPU is first in line.
+}
+spinlock_node_t;
+
 typedef struct
 {
     uint8_t lock;
-    bool prev_int_state;
+    spinlock_node_t *tail; // Last CPU in line, NULL if nobody waits.
+#ifdef LOCKSTAT
+    const char *stat_name; // NULL if not tracked.
+    uint32_t stat_id;      // Index of the name in the statistics plus one, 0 until first taken.
+    uint64_t stat_since;   // Cycle count when the holder took the lock.
+#endif
 }
 spinlock_t;
 
-#define SPINLOCK_INIT ((spinlock_t) {.lock = 0, .prev_int_state = 0 })
+#define SPINLOCK_INIT ((spinlock_t) {.lock = 0, .tail = NULL })
+
+#ifdef LOCKSTAT
+#define SPINLOCK_INIT_NAMED(NAME) ((spinlock_t) {.lock = 0, .tail = NULL, .stat_name = (NAME), .stat_id = 0, .stat_since = 0 })
+#else
+#define SPINLOCK_INIT_NAMED(NAME) SPINLOCK_INIT
+#endif
 
 void spinlock_acquire(volatile spinlock_t *slock);
 
+/**
+ * @brief Acquire the lock only if it is free.
+ *
+ * @return true if the lock was acquired.
+ */
+bool spinlock_try_acquire(volatile spinlock_t *slock);
+
 void spinlock_release(volatile spinlock_t *slock);
 
+/**
+ * @brief Acquire the lock, leaving the interrupt state alone. Interrupts must
+ * be masked.
+ */
 void spinlock_primitive_acquire(volatile spinlock_t *slock);
 
 void spinlock_primitive_release(volatile spinlock_t *slock);
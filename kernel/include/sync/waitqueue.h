@@ -0,0 +1,56 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "utils/list.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct thread thread_t;
+
+/*
+ * Wait queue: threads blocked until a condition holds.
+ *
+ * A queue has no lock of its own, it is guarded by the spinlock that also
+ * guards the condition. Waiters check the condition and queue themselves
+ * under that lock, and `waitqueue_wait` only drops it once the thread can no
+ * longer miss a wake-up. Threads are woken in the order they started waiting.
+ */
+
+typedef struct
+{
+    list_t waiters;
+}
+waitqueue_t;
+
+#define WAITQUEUE_INIT ((waitqueue_t) {.waiters = LIST_INIT })
+
+/**
+ * @brief Block the calling thread on `wq` until it is woken or `deadline`, in
+ * uptime ns, passes, `UINT64_MAX` for none.
+ *
+ * `lock` must be held, it is released while blocked and held again on return.
+ * The condition may have changed again by then, callers check it in a loop.
+ *
+ * @return false if the deadline passed first.
+ */
+bool waitqueue_wait(waitqueue_t *wq, spinlock_t *lock, uint64_t deadline);
+
+/**
+ * @brief Wake the thread that has waited longest on `wq`. The queue's lock
+ * must be held.
+ *
+ * @return The woken thread, NULL if there was none.
+ */
+thread_t *waitqueue_wake_one(waitqueue_t *wq);
+
+/**
+ * @brief Wake every thread waiting on `wq`. The queue's lock must be held.
+ *
+ * @return The number of threads woken.
+ */
+size_t waitqueue_wake_all(waitqueue_t *wq);
+
+static inline bool waitqueue_empty(waitqueue_t *wq)
+{
+    return list_is_empty(&wq->waiters);
+}
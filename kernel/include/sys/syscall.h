@@ -36,12 +36,20 @@ sys_ret_t syscall_close(int fd);
 sys_ret_t syscall_read(int fd, void *buf, size_t count);
 sys_ret_t syscall_write(int fd, void *buf, size_t count);
 sys_ret_t syscall_seek(int fd, size_t offset, int whence);
+sys_ret_t syscall_ftruncate(int fd, size_t length);
 
 // Memory
 
 sys_ret_t syscall_mmap(uintptr_t addr, size_t len, int prot, int flags, int fd, size_t off);
+sys_ret_t syscall_madvise(uintptr_t addr, size_t length, int advice);
+sys_ret_t syscall_memfd_create(const char *name, int flags);
+sys_ret_t syscall_mremap(uintptr_t old_addr, size_t old_size, size_t new_size, int flags);
 
 // Process
 
 sys_ret_t syscall_exit(int code);
 sys_ret_t syscall_tcb_set(void *ptr);
+sys_ret_t syscall_sched_setpolicy(int policy, int64_t param);
+sys_ret_t syscall_sched_setaffinity(const void *mask, size_t size);
+sys_ret_t syscall_sched_getaffinity(void *mask, size_t size);
+sys_ret_t syscall_futex(uint32_t *uaddr, int op, uint32_t val, uintptr_t arg, uint32_t *uaddr2, uint32_t val3);
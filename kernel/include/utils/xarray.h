@@ -5,7 +5,7 @@
 
 #define XA_SHIFT 6u // This will result in each node having 2^6=64 children.
 #define XA_FANOUT (1u << XA_SHIFT)
-#define XA_LEVELS ((sizeof(size_t) + XA_SHIFT - 1u) / XA_SHIFT)
+#define XA_LEVELS ((sizeof(size_t) * 8u + XA_SHIFT - 1u) / XA_SHIFT) // Enough to cover every index bit.
 #define XA_MASK (XA_FANOUT - 1u)
 
 typedef unsigned xa_mark_t;
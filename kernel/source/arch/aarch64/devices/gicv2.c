@@ -63,6 +63,18 @@ static void gic_set_target(uint32_t intid, uint32_t cpuid)
     REG(GICD_ITARGETSR(intid / 4)) = val;
 }
 
+// The target registers of SGIs and PPIs are banked, and read back the
+// calling CPU's own interface.
+static uint32_t gic_cpu_target()
+{
+    return REG(GICD_ITARGETSR(0)) & 0xff;
+}
+
+static void gic_send_sgi(uint32_t intid, uint32_t targets)
+{
+    REG(GICD_SGIR) = ((targets & 0xff) << 16) | (intid & 0xf);
+}
+
 // Acknowledge & EOI
 
 static uint32_t gic_ack_int()
@@ -101,5 +113,7 @@ aarch64_gic_t aarch64_gicv2 = (aarch64_gic_t) {
     .disable_int = gic_disable_int,
     .set_target = gic_set_target,
     .ack_int = gic_ack_int,
-    .end_of_int = gic_end_of_int
+    .end_of_int = gic_end_of_int,
+    .cpu_target = gic_cpu_target,
+    .send_sgi = gic_send_sgi
 };
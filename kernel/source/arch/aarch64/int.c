@@ -1,7 +1,9 @@
 #include "arch/aarch64/devices/gic.h"
 #include "arch/lcpu.h"
 #include "log.h"
+#include "mm/vm.h"
 #include "panic.h"
+#include "proc/sched.h"
 #include "sync/spinlock.h"
 
 // Interrupt handling
@@ -14,12 +16,38 @@ __attribute__((packed))
 cpu_state_t;
 
 static void (*arch_timer_handler)();
+static void (*arch_ipi_handler)();
 
 void arch_timer_set_handler_per_cpu(void (*handler)())
 {
     arch_timer_handler = handler;
 }
 
+void arch_lcpu_set_ipi_handler(void (*handler)())
+{
+    arch_ipi_handler = handler;
+}
+
+static bool page_fault(uint64_t esr, uint64_t far)
+{
+    uint64_t ec = esr >> 26;
+    uint64_t iss = esr & 0x1FFFFFF;
+
+    // Instruction or data abort, from a lower or the current EL.
+    if (ec != 0x20 && ec != 0x21 && ec != 0x24 && ec != 0x25)
+        return false;
+    bool write = (ec == 0x24 || ec == 0x25) && (iss & (1 << 6)); // WnR
+    bool translation = (iss & 0x3C) == 0x04;
+    bool permission = (iss & 0x3C) == 0x0C;
+
+    // Missing pages, and writes to the read-only zero page.
+    if (!translation && !(permission && write))
+        return false;
+    // The early boot pseudo-thread has no process, hence no address space.
+    proc_t *proc = sched_get_curr_thread()->owner;
+    return proc && vm_page_fault(proc->as, far, write);
+}
+
 void aarch64_int_handler(
     const uint64_t source,
     cpu_state_t const *cpu_state,
@@ -34,7 +62,11 @@ void aarch64_int_handler(
         // Synchronous
         case 0:
         case 4:
+        case 8:
         {
+            if (page_fault(esr, far))
+                return;
+
             log(
                 LOG_FATAL,
                 "SYNC exception ESR=%lx ELR=%lx FAR=%lx SPSR=%lx",
@@ -52,15 +84,26 @@ void aarch64_int_handler(
 
             if (intid < 16)// SGIs
             {
-                panic("Unhandled SGI %d", intid);
+                switch (intid)
+                {
+                    case 0: // Reschedule IPI
+                        aarch64_gic->end_of_int(iar);
+                        arch_ipi_handler();
+                        return;
+                    default:
+                        panic("Unhandled SGI %d", intid);
+                        break;
+                }
             }
             else if (intid < 32) // PPIs
             {
                 switch (intid)
                 {
                     case 27: // Timer
+                        // The handler may switch to another thread, acknowledge first.
+                        aarch64_gic->end_of_int(iar);
                         arch_timer_handler();
-                        break;
+                        return;
                     default:
                         panic("Unhandled PPI %d", intid);
                         break;
@@ -4,12 +4,33 @@
 #include "arch/aarch64/devices/gic.h"
 #include "arch/aarch64/devices/timer.h"
 #include "arch/aarch64/int.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
 
 void arch_lcpu_halt()
 {
     asm volatile("wfi");
 }
 
+void arch_lcpu_wait(volatile bool *wake)
+{
+    // A pending interrupt ends `wfi` even while masked, so nothing sent after
+    // the check is missed.
+    if (!*wake)
+        asm volatile("wfi");
+    arch_lcpu_int_unmask();
+}
+
+void arch_lcpu_wake(smp_cpu_t *cpu)
+{
+    arch_lcpu_send_ipi(cpu);
+}
+
+void arch_lcpu_send_ipi(smp_cpu_t *cpu)
+{
+    aarch64_gic->send_sgi(0, cpu->gic_target);
+}
+
 void arch_lcpu_int_mask()
 {
     asm volatile("msr daifset, #0b1111");
@@ -32,21 +53,64 @@ void arch_lcpu_relax()
     asm volatile("yield");
 }
 
-size_t arch_lcpu_thread_reg_read()
+uint64_t arch_lcpu_cycles()
 {
-    size_t ret;
-    asm volatile("mrs %0, tpidr_el1" : "=r"(ret));
-    return ret;
+    uint64_t v;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(v) : : "memory");
+    return v;
 }
 
-void arch_lcpu_thread_reg_write(size_t t)
+void arch_lcpu_percpu_init(smp_cpu_t *cpu)
 {
-    asm volatile("msr tpidr_el1, %0" : : "r"(t));
+    asm volatile("msr tpidr_el1, %0" : : "r"(cpu) : "memory");
+}
+
+// Topology
+
+// The architecture leaves the meaning of the affinity levels to the
+// implementation. This follows the common layout: Aff0 numbers cores, or
+// threads of a core with MPIDR_EL1.MT set, the next level numbers clusters
+// sharing an L2 cache, and the levels above separate packages, taken as the
+// last-level cache domain.
+static void detect_topology(smp_topology_t *topo)
+{
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+
+    uint32_t aff0 = mpidr & 0xFF;
+    uint32_t aff1 = (mpidr >> 8) & 0xFF;
+    uint32_t aff2 = (mpidr >> 16) & 0xFF;
+    uint32_t aff3 = (mpidr >> 32) & 0xFF;
+
+    uint32_t cluster;
+    if (mpidr & (1 << 24))
+    {
+        topo->thread = aff0;
+        topo->core = aff1;
+        cluster = aff2;
+        topo->package = aff3;
+    }
+    else
+    {
+        topo->thread = 0;
+        topo->core = aff0;
+        cluster = aff1;
+        topo->package = (aff3 << 8) | aff2;
+    }
+
+    topo->core |= cluster << 8;
+    topo->l2 = (topo->package << 8) | cluster;
+    topo->llc = topo->package;
 }
 
 void arch_lcpu_init()
 {
+    smp_cpu_t *cpu = this_cpu_ptr();
+    detect_topology(&cpu->topology);
+
     aarch64_int_init_cpu();
     aarch64_gic->gicc_init();
+    cpu->gic_target = aarch64_gic->cpu_target();
+    aarch64_gic->enable_int(0); // Reschedule IPI
     aarch64_timer_init_cpu();
 }
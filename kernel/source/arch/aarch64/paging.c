@@ -52,13 +52,37 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     };
 
     size_t target_level = (size == 1 * GIB) ? 1 : (size == 2 * MIB) ? 2 : 3;
+
+    // Take the missing tables up front, so that running out of memory leaves
+    // the map untouched. Below the first missing one, all are missing.
+    page_t *spare[3];
+    size_t missing = 0;
+    pte_t *walk = table;
+    for (size_t level = 0; level < target_level; level++)
+    {
+        pte_t entry = walk[indices[level]];
+        if (!(entry & PTE_VALID))
+        {
+            missing = target_level - level;
+            break;
+        }
+        walk = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+    for (size_t i = 0; i < missing; i++)
+        if (!(spare[i] = pm_alloc(0)))
+        {
+            while (i--)
+                pm_free(spare[i]);
+            return -1;
+        }
+
     for (size_t level = 0; level < target_level; level++)
     {
         size_t idx = indices[level];
 
         if (!(table[idx] & PTE_VALID))
         {
-            uintptr_t phys = pm_alloc(0)->addr;
+            uintptr_t phys = spare[--missing]->addr;
             pte_t *next_table = (pte_t *)(phys + HHDM);
             memset(next_table, 0, 0x1000);
             table[idx] = phys | PTE_VALID | PTE_TABLE | PTE_ACCESS;
@@ -136,6 +160,99 @@ int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
     return 0;
 }
 
+// Collect the level 0, 1 and 2 tables leading to the level 3 table of `vaddr`,
+// creating missing ones if `create` is set.
+static bool walk_to_l2(arch_paging_map_t *map, uintptr_t vaddr, bool create, pte_t *path[3])
+{
+    pte_t *table = map->pml4[vaddr >= HHDM ? 1 : 0]; // Is higher half?
+    for (size_t level = 0; level <= 1; level++)
+    {
+        path[level] = table;
+        pte_t *entry = &table[(vaddr >> (39 - 9 * level)) & 0x1FF];
+
+        if (!(*entry & PTE_VALID))
+        {
+            if (!create)
+                return false;
+
+            page_t *page = pm_alloc(0);
+            if (!page)
+                return false;
+            memset((void *)(page->addr + HHDM), 0, 0x1000);
+            *entry = page->addr | PTE_VALID | PTE_TABLE | PTE_ACCESS;
+        }
+        else if (!(*entry & PTE_TABLE))
+            return false;
+
+        table = (pte_t *)(PTE_ADDR_MASK(*entry) + HHDM);
+    }
+
+    path[2] = table;
+    return true;
+}
+
+static size_t count_valid(pte_t *table)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < 512; i++)
+        if (table[i] & PTE_VALID)
+            count++;
+    return count;
+}
+
+bool arch_paging_move_table(arch_paging_map_t *map, uintptr_t old_vaddr, uintptr_t new_vaddr)
+{
+    pte_t *old_path[3], *new_path[3];
+
+    if (!walk_to_l2(map, old_vaddr, false, old_path))
+        return false;
+    pte_t *old_entry = &old_path[2][(old_vaddr >> 21) & 0x1FF];
+    if (!(*old_entry & PTE_VALID) || !(*old_entry & PTE_TABLE))
+        return false;
+
+    if (!walk_to_l2(map, new_vaddr, true, new_path))
+        return false;
+    pte_t *new_entry = &new_path[2][(new_vaddr >> 21) & 0x1FF];
+    if (*new_entry & PTE_VALID
+    && (!(*new_entry & PTE_TABLE) || count_valid((pte_t *)(PTE_ADDR_MASK(*new_entry) + HHDM))))
+        return false;
+
+    pte_t *l3 = (pte_t *)(PTE_ADDR_MASK(*old_entry) + HHDM);
+    size_t mappings = count_valid(l3);
+
+    pte_t empty = *new_entry;
+    *new_entry = *old_entry;
+    *old_entry = empty;
+
+    // Every mapping counts towards each table above it.
+    for (size_t i = 0; i < 3; i++)
+    {
+        atomic_fetch_sub_explicit(&pm_phys_to_page((uintptr_t)old_path[i] - HHDM)->refcount, mappings, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pm_phys_to_page((uintptr_t)new_path[i] - HHDM)->refcount, mappings, memory_order_relaxed);
+    }
+
+    // Flush TLB
+    asm volatile("dsb ishst" ::: "memory");
+    for (size_t i = 0; i < 512; i++)
+        if (l3[i] & PTE_VALID)
+            asm volatile("tlbi vae1is, %0" :: "r"((old_vaddr >> 12) + i) : "memory");
+    asm volatile("dsb ish" ::: "memory");
+    asm volatile("isb" ::: "memory");
+
+    return true;
+}
+
+// TLB shootdown
+
+void arch_paging_shootdown(const cpumask_t *cpus, uintptr_t vaddr, size_t length)
+{
+    // Invalidations are broadcast to the inner shareable domain and complete
+    // with the `dsb ish` that follows them, nothing is left to do.
+    (void)cpus;
+    (void)vaddr;
+    (void)length;
+}
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr)
@@ -184,6 +301,13 @@ bool arch_paging_vaddr_to_paddr(arch_paging_map_t *map, uintptr_t vaddr, uintptr
     return true;
 }
 
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    // The access flag is set in software when a page is mapped and hardware
+    // management of it is not enabled, so there is nothing to report.
+    return false;
+}
+
 // Map creation and destruction
 
 pte_t *higher_half_pml4;
@@ -3,9 +3,8 @@
 #include "arch/aarch64/abi/stack.h"
 #include "arch/lcpu.h"
 #include "arch/types.h"
-#include "hhdm.h"
 #include "mm/mm.h"
-#include "mm/pm.h"
+#include "proc/smp.h"
 
 typedef struct
 {
@@ -89,14 +88,18 @@ extern void __aarch64_thread_userspace_init();
 
 extern __attribute__((naked)) void __thread_context_switch(arch_thread_context_t *new, arch_thread_context_t *old);
 
-void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry)
+bool arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry)
 {
+    uintptr_t stack = smp_page_cache_alloc(SMP_PAGE_CACHE_STACK, 0);
+    if (!stack)
+        return false;
+    context->kernel_stack = stack + ARCH_PAGE_GRAN;
+
     if (user)
     {
         char *argv[] = { "test", NULL };
         char *envp[] = { NULL };
 
-        context->kernel_stack = pm_alloc(0)->addr + HHDM + ARCH_PAGE_GRAN;
         context->rsp = (context->kernel_stack - sizeof(arch_thread_init_stack_kernel_t)) & (~0xF); // align as 16
 
         arch_thread_init_stack_user_t *init_stack = (arch_thread_init_stack_user_t *)context->rsp;
@@ -108,15 +111,19 @@ void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as
     }
     else
     {
-        context->kernel_stack = pm_alloc(0)->addr + HHDM + ARCH_PAGE_GRAN;
         context->rsp = context->kernel_stack - sizeof(arch_thread_init_stack_kernel_t);
         memset((void *)context->rsp, 0, sizeof(arch_thread_init_stack_kernel_t));
         ((arch_thread_init_stack_kernel_t *)context->rsp)->entry = entry;
     }
+    return true;
+}
+
+void arch_thread_context_fini(arch_thread_context_t *context)
+{
+    smp_page_cache_free(SMP_PAGE_CACHE_STACK, context->kernel_stack - ARCH_PAGE_GRAN, 0);
 }
 
 void arch_thread_context_switch(arch_thread_context_t *curr, arch_thread_context_t *next)
 {
-    arch_lcpu_thread_reg_write((size_t)next);
     __thread_context_switch(curr, next); // This function calls `sched_drop` for `curr` too.
 }
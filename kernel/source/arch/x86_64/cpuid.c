@@ -15,10 +15,15 @@ bool x86_64_cpuid_check_feature(x86_64_cpuid_feature_t feature)
 {
     uint32_t value;
 
-    x86_64_cpuid_response_t resp = x86_64_cpuid(feature.eax, feature.reg);
+    // Leaves past the highest one return unrelated data.
+    if (feature.eax > x86_64_cpuid(0, 0).eax)
+        return false;
+
+    x86_64_cpuid_response_t resp = x86_64_cpuid(feature.eax, 0);
 
     switch(feature.reg)
     {
+        case EBX: value = resp.ebx;  break;
         case ECX: value = resp.ecx;  break;
         case EDX: value = resp.edx;  break;
         default: ASSERT(false); break;
@@ -1,6 +1,10 @@
 #include "arch/clock.h"
 
+#include "arch/timer.h"
+#include "arch/x86_64/devices/hpet.h"
 #include "arch/x86_64/ioport.h"
+#include "sync/seqlock.h"
+#include "sync/spinlock.h"
 #include <stdint.h>
 
 #define CMOS_ADDR   0x70
@@ -15,6 +19,20 @@
 #define RTC_REG_STATUS_A    0x0A
 #define RTC_REG_STATUS_B    0x0B
 
+// How long the wall clock runs on the HPET before being checked against the RTC.
+#define RESYNC_NS (60ull * 1'000'000'000)
+
+// The index/data port pair is one piece of state for all CPUs.
+static spinlock_t cmos_slock = SPINLOCK_INIT;
+
+// Wall clock: the Unix time read from the RTC at some uptime, advanced by the
+// uptime since, so that readers only go to the CMOS once per `RESYNC_NS`.
+static seqlock_t wall_seqlock = SEQLOCK_INIT;
+static bool wall_synced = false;
+static uint64_t wall_unix;
+static uint64_t wall_uptime;  // When `wall_unix` was read.
+static uint64_t wall_checked; // When the RTC was last looked at.
+
 // Helpers
 
 static bool is_updating()
@@ -46,9 +64,7 @@ static void read_snapshot(arch_clock_snapshot_t *s)
     };
 }
 
-// API
-
-bool arch_clock_get_snapshot(arch_clock_snapshot_t *out)
+static bool read_rtc(arch_clock_snapshot_t *out)
 {
     arch_clock_snapshot_t a, b;
 
@@ -102,10 +118,8 @@ bool arch_clock_get_snapshot(arch_clock_snapshot_t *out)
     return true;
 }
 
-uint64_t arch_clock_get_unix_time()
+static uint64_t snapshot_to_unix(arch_clock_snapshot_t now)
 {
-    arch_clock_snapshot_t now;
-    arch_clock_get_snapshot(&now);
 
     now.year -= now.month <= 2;
     const int64_t era = (now.year >= 0 ? now.year : now.year - 399) / 400;
@@ -117,3 +131,63 @@ uint64_t arch_clock_get_unix_time()
 
     return (uint64_t)(days * 86400 + sod);
 }
+
+// API
+
+bool arch_clock_get_snapshot(arch_clock_snapshot_t *out)
+{
+    spinlock_acquire(&cmos_slock);
+    bool ret = read_rtc(out);
+    spinlock_release(&cmos_slock);
+
+    return ret;
+}
+
+uint64_t arch_clock_get_unix_time()
+{
+    arch_clock_snapshot_t snapshot;
+
+    // No uptime to advance the clock by before the HPET runs.
+    if (x86_64_hpet_get_frequency() == 0)
+    {
+        arch_clock_get_snapshot(&snapshot);
+        return snapshot_to_unix(snapshot);
+    }
+
+    bool synced;
+    uint64_t base, at, checked;
+    uint32_t seq;
+    do
+    {
+        seq = seqlock_read_begin(&wall_seqlock);
+        synced = __atomic_load_n(&wall_synced, __ATOMIC_RELAXED);
+        base = __atomic_load_n(&wall_unix, __ATOMIC_RELAXED);
+        at = __atomic_load_n(&wall_uptime, __ATOMIC_RELAXED);
+        checked = __atomic_load_n(&wall_checked, __ATOMIC_RELAXED);
+    }
+    while (seqlock_read_retry(&wall_seqlock, seq));
+
+    // Read after the copy, so never before `at`.
+    uint64_t now = arch_timer_get_uptime_ns();
+    uint64_t estimate = base + (now - at) / 1'000'000'000;
+    if (synced && now - checked < RESYNC_NS)
+        return estimate;
+
+    arch_clock_get_snapshot(&snapshot);
+    uint64_t rtc = snapshot_to_unix(snapshot);
+
+    seqlock_write_lock(&wall_seqlock);
+    // The RTC only counts whole seconds; a base moved on every check would
+    // make the clock step back and forth.
+    if (!synced || rtc + 1 < estimate || rtc > estimate + 1)
+    {
+        __atomic_store_n(&wall_unix, rtc, __ATOMIC_RELAXED);
+        __atomic_store_n(&wall_uptime, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&wall_synced, true, __ATOMIC_RELAXED);
+        estimate = rtc;
+    }
+    __atomic_store_n(&wall_checked, now, __ATOMIC_RELAXED);
+    seqlock_write_unlock(&wall_seqlock);
+
+    return estimate;
+}
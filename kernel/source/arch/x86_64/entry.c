@@ -20,14 +20,15 @@ uintptr_t HHDM;
 
 [[noreturn]] extern void kernel_main();
 
+static thread_t early_thread;
+
 static cpu_t early_cpu = (cpu_t) {
+    .self = &early_cpu,
+    .curr_thread = &early_thread,
     .id = 0,
 };
 
 static thread_t early_thread = (thread_t) {
-    .context = (arch_thread_context_t) {
-        .self = &early_thread.context
-    },
     .tid = 0,
     .assigned_cpu = &early_cpu
 };
@@ -35,8 +36,8 @@ static thread_t early_thread = (thread_t) {
 void __entry()
 {
     HHDM = bootreq_hhdm.response->offset;
-    // Load pseudo-thread
-    arch_lcpu_thread_reg_write((size_t)&early_thread.context);
+    // Load pseudo-CPU, running the pseudo-thread
+    arch_lcpu_percpu_init(&early_cpu);
 
     simplefb_init();
     log(LOG_INFO, "Kernel compiled on %s at %s.", __DATE__, __TIME__);
@@ -1,13 +1,46 @@
 #include "arch/x86_64/fpu.h"
 
 #include "arch/x86_64/cpuid.h"
+#include "mm/mm.h"
 #include "panic.h"
+#include "proc/percpu.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
 #include <stdint.h>
 
+/*
+ * FPU and SIMD state is switched lazily. CR0.TS is set when a thread is
+ * switched in, and the first FPU or SIMD instruction it runs traps (#NM) to
+ * load its state, so threads that never use the FPU, kernel threads among
+ * them, are neither saved nor restored. The registers keep the state of the
+ * last thread that loaded it on the CPU, and that thread coming back before
+ * anyone else used the FPU does not reload it either.
+ *
+ * Threads that used the FPU on `EAGER_STREAK` runs in a row have it loaded
+ * right away to spare them the trap. The streak wraps around after 256 runs,
+ * which gives threads that stopped using the FPU a chance to drop out.
+ */
+
+#define EAGER_STREAK 5
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+// CPUID leaf 0xD, sub-leaf 1, EAX.
+#define XSAVE_EXT_XSAVEOPT (1 << 0)
+#define XSAVE_EXT_XSAVEC   (1 << 1)
+#define XSAVE_EXT_XSAVES   (1 << 3)
+
+#define CR0_TS (1 << 3)
+
 size_t x86_64_fpu_area_size = 0;
 void (*x86_64_fpu_save)(void *area) = NULL;
 void (*x86_64_fpu_restore)(void *area) = NULL;
 
+static uint64_t xfeatures = 0; // State components enabled in XCR0.
+static bool compacted = false; // Whether the save area is in the compacted format.
+
 static inline void fxsave(void *area)
 {
     asm volatile("fxsave (%0)" : : "r"(area) : "memory");
@@ -20,14 +53,115 @@ static inline void fxrstor(void *area)
 
 static inline void xsave(void *area)
 {
-    asm volatile("xsave (%0)" : : "r"(area), "a"(0xFFFF'FFFF), "d"(0xFFFF'FFFF) : "memory");
+    asm volatile("xsave (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+}
+
+// Skips the components left unmodified since the area was restored.
+static inline void xsaveopt(void *area)
+{
+    asm volatile("xsaveopt (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+}
+
+// Skips the components in their initial state.
+static inline void xsavec(void *area)
+{
+    asm volatile("xsavec (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+}
+
+// Both of the above.
+static inline void xsaves(void *area)
+{
+    asm volatile("xsaves (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
 }
 
 static inline void xrstor(void *area)
 {
-    asm volatile("xrstor (%0)" : : "r"(area), "a"(0xFFFF'FFFF), "d"(0xFFFF'FFFF) : "memory");
+    asm volatile("xrstor (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+}
+
+static inline void xrstors(void *area)
+{
+    asm volatile("xrstors (%0)" : : "r"(area), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+}
+
+static inline void set_ts()
+{
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS) : "memory");
+}
+
+static inline void clear_ts()
+{
+    asm volatile("clts" : : : "memory");
+}
+
+// Switching
+
+// Give the FPU of `cpu` to `ctx`, restoring its state unless the registers
+// still hold it.
+static void load(smp_cpu_t *cpu, arch_thread_context_t *ctx)
+{
+    clear_ts();
+    if (cpu->fpu_owner != ctx || ctx->fpu_cpu != cpu)
+    {
+        x86_64_fpu_restore(ctx->fpu_area);
+        cpu->fpu_owner = ctx;
+        ctx->fpu_cpu = cpu;
+    }
+    cpu->fpu_active = true;
+}
+
+void x86_64_fpu_switch(arch_thread_context_t *curr, arch_thread_context_t *next)
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+
+    // Saved right away, so that the thread may run anywhere next.
+    if (cpu->fpu_active)
+    {
+        x86_64_fpu_save(curr->fpu_area);
+        curr->fpu_streak++;
+    }
+    else
+        curr->fpu_streak = 0;
+
+    if (next->fpu_streak >= EAGER_STREAK)
+        load(cpu, next);
+    else if (cpu->fpu_active)
+    {
+        set_ts();
+        cpu->fpu_active = false;
+    }
+}
+
+bool x86_64_fpu_trap()
+{
+    thread_t *t = sched_get_curr_thread();
+    smp_cpu_t *cpu = this_cpu_ptr();
+
+    // Only ours while the FPU is not in use.
+    if (cpu->fpu_active)
+        return false;
+
+    load(cpu, &t->context);
+    return true;
 }
 
+void x86_64_fpu_init_area(void *area)
+{
+    memset(area, 0, x86_64_fpu_area_size);
+
+    // Legacy region: the control words are not covered by the XSAVE header.
+    *(uint16_t *)((uintptr_t)area + 0) = 0x037F; // FCW, all exceptions masked.
+    *(uint32_t *)((uintptr_t)area + 24) = 0x1F80; // MXCSR, all exceptions masked.
+
+    // XSAVE header: no component saved, the rest start in their initial state.
+    if (compacted)
+        *(uint64_t *)((uintptr_t)area + 512 + 8) = (1ull << 63) | xfeatures; // XCOMP_BV
+}
+
+// Initialization
+
 void x86_64_fpu_init()
 {
     if (!x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_FXSR))
@@ -35,10 +169,39 @@ void x86_64_fpu_init()
 
     if(x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_XSAVE))
     {
+        xfeatures = XCR0_X87 | XCR0_SSE;
+        if(x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_AVX))
+            xfeatures |= XCR0_AVX;
+
+        //TODO: AVX512 support
+
+        // Large enough for every format.
         size_t area_size = x86_64_cpuid(0xD, 0).ecx;
         x86_64_fpu_area_size = area_size;
-        x86_64_fpu_save = xsave;
-        x86_64_fpu_restore = xrstor;
+
+        uint32_t ext = x86_64_cpuid(0xD, 1).eax;
+        if (ext & XSAVE_EXT_XSAVES)
+        {
+            x86_64_fpu_save = xsaves;
+            x86_64_fpu_restore = xrstors;
+            compacted = true;
+        }
+        else if (ext & XSAVE_EXT_XSAVEOPT)
+        {
+            x86_64_fpu_save = xsaveopt;
+            x86_64_fpu_restore = xrstor;
+        }
+        else if (ext & XSAVE_EXT_XSAVEC)
+        {
+            x86_64_fpu_save = xsavec;
+            x86_64_fpu_restore = xrstor;
+            compacted = true;
+        }
+        else
+        {
+            x86_64_fpu_save = xsave;
+            x86_64_fpu_restore = xrstor;
+        }
     }
     else
     {
@@ -70,16 +233,9 @@ void x86_64_fpu_init_cpu()
         cr4 |= 1 << 18; // CR4.OSXSAVE
         asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
 
-        uint64_t xcr0 = 0;
-        xcr0 |= 1 << 0; // XCR0.X87
-        xcr0 |= 1 << 1; // XCR0.SSE
-
-        // Enable AVX
-        if(x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_AVX))
-            xcr0 |= 1 << 2; // XCR0.AVX
-
-        //TODO: AVX512 support
-
-        asm volatile("xsetbv" : : "a"(xcr0), "d"(xcr0 >> 32), "c"(0) : "memory");
+        asm volatile("xsetbv" : : "a"(xfeatures), "d"(xfeatures >> 32), "c"(0) : "memory");
     }
+
+    // Nobody owns the FPU yet, the first thread to use it traps.
+    set_ts();
 }
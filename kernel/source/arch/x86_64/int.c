@@ -1,5 +1,9 @@
 #include "arch/x86_64/devices/lapic.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/paging.h"
+#include "mm/vm.h"
 #include "panic.h"
+#include "proc/sched.h"
 
 // Interrupt handling
 
@@ -14,16 +18,45 @@ __attribute__((packed))
 cpu_state_t;
 
 static void (*arch_timer_handler)();
+static void (*arch_ipi_handler)();
 
 void arch_timer_set_handler_per_cpu(void (*handler)())
 {
     arch_timer_handler = handler;
 }
 
+void arch_lcpu_set_ipi_handler(void (*handler)())
+{
+    arch_ipi_handler = handler;
+}
+
+static bool page_fault(cpu_state_t *cpu_state)
+{
+    bool present = cpu_state->err_code & 0x1;
+    bool write = cpu_state->err_code & 0x2;
+
+    // The only protection violation that can be resolved is a write to the
+    // read-only zero page.
+    if (present && !write)
+        return false;
+
+    uintptr_t cr2;
+    asm volatile("movq %%cr2, %0" : "=r"(cr2));
+
+    // The early boot pseudo-thread has no process, hence no address space.
+    proc_t *proc = sched_get_curr_thread()->owner;
+    return proc && vm_page_fault(proc->as, cr2, write);
+}
+
 void arch_int_handler(cpu_state_t *cpu_state)
 {
     if (cpu_state->int_no < 32) // Exceptions
     {
+        if (cpu_state->int_no == 7 && x86_64_fpu_trap())
+            return;
+        if (cpu_state->int_no == 14 && page_fault(cpu_state))
+            return;
+
         panic("CPU EXCEPTION: %llx %#llx", cpu_state->int_no, cpu_state->err_code);
     }
     else // IRQs
@@ -34,8 +67,17 @@ void arch_int_handler(cpu_state_t *cpu_state)
         {
             case 0: // PIT
                 break;
-            case 2: // LAPIC Timer
+            case X86_64_LAPIC_TIMER_IRQ:
+                // The handler may switch to another thread, acknowledge first.
+                x86_64_lapic_send_eoi();
                 arch_timer_handler();
+                return;
+            case X86_64_LAPIC_IPI_IRQ:
+                x86_64_lapic_send_eoi();
+                arch_ipi_handler();
+                return;
+            case X86_64_LAPIC_TLB_IRQ:
+                x86_64_paging_shootdown_poll();
                 break;
             default:
                 panic("Unhandled IRQ %d", irq);
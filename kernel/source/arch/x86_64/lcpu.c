@@ -1,20 +1,59 @@
 #include "arch/lcpu.h"
 
+#include "arch/x86_64/cpuid.h"
 #include "arch/x86_64/devices/lapic.h"
 #include "arch/x86_64/fpu.h"
 #include "arch/x86_64/msr.h"
+#include "arch/x86_64/paging.h"
 #include "arch/x86_64/syscall.h"
+#include "arch/x86_64/tcb.h"
 #include "arch/x86_64/tables/gdt.h"
 #include "arch/x86_64/tables/idt.h"
+#include "mm/heap.h"
 #include "mm/vm.h"
+#include "panic.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
 
 #include <stdint.h>
 
+static bool mwait_supported;
+
 void arch_lcpu_halt()
 {
     asm volatile("hlt");
 }
 
+void arch_lcpu_wait(volatile bool *wake)
+{
+    // An interrupt right after `sti` is held back until the next instruction
+    // halts, so it can not slip in between and be missed.
+    if (mwait_supported)
+    {
+        asm volatile("monitor" : : "a"(wake), "c"(0), "d"(0));
+        if (!*wake)
+            asm volatile("sti; mwait" : : "a"(0), "c"(0));
+        else
+            arch_lcpu_int_unmask();
+    }
+    else if (!*wake)
+        asm volatile("sti; hlt");
+    else
+        arch_lcpu_int_unmask();
+}
+
+void arch_lcpu_wake(smp_cpu_t *cpu)
+{
+    // The write to the monitored flag already woke it up.
+    if (!mwait_supported)
+        arch_lcpu_send_ipi(cpu);
+}
+
+void arch_lcpu_send_ipi(smp_cpu_t *cpu)
+{
+    x86_64_lapic_ipi(cpu->lapic_id, 32 + X86_64_LAPIC_IPI_IRQ);
+}
+
 void arch_lcpu_int_mask()
 {
     asm volatile ("cli");
@@ -35,26 +74,123 @@ bool arch_lcpu_int_enabled()
 void arch_lcpu_relax()
 {
     asm volatile ("pause");
+    x86_64_paging_shootdown_poll();
+}
+
+uint64_t arch_lcpu_cycles()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
 }
 
-size_t arch_lcpu_thread_reg_read()
+// Also used before `arch_lcpu_init` enabled FSGSBASE.
+void arch_lcpu_percpu_init(smp_cpu_t *cpu)
 {
-    uint64_t gs;
-    asm volatile("mov %%gs:0, %0" : "=r"(gs));
-    return gs;
+    x86_64_msr_write(X86_64_MSR_GS_BASE, (uint64_t)cpu);
 }
 
-void arch_lcpu_thread_reg_write(size_t t)
+// Topology
+
+// Width of an APIC ID field that numbers `count` IDs.
+static inline uint32_t id_bits(uint32_t count)
 {
-    x86_64_msr_write(X86_64_MSR_GS_BASE, (uint64_t)t);
+    return count > 1 ? 32 - __builtin_clz(count - 1) : 0;
+}
+
+static void detect_topology(smp_topology_t *topo)
+{
+    uint32_t max_leaf = x86_64_cpuid(0, 0).eax;
+    uint32_t apic_id = x86_64_cpuid(1, 0).ebx >> 24;
+    uint32_t smt_shift = 0;
+    uint32_t pkg_shift;
+
+    // Leaf 0x1F adds module, tile and die levels to 0xB. Only the SMT level
+    // and the shift to the package matter here.
+    uint32_t leaf = 0;
+    if (max_leaf >= 0x1F && x86_64_cpuid(0x1F, 0).ebx)
+        leaf = 0x1F;
+    else if (max_leaf >= 0xB && x86_64_cpuid(0xB, 0).ebx)
+        leaf = 0xB;
+
+    if (leaf)
+    {
+        pkg_shift = 0;
+        for (uint32_t sub = 0; ; sub++)
+        {
+            x86_64_cpuid_response_t r = x86_64_cpuid(leaf, sub);
+            uint32_t type = (r.ecx >> 8) & 0xFF;
+            if (type == 0)
+                break;
+            if (type == 1)
+                smt_shift = r.eax & 0x1F;
+            pkg_shift = r.eax & 0x1F;
+            apic_id = r.edx; // The full x2APIC ID.
+        }
+    }
+    else
+    {
+        // All that is known is how many logical CPUs share the package.
+        pkg_shift = id_bits((x86_64_cpuid(1, 0).ebx >> 16) & 0xFF);
+    }
+
+    topo->package = apic_id >> pkg_shift;
+    topo->core = (apic_id & ((1u << pkg_shift) - 1)) >> smt_shift;
+    topo->thread = apic_id & ((1u << smt_shift) - 1);
+    topo->l2 = apic_id >> smt_shift;
+    topo->llc = topo->package;
+
+    // Deterministic cache parameters: leaf 4 on Intel, 0x8000001D on AMD,
+    // which leaves leaf 4 empty.
+    uint32_t cache_leaf = max_leaf >= 4 ? 4 : 0;
+    if (!(cache_leaf && (x86_64_cpuid(4, 0).eax & 0x1F))
+    &&  x86_64_cpuid(0x80000000, 0).eax >= 0x8000001D)
+        cache_leaf = 0x8000001D;
+    if (!cache_leaf)
+        return;
+
+    uint32_t llc_level = 0;
+    for (uint32_t sub = 0; ; sub++)
+    {
+        x86_64_cpuid_response_t r = x86_64_cpuid(cache_leaf, sub);
+        uint32_t type = r.eax & 0x1F; // 1 data, 2 instruction, 3 unified.
+        if (type == 0)
+            break;
+        if (type == 2)
+            continue;
+
+        uint32_t level = (r.eax >> 5) & 0x7;
+        uint32_t id = apic_id >> id_bits(((r.eax >> 14) & 0xFFF) + 1);
+        if (level == 2)
+            topo->l2 = id;
+        if (level >= llc_level)
+        {
+            llc_level = level;
+            topo->llc = id;
+        }
+    }
 }
 
 void arch_lcpu_init()
 {
     vm_addrspace_load(vm_kernel_as);
     x86_64_gdt_init_cpu();
+
+    // CPUs come up one at a time, so they can take turns loading their TSS
+    // through the single descriptor in the shared GDT.
+    smp_cpu_t *cpu = this_cpu_ptr();
+    cpu->tss = heap_alloc(sizeof(tss_t));
+    if (!cpu->tss)
+        panic("Could not allocate the TSS of CPU #%lu!", cpu->id);
+    x86_64_gdt_load_tss(cpu->tss);
+
+    detect_topology(&cpu->topology);
+
     x86_64_idt_init_cpu();
     x86_64_lapic_init_cpu();
+    cpu->lapic_id = x86_64_lapic_id();
+    mwait_supported = x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_MONITOR);
     x86_64_fpu_init_cpu();
+    x86_64_tcb_init_cpu();
     x86_64_syscall_init_cpu();
 }
@@ -1,13 +1,20 @@
 #include "arch/paging.h"
 
+#include "arch/lcpu.h"
+#include "arch/x86_64/devices/lapic.h"
+#include "arch/x86_64/paging.h"
 #include "hhdm.h"
 #include "mm/heap.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
+#include "sync/spinlock.h"
 
 #define PTE_PRESENT   (1ull <<  0)
 #define PTE_WRITE     (1ull <<  1)
 #define PTE_USER      (1ull <<  2)
+#define PTE_ACCESSED  (1ull <<  5)
 #define PTE_HUGE      (1ull <<  7)
 #define PTE_GLOBAL    (1ull <<  8)
 #define PTE_NX        (1ull << 63)
@@ -64,13 +71,37 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     pte_t *table = map->pml4;
     size_t level;
     size_t target_level = (size == 1 * GIB) ? 2 : (size == 2 * MIB) ? 1 : 0;
+
+    // Take the missing tables up front, so that running out of memory leaves
+    // the map untouched. Below the first missing one, all are missing.
+    page_t *spare[3];
+    size_t missing = 0;
+    for (level = 3; level > target_level; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT))
+        {
+            missing = level - target_level;
+            break;
+        }
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+    for (size_t i = 0; i < missing; i++)
+        if (!(spare[i] = pm_alloc(0)))
+        {
+            while (i--)
+                pm_free(spare[i]);
+            return -1;
+        }
+
+    table = map->pml4;
     for (level = 3; level > target_level; level--)
     {
         size_t idx = indices[level];
 
         if (!(table[idx] & PTE_PRESENT))
         {
-            uintptr_t phys = pm_alloc(0)->addr;
+            uintptr_t phys = spare[--missing]->addr;
             pte_t *next_table = (pte_t *)(phys + HHDM);
             memset(next_table, 0, 0x1000);
             table[idx] = phys | PTE_PRESENT | PTE_WRITE | hh_user_flag(hh);
@@ -145,6 +176,162 @@ int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
     return 0;
 }
 
+// Collect the PML4, PML3 and PML2 tables leading to the PML1 table of `vaddr`,
+// creating missing ones if `create` is set.
+static bool walk_to_pml2(arch_paging_map_t *map, uintptr_t vaddr, bool create, pte_t *path[3])
+{
+    pte_t *table = map->pml4;
+    for (size_t level = 3; level >= 2; level--)
+    {
+        path[3 - level] = table;
+        pte_t *entry = &table[(vaddr >> (12 + 9 * level)) & 0x1FF];
+
+        if (!(*entry & PTE_PRESENT))
+        {
+            if (!create)
+                return false;
+
+            page_t *page = pm_alloc(0);
+            if (!page)
+                return false;
+            memset((void *)(page->addr + HHDM), 0, 0x1000);
+            *entry = page->addr | PTE_PRESENT | PTE_WRITE | hh_user_flag(vaddr >= HHDM);
+        }
+        else if (*entry & PTE_HUGE)
+            return false;
+
+        table = (pte_t *)(PTE_ADDR_MASK(*entry) + HHDM);
+    }
+
+    path[2] = table;
+    return true;
+}
+
+static size_t count_present(pte_t *table)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < 512; i++)
+        if (table[i] & PTE_PRESENT)
+            count++;
+    return count;
+}
+
+bool arch_paging_move_table(arch_paging_map_t *map, uintptr_t old_vaddr, uintptr_t new_vaddr)
+{
+    pte_t *old_path[3], *new_path[3];
+
+    if (!walk_to_pml2(map, old_vaddr, false, old_path))
+        return false;
+    pte_t *old_entry = &old_path[2][(old_vaddr >> 21) & 0x1FF];
+    if (!(*old_entry & PTE_PRESENT) || *old_entry & PTE_HUGE)
+        return false;
+
+    if (!walk_to_pml2(map, new_vaddr, true, new_path))
+        return false;
+    pte_t *new_entry = &new_path[2][(new_vaddr >> 21) & 0x1FF];
+    if (*new_entry & PTE_PRESENT
+    && (*new_entry & PTE_HUGE || count_present((pte_t *)(PTE_ADDR_MASK(*new_entry) + HHDM))))
+        return false;
+
+    pte_t *pml1 = (pte_t *)(PTE_ADDR_MASK(*old_entry) + HHDM);
+    size_t mappings = count_present(pml1);
+
+    pte_t empty = *new_entry;
+    *new_entry = *old_entry;
+    *old_entry = empty;
+
+    // Every mapping counts towards each table above it.
+    for (size_t i = 0; i < 3; i++)
+    {
+        atomic_fetch_sub_explicit(&pm_phys_to_page((uintptr_t)old_path[i] - HHDM)->refcount, mappings, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pm_phys_to_page((uintptr_t)new_path[i] - HHDM)->refcount, mappings, memory_order_relaxed);
+    }
+
+    // Flush TLB
+    for (size_t i = 0; i < 512; i++)
+        if (pml1[i] & PTE_PRESENT)
+            asm volatile("invlpg (%0)" ::"r"(old_vaddr + i * 0x1000) : "memory");
+
+    return true;
+}
+
+// TLB shootdown
+
+#define SHOOTDOWN_MAX_PAGES 32 // Larger ranges flush the whole TLB.
+#define CR4_PGE (1ull << 7)
+
+// One shootdown runs at a time, the one described here.
+static spinlock_t shootdown_slock = SPINLOCK_INIT;
+static uintptr_t shootdown_vaddr;
+static size_t shootdown_length;
+static cpumask_t shootdown_pending; // Targets that have not flushed yet.
+
+static void flush_range(uintptr_t vaddr, size_t length)
+{
+    if (length <= SHOOTDOWN_MAX_PAGES * 0x1000)
+    {
+        for (size_t i = 0; i < length; i += 0x1000)
+            asm volatile("invlpg (%0)" ::"r"(vaddr + i) : "memory");
+        return;
+    }
+
+    // User mappings are global, which a CR3 reload keeps and toggling
+    // CR4.PGE does not.
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & CR4_PGE)
+    {
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    }
+    else
+    {
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+}
+
+void x86_64_paging_shootdown_poll()
+{
+    size_t id = this_cpu_read(id);
+    if (!cpumask_test_atomic(&shootdown_pending, id))
+        return;
+
+    flush_range(shootdown_vaddr, shootdown_length);
+    cpumask_clear_atomic(&shootdown_pending, id);
+}
+
+void arch_paging_shootdown(const cpumask_t *cpus, uintptr_t vaddr, size_t length)
+{
+    // Taking the lock also orders the page table changes before the reads of
+    // `cpus`, so a CPU that is not in there yet loads the new tables.
+    spinlock_acquire(&shootdown_slock);
+
+    shootdown_vaddr = vaddr;
+    shootdown_length = length;
+
+    size_t self = this_cpu_read(id);
+    if (cpumask_test_atomic(cpus, self))
+        flush_range(vaddr, length);
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (cpu->id == self || !cpumask_test_atomic(cpus, cpu->id))
+            continue;
+
+        cpumask_set_atomic(&shootdown_pending, cpu->id);
+        x86_64_lapic_ipi(cpu->lapic_id, 32 + X86_64_LAPIC_TLB_IRQ);
+    }
+
+    for (size_t i = 0; i < CPUMASK_MAX_CPUS / 64; i++)
+        while (__atomic_load_n(&shootdown_pending.bits[i], __ATOMIC_ACQUIRE))
+            arch_lcpu_relax();
+
+    spinlock_release(&shootdown_slock);
+}
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr)
@@ -189,6 +376,35 @@ bool arch_paging_vaddr_to_paddr(arch_paging_map_t *map, uintptr_t vaddr, uintptr
     return true;
 }
 
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF, // PML1 entry
+        (vaddr >> 21) & 0x1FF, // PML2 entry
+        (vaddr >> 30) & 0x1FF, // PML3 entry
+        (vaddr >> 39) & 0x1FF  // PML4 entry
+    };
+
+    pte_t *table = map->pml4;
+    for (size_t level = 3; level >= 1; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT) || entry & PTE_HUGE)
+            return false;
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    // The CPU sets the bit atomically, so clear it the same way.
+    pte_t prev = __atomic_fetch_and(&table[indices[0]], ~PTE_ACCESSED, __ATOMIC_RELAXED);
+    if (!(prev & PTE_PRESENT) || !(prev & PTE_ACCESSED))
+        return false;
+
+    // Make the next access set the bit again.
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+    return true;
+}
+
 
 // Map creation and destruction
 
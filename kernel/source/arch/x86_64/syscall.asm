@@ -1,7 +1,8 @@
 global x86_64_arch_syscall_entry
 
-%define KERNEL_STACK_OFFSET 40
-%define SYSCALL_STACK_OFFSET 48
+; Offsets in `smp_cpu_t`, the per-CPU data area GS points at after `swapgs`.
+%define PERCPU_KERNEL_STACK_OFFSET 16
+%define PERCPU_USER_SP_OFFSET 24
 
 extern syscall_table
 extern syscall_table_length
@@ -9,8 +10,11 @@ extern syscall_table_length
 section .text
 x86_64_arch_syscall_entry:
     swapgs
-    mov qword [gs:SYSCALL_STACK_OFFSET], rsp
-    mov rsp, qword [gs:KERNEL_STACK_OFFSET]
+    mov qword [gs:PERCPU_USER_SP_OFFSET], rsp
+    mov rsp, qword [gs:PERCPU_KERNEL_STACK_OFFSET]
+    ; The user stack pointer stays with the thread, which may block and
+    ; return on another CPU.
+    push qword [gs:PERCPU_USER_SP_OFFSET]
 
     ; RAX and RDX are not preserved because they hold the syscall return value and errno, respectively.
 
@@ -60,6 +64,8 @@ x86_64_arch_syscall_entry:
     pop rcx
     pop rbx
 
-    mov rsp, qword [gs:SYSCALL_STACK_OFFSET]
+    ; Not to be interrupted on the user stack, or with the user GS.
+    cli
+    pop rsp
     swapgs
     o64 sysret
@@ -1,9 +1,25 @@
 // API
 #include "arch/misc.h"
 //
-#include "arch/x86_64/msr.h"
+#include "arch/x86_64/cpuid.h"
+#include "arch/x86_64/tcb.h"
+
+bool x86_64_tcb_fsgsbase = false;
 
 void arch_syscall_tcb_set(void *ptr)
 {
-    x86_64_msr_write(X86_64_MSR_FS_BASE, (uint64_t)ptr);
+    x86_64_tcb_fs_write((uint64_t)ptr);
+}
+
+void x86_64_tcb_init_cpu()
+{
+    if (!x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_FSGSBASE))
+        return;
+
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 1 << 16; // CR4.FSGSBASE
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
+    x86_64_tcb_fsgsbase = true;
 }
@@ -4,10 +4,11 @@
 #include "arch/types.h"
 #include "arch/x86_64/abi/stack.h"
 #include "arch/x86_64/fpu.h"
-#include "arch/x86_64/msr.h"
-#include "hhdm.h"
+#include "arch/x86_64/tcb.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
 #include "utils/math.h"
 
 typedef struct
@@ -60,17 +61,31 @@ extern void __x86_64_thread_userspace_init();
 
 extern __attribute__((naked)) void __thread_context_switch(arch_thread_context_t *new, arch_thread_context_t *old);
 
-void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry)
+static inline uint8_t fpu_area_order()
 {
-    context->self = context;
+    return pm_pagecount_to_order(CEIL(x86_64_fpu_area_size, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
+}
+
+bool arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as, bool user, uintptr_t entry)
+{
+    uintptr_t stack = smp_page_cache_alloc(SMP_PAGE_CACHE_STACK, 0);
+    if (!stack)
+        return false;
+    context->fpu_area = (void*)smp_page_cache_alloc(SMP_PAGE_CACHE_FPU, fpu_area_order());
+    if (!context->fpu_area)
+    {
+        smp_page_cache_free(SMP_PAGE_CACHE_STACK, stack, 0);
+        return false;
+    }
+
     context->fs = context->gs = 0;
+    context->kernel_stack = stack + ARCH_PAGE_GRAN;
 
     if (user)
     {
         char *argv[] = { "test", NULL };
         char *envp[] = { NULL };
 
-        context->kernel_stack = pm_alloc(0)->addr + HHDM + ARCH_PAGE_GRAN;
         context->rsp = (context->kernel_stack - sizeof(arch_thread_init_stack_kernel_t)) & (~0xF); // align as 16
 
         arch_thread_init_stack_user_t *init_stack = (arch_thread_init_stack_user_t *)context->rsp;
@@ -82,29 +97,37 @@ void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as
     }
     else
     {
-        context->kernel_stack = pm_alloc(0)->addr + HHDM + ARCH_PAGE_GRAN;
         context->rsp = context->kernel_stack - sizeof(arch_thread_init_stack_kernel_t);
         memset((void *)context->rsp, 0, sizeof(arch_thread_init_stack_kernel_t));
         ((arch_thread_init_stack_kernel_t *)context->rsp)->entry = entry;
     }
 
-    uint8_t order = pm_pagecount_to_order(CEIL(x86_64_fpu_area_size, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
-    context->fpu_area = (void*)(pm_alloc(order)->addr + HHDM);
-    memset(context->fpu_area, 0, x86_64_fpu_area_size);
+    x86_64_fpu_init_area(context->fpu_area);
+    context->fpu_cpu = NULL;
+    context->fpu_streak = 0;
+    return true;
+}
+
+void arch_thread_context_fini(arch_thread_context_t *context)
+{
+    smp_page_cache_free(SMP_PAGE_CACHE_STACK, context->kernel_stack - ARCH_PAGE_GRAN, 0);
+    smp_page_cache_free(SMP_PAGE_CACHE_FPU, (uintptr_t)context->fpu_area, fpu_area_order());
 }
 
 void arch_thread_context_switch(arch_thread_context_t *curr, arch_thread_context_t *next)
 {
     // FS & GS
-    curr->fs = x86_64_msr_read(X86_64_MSR_FS_BASE);
-    curr->gs = x86_64_msr_read(X86_64_MSR_KERNEL_GS_BASE);
-    x86_64_msr_write(X86_64_MSR_FS_BASE, next->fs);
-    x86_64_msr_write(X86_64_MSR_KERNEL_GS_BASE, next->gs);
+    curr->fs = x86_64_tcb_fs_read();
+    curr->gs = x86_64_tcb_user_gs_read();
+    x86_64_tcb_fs_write(next->fs);
+    x86_64_tcb_user_gs_write(next->gs);
     // FPU
-    x86_64_fpu_save(curr->fpu_area);
-    x86_64_fpu_restore(next->fpu_area);
+    x86_64_fpu_switch(curr, next);
 
-    arch_lcpu_thread_reg_write((size_t)next);
+    // Interrupts and system calls from user mode land on the kernel stack of
+    // the thread.
+    tss_set_rsp0(this_cpu_read(tss), next->kernel_stack);
+    this_cpu_write(kernel_stack, next->kernel_stack);
 
     __thread_context_switch(curr, next); // This function calls `sched_drop` for `curr` too.
 }
@@ -1,27 +1,28 @@
 #include "dev/bus.h"
 
 #include "log.h"
+#include "sync/percpu_rwlock.h"
 #include "utils/string.h"
 
+// Guarded by `SMP_RWLOCK_BUSES`.
 static list_t bus_list = LIST_INIT;
-static spinlock_t bus_list_slock = SPINLOCK_INIT;
 
 bus_t *bus_get(const char *name)
 {
-    spinlock_acquire(&bus_list_slock);
+    percpu_rwlock_acquire_read(SMP_RWLOCK_BUSES);
 
     FOREACH(n, bus_list)
     {
         bus_t *bus = LIST_GET_CONTAINER(n, bus_t, list_node);
         if (strcmp(bus->name, name) == 0)
         {
-            spinlock_release(&bus_list_slock);
+            percpu_rwlock_release_read(SMP_RWLOCK_BUSES);
             ref_get(&bus->refcount);
             return bus;
         }
     }
 
-    spinlock_release(&bus_list_slock);
+    percpu_rwlock_release_read(SMP_RWLOCK_BUSES);
     return NULL;
 }
 
@@ -40,17 +41,20 @@ bool bus_register(bus_t *bus)
     ref_init(&bus->refcount);
     bus->slock = SPINLOCK_INIT;
 
-    spinlock_acquire(&bus_list_slock);
+    percpu_rwlock_acquire_write(SMP_RWLOCK_BUSES);
 
     FOREACH(n, bus_list)
     {
         bus_t *b = LIST_GET_CONTAINER(n, bus_t, list_node);
         if (strcmp(b->name, bus->name) == 0)
+        {
+            percpu_rwlock_release_write(SMP_RWLOCK_BUSES);
             return false;
+        }
     }
     list_append(&bus_list, &bus->list_node);
 
-    spinlock_release(&bus_list_slock);
+    percpu_rwlock_release_write(SMP_RWLOCK_BUSES);
 
     log(LOG_INFO, "Bus registered: %s", bus->name);
     return true;
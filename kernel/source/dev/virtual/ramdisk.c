@@ -0,0 +1,95 @@
+#include "assert.h"
+#include "dev/bus.h"
+#include "dev/device.h"
+#include "fs/devfs.h"
+#include "fs/vfs.h"
+#include "mm/mm.h"
+#include "mm/vm.h"
+#include "uapi/errno.h"
+
+#define RAMDISK_SIZE (8 * MIB)
+
+static uint8_t *ramdisk;
+
+static int read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
+                uint64_t *out_bytes_read)
+{
+    ASSERT(buffer && out_bytes_read);
+
+    if (offset >= RAMDISK_SIZE)
+    {
+        *out_bytes_read = 0;
+        return EOK;
+    }
+
+    size_t available = RAMDISK_SIZE - offset;
+    size_t to_read = (count < available) ? count : available;
+
+    memcpy(buffer, ramdisk + offset, to_read);
+
+    *out_bytes_read = to_read;
+    return EOK;
+}
+
+static int write(vnode_t *vn, const void *buffer, uint64_t offset, uint64_t count,
+                 uint64_t *out_bytes_written)
+{
+    ASSERT(buffer && out_bytes_written);
+
+    if (offset >= RAMDISK_SIZE)
+    {
+        *out_bytes_written = 0;
+        return EOK;
+    }
+
+    size_t available = RAMDISK_SIZE - offset;
+    size_t to_write = (count < available) ? count : available;
+
+    memcpy(ramdisk + offset, buffer, to_write);
+
+    *out_bytes_written = to_write;
+    return EOK;
+}
+
+static int mmap(vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
+            int prot, int flags, uint64_t offset)
+{
+    return ENOTSUP;
+}
+
+static vnode_ops_t file_ops = {
+    .read = read,
+    .write = write,
+    .mmap = mmap
+};
+
+static device_t ramdisk_device = {
+    .name = "RAM disk",
+    .class = DEVICE_STORAGE,
+    .power_ops = NULL,
+};
+
+void virtual_ramdisk_init()
+{
+    ramdisk = vm_alloc(RAMDISK_SIZE);
+    ASSERT(ramdisk);
+
+    bus_t *virtual_bus = bus_get("virtual");
+    ASSERT(virtual_bus);
+
+    bool ret = false;
+    ret = virtual_bus->register_device(&ramdisk_device);
+    ASSERT(ret);
+    ret = devfs_register_device("/dev/ram0", VBLK, &file_ops, NULL);
+    ASSERT(ret);
+
+    // Device nodes start out empty, the size is what makes the disk usable
+    // as a swap device.
+    vnode_t *vn;
+    ret = vfs_lookup("/dev/ram0", &vn) == EOK;
+    ASSERT(ret);
+    vn->size = RAMDISK_SIZE;
+    vnode_unref(vn);
+
+    bus_put(virtual_bus);
+}
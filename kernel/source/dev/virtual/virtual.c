@@ -32,6 +32,7 @@ static bool virtual_bus_device_register(struct device *dev)
 }
 
 extern void virtual_fb_init();
+extern void virtual_ramdisk_init();
 
 void virtual_devices_init()
 {
@@ -39,4 +40,5 @@ void virtual_devices_init()
     ASSERT(ret);
 
     virtual_fb_init();
+    virtual_ramdisk_init();
 }
@@ -19,6 +19,7 @@ bool devfs_register_device(const char *path, vnode_type_t type,
 
     vn->ops = ops;
     // vn->inode = priv_data;
+    vnode_unref(vn);
     return true;
 }
 
@@ -5,28 +5,45 @@
 #include "fs/path.h"
 #include "mm/heap.h"
 #include "mm/mm.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 #include "uapi/errno.h"
 #include "utils/string.h"
 
-typedef struct trie_node
+typedef struct trie_node trie_node_t;
+
+// Children of a node. Replaced as a whole to add one, so that readers always
+// see a complete array.
+typedef struct
+{
+    rcu_head_t rcu;
+    size_t count;
+    trie_node_t *nodes[];
+}
+trie_children_t;
+
+#define MAX_CHILDREN ((1024 - sizeof(trie_children_t)) / sizeof(trie_node_t *))
+
+struct trie_node
 {
     size_t hash;
     size_t len;
 
-    size_t children_cnt;
-    struct trie_node *children[16];
+    trie_children_t *children; // NULL if none.
 
     vfsmount_t *vfsmount;
 
     const char *comp;
-}
-trie_node_t;
+};
 
 /*
  * Global data
  */
 
+// Every path lookup walks the trie, under RCU only. Mounting is rare and
+// serialized by `mount_slock`; nodes and mounts stay until unmounted.
 static trie_node_t trie_root;
+static spinlock_t mount_slock = SPINLOCK_INIT;
 
 /*
  * Helpers
@@ -34,9 +51,13 @@ static trie_node_t trie_root;
 
 static trie_node_t *find_child(trie_node_t *parent, size_t hash, const char *comp, size_t len)
 {
-    for (size_t i = 0; i < parent->children_cnt; i++)
+    trie_children_t *children = rcu_dereference(parent->children);
+    if (!children)
+        return NULL;
+
+    for (size_t i = 0; i < children->count; i++)
     {
-        trie_node_t *child = parent->children[i];
+        trie_node_t *child = children->nodes[i];
 
         if (child->hash == hash
         &&  child->len == len
@@ -47,11 +68,34 @@ static trie_node_t *find_child(trie_node_t *parent, size_t hash, const char *com
     return NULL;
 }
 
-/*
- * API
- */
+static void free_children(rcu_head_t *head)
+{
+    heap_free(LIST_GET_CONTAINER(head, trie_children_t, rcu));
+}
 
-int mount(const char *path, vfs_t *vfs, unsigned flags)
+static bool add_child(trie_node_t *parent, trie_node_t *child)
+{
+    trie_children_t *old = parent->children;
+    size_t count = old ? old->count : 0;
+    if (count == MAX_CHILDREN)
+        return false;
+
+    trie_children_t *new = heap_alloc(sizeof(trie_children_t) + (count + 1) * sizeof(trie_node_t *));
+    if (!new)
+        return false;
+    new->count = count + 1;
+    if (old)
+        memcpy(new->nodes, old->nodes, count * sizeof(trie_node_t *));
+    new->nodes[count] = child;
+
+    rcu_assign_pointer(parent->children, new);
+    if (old)
+        call_rcu(&old->rcu, free_children);
+
+    return true;
+}
+
+static int mount_locked(const char *path, vfs_t *vfs, unsigned flags)
 {
     trie_node_t *current = &trie_root;
     char component[PATH_MAX];
@@ -68,9 +112,6 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
 
         if (!next)
         {
-            // TODO: make trie count variable
-            ASSERT(current->children_cnt < 16);
-
             next = heap_alloc(sizeof(trie_node_t));
             if (!next)
                 return ENOMEM;
@@ -85,7 +126,12 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
             comp_name[len] = '\0';
             next->comp = comp_name;
 
-            current->children[current->children_cnt++] = next;
+            if (!add_child(current, next))
+            {
+                heap_free(comp_name);
+                heap_free(next);
+                return ENOMEM;
+            }
         }
         current = next;
     }
@@ -102,15 +148,30 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
         .mountpoint = NULL,
         .flags = flags,
     };
-    current->vfsmount = mnt;
+    rcu_assign_pointer(current->vfsmount, mnt);
 
     return EOK;
 }
 
+/*
+ * API
+ */
+
+int mount(const char *path, vfs_t *vfs, unsigned flags)
+{
+    spinlock_acquire(&mount_slock);
+    int ret = mount_locked(path, vfs, flags);
+    spinlock_release(&mount_slock);
+
+    return ret;
+}
+
 vfsmount_t *find_mount(const char *path, const char **rest)
 {
+    rcu_read_lock();
+
     trie_node_t *current = &trie_root;
-    vfsmount_t *last_match = trie_root.vfsmount;
+    vfsmount_t *last_match = rcu_dereference(trie_root.vfsmount);
 
     const char *last_rest = (*path == '/') ? path + 1 : path;
 
@@ -133,13 +194,16 @@ vfsmount_t *find_mount(const char *path, const char **rest)
             break;
 
         current = next;
-        if (current->vfsmount)
+        vfsmount_t *mnt = rcu_dereference(current->vfsmount);
+        if (mnt)
         {
-            last_match = current->vfsmount;
+            last_match = mnt;
             last_rest = (*path == '/') ? path + 1 : path;
         }
     }
 
+    rcu_read_unlock();
+
     if (rest)
         *rest = last_rest;
 
@@ -7,6 +7,8 @@
 #include "mm/heap.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 #include "uapi/errno.h"
 #include "utils/list.h"
 #include "utils/string.h"
@@ -15,6 +17,9 @@
 
 #define INITIAL_PAGE_CAPACITY 1
 
+// Serializes changes to directories of every ramfs; lookups only hold RCU.
+static spinlock_t tree_slock = SPINLOCK_INIT_NAMED("ramfs_tree");
+
 // VFS API
 
 static vnode_t *ramfs_get_root(vfs_t *self);
@@ -29,6 +34,7 @@ static int lookup(vnode_t *self, const char *name, vnode_t **out);
 static int create(vnode_t *self, const char *name, vnode_type_t t, vnode_t **out);
 static int remove(vnode_t *self, const char *name);
 static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count);
+static void release(vnode_t *self);
 
 vnode_ops_t ramfs_node_ops = {
     .read   = read,
@@ -36,7 +42,8 @@ vnode_ops_t ramfs_node_ops = {
     .lookup = lookup,
     .create = create,
     .remove = remove,
-    .readdir = readdir
+    .readdir = readdir,
+    .release = release
 };
 
 // Filesystem Operations
@@ -99,7 +106,10 @@ static int write(vnode_t *self, const void *buf, uint64_t offset, uint64_t count
         void *page = xa_get(&node->pages, page_idx);
         if (!page)
         {
-            page = (void*)(pm_alloc(0)->addr + HHDM);
+            page_t *new_page = pm_alloc(0);
+            if (!new_page)
+                return ENOMEM;
+            page = (void*)(new_page->addr + HHDM);
             xa_insert(&node->pages, page_idx, page);
         }
 
@@ -123,23 +133,39 @@ static int lookup(vnode_t *self, const char *name, vnode_t **out)
 
     if (strcmp(name, ".") == 0)
     {
+        vnode_ref(self);
         *out = self;
         return EOK;
     }
     if (strcmp(name, "..") == 0)
     {
+        // Children keep their parent around.
         *out = current->parent ? &current->parent->vn : self;
+        vnode_ref(*out);
         return EOK;
     }
-    FOREACH(n, current->children)
+
+    rcu_read_lock();
+    RCU_FOREACH(n, current->children)
     {
         ramfs_node_t *child = LIST_GET_CONTAINER(n, ramfs_node_t, list_node);
-        if (strcmp(child->vn.name, name) == 0)
-        {
-            *out = &child->vn;
-            return EOK;
-        }
+        if (strcmp(child->vn.name, name) != 0)
+            continue;
+
+        // The node stays until the grace period ends, but once its last
+        // reference is gone it must not be handed out again.
+        unsigned int refs = atomic_load_explicit(&child->vn.refcount, memory_order_relaxed);
+        while (refs && !atomic_compare_exchange_weak_explicit(&child->vn.refcount, &refs, refs + 1,
+                                                               memory_order_acquire, memory_order_relaxed))
+            ;
+        rcu_read_unlock();
+
+        if (!refs)
+            break;
+        *out = &child->vn;
+        return EOK;
     }
+    rcu_read_unlock();
 
     *out = NULL;
     return ENOENT;
@@ -162,7 +188,7 @@ static int create(vnode_t *self, const char *name, vnode_type_t t, vnode_t **out
             .size = 0,
             .ops  = &ramfs_node_ops,
             .inode = child,
-            .refcount = 1
+            .refcount = 2 // The parent's and the caller's.
         },
         .parent = current,
         .children = LIST_INIT,
@@ -171,32 +197,72 @@ static int create(vnode_t *self, const char *name, vnode_type_t t, vnode_t **out
         .list_node = LIST_NODE_INIT,
     };
 
-    list_append(&current->children, &child->list_node);
+    vnode_ref(self);
+
+    spinlock_acquire(&tree_slock);
+    rcu_list_append(&current->children, &child->list_node);
+    spinlock_release(&tree_slock);
 
     *out = &child->vn;
     return EOK;
 }
 
+static void free_node(rcu_head_t *head)
+{
+    ramfs_node_t *node = LIST_GET_CONTAINER(head, ramfs_node_t, rcu);
+
+    size_t idx;
+    void *page;
+    xa_foreach(&node->pages, idx, page)
+    {
+        xa_remove(&node->pages, idx);
+        pm_free(pm_phys_to_page((uintptr_t)page - HHDM));
+    }
+
+    heap_free(node->vn.name);
+    heap_free(node);
+}
+
+// The last reference is gone, so the node is unlinked already. Lookups may
+// still be looking at it until the grace period ends.
+static void release(vnode_t *self)
+{
+    ramfs_node_t *node = (ramfs_node_t *)self;
+
+    if (node->parent != node)
+        vnode_unref(&node->parent->vn);
+    call_rcu(&node->rcu, free_node);
+}
+
+// Unlink `child` and everything below it and drop the references of their
+// parents, so that each is freed once the last user lets go of it.
+static void unlink_node(ramfs_node_t *parent, ramfs_node_t *child)
+{
+    list_remove(&parent->children, &child->list_node);
+
+    list_node_t *n;
+    while ((n = LIST_FIRST(&child->children)))
+        unlink_node(child, LIST_GET_CONTAINER(n, ramfs_node_t, list_node));
+
+    vnode_unref(&child->vn);
+}
+
 static int remove(vnode_t *self, const char *name)
 {
     ramfs_node_t *current = (ramfs_node_t *)self;
 
+    spinlock_acquire(&tree_slock);
     FOREACH(n, current->children)
     {
         ramfs_node_t *child = LIST_GET_CONTAINER(n, ramfs_node_t, list_node);
         if (strcmp(child->vn.name, name) == 0)
         {
-            list_remove(&current->children, &child->list_node);
-            FOREACH(c, child->children)
-            {
-                ramfs_node_t *grandchild = LIST_GET_CONTAINER(c, ramfs_node_t, list_node);
-                remove(&child->vn, grandchild->vn.name);
-            }
-            heap_free(child->vn.name);
-            heap_free(child);
+            unlink_node(current, child);
+            spinlock_release(&tree_slock);
             return EOK;
         }
     }
+    spinlock_release(&tree_slock);
 
     return ENOENT;
 }
@@ -209,7 +275,7 @@ static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count)
         return ENOTDIR;
 
     ramfs_node_t *dir = (ramfs_node_t *)self;
-    size_t entry_count = dir->children.length;
+    size_t entry_count = __atomic_load_n(&dir->children.length, __ATOMIC_RELAXED);
 
     if (!entry_count)
     {
@@ -222,17 +288,23 @@ static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count)
     vfs_dirent_t *entries = heap_alloc(entry_count * sizeof(vfs_dirent_t));
     size_t index = 0;
 
-    FOREACH(n, dir->children)
+    // Entries may come and go meanwhile, list at most the ones counted.
+    rcu_read_lock();
+    RCU_FOREACH(n, dir->children)
     {
+        if (index == entry_count)
+            break;
+
         ramfs_node_t *child = LIST_GET_CONTAINER(n, ramfs_node_t, list_node);
         strcpy(entries[index].name, child->vn.name);
         entries[index].type = child->vn.type;
         index++;
     }
+    rcu_read_unlock();
 
     self->atime = arch_clock_get_unix_time();
     *out_entries = entries;
-    *out_count = entry_count;
+    *out_count = index;
     return EOK;
 }
 
@@ -55,6 +55,7 @@ int ustar_extract(const void *archive, uint64_t archive_size, const char *dest_p
     vnode_t *dest_vn;
     if (vfs_lookup(dest_path, &dest_vn) != EOK)
         panic("USTAR: destination path not found");
+    vnode_unref(dest_vn);
 
     const uint8_t *data = (const uint8_t *)archive;
     uint64_t offset = 0;
@@ -99,7 +100,9 @@ int ustar_extract(const void *archive, uint64_t archive_size, const char *dest_p
             {
                 vnode_t *dir_vn = NULL;
                 int ret = vfs_create(full_path, VDIR, &dir_vn);
-                if (ret != EOK && ret != EEXIST)
+                if (ret == EOK)
+                    vnode_unref(dir_vn);
+                else if (ret != EEXIST)
                     log(LOG_ERROR, "USTAR: failed to create directory %s", full_path);
                 break;
             }
@@ -123,6 +126,7 @@ int ustar_extract(const void *archive, uint64_t archive_size, const char *dest_p
                     ||  written != file_size)
                         log(LOG_ERROR, "USTAR: failed to write to created file %s", full_path);
                 }
+                vnode_unref(file_vn);
                 break;
             }
 
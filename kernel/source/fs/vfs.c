@@ -9,6 +9,7 @@
 #include "log.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/reclaim.h"
 #include "uapi/errno.h"
 #include "utils/list.h"
 #include "utils/math.h"
@@ -18,16 +19,24 @@
  * Veneer layer.
  */
 
+// Look up page `pg_idx` of the page cache, reading it in on a miss. The page
+// comes with a reference that keeps reclaim away from it until dropped.
 static int get_page(vnode_t *vn, uint64_t pg_idx, bool read, page_t **out)
 {
+    spinlock_acquire(&vn->slock);
     page_t *page = xa_get(&vn->pages, pg_idx);
     if (page)
     {
+        page->referenced = true;
+        pm_page_refcount_inc(page);
+        spinlock_release(&vn->slock);
+
         *out = page;
         return EOK;
     }
+    spinlock_release(&vn->slock);
 
-    page = pm_alloc(0);
+    page = reclaim_alloc_page();
     if (!page)
         return ENOMEM;
 
@@ -46,13 +55,132 @@ static int get_page(vnode_t *vn, uint64_t pg_idx, bool read, page_t **out)
             pm_free(page);
             return err;
         }
+
+        // Pages past the end of the file may get mapped, don't leak memory.
+        if (read_bytes < ARCH_PAGE_GRAN)
+            memset((void *)(page->addr + HHDM + read_bytes), 0, ARCH_PAGE_GRAN - read_bytes);
+    }
+
+    spinlock_acquire(&vn->slock);
+
+    // Someone else may have read the page in meanwhile.
+    page_t *cached = xa_get(&vn->pages, pg_idx);
+    if (cached || !xa_insert(&vn->pages, pg_idx, page))
+    {
+        if (cached)
+            pm_page_refcount_inc(cached);
+        spinlock_release(&vn->slock);
+
+        pm_free(page);
+        if (!cached)
+            return ENOMEM;
+        *out = cached;
+        return EOK;
     }
 
-    xa_insert(&vn->pages, pg_idx, page);
+    pm_page_refcount_inc(page);
+    reclaim_lru_add(page, vn, pg_idx, false);
+
+    spinlock_release(&vn->slock);
+
     *out = page;
     return EOK;
 }
 
+// Drop the page cache of a vnode that is going away. Pages still in use are
+// left to their users rather than freed under them.
+static void drop_page_cache(vnode_t *vn)
+{
+    spinlock_acquire(&vn->slock);
+
+    size_t idx;
+    page_t *page;
+    xa_foreach(&vn->pages, idx, page)
+    {
+        xa_remove(&vn->pages, idx);
+        reclaim_lru_remove(page);
+
+        if (atomic_load_explicit(&page->refcount, memory_order_acquire) == 1
+        &&  atomic_load_explicit(&page->mapcount, memory_order_acquire) == 0)
+            pm_free(page);
+        else
+            pm_page_refcount_dec(page);
+    }
+
+    spinlock_release(&vn->slock);
+}
+
+// Page cache
+
+int vfs_get_page(vnode_t *vn, uint64_t pg_idx, page_t **out)
+{
+    ASSERT (vn && out);
+
+    if (vn->ops && vn->ops->get_page)
+        return vn->ops->get_page(vn, pg_idx, out);
+    if (!vn->ops || !vn->ops->read)
+        return ENOTSUP;
+
+    return get_page(vn, pg_idx, true, out);
+}
+
+reclaim_result_t vfs_evict_page(vnode_t *vn, uint64_t pg_idx, page_t *page)
+{
+    if (xa_get(&vn->pages, pg_idx) != page)
+        return RECLAIM_RETRY;
+
+    if (page->referenced)
+    {
+        page->referenced = false;
+        return RECLAIM_ACTIVATE;
+    }
+
+    // Dirty pages hold the only copy of their data until there is writeback.
+    // The refcount is checked first: users map a page before they let go of it.
+    if (xa_get_mark(&vn->pages, pg_idx, XA_MARK_0)
+    ||  atomic_load_explicit(&page->refcount, memory_order_acquire) != 1
+    ||  atomic_load_explicit(&page->mapcount, memory_order_acquire) != 0)
+        return RECLAIM_ACTIVATE;
+
+    xa_remove(&vn->pages, pg_idx);
+    pm_free(page);
+    return RECLAIM_EVICTED;
+}
+
+void vfs_dirty_page(vnode_t *vn, uint64_t pg_idx, page_t *page)
+{
+    ASSERT (vn && page);
+
+    // Memory-backed vnodes have nothing to write back.
+    if (vn->ops && vn->ops->get_page)
+        return;
+
+    spinlock_acquire(&vn->slock);
+    // The cache may have been dropped meanwhile.
+    if (xa_get(&vn->pages, pg_idx) == page)
+        xa_set_mark(&vn->pages, pg_idx, XA_MARK_0);
+    spinlock_release(&vn->slock);
+}
+
+void vfs_readahead(vnode_t *vn, uint64_t pg_idx, size_t count)
+{
+    ASSERT (vn);
+
+    if (!vn->ops || !vn->ops->read || vn->ops->get_page)
+        return;
+
+    uint64_t end = MIN(pg_idx + count, CEIL(vn->size, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
+    for (; pg_idx < end; pg_idx++)
+    {
+        page_t *page;
+        if (get_page(vn, pg_idx, true, &page) != EOK)
+            return;
+        pm_page_refcount_dec(page);
+    }
+}
+
+// Read/Write
+
 int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
              uint64_t *out_bytes_read)
 {
@@ -61,6 +189,10 @@ int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
     if (!vn->ops || !vn->ops->read)
         return ENOTSUP;
 
+    // Memory-backed vnodes have nothing to cache.
+    if (vn->ops->get_page)
+        return vn->ops->read(vn, buffer, offset, count, out_bytes_read);
+
     uint64_t total_read = 0;
     while (total_read < count)
     {
@@ -79,6 +211,7 @@ int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
             (uint8_t *)page->addr + HHDM + pg_off,
             to_copy
         );
+        pm_page_refcount_dec(page);
 
         total_read += to_copy;
     }
@@ -96,6 +229,9 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
     if (!vn->ops || !vn->ops->write)
         return ENOTSUP;
 
+    if (vn->ops->get_page)
+        return vn->ops->write(vn, buffer, offset, count, out_bytes_written);
+
     uint64_t total_written = 0;
     while (total_written < count)
     {
@@ -109,7 +245,7 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
             vn,
             pg_idx,
             // read-modify-write only if needed
-            (pg_off == 0 && to_copy == ARCH_PAGE_GRAN) ? true : false,
+            (pg_off == 0 && to_copy == ARCH_PAGE_GRAN) ? false : true,
             &page
         );
         if (err != EOK)
@@ -121,7 +257,11 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
             to_copy
         );
 
+        spinlock_acquire(&vn->slock);
         xa_set_mark(&vn->pages, pg_idx, XA_MARK_0); // Mark dirty.
+        spinlock_release(&vn->slock);
+        pm_page_refcount_dec(page);
+
         total_written += to_copy;
     }
 
@@ -132,6 +272,16 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
     return EOK;
 }
 
+int vfs_truncate(vnode_t *vn, uint64_t size)
+{
+    ASSERT (vn);
+
+    if (!vn->ops || !vn->ops->truncate)
+        return ENOTSUP;
+
+    return vn->ops->truncate(vn, size);
+}
+
 // Directory
 
 int vfs_lookup(const char *path, vnode_t **out_vn)
@@ -140,18 +290,20 @@ int vfs_lookup(const char *path, vnode_t **out_vn)
 
     vfsmount_t *vfsmount = find_mount(path, &path);
     vnode_t *curr = vfsmount->vfs->vfs_ops->get_root(vfsmount->vfs);
+    vnode_ref(curr);
 
     char comp[PATH_MAX + 1];
     size_t comp_len;
-    while (curr)
+    while (*path)
     {
-        if (!*path)
-            break;
-
         path = path_next_component(path, comp, &comp_len);
 
-        if (curr->ops->lookup(curr, comp, &curr) != EOK)
+        vnode_t *next;
+        int err = curr->ops->lookup(curr, comp, &next);
+        vnode_unref(curr);
+        if (err != EOK)
             return ENOENT;
+        curr = next;
     }
 
     *out_vn = curr;
@@ -174,7 +326,9 @@ int vfs_create(const char *path, vnode_type_t type, vnode_t **out)
     if (ret != EOK)
         return ret;
 
-    return parent->ops->create(parent, basename, type, out);
+    ret = parent->ops->create(parent, basename, type, out);
+    vnode_unref(parent);
+    return ret;
 }
 
 int vfs_remove(const char *path)
@@ -193,7 +347,22 @@ int vfs_remove(const char *path)
     if (ret != EOK)
         return ret;
 
-    return parent->ops->remove(parent, basename);
+    // The reference keeps the vnode around until its cache is gone.
+    vnode_t *vn;
+    if (vfs_lookup(path, &vn) != EOK)
+        vn = NULL;
+
+    ret = parent->ops->remove(parent, basename);
+    vnode_unref(parent);
+
+    // Reclaim must not find pages of the vnode once it is freed.
+    if (vn)
+    {
+        if (ret == EOK)
+            drop_page_cache(vn);
+        vnode_unref(vn);
+    }
+    return ret;
 }
 
 // Misc
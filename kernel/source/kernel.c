@@ -5,11 +5,15 @@
 #include "fs/vfs.h"
 #include "log.h"
 #include "mod/ksym.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
 #include "mod/module.h"
 #include "panic.h"
 #include "proc/init.h"
 #include "proc/sched.h"
 #include "proc/smp.h"
+#include "proc/workqueue.h"
+#include "sync/lockstat.h"
 #include "uapi/errno.h"
 #include "utils/string.h"
 #include <stddef.h>
@@ -28,6 +32,8 @@ static void load_initrd()
             {
                 log(LOG_FATAL, "Root fs node doesnt exist");
             }
+            else
+                vnode_unref(root);
 
             ustar_extract(
                 bootreq_module.response->modules[i]->address,
@@ -39,15 +45,32 @@ static void load_initrd()
     }
 }
 
+static void enable_swap()
+{
+    // The reference is kept for as long as swap is on.
+    vnode_t *swap_dev;
+    if (vfs_lookup("/dev/ram0", &swap_dev) != EOK)
+        swap_dev = NULL;
+    if (!swap_dev || swap_activate(swap_dev) != EOK)
+    {
+        if (swap_dev)
+            vnode_unref(swap_dev);
+        log(LOG_WARN, "Could not enable swap, anonymous memory will not be reclaimed.");
+    }
+}
+
 static void load_boot_modules()
 {
     ksym_init();
 
     vnode_t *boot_module_dir;
 
-    if (vfs_lookup("/boot/modules", &boot_module_dir) != EOK
-    ||  boot_module_dir->type != VDIR)
+    if (vfs_lookup("/boot/modules", &boot_module_dir) != EOK)
+        boot_module_dir = NULL;
+    if (!boot_module_dir || boot_module_dir->type != VDIR)
     {
+        if (boot_module_dir)
+            vnode_unref(boot_module_dir);
         log(LOG_INFO, "No boot modules directory found.");
         return;
     }
@@ -58,15 +81,20 @@ static void load_boot_modules()
     for (size_t i = 0; i < entry_count; i++)
     {
         vnode_t *module_vn;
-        if(boot_module_dir->ops->lookup(boot_module_dir, entries[i].name, &module_vn) != EOK
-        || module_vn->type != VREG)
+        if(boot_module_dir->ops->lookup(boot_module_dir, entries[i].name, &module_vn) != EOK)
             continue;
+        if (module_vn->type != VREG)
+        {
+            vnode_unref(module_vn);
+            continue;
+        }
 
         module_t *mod;
         if (module_load(module_vn, &mod) == EOK)
             mod->install();
-        // TO-DO: closing
+        vnode_unref(module_vn);
     }
+    vnode_unref(boot_module_dir);
 }
 
 static void load_init_proc()
@@ -77,6 +105,7 @@ static void load_init_proc()
         panic("Init process not found!");
 
     proc_t *init_proc = init_load(init_elf_file);
+    vnode_unref(init_elf_file);
     if (init_proc)
         sched_enqueue(LIST_GET_CONTAINER(init_proc->threads.head, thread_t, proc_thread_list_node));
     else
@@ -90,6 +119,11 @@ void kernel_main()
 
     devfs_init();
     virtual_devices_init();
+    lockstat_init();
+    workqueue_init();
+
+    enable_swap();
+    reclaim_init();
 
     load_initrd();
     load_boot_modules();
@@ -8,7 +8,7 @@
 #include "utils/printf.h"
 #include "utils/string.h"
 
-static spinlock_t slock = SPINLOCK_INIT;
+static spinlock_t slock = SPINLOCK_INIT_NAMED("log");
 
 static const char *level_to_name(log_level_t level)
 {
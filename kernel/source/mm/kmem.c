@@ -3,15 +3,19 @@
 #include "arch/types.h"
 #include "hhdm.h"
 #include "mm/pm.h"
+#include "panic.h"
+#include "proc/percpu.h"
 #include "proc/smp.h"
-#include "proc/thread.h"
-#include "proc/sched.h"
 #include "utils/list.h"
 
 static kmem_slab_t *cache_make_slab(kmem_cache_t *cache)
 {
-    kmem_slab_t *slab = (kmem_slab_t *)(pm_alloc(0)->addr + HHDM);
+    page_t *page = pm_alloc(0);
+    if (!page)
+        return NULL;
 
+    kmem_slab_t *slab = (kmem_slab_t *)(page->addr + HHDM);
+    slab->list_node = LIST_NODE_INIT;
     slab->cache = cache;
     slab->freelist = NULL;
 
@@ -27,10 +31,29 @@ static kmem_slab_t *cache_make_slab(kmem_cache_t *cache)
     return slab;
 }
 
+static void cache_free_to_slab(kmem_cache_t *cache, void *obj)
+{
+    kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)obj & ~(SLAB_SIZE - 1));
+
+    if (slab->freelist == NULL)
+    {
+        list_remove(&cache->slabs_full, &slab->list_node);
+        list_append(&cache->slabs_partial, &slab->list_node);
+    }
+
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+}
+
 static void *cache_alloc_from_slabs(kmem_cache_t *cache)
 {
     if (list_is_empty(&cache->slabs_partial))
-        list_append(&cache->slabs_partial, &cache_make_slab(cache)->list_node);
+    {
+        kmem_slab_t *slab = cache_make_slab(cache);
+        if (!slab)
+            return NULL;
+        list_append(&cache->slabs_partial, &slab->list_node);
+    }
 
     kmem_slab_t *slab = LIST_GET_CONTAINER(LIST_FIRST(&cache->slabs_partial), kmem_slab_t, list_node);
 
@@ -48,23 +71,34 @@ static void *cache_alloc_from_slabs(kmem_cache_t *cache)
 
 static kmem_magazine_t *cache_make_magazine(kmem_cache_t *cache, bool populate)
 {
-    kmem_magazine_t *mag = (kmem_magazine_t *)(pm_alloc(0)->addr + HHDM);
+    page_t *page = pm_alloc(0);
+    if (!page)
+        return NULL;
 
+    kmem_magazine_t *mag = (kmem_magazine_t *)(page->addr + HHDM);
+    mag->count = 0;
+    mag->list_node = LIST_NODE_INIT;
+
+    // A magazine that could only be partially filled is still usable.
     spinlock_acquire(&cache->slabs_lock);
-    for (size_t i = 0; i < MAG_SIZE; i++)
-        mag->objects[i] = populate ? cache_alloc_from_slabs(cache) : NULL;
+    while (populate && mag->count < MAG_SIZE)
+    {
+        void *obj = cache_alloc_from_slabs(cache);
+        if (!obj)
+            break;
+        mag->objects[mag->count++] = obj;
+    }
     spinlock_release(&cache->slabs_lock);
 
-    mag->count = populate ? MAG_SIZE : 0;
-    mag->list_node = LIST_NODE_INIT;
-
     return mag;
 }
 
-void *kmem_alloc_cache(kmem_cache_t *cache)
+// Per-CPU magazines are only touched with interrupts masked, so that the
+// thread can neither be preempted nor moved to another CPU halfway through.
+
+static void *cpu_cache_alloc(kmem_cache_t *cache)
 {
-    size_t cpu_id = sched_get_curr_thread()->assigned_cpu->id;
-    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[cpu_id];
+    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[this_cpu_read(id)];
 
     kmem_magazine_t *mag = cpu_cache->loaded;
     if (mag->count > 0)
@@ -98,10 +132,9 @@ void *kmem_alloc_cache(kmem_cache_t *cache)
     return obj;
 }
 
-void kmem_free_cache(kmem_cache_t *cache, void *obj)
+static void cpu_cache_free(kmem_cache_t *cache, void *obj)
 {
-    size_t cpu_id = sched_get_curr_thread()->assigned_cpu->id;
-    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[cpu_id];
+    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[this_cpu_read(id)];
 
     kmem_magazine_t *mag = cpu_cache->loaded;
     if (mag->count < MAG_SIZE)
@@ -119,8 +152,7 @@ void kmem_free_cache(kmem_cache_t *cache, void *obj)
     }
 
     spinlock_acquire(&cache->magazines_lock);
-    list_append(&cache->magazines_full, &mag->list_node);
-    kmem_magazine_t *new_mag = LIST_GET_CONTAINER(list_pop_head(&cache->magazines_full), kmem_magazine_t, list_node);
+    kmem_magazine_t *new_mag = LIST_GET_CONTAINER(list_pop_head(&cache->magazines_empty), kmem_magazine_t, list_node);
     spinlock_release(&cache->magazines_lock);
 
     // If the depot has no empty magazines then we create a new magazine.
@@ -128,25 +160,59 @@ void kmem_free_cache(kmem_cache_t *cache, void *obj)
     if (!new_mag)
         new_mag = cache_make_magazine(cache, false);
 
+    // Out of memory for a magazine, hand the object straight back to its slab.
+    if (!new_mag)
+    {
+        spinlock_acquire(&cache->slabs_lock);
+        cache_free_to_slab(cache, obj);
+        spinlock_release(&cache->slabs_lock);
+        return;
+    }
+
+    // Both loaded magazines are full, the previous one goes to the depot.
+    spinlock_acquire(&cache->magazines_lock);
+    list_append(&cache->magazines_full, &cpu_cache->previous->list_node);
+    spinlock_release(&cache->magazines_lock);
+
     cpu_cache->previous = cpu_cache->loaded;
     cpu_cache->loaded = new_mag;
     new_mag->count = 0;
     new_mag->objects[new_mag->count++] = obj;
 }
 
+void *kmem_alloc_cache(kmem_cache_t *cache)
+{
+    smp_int_mask_push();
+    void *obj = cpu_cache_alloc(cache);
+    smp_int_mask_pop();
+
+    return obj;
+}
+
+void kmem_free_cache(kmem_cache_t *cache, void *obj)
+{
+    smp_int_mask_push();
+    cpu_cache_free(cache, obj);
+    smp_int_mask_pop();
+}
+
 kmem_cache_t *kmem_new_cache(const char *name, size_t size)
 {
-    kmem_cache_t *cache = (kmem_cache_t *)(pm_alloc(0)->addr + HHDM);
+    page_t *page = pm_alloc(0);
+    if (!page)
+        return NULL;
+
+    kmem_cache_t *cache = (kmem_cache_t *)(page->addr + HHDM);
 
     *cache = (kmem_cache_t) {
         .name = name,
         .object_size = size,
         .slabs_full = LIST_INIT,
         .slabs_partial = LIST_INIT,
-        .slabs_lock = SPINLOCK_INIT,
+        .slabs_lock = SPINLOCK_INIT_NAMED("kmem_slabs"),
         .magazines_full = LIST_INIT,
         .magazines_empty = LIST_INIT,
-        .magazines_lock = SPINLOCK_INIT
+        .magazines_lock = SPINLOCK_INIT_NAMED("kmem_magazines")
     };
 
     for (int i = 0; i < MAX_CPUS; i++)
@@ -155,6 +221,10 @@ kmem_cache_t *kmem_new_cache(const char *name, size_t size)
             .loaded = cache_make_magazine(cache, true),
             .previous = cache_make_magazine(cache, false)
         };
+
+        // Caches are created at boot, there is nothing to fall back on.
+        if (!cache->cpu_cache[i].loaded || !cache->cpu_cache[i].previous)
+            panic("kmem: out of memory creating cache `%s`!", name);
     }
 
     return cache;
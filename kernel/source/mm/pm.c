@@ -12,7 +12,10 @@
 static page_t *blocks;
 static size_t block_count;
 static list_t levels[PM_MAX_PAGE_ORDER + 1];
-static spinlock_t slock = SPINLOCK_INIT;
+static spinlock_t slock = SPINLOCK_INIT_NAMED("pm");
+
+static size_t free_pages;
+static size_t total_pages;
 
 uint8_t pm_pagecount_to_order(size_t pages)
 {
@@ -40,7 +43,10 @@ page_t *pm_alloc(uint8_t order)
     {
         i++;
         if (i > PM_MAX_PAGE_ORDER)
-            return 0;
+        {
+            spinlock_release(&slock);
+            return NULL;
+        }
     }
 
     page_t *page = LIST_GET_CONTAINER(levels[i].head, page_t, list_elem);
@@ -56,12 +62,20 @@ page_t *pm_alloc(uint8_t order)
         list_append(&levels[i - 1], &right->list_elem);
     }
 
+    free_pages -= pm_order_to_pagecount(order);
+
     spinlock_release(&slock);
 
     page->order = order;
     page->free = false;
     page->mapcount = 0;
     page->refcount = 1;
+    page->lru = PM_LRU_NONE;
+    page->anon = false;
+    page->referenced = false;
+    page->owner = NULL;
+    page->index = 0;
+    page->list_elem = LIST_NODE_INIT;
     return page;
 }
 
@@ -69,8 +83,12 @@ void pm_free(page_t *block)
 {
     ASSERT(block->refcount == 1);
 
+    ASSERT(block->lru == PM_LRU_NONE);
+
     spinlock_acquire(&slock);
 
+    free_pages += pm_order_to_pagecount(block->order);
+
     size_t idx = block->addr / ARCH_PAGE_GRAN;
     uint8_t i = block->order;
 
@@ -103,6 +121,16 @@ void pm_free(page_t *block)
     spinlock_release(&slock);
 }
 
+size_t pm_free_page_count()
+{
+    return __atomic_load_n(&free_pages, __ATOMIC_RELAXED);
+}
+
+size_t pm_total_page_count()
+{
+    return total_pages;
+}
+
 // Initialization
 
 void pm_init()
@@ -155,6 +183,7 @@ void pm_init()
             .mapcount = 0,
             .order = 0,
             .free = false,
+            .lru = PM_LRU_NONE,
             .list_elem = LIST_NODE_INIT
         };
 
@@ -186,6 +215,7 @@ void pm_init()
             blocks[idx].order = order;
             blocks[idx].free = true;
             list_append(&levels[order], &blocks[idx].list_elem);
+            free_pages += pm_order_to_pagecount(order);
 
             addr += span;
 
@@ -193,5 +223,7 @@ void pm_init()
         }
     }
 
+    total_pages = free_pages;
+
     log(LOG_INFO, "Phyiscal memory allocator initialized.");
 }
@@ -0,0 +1,227 @@
+#include "mm/reclaim.h"
+
+#include "arch/timer.h"
+#include "fs/vfs.h"
+#include "log.h"
+#include "mm/vm.h"
+#include "panic.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/thread.h"
+#include "sync/rwlock.h"
+#include "sync/spinlock.h"
+#include "utils/list.h"
+
+#define RECLAIM_POLL_NS (50 * 1000 * 1000)
+#define RECLAIM_BATCH 32 // Pages freed by one round of direct reclaim.
+
+static list_t active = LIST_INIT;
+static list_t inactive = LIST_INIT;
+static size_t active_count;
+static size_t inactive_count;
+
+// Taken inside address space read locks and released before them.
+static spinlock_t lru_slock = SPINLOCK_INIT_NAMED("lru");
+
+// Watermarks, in free pages.
+static size_t wmark_min;
+static size_t wmark_low;
+static size_t wmark_high;
+
+static void lru_lock()
+{
+    spinlock_acquire(&lru_slock);
+}
+
+static void lru_unlock()
+{
+    spinlock_release(&lru_slock);
+}
+
+// LRU lists. The lock must be held.
+
+static void lru_append(page_t *page, pm_lru_t lru)
+{
+    page->lru = lru;
+    if (lru == PM_LRU_ACTIVE)
+    {
+        list_append(&active, &page->list_elem);
+        active_count++;
+    }
+    else
+    {
+        list_append(&inactive, &page->list_elem);
+        inactive_count++;
+    }
+}
+
+static void lru_unlink(page_t *page)
+{
+    if (page->lru == PM_LRU_ACTIVE)
+    {
+        list_remove(&active, &page->list_elem);
+        active_count--;
+    }
+    else if (page->lru == PM_LRU_INACTIVE)
+    {
+        list_remove(&inactive, &page->list_elem);
+        inactive_count--;
+    }
+    page->lru = PM_LRU_NONE;
+}
+
+static void lru_requeue(page_t *page, reclaim_result_t result)
+{
+    lru_append(page, result == RECLAIM_ACTIVATE ? PM_LRU_ACTIVE : PM_LRU_INACTIVE);
+}
+
+void reclaim_lru_add(page_t *page, void *owner, uint64_t index, bool anon)
+{
+    lru_lock();
+
+    page->owner = owner;
+    page->index = index;
+    page->anon = anon;
+    page->referenced = false;
+    lru_append(page, PM_LRU_INACTIVE);
+
+    lru_unlock();
+}
+
+void reclaim_lru_remove(page_t *page)
+{
+    lru_lock();
+    lru_unlink(page);
+    lru_unlock();
+}
+
+// Clock
+
+// Look at the page under the clock hand and evict it if it was not used since
+// the last pass. The owner lock is only tried, since owners take the LRU lock
+// while holding theirs.
+static bool reclaim_one()
+{
+    lru_lock();
+
+    // Age the active list so that it does not outgrow the inactive one.
+    if (inactive_count < active_count)
+    {
+        page_t *oldest = LIST_GET_CONTAINER(LIST_FIRST(&active), page_t, list_elem);
+        lru_unlink(oldest);
+        lru_append(oldest, PM_LRU_INACTIVE);
+    }
+
+    if (list_is_empty(&inactive))
+    {
+        lru_unlock();
+        return false;
+    }
+
+    page_t *page = LIST_GET_CONTAINER(LIST_FIRST(&inactive), page_t, list_elem);
+    lru_unlink(page);
+
+    reclaim_result_t result = RECLAIM_RETRY;
+    if (page->anon)
+    {
+        // Holding the address space lock keeps its pages mapped, so the LRU
+        // lock can go while the page is written out.
+        vm_addrspace_t *as = page->owner;
+        if (rwlock_try_acquire_read(&as->lock))
+        {
+            lru_unlock();
+
+            result = vm_evict_page(as, page->index, page);
+
+            if (result != RECLAIM_EVICTED)
+            {
+                lru_lock();
+                lru_requeue(page, result);
+                lru_unlock();
+            }
+            rwlock_release_read(&as->lock);
+
+            return result == RECLAIM_EVICTED;
+        }
+    }
+    else
+    {
+        vnode_t *vn = page->owner;
+        if (spinlock_try_acquire(&vn->slock))
+        {
+            result = vfs_evict_page(vn, page->index, page);
+            spinlock_release(&vn->slock);
+        }
+    }
+
+    if (result != RECLAIM_EVICTED)
+        lru_requeue(page, result);
+
+    lru_unlock();
+    return result == RECLAIM_EVICTED;
+}
+
+size_t reclaim_pages(size_t count)
+{
+    // Two full sweeps see every page twice, whatever is left after that is
+    // busy or in use.
+    lru_lock();
+    size_t budget = 2 * (active_count + inactive_count);
+    lru_unlock();
+
+    size_t freed = 0;
+    while (freed < count && budget--)
+        if (reclaim_one())
+            freed++;
+
+    return freed;
+}
+
+page_t *reclaim_alloc_page()
+{
+    if (pm_free_page_count() < wmark_min)
+        reclaim_pages(RECLAIM_BATCH);
+
+    page_t *page = pm_alloc(0);
+    if (!page && reclaim_pages(1))
+        page = pm_alloc(0);
+
+    return page;
+}
+
+// Background reclaim
+
+[[noreturn]] static void reclaim_worker()
+{
+    while (true)
+    {
+        size_t free = pm_free_page_count();
+        if (free < wmark_low)
+        {
+            size_t target = wmark_high - free;
+            size_t freed = reclaim_pages(target);
+            if (freed < target)
+                log(LOG_DEBUG, "reclaim: freed %lu of %lu pages.", freed, target);
+        }
+
+        sched_get_curr_thread()->sleep_until = arch_timer_get_uptime_ns() + RECLAIM_POLL_NS;
+        sched_yield(THREAD_STATE_SLEEPING);
+    }
+}
+
+// Initialization
+
+void reclaim_init()
+{
+    size_t total = pm_total_page_count();
+    wmark_min = total / 128;
+    wmark_low = total / 64;
+    wmark_high = total / 32;
+
+    thread_t *worker = thread_create(proc_create("reclaim", false), (uintptr_t)&reclaim_worker);
+    if (!worker)
+        panic("Could not create the reclaim thread!");
+    sched_enqueue(worker);
+
+    log(LOG_INFO, "Page reclaim started: watermarks %lu/%lu/%lu pages.", wmark_min, wmark_low, wmark_high);
+}
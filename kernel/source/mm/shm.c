@@ -0,0 +1,253 @@
+#include "mm/shm.h"
+
+#include "arch/clock.h"
+#include "arch/types.h"
+#include "assert.h"
+#include "hhdm.h"
+#include "mm/heap.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "mm/reclaim.h"
+#include "uapi/errno.h"
+#include "utils/math.h"
+#include "utils/string.h"
+
+static inline uint64_t page_count(shm_t *shm)
+{
+    return CEIL(shm->vn.size, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN;
+}
+
+// Page `pg_idx` with a reference held, or NULL if it was never touched.
+static page_t *peek_page(shm_t *shm, uint64_t pg_idx)
+{
+    spinlock_acquire(&shm->slock);
+    page_t *page = xa_get(&shm->pages, pg_idx);
+    if (page)
+        pm_page_refcount_inc(page);
+    spinlock_release(&shm->slock);
+
+    return page;
+}
+
+// Page `pg_idx` with a reference held, allocated on first use.
+static int get_page(vnode_t *vn, uint64_t pg_idx, page_t **out)
+{
+    shm_t *shm = (shm_t *)vn;
+
+    page_t *page = peek_page(shm, pg_idx);
+    if (page)
+    {
+        *out = page;
+        return EOK;
+    }
+
+    page_t *new_page = reclaim_alloc_page();
+    if (!new_page)
+        return ENOMEM;
+    memset((void *)(new_page->addr + HHDM), 0, ARCH_PAGE_GRAN);
+
+    spinlock_acquire(&shm->slock);
+
+    // The object may have shrunk, or someone else added the page meanwhile.
+    int err = EOK;
+    page = xa_get(&shm->pages, pg_idx);
+    if (pg_idx >= page_count(shm))
+        err = ENXIO;
+    else if (!page)
+    {
+        if (xa_insert(&shm->pages, pg_idx, new_page))
+        {
+            page = new_page;
+            new_page = NULL;
+        }
+        else
+            err = ENOMEM;
+    }
+    if (err == EOK)
+        pm_page_refcount_inc(page);
+
+    spinlock_release(&shm->slock);
+
+    if (new_page)
+        pm_free(new_page);
+
+    *out = page;
+    return err;
+}
+
+static int read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
+                uint64_t *out_bytes_read)
+{
+    shm_t *shm = (shm_t *)vn;
+
+    spinlock_acquire(&shm->slock);
+    uint64_t size = shm->vn.size;
+    spinlock_release(&shm->slock);
+
+    count = offset < size ? MIN(count, size - offset) : 0;
+
+    uint64_t total_read = 0;
+    while (total_read < count)
+    {
+        uint64_t pos     = offset + total_read;
+        uint64_t pg_off  = pos % ARCH_PAGE_GRAN;
+        uint64_t to_copy = MIN(ARCH_PAGE_GRAN - pg_off, count - total_read);
+
+        // Pages that were never written read as zero without being allocated.
+        page_t *page = peek_page(shm, pos / ARCH_PAGE_GRAN);
+        if (page)
+        {
+            memcpy((uint8_t *)buffer + total_read, (uint8_t *)page->addr + HHDM + pg_off, to_copy);
+            pm_page_refcount_dec(page);
+        }
+        else
+            memset((uint8_t *)buffer + total_read, 0, to_copy);
+
+        total_read += to_copy;
+    }
+
+    shm->vn.atime = arch_clock_get_unix_time();
+
+    *out_bytes_read = total_read;
+    return EOK;
+}
+
+static int write(vnode_t *vn, const void *buffer, uint64_t offset, uint64_t count,
+                 uint64_t *out_bytes_written)
+{
+    shm_t *shm = (shm_t *)vn;
+
+    // Writing past the end grows the object.
+    spinlock_acquire(&shm->slock);
+    if (offset + count > shm->vn.size)
+        shm->vn.size = offset + count;
+    spinlock_release(&shm->slock);
+
+    uint64_t total_written = 0;
+    while (total_written < count)
+    {
+        uint64_t pos     = offset + total_written;
+        uint64_t pg_off  = pos % ARCH_PAGE_GRAN;
+        uint64_t to_copy = MIN(ARCH_PAGE_GRAN - pg_off, count - total_written);
+
+        page_t *page;
+        int err = get_page(vn, pos / ARCH_PAGE_GRAN, &page);
+        if (err != EOK)
+        {
+            if (total_written == 0)
+                return err;
+            break;
+        }
+
+        memcpy((uint8_t *)page->addr + HHDM + pg_off, (const uint8_t *)buffer + total_written, to_copy);
+        pm_page_refcount_dec(page);
+
+        total_written += to_copy;
+    }
+
+    shm->vn.mtime = arch_clock_get_unix_time();
+
+    *out_bytes_written = total_written;
+    return EOK;
+}
+
+// Growing only moves the end, pages are allocated once they are touched.
+// Shrinking frees the pages past the new end, except for those still mapped or
+// in use somewhere: those are zeroed and kept until the object goes away, so
+// that their mappings stay valid and growing again still reads zeros.
+static int truncate(vnode_t *vn, uint64_t size)
+{
+    shm_t *shm = (shm_t *)vn;
+
+    spinlock_acquire(&shm->slock);
+
+    uint64_t old_size = shm->vn.size;
+    shm->vn.size = size;
+
+    if (size < old_size)
+    {
+        if (size % ARCH_PAGE_GRAN)
+        {
+            page_t *last = xa_get(&shm->pages, size / ARCH_PAGE_GRAN);
+            if (last)
+                memset((uint8_t *)last->addr + HHDM + size % ARCH_PAGE_GRAN, 0,
+                       ARCH_PAGE_GRAN - size % ARCH_PAGE_GRAN);
+        }
+
+        size_t idx = page_count(shm);
+        page_t *page;
+        while ((page = xa_find(&shm->pages, &idx, SIZE_MAX)))
+        {
+            if (atomic_load_explicit(&page->refcount, memory_order_acquire) == 1
+            &&  atomic_load_explicit(&page->mapcount, memory_order_acquire) == 0)
+            {
+                xa_remove(&shm->pages, idx);
+                pm_free(page);
+            }
+            else
+                memset((void *)(page->addr + HHDM), 0, ARCH_PAGE_GRAN);
+            idx++;
+        }
+    }
+
+    spinlock_release(&shm->slock);
+
+    shm->vn.mtime = arch_clock_get_unix_time();
+    return EOK;
+}
+
+// Mappings hold a vnode reference, so nothing maps the pages anymore.
+static void release(vnode_t *vn)
+{
+    shm_t *shm = (shm_t *)vn;
+
+    size_t idx;
+    page_t *page;
+    xa_foreach(&shm->pages, idx, page)
+    {
+        ASSERT(atomic_load_explicit(&page->mapcount, memory_order_relaxed) == 0);
+        xa_remove(&shm->pages, idx);
+        pm_free(page);
+    }
+
+    heap_free(shm->vn.name);
+    heap_free(shm);
+}
+
+static vnode_ops_t shm_ops = {
+    .read = read,
+    .write = write,
+    .truncate = truncate,
+    .get_page = get_page,
+    .release = release
+};
+
+vnode_t *shm_create(const char *name)
+{
+    uint64_t now = arch_clock_get_unix_time();
+
+    shm_t *shm = heap_alloc(sizeof(shm_t));
+    if (!shm)
+        return NULL;
+
+    *shm = (shm_t) {
+        .vn = (vnode_t) {
+            .name = strdup(name),
+            .type = VREG,
+            .perm = 0,
+            .ctime = now,
+            .mtime = now,
+            .atime = now,
+            .size = 0,
+            .pages = XARRAY_INIT,
+            .ops = &shm_ops,
+            .inode = shm,
+            .refcount = 1,
+            .slock = SPINLOCK_INIT
+        },
+        .pages = XARRAY_INIT,
+        .slock = SPINLOCK_INIT
+    };
+
+    return &shm->vn;
+}
@@ -0,0 +1,113 @@
+#include "mm/swap.h"
+
+#include "arch/types.h"
+#include "assert.h"
+#include "hhdm.h"
+#include "log.h"
+#include "mm/mm.h"
+#include "mm/vm.h"
+#include "sync/spinlock.h"
+#include "uapi/errno.h"
+#include "utils/math.h"
+
+static vnode_t *swap_vn;
+static uint64_t *slot_map; // Bit set for every slot in use.
+static size_t slot_count;
+static size_t slots_used;
+static size_t next_slot;   // Where the search for a free slot starts.
+static spinlock_t swap_slock = SPINLOCK_INIT;
+
+int swap_activate(vnode_t *vn)
+{
+    if (!vn->ops || !vn->ops->read || !vn->ops->write)
+        return ENOTSUP;
+
+    size_t count = vn->size / ARCH_PAGE_GRAN;
+    if (count == 0)
+        return EINVAL;
+
+    size_t map_size = CEIL(count, 64) / 64 * sizeof(uint64_t);
+    uint64_t *map = vm_alloc(map_size);
+    if (!map)
+        return ENOMEM;
+    memset(map, 0, map_size);
+
+    spinlock_acquire(&swap_slock);
+    if (swap_vn)
+    {
+        spinlock_release(&swap_slock);
+        vm_free(map);
+        return EBUSY;
+    }
+    slot_map = map;
+    slot_count = count;
+    slots_used = 0;
+    next_slot = 0;
+    swap_vn = vn;
+    spinlock_release(&swap_slock);
+
+    vnode_ref(vn);
+
+    log(LOG_INFO, "Swapping to `%s`: %lu slots (%lu KiB).", vn->name, count, count * ARCH_PAGE_GRAN / KIB);
+    return EOK;
+}
+
+bool swap_alloc(size_t *out_slot)
+{
+    spinlock_acquire(&swap_slock);
+
+    if (slots_used == slot_count)
+    {
+        spinlock_release(&swap_slock);
+        return false;
+    }
+
+    // There is a free slot somewhere, go around once looking for it.
+    size_t slot = next_slot;
+    while (slot_map[slot / 64] & (1ull << (slot % 64)))
+        slot = (slot + 1) % slot_count;
+
+    slot_map[slot / 64] |= 1ull << (slot % 64);
+    slots_used++;
+    next_slot = (slot + 1) % slot_count;
+
+    spinlock_release(&swap_slock);
+
+    *out_slot = slot;
+    return true;
+}
+
+void swap_free(size_t slot)
+{
+    spinlock_acquire(&swap_slock);
+
+    ASSERT(slot < slot_count && slot_map[slot / 64] & (1ull << (slot % 64)));
+    slot_map[slot / 64] &= ~(1ull << (slot % 64));
+    slots_used--;
+
+    spinlock_release(&swap_slock);
+}
+
+// Slots are only ever touched by whoever holds them, so I/O needs no locking.
+
+int swap_write(size_t slot, page_t *page)
+{
+    uint64_t written;
+    int err = swap_vn->ops->write(swap_vn, (void *)(page->addr + HHDM), slot * ARCH_PAGE_GRAN,
+                                  ARCH_PAGE_GRAN, &written);
+    if (err != EOK)
+        return err;
+
+    return written == ARCH_PAGE_GRAN ? EOK : EIO;
+}
+
+int swap_read(size_t slot, page_t *page)
+{
+    uint64_t read;
+    int err = swap_vn->ops->read(swap_vn, (void *)(page->addr + HHDM), slot * ARCH_PAGE_GRAN,
+                                 ARCH_PAGE_GRAN, &read);
+    if (err != EOK)
+        return err;
+
+    return read == ARCH_PAGE_GRAN ? EOK : EIO;
+}
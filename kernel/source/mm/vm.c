@@ -1,5 +1,6 @@
 #include "mm/vm.h"
 
+#include "arch/lcpu.h"
 #include "arch/types.h"
 #include "assert.h"
 #include "bootreq.h"
@@ -9,11 +10,20 @@
 #include "mm/heap.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/swap.h"
+#include "mm/vmem.h"
 #include "panic.h"
+#include "proc/percpu.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/thread.h"
+#include "sync/rwlock.h"
 #include "sync/spinlock.h"
+#include "sync/waitqueue.h"
 #include "uapi/errno.h"
 #include "utils/list.h"
 #include "utils/math.h"
+#include "utils/xarray.h"
 #include <stdint.h>
 
 /*
@@ -21,6 +31,15 @@
  */
 
 vm_addrspace_t *vm_kernel_as;
+vmem_t vm_kernel_arena;
+
+// Mapped read-only wherever anonymous memory is read before it is written.
+static page_t *zero_page;
+
+// The kernel arena is a dedicated window far above the HHDM so that it never
+// overlaps the direct map, whatever the physical memory layout looks like.
+#define KERNEL_ARENA_OFFSET (64 * 1024 * GIB)
+#define KERNEL_ARENA_SIZE (512 * GIB)
 
 // Segment utils
 
@@ -102,30 +121,489 @@ static vm_segment_t *find_seg(vm_addrspace_t *as, uintptr_t addr)
     return NULL;
 }
 
+// Page population
+
+#define READAHEAD_NORMAL 4      // Pages read ahead of a fault by default.
+#define READAHEAD_SEQUENTIAL 32 // Pages read ahead of a fault in sequential segments.
+#define HUGEPAGE_SIZE (2 * MIB) // Block faulted in at once in hugepage segments.
+
+// Vnodes without an `mmap` operation are mapped through the page cache and
+// populated on fault. Those that have one populate the segment themselves.
+static inline bool seg_is_cached(vm_segment_t *seg)
+{
+    return seg->vn && !(seg->vn->ops && seg->vn->ops->mmap);
+}
+
+// Whether the pages of this segment belong to it alone and are freed with it.
+static inline bool seg_is_private(vm_segment_t *seg)
+{
+    return !seg->vn || (seg_is_cached(seg) && (seg->flags & VM_MAP_PRIVATE));
+}
+
+static inline bool is_mapped(vm_addrspace_t *as, uintptr_t vaddr)
+{
+    uintptr_t phys;
+    return arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys);
+}
+
+// Whether `vaddr` is mapped to anything but the zero page. Writes to the zero
+// page fault, so for them it counts as not mapped.
+static inline bool is_mapped_for(vm_addrspace_t *as, uintptr_t vaddr, bool write)
+{
+    uintptr_t phys;
+    return arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys)
+        && !(write && FLOOR(phys, ARCH_PAGE_GRAN) == zero_page->addr);
+}
+
+// Stands in `swap_map` for a page being written out or read back in, which
+// happens without `pt_slock`. Faults on the page wait until it is gone. Both
+// sides hold the address space lock shared, so nothing else runs into one.
+#define SWAP_BUSY ((void *)UINTPTR_MAX)
+
+// Map `page` at `vaddr` unless something already is, in which case a private
+// `page` is freed. A zero page mapping is replaced by anything else, and a
+// page that was swapped out is read back into `page` first. Only the install
+// itself happens under `pt_slock`, so concurrent faults do not serialize on
+// allocating or filling pages.
+//
+// Returns false if `vaddr` is swapped out and `page` is the zero page.
+static bool install_page(vm_addrspace_t *as, uintptr_t vaddr, page_t *page, int prot, bool private)
+{
+    size_t idx = vaddr / ARCH_PAGE_GRAN;
+
+    spinlock_acquire(&as->pt_slock);
+
+    while (xa_get(&as->swap_map, idx) == SWAP_BUSY)
+    {
+        spinlock_release(&as->pt_slock);
+        arch_lcpu_relax();
+        spinlock_acquire(&as->pt_slock);
+    }
+
+    uintptr_t phys;
+    bool replaced = false;
+    if (arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys))
+    {
+        if (page == zero_page || phys != zero_page->addr)
+        {
+            // Another thread faulted the page in first.
+            spinlock_release(&as->pt_slock);
+            if (private)
+                pm_free(page);
+            return true;
+        }
+
+        arch_paging_unmap_page(as->page_map, vaddr);
+        pm_page_map_dec(zero_page);
+        replaced = true;
+    }
+
+    size_t swap_entry = (size_t)xa_get(&as->swap_map, idx);
+    if (swap_entry)
+    {
+        if (page == zero_page)
+        {
+            spinlock_release(&as->pt_slock);
+            return false;
+        }
+
+        // Replacing an entry allocates nothing and can not fail.
+        xa_insert(&as->swap_map, idx, SWAP_BUSY);
+        spinlock_release(&as->pt_slock);
+
+        if (swap_read(swap_entry - 1, page) != EOK)
+            panic("Could not read page %#lx back from swap!", vaddr);
+
+        spinlock_acquire(&as->pt_slock);
+        ASSERT(xa_get(&as->swap_map, idx) == SWAP_BUSY && !is_mapped(as, vaddr));
+        xa_remove(&as->swap_map, idx);
+        swap_free(swap_entry - 1);
+    }
+
+    arch_paging_map_page(as->page_map, vaddr, page->addr, ARCH_PAGE_GRAN, prot);
+    pm_page_map_inc(page);
+
+    spinlock_release(&as->pt_slock);
+
+    // Other CPUs would go on reading the zero page.
+    if (replaced)
+        arch_paging_shootdown(&as->cpus, vaddr, ARCH_PAGE_GRAN);
+
+    // Nothing can unmap the page while the address space lock is held, so it
+    // can be handed to reclaim after the fact.
+    if (private)
+        reclaim_lru_add(page, as, vaddr, true);
+    return true;
+}
+
+// Back `vaddr` with the zero page for reads, or with a fresh zeroed page for
+// writes and swapped out pages, unless it is already mapped.
+static bool populate_anon_page(vm_addrspace_t *as, uintptr_t vaddr, int prot, bool write)
+{
+    if (is_mapped_for(as, vaddr, write))
+        return true;
+
+    if (!write && install_page(as, vaddr, zero_page, prot & ~MM_PROT_WRITE, false))
+        return true;
+
+    page_t *page = reclaim_alloc_page();
+    if (!page)
+        return false;
+    memset((void *)(page->addr + HHDM), 0, ARCH_PAGE_GRAN);
+
+    install_page(as, vaddr, page, prot, true);
+    return true;
+}
+
+typedef enum
+{
+    POPULATE_OK,
+    POPULATE_FAILED,
+    POPULATE_RETRY // The address space lock was dropped, look the segment up again.
+}
+populate_result_t;
+
+// Map the page cache page behind `vaddr`, or a copy of it for private
+// mappings, and read ahead according to the segment's access hint. The
+// address space lock is dropped for the file I/O, and the page is only mapped
+// if the segment still maps the same page of the same file afterwards.
+static populate_result_t populate_file_page(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr)
+{
+    if (is_mapped(as, vaddr))
+        return POPULATE_OK;
+
+    vnode_t *vn = seg->vn;
+    uint64_t offset = seg->offset + (vaddr - seg->start);
+    bool private = seg_is_private(seg);
+    int advice = seg->advice;
+
+    // Keeps the vnode around should the segment go meanwhile.
+    vnode_ref(vn);
+    rwlock_release_read(&as->lock);
+
+    page_t *page;
+    int err = vfs_get_page(vn, offset / ARCH_PAGE_GRAN, &page);
+    if (err == EOK && private)
+    {
+        page_t *copy = reclaim_alloc_page();
+        if (copy)
+            memcpy((void *)(copy->addr + HHDM), (void *)(page->addr + HHDM), ARCH_PAGE_GRAN);
+        else
+            err = ENOMEM;
+        pm_page_refcount_dec(page);
+        page = copy;
+    }
+
+    if (err == EOK && advice != VM_ADVICE_RANDOM)
+        vfs_readahead(vn, offset / ARCH_PAGE_GRAN + 1,
+                      advice == VM_ADVICE_SEQUENTIAL ? READAHEAD_SEQUENTIAL : READAHEAD_NORMAL);
+
+    rwlock_acquire_read(&as->lock);
+
+    seg = find_seg(as, vaddr);
+    bool same = seg && seg->vn == vn && seg_is_private(seg) == private
+             && seg->offset + (vaddr - seg->start) == offset;
+    if (err != EOK || !same)
+    {
+        if (err == EOK && private)
+            pm_free(page);
+        else if (err == EOK)
+            pm_page_refcount_dec(page);
+        vnode_unref(vn);
+        return same ? POPULATE_FAILED : POPULATE_RETRY;
+    }
+
+    // Stores through a shared mapping bypass `vfs_write` and the PTE dirty bit
+    // is not looked at, so a page that may be written is dirty from the start.
+    if (!private && (seg->prot & MM_PROT_WRITE))
+        vfs_dirty_page(vn, offset / ARCH_PAGE_GRAN, page);
+
+    // A swapped out private copy is read back over the fresh one.
+    install_page(as, vaddr, page, seg->prot, private);
+    if (!private)
+        pm_page_refcount_dec(page);
+
+    vnode_unref(vn);
+    return POPULATE_OK;
+}
+
+static populate_result_t populate_page(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, bool write)
+{
+    if (seg->vn)
+        return populate_file_page(as, seg, vaddr);
+
+    return populate_anon_page(as, vaddr, seg->prot, write) ? POPULATE_OK : POPULATE_FAILED;
+}
+
+// Drop every page mapped or swapped out in `[start, start + length)`. Private
+// pages are freed once their last mapping is gone, page cache and device pages
+// are left alone. The address space lock must be held exclusively, so that
+// reclaim is not looking at any of these pages.
+static void release_seg_pages(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t start, size_t length)
+{
+    bool private = seg_is_private(seg);
+    bool unmapped = false;
+    list_t freed = LIST_INIT; // Off the LRU lists, through `list_elem`.
+
+    spinlock_acquire(&as->pt_slock);
+
+    if (private && length > 0)
+    {
+        size_t idx = start / ARCH_PAGE_GRAN;
+        void *entry;
+        while ((entry = xa_find(&as->swap_map, &idx, (start + length) / ARCH_PAGE_GRAN - 1)))
+        {
+            xa_remove(&as->swap_map, idx);
+            swap_free((size_t)entry - 1);
+        }
+    }
+
+    for (size_t i = 0; i < length; i += ARCH_PAGE_GRAN)
+    {
+        uintptr_t phys;
+        if (!arch_paging_vaddr_to_paddr(as->page_map, start + i, &phys))
+            continue;
+
+        arch_paging_unmap_page(as->page_map, start + i);
+        unmapped = true;
+
+        if (seg->vn && !seg_is_cached(seg))
+            continue;
+
+        page_t *page = pm_phys_to_page(phys);
+        if (pm_page_map_dec(page) && private && page != zero_page)
+        {
+            reclaim_lru_remove(page);
+            list_append(&freed, &page->list_elem);
+        }
+    }
+
+    spinlock_release(&as->pt_slock);
+
+    // Other CPUs may still reach the pages through their TLBs until then.
+    if (unmapped)
+        arch_paging_shootdown(&as->cpus, start, length);
+
+    list_node_t *n;
+    while ((n = list_pop_head(&freed)))
+        pm_free(LIST_GET_CONTAINER(n, page_t, list_elem));
+}
+
 // Page fault handler
 
-static bool page_fault(vm_addrspace_t *as, uintptr_t virt)
+// Populate the page at `vaddr`, with the address space lock held shared.
+static bool fault_page(vm_addrspace_t *as, uintptr_t vaddr, bool write)
 {
-    vm_segment_t *seg = check_collision(as, virt, 1);
-    if (!seg)
+    while (true)
+    {
+        vm_segment_t *seg = find_seg(as, vaddr);
+        if (!seg
+        ||  (seg->vn && !seg_is_cached(seg))
+        ||  (write && !(seg->prot & MM_PROT_WRITE)))
+            return false;
+
+        populate_result_t res = populate_page(as, seg, FLOOR(vaddr, ARCH_PAGE_GRAN), write);
+        if (res != POPULATE_RETRY)
+            return res == POPULATE_OK;
+    }
+}
+
+bool vm_page_fault(vm_addrspace_t *as, uintptr_t vaddr, bool write)
+{
+    // Kernel memory is always mapped up front, a fault there is a bug.
+    if (as == vm_kernel_as)
         return false;
 
-    // if (seg->vn)
-    // {
+    rwlock_acquire_read(&as->lock);
 
-    // }
-    // else
-    // {
-    //     page_t *page = pm_alloc(0);
-    //     if (!page)
-    //         return false;
+    bool ok = fault_page(as, vaddr, write);
 
-    //     uintptr_t phys = page->addr;
-    //     memset((void *)(phys + HHDM), 0, ARCH_PAGE_GRAN);
-    //     arch_paging_map_page(as->page_map, FLOOR(virt, ARCH_PAGE_GRAN), phys, ARCH_PAGE_GRAN, seg->prot);
-    // }
+    // User mappings are only ever mapped with base pages, so the hugepage
+    // hint is honoured by faulting in the whole surrounding block at once.
+    // The lock may have been dropped, so the segment is looked up again.
+    vm_segment_t *seg = ok ? find_seg(as, vaddr) : NULL;
+    if (seg && seg->hugepage)
+    {
+        uintptr_t start = MAX(FLOOR(vaddr, HUGEPAGE_SIZE), seg->start);
+        uintptr_t end = MIN(FLOOR(vaddr, HUGEPAGE_SIZE) + HUGEPAGE_SIZE, seg->start + seg->length);
+        for (uintptr_t addr = start; addr < end; addr += ARCH_PAGE_GRAN)
+            if (!fault_page(as, addr, write))
+                break;
+    }
 
-    return true;
+    rwlock_release_read(&as->lock);
+    return ok;
+}
+
+// Reclaim
+
+reclaim_result_t vm_evict_page(vm_addrspace_t *as, uintptr_t vaddr, page_t *page)
+{
+    vm_segment_t *seg = find_seg(as, vaddr);
+    if (!seg)
+        return RECLAIM_RETRY;
+
+    size_t idx = vaddr / ARCH_PAGE_GRAN;
+
+    spinlock_acquire(&as->pt_slock);
+
+    uintptr_t phys;
+    if (!arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys) || FLOOR(phys, ARCH_PAGE_GRAN) != page->addr)
+    {
+        spinlock_release(&as->pt_slock);
+        return RECLAIM_RETRY;
+    }
+
+    size_t slot;
+    if (arch_paging_test_and_clear_accessed(as->page_map, vaddr) || !swap_alloc(&slot))
+    {
+        spinlock_release(&as->pt_slock);
+        return RECLAIM_ACTIVATE;
+    }
+
+    if (!xa_insert(&as->swap_map, idx, SWAP_BUSY))
+    {
+        swap_free(slot);
+        spinlock_release(&as->pt_slock);
+        return RECLAIM_ACTIVATE;
+    }
+
+    // Unmap before copying, so that a write from now on faults and waits for
+    // the marker to go instead of being lost.
+    arch_paging_unmap_page(as->page_map, vaddr);
+    spinlock_release(&as->pt_slock);
+
+    // Other CPUs may still write through what their TLBs hold until then.
+    arch_paging_shootdown(&as->cpus, vaddr, ARCH_PAGE_GRAN);
+
+    int err = swap_write(slot, page);
+
+    spinlock_acquire(&as->pt_slock);
+    ASSERT(xa_get(&as->swap_map, idx) == SWAP_BUSY && !is_mapped(as, vaddr));
+
+    if (err != EOK)
+    {
+        xa_remove(&as->swap_map, idx);
+        swap_free(slot);
+        arch_paging_map_page(as->page_map, vaddr, page->addr, ARCH_PAGE_GRAN, seg->prot);
+        spinlock_release(&as->pt_slock);
+        return RECLAIM_ACTIVATE;
+    }
+
+    xa_insert(&as->swap_map, idx, (void *)(slot + 1));
+    pm_page_map_dec(page);
+    spinlock_release(&as->pt_slock);
+
+    pm_free(page);
+    return RECLAIM_EVICTED;
+}
+
+/*
+ * Background prefaulting
+ *
+ * VM_ADVICE_WILLNEED ranges are handed to a kernel thread that faults them in
+ * page by page, so the caller does not wait for the memory to be populated.
+ */
+
+typedef struct
+{
+    vm_addrspace_t *as;
+    uintptr_t start;
+    size_t length;
+
+    list_node_t list_node;
+}
+prefault_req_t;
+
+static list_t prefault_queue = LIST_INIT;
+static vm_addrspace_t *prefault_curr_as; // Address space being populated right now.
+static spinlock_t prefault_slock = SPINLOCK_INIT;
+// Set up in `vm_init`, as `WAITQUEUE_INIT` is no constant expression.
+static waitqueue_t prefault_wq;      // The worker, while the queue is empty.
+static waitqueue_t prefault_done_wq; // Threads waiting for the worker to drop `prefault_curr_as`.
+static bool prefault_started = false;
+
+[[noreturn]] static void prefault_worker()
+{
+    while (true)
+    {
+        spinlock_acquire(&prefault_slock);
+        while (list_is_empty(&prefault_queue))
+            waitqueue_wait(&prefault_wq, &prefault_slock, UINT64_MAX);
+
+        prefault_req_t *req = LIST_GET_CONTAINER(list_pop_head(&prefault_queue), prefault_req_t, list_node);
+        prefault_curr_as = req->as;
+        spinlock_release(&prefault_slock);
+
+        // Populate writable memory for writing, so that it does not end up
+        // backed by the zero page and fault again on the first write.
+        for (size_t i = 0; i < req->length; i += ARCH_PAGE_GRAN)
+            if (!vm_page_fault(req->as, req->start + i, true)
+            &&  !vm_page_fault(req->as, req->start + i, false))
+                break;
+
+        spinlock_acquire(&prefault_slock);
+        prefault_curr_as = NULL;
+        waitqueue_wake_all(&prefault_done_wq);
+        spinlock_release(&prefault_slock);
+
+        heap_free(req);
+    }
+}
+
+static int prefault_async(vm_addrspace_t *as, uintptr_t start, size_t length)
+{
+    prefault_req_t *req = heap_alloc(sizeof(prefault_req_t));
+    if (!req)
+        return ENOMEM;
+    *req = (prefault_req_t) {
+        .as = as,
+        .start = start,
+        .length = length,
+        .list_node = LIST_NODE_INIT
+    };
+
+    spinlock_acquire(&prefault_slock);
+    list_append(&prefault_queue, &req->list_node);
+    waitqueue_wake_one(&prefault_wq);
+    spinlock_release(&prefault_slock);
+
+    if (!__atomic_exchange_n(&prefault_started, true, __ATOMIC_ACQ_REL))
+    {
+        // The request stays queued for the next attempt to start the worker.
+        thread_t *worker = thread_create(proc_create("vm-prefault", false), (uintptr_t)&prefault_worker);
+        if (worker)
+            sched_enqueue(worker);
+        else
+            __atomic_store_n(&prefault_started, false, __ATOMIC_RELEASE);
+    }
+
+    return EOK;
+}
+
+// Forget the queued requests of an address space about to be destroyed.
+static void prefault_cancel(vm_addrspace_t *as)
+{
+    spinlock_acquire(&prefault_slock);
+
+    list_node_t *n = prefault_queue.head;
+    while (n)
+    {
+        list_node_t *next = n->next;
+        prefault_req_t *req = LIST_GET_CONTAINER(n, prefault_req_t, list_node);
+        if (req->as == as)
+        {
+            list_remove(&prefault_queue, n);
+            heap_free(req);
+        }
+        n = next;
+    }
+
+    // Wait for the worker to be done with it.
+    while (prefault_curr_as == as)
+        waitqueue_wait(&prefault_done_wq, &prefault_slock, UINT64_MAX);
+
+    spinlock_release(&prefault_slock);
 }
 
 // Mapping and unmapping
@@ -159,13 +637,13 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
            vnode_t *vn, uintptr_t offset,
            uintptr_t *out)
 {
-    spinlock_acquire(&as->slock);
+    rwlock_acquire_write(&as->lock);
 
     // Determine where the segment goes in the virtual address space.
     int ret = resolve_vaddr(as, vaddr, length, flags, &vaddr);
     if (ret != EOK)
     {
-        spinlock_release(&as->slock);
+        rwlock_release_write(&as->lock);
         return ret;
     }
 
@@ -173,7 +651,7 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
     vm_segment_t *seg = heap_alloc(sizeof(vm_segment_t));
     if (!seg)
     {
-        spinlock_release(&as->slock);
+        rwlock_release_write(&as->lock);
         return ENOMEM;
     }
     *seg = (vm_segment_t) {
@@ -182,40 +660,48 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
         .prot = prot,
         .flags = flags,
         .vn = vn,
-        .offset = offset
+        .offset = offset,
+        .advice = VM_ADVICE_NORMAL,
+        .hugepage = false
     };
     insert_seg(as, seg);
 
-    for (size_t i = 0; i < length; i += ARCH_PAGE_GRAN)
+    if (vn) // VNode backed
     {
-        if (vn) // VNode backed
-        {
-            if (vn->ops && vn->ops->mmap)
-                return vn->ops->mmap(vn, as, vaddr, length, prot, flags, offset);
-            else
-                return ENOTSUP;
-        }
-        else // Anon
-        {
-            page_t *page = pm_alloc(0);
-            if (!page)
+        if (seg_is_cached(seg)) // Populated from the page cache on fault.
+            ret = (vn->type == VREG && vn->ops && vn->ops->read && offset % ARCH_PAGE_GRAN == 0) ? EOK : ENOTSUP;
+        else
+            ret = vn->ops->mmap(vn, as, vaddr, length, prot, flags, offset);
+    }
+    else if (flags & VM_MAP_POPULATE) // Anon, otherwise populated on fault.
+    {
+        for (size_t i = 0; i < length; i += ARCH_PAGE_GRAN)
+            if (!populate_anon_page(as, vaddr + i, prot, true))
             {
-                heap_free(seg);
-                return ENOMEM;
+                release_seg_pages(as, seg, vaddr, i);
+                ret = ENOMEM;
+                break;
             }
+    }
 
-            arch_paging_map_page(as->page_map, vaddr + i, page->addr, ARCH_PAGE_GRAN, prot);
-        }
+    if (ret != EOK)
+    {
+        list_remove(&as->segments, &seg->list_node);
+        heap_free(seg);
     }
+    else if (vn)
+        vnode_ref(vn);
 
-    spinlock_release(&as->slock);
-    *out = vaddr;
-    return EOK;
+    rwlock_release_write(&as->lock);
+
+    if (ret == EOK)
+        *out = vaddr;
+    return ret;
 }
 
 int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length)
 {
-    spinlock_acquire(&as->slock);
+    rwlock_acquire_write(&as->lock);
 
     FOREACH(n, as->segments)
     {
@@ -223,76 +709,518 @@ int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length)
 
         if (seg->start == vaddr && seg->length == length)
         {
-            for (size_t i = 0; i < seg->length; i += ARCH_PAGE_GRAN)
-                arch_paging_unmap_page(as->page_map, seg->start + i);
+            release_seg_pages(as, seg, seg->start, seg->length);
 
             list_remove(&as->segments, n);
+            if (seg->vn)
+                vnode_unref(seg->vn);
             heap_free(seg);
 
-            spinlock_release(&as->slock);
+            rwlock_release_write(&as->lock);
             return EOK;
         }
     }
 
-    spinlock_release(&as->slock);
+    rwlock_release_write(&as->lock);
     return ENOENT;
 }
 
+// Remapping
+
+#define TABLE_SPAN (2 * MIB) // Range mapped by one last-level page table.
+
+// Move the swap entries of `[from, from + length)` to `to`. New keys are all
+// inserted before the old ones go, so a failure leaves the old range intact.
+static bool move_swap_entries(vm_addrspace_t *as, uintptr_t from, uintptr_t to, size_t length)
+{
+    size_t first = from / ARCH_PAGE_GRAN;
+    size_t last = (from + length) / ARCH_PAGE_GRAN - 1;
+    size_t delta = (to - from) / ARCH_PAGE_GRAN;
+
+    size_t idx = first;
+    void *entry;
+    while ((entry = xa_find(&as->swap_map, &idx, last)))
+    {
+        if (!xa_insert(&as->swap_map, idx + delta, entry))
+        {
+            size_t undo = first + delta;
+            while (undo < idx + delta && xa_find(&as->swap_map, &undo, idx + delta - 1))
+                xa_remove(&as->swap_map, undo);
+            return false;
+        }
+        idx++;
+    }
+
+    idx = first;
+    while (xa_find(&as->swap_map, &idx, last))
+        xa_remove(&as->swap_map, idx);
+    return true;
+}
+
+// Undo the first `done` bytes of a `move_seg_pages` that could not finish.
+// Moved tables go back, which only succeeds where the old block was left
+// empty, and single entries, still mapped at `from`, are dropped from `to`.
+static void unmove_seg_pages(vm_addrspace_t *as, uintptr_t from, uintptr_t to, size_t done)
+{
+    size_t i = 0;
+    while (i < done)
+    {
+        if ((from + i) % TABLE_SPAN == 0 && (to + i) % TABLE_SPAN == 0 && done - i >= TABLE_SPAN
+        &&  arch_paging_move_table(as->page_map, to + i, from + i))
+        {
+            i += TABLE_SPAN;
+            continue;
+        }
+
+        if (is_mapped(as, to + i))
+            arch_paging_unmap_page(as->page_map, to + i);
+        i += ARCH_PAGE_GRAN;
+    }
+}
+
+// Move the page table entries of `[from, from + length)` to `to`, which must
+// be unmapped. Whole tables are moved where both ranges cover them entirely,
+// single entries elsewhere. Those are mapped at `to` first and only unmapped
+// from `from` once everything is in place, so that a page table allocation
+// failing half way can be undone. The address space lock must be held
+// exclusively, so that reclaim is not looking at any of these pages.
+static bool move_seg_pages(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t from, uintptr_t to, size_t length)
+{
+    spinlock_acquire(&as->pt_slock);
+
+    size_t i = 0;
+    bool ok = true;
+    while (i < length && ok)
+    {
+        if ((from + i) % TABLE_SPAN == 0 && (to + i) % TABLE_SPAN == 0 && length - i >= TABLE_SPAN
+        &&  arch_paging_move_table(as->page_map, from + i, to + i))
+        {
+            i += TABLE_SPAN;
+            continue;
+        }
+
+        uintptr_t phys;
+        if (arch_paging_vaddr_to_paddr(as->page_map, from + i, &phys))
+        {
+            // Zero page mappings stay read-only.
+            int prot = FLOOR(phys, ARCH_PAGE_GRAN) == zero_page->addr ? seg->prot & ~MM_PROT_WRITE : seg->prot;
+
+            ok = arch_paging_map_page(as->page_map, to + i, FLOOR(phys, ARCH_PAGE_GRAN), ARCH_PAGE_GRAN, prot) == 0;
+        }
+        if (ok)
+            i += ARCH_PAGE_GRAN;
+    }
+
+    if (!ok || (seg_is_private(seg) && !move_swap_entries(as, from, to, length)))
+    {
+        unmove_seg_pages(as, from, to, i);
+        spinlock_release(&as->pt_slock);
+        return false;
+    }
+
+    for (i = 0; i < length; i += ARCH_PAGE_GRAN)
+        if (is_mapped(as, from + i))
+            arch_paging_unmap_page(as->page_map, from + i);
+
+    // Reclaim finds private pages by the address they are mapped at.
+    if (seg_is_private(seg))
+        for (i = 0; i < length; i += ARCH_PAGE_GRAN)
+        {
+            uintptr_t phys;
+            if (!arch_paging_vaddr_to_paddr(as->page_map, to + i, &phys))
+                continue;
+
+            page_t *page = pm_phys_to_page(phys);
+            if (page != zero_page)
+                page->index = to + i;
+        }
+
+    spinlock_release(&as->pt_slock);
+
+    // Other CPUs may still reach the pages at their old address.
+    arch_paging_shootdown(&as->cpus, from, length);
+    return true;
+}
+
+// Find room for `length` bytes at the same offset into a page table span as
+// `vaddr`, so that whole tables can be moved there. Falls back to any room.
+static bool find_remap_space(vm_addrspace_t *as, uintptr_t vaddr, size_t length, uintptr_t *out)
+{
+    uintptr_t dest;
+    if (length >= TABLE_SPAN && find_space(as, length + TABLE_SPAN, &dest))
+    {
+        *out = dest + (vaddr - dest) % TABLE_SPAN;
+        return true;
+    }
+
+    return find_space(as, length, out);
+}
+
+int vm_remap(vm_addrspace_t *as, uintptr_t vaddr, size_t old_length, size_t new_length,
+             int flags, uintptr_t *out)
+{
+    old_length = CEIL(old_length, ARCH_PAGE_GRAN);
+    new_length = CEIL(new_length, ARCH_PAGE_GRAN);
+    if (vaddr % ARCH_PAGE_GRAN || old_length == 0 || new_length == 0)
+        return EINVAL;
+
+    rwlock_acquire_write(&as->lock);
+
+    int ret = EOK;
+    vm_segment_t *seg = find_seg(as, vaddr);
+    if (!seg || seg->start != vaddr || seg->length != old_length)
+        ret = ENOENT;
+    else if (new_length <= old_length)
+    {
+        release_seg_pages(as, seg, vaddr + new_length, old_length - new_length);
+        seg->length = new_length;
+    }
+    else if (seg->vn && !seg_is_cached(seg)) // Device mappings are never faulted in.
+        ret = EINVAL;
+    else if (new_length - 1 <= as->limit_high - vaddr
+         &&  !check_collision(as, vaddr + old_length, new_length - old_length))
+        seg->length = new_length;
+    else if (!(flags & VM_REMAP_MAYMOVE))
+        ret = ENOMEM;
+    else
+    {
+        uintptr_t dest;
+        if (!find_remap_space(as, vaddr, new_length, &dest)
+        ||  !move_seg_pages(as, seg, vaddr, dest, old_length))
+            ret = ENOMEM;
+        else
+        {
+            list_remove(&as->segments, &seg->list_node);
+            seg->start = dest;
+            seg->length = new_length;
+            insert_seg(as, seg);
+            vaddr = dest;
+        }
+    }
+
+    rwlock_release_write(&as->lock);
+
+    if (ret == EOK)
+        *out = vaddr;
+    return ret;
+}
+
+// Split `seg` at `addr`, returning the upper half.
+static vm_segment_t *split_seg(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t addr)
+{
+    vm_segment_t *upper = heap_alloc(sizeof(vm_segment_t));
+    if (!upper)
+        return NULL;
+
+    *upper = *seg;
+    upper->start = addr;
+    upper->length = seg->start + seg->length - addr;
+    upper->offset = seg->offset + (addr - seg->start);
+    upper->list_node = LIST_NODE_INIT;
+    seg->length = addr - seg->start;
+
+    if (upper->vn)
+        vnode_ref(upper->vn);
+    list_insert_after(&as->segments, &seg->list_node, &upper->list_node);
+    return upper;
+}
+
+// Whether `[start, end)` is entirely covered by segments.
+static bool range_is_mapped(vm_addrspace_t *as, uintptr_t start, uintptr_t end)
+{
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+
+        if (seg->start + seg->length <= start)
+            continue;
+        if (seg->start > start)
+            return false;
+
+        start = seg->start + seg->length;
+        if (start >= end)
+            return true;
+    }
+
+    return false;
+}
+
+static int advise_sticky(vm_addrspace_t *as, uintptr_t start, uintptr_t end, int advice)
+{
+    rwlock_acquire_write(&as->lock);
+
+    if (!range_is_mapped(as, start, end))
+    {
+        rwlock_release_write(&as->lock);
+        return ENOMEM;
+    }
+
+    int ret = EOK;
+    for (list_node_t *n = as->segments.head; n; n = n->next)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        if (seg->start >= end)
+            break;
+        if (seg->start + seg->length <= start)
+            continue;
+
+        // Hints apply to whole segments, so cut off what lies outside the range.
+        if (seg->start < start)
+        {
+            seg = split_seg(as, seg, start);
+            if (!seg)
+            {
+                ret = ENOMEM;
+                break;
+            }
+            n = &seg->list_node;
+        }
+        if (seg->start + seg->length > end && !split_seg(as, seg, end))
+        {
+            ret = ENOMEM;
+            break;
+        }
+
+        switch (advice)
+        {
+            case VM_ADVICE_HUGEPAGE:
+                seg->hugepage = true;
+                break;
+            case VM_ADVICE_NOHUGEPAGE:
+                seg->hugepage = false;
+                break;
+            default:
+                seg->advice = advice;
+                break;
+        }
+    }
+
+    rwlock_release_write(&as->lock);
+    return ret;
+}
+
+static int advise_dontneed(vm_addrspace_t *as, uintptr_t start, uintptr_t end)
+{
+    // Taken exclusively to keep reclaim away from the pages being dropped.
+    rwlock_acquire_write(&as->lock);
+
+    if (!range_is_mapped(as, start, end))
+    {
+        rwlock_release_write(&as->lock);
+        return ENOMEM;
+    }
+
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        if (seg->start >= end)
+            break;
+
+        uintptr_t from = MAX(start, seg->start);
+        uintptr_t to = MIN(end, seg->start + seg->length);
+        // Device mappings are never faulted back in, leave them.
+        if (from < to && (!seg->vn || seg_is_cached(seg)))
+            release_seg_pages(as, seg, from, to - from);
+    }
+
+    rwlock_release_write(&as->lock);
+    return EOK;
+}
+
+int vm_advise(vm_addrspace_t *as, uintptr_t vaddr, size_t length, int advice)
+{
+    length = CEIL(length, ARCH_PAGE_GRAN);
+    if (vaddr % ARCH_PAGE_GRAN || vaddr > as->limit_high || length > as->limit_high - vaddr)
+        return EINVAL;
+    if (length == 0)
+        return EOK;
+
+    uintptr_t end = vaddr + length;
+
+    switch (advice)
+    {
+        case VM_ADVICE_NORMAL:
+        case VM_ADVICE_RANDOM:
+        case VM_ADVICE_SEQUENTIAL:
+        case VM_ADVICE_HUGEPAGE:
+        case VM_ADVICE_NOHUGEPAGE:
+            return advise_sticky(as, vaddr, end, advice);
+        case VM_ADVICE_WILLNEED:
+        {
+            rwlock_acquire_read(&as->lock);
+            bool mapped = range_is_mapped(as, vaddr, end);
+            rwlock_release_read(&as->lock);
+
+            return mapped ? prefault_async(as, vaddr, length) : ENOMEM;
+        }
+        case VM_ADVICE_DONTNEED:
+            return advise_dontneed(as, vaddr, end);
+        default:
+            return EINVAL;
+    }
+}
+
 /*
  * Memory allocation
  */
 
-typedef struct
+void *vm_alloc(size_t size)
 {
-    size_t obj_size;
+    return vm_alloc_prot(size, MM_PROT_WRITE);
 }
-vm_alloc_hdr_t;
 
-void *vm_alloc(size_t size)
+static void release_kernel_pages(uintptr_t base, size_t size)
 {
-    size = CEIL(size + sizeof(vm_alloc_hdr_t), ARCH_PAGE_GRAN);
+    // Kernel pages are on no LRU list, so theirs can hold them until freed.
+    list_t freed = LIST_INIT;
 
-    spinlock_acquire(&vm_kernel_as->slock);
+    spinlock_acquire(&vm_kernel_as->pt_slock);
 
-    uintptr_t out = 0;
-    vm_map(vm_kernel_as, 0, size, MM_PROT_WRITE, VM_MAP_ANON | VM_MAP_POPULATE, NULL, 0, &out);
+    for (size_t i = 0; i < size; i += ARCH_PAGE_GRAN)
+    {
+        uintptr_t phys;
+        if (!arch_paging_vaddr_to_paddr(vm_kernel_as->page_map, base + i, &phys))
+            continue;
+
+        arch_paging_unmap_page(vm_kernel_as->page_map, base + i);
+        list_append(&freed, &pm_phys_to_page(phys)->list_elem);
+    }
 
-    spinlock_release(&vm_kernel_as->slock);
+    spinlock_release(&vm_kernel_as->pt_slock);
 
-    return out ? (void *)out : NULL;
+    // Every CPU shares the kernel half of the page tables.
+    arch_paging_shootdown(&CPUMASK_ALL, base, size);
+
+    list_node_t *n;
+    while ((n = list_pop_head(&freed)))
+        pm_free(LIST_GET_CONTAINER(n, page_t, list_elem));
+}
+
+void *vm_alloc_prot(size_t size, int prot)
+{
+    size = CEIL(size, ARCH_PAGE_GRAN);
+
+    // The range comes from the kernel arena, so neither the segment list nor
+    // the address space lock are involved.
+    uintptr_t base = vmem_alloc(&vm_kernel_arena, size);
+    if (!base)
+        return NULL;
+
+    for (size_t i = 0; i < size; i += ARCH_PAGE_GRAN)
+    {
+        page_t *page = pm_alloc(0);
+        bool mapped = false;
+        if (page)
+        {
+            // Mapping may need page table pages and fail as well.
+            spinlock_acquire(&vm_kernel_as->pt_slock);
+            mapped = arch_paging_map_page(vm_kernel_as->page_map, base + i, page->addr, ARCH_PAGE_GRAN, prot) == 0;
+            spinlock_release(&vm_kernel_as->pt_slock);
+        }
+
+        if (!mapped)
+        {
+            if (page)
+                pm_free(page);
+            release_kernel_pages(base, i);
+            vmem_free(&vm_kernel_arena, base, size);
+            return NULL;
+        }
+    }
+
+    return (void *)base;
 }
 
 void vm_free(void *obj)
 {
-    spinlock_acquire(&vm_kernel_as->slock);
+    uintptr_t base = (uintptr_t)obj;
 
-    vm_segment_t *seg = find_seg(vm_kernel_as, (uintptr_t)obj);
-    vm_unmap(vm_kernel_as, (uintptr_t)obj, seg->length);
+    size_t size = vmem_size(&vm_kernel_arena, base);
+    ASSERT_C(size, "vm_free: %#lx was not allocated with vm_alloc!", base);
 
-    spinlock_release(&vm_kernel_as->slock);
+    release_kernel_pages(base, size);
+    vmem_free(&vm_kernel_arena, base, size);
 }
 
 /*
  * Userspace utils
  */
 
-size_t vm_copy_to_user(vm_addrspace_t *dest_as, uintptr_t dest, const void *src, size_t count)
+// Anonymous memory is populated lazily, so user buffers may not be backed yet.
+static bool translate_user(vm_addrspace_t *as, uintptr_t vaddr, bool write, uintptr_t *out)
 {
-    size_t i = 0;
-    while (i < count)
+    // Writes go through the HHDM and would not fault on the zero page.
+    if (is_mapped_for(as, vaddr, write))
+        return arch_paging_vaddr_to_paddr(as->page_map, vaddr, out);
+
+    return vm_page_fault(as, vaddr, write)
+        && arch_paging_vaddr_to_paddr(as->page_map, vaddr, out);
+}
+
+bool vm_user_to_phys(vm_addrspace_t *as, uintptr_t vaddr, bool write, uintptr_t *out)
+{
+    return translate_user(as, vaddr, write, out);
+}
+
+bool vm_user_load_u32(vm_addrspace_t *as, uintptr_t vaddr, uint32_t *out, uintptr_t *out_phys)
+{
+    ASSERT(vaddr % sizeof(uint32_t) == 0);
+
+    // Pages are unmapped under `pt_slock` before they are freed.
+    spinlock_acquire(&as->pt_slock);
+    uintptr_t phys;
+    bool mapped = arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys);
+    if (mapped)
     {
-        size_t offset = (dest + i) % ARCH_PAGE_GRAN;
+        *out = __atomic_load_n((uint32_t *)(phys + HHDM), __ATOMIC_ACQUIRE);
+        *out_phys = phys;
+    }
+    spinlock_release(&as->pt_slock);
+
+    return mapped;
+}
+
+// Copy `len` bytes from `src` to the user page at `vaddr`, or zero them if
+// `src` is NULL, or copy them from the page to `dest`. The range must not cross
+// a page. Pages are unmapped under `pt_slock` before they are freed, so the copy
+// is done with it held; the lock is dropped to fault the page in.
+static bool copy_user_page(vm_addrspace_t *as, uintptr_t vaddr, void *dest, const void *src, size_t len)
+{
+    bool write = !dest;
+    while (true)
+    {
+        spinlock_acquire(&as->pt_slock);
         uintptr_t phys;
-        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys))
+        if (is_mapped_for(as, vaddr, write)
+        &&  arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys))
         {
-            // TODO: Handle this
-            panic("Not mapped!");
+            void *page = (void *)(phys + HHDM);
+            if (!write)
+                memcpy(dest, page, len);
+            else if (src)
+                memcpy(page, src, len);
+            else
+                memset(page, 0, len);
+            spinlock_release(&as->pt_slock);
+            return true;
         }
+        spinlock_release(&as->pt_slock);
+
+        if (!vm_page_fault(as, vaddr, write))
+            return false;
+    }
+}
 
+size_t vm_copy_to_user(vm_addrspace_t *dest_as, uintptr_t dest, const void *src, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t offset = (dest + i) % ARCH_PAGE_GRAN;
         size_t len = MIN(count - i, ARCH_PAGE_GRAN - offset);
-        memcpy((void*)(phys + HHDM), src, len);
+        if (!copy_user_page(dest_as, dest + i, NULL, (const uint8_t *)src + i, len))
+            break;
         i += len;
-        src = (void *)((uintptr_t)src + len);
     }
     return i;
 }
@@ -303,17 +1231,10 @@ size_t vm_copy_from_user(vm_addrspace_t *src_as, void *dest, uintptr_t src, size
     while (i < count)
     {
         size_t offset = (src + i) % ARCH_PAGE_GRAN;
-        uintptr_t phys;
-        if (!arch_paging_vaddr_to_paddr(src_as->page_map, src + i, &phys))
-        {
-            // TODO: Handle this
-            panic("Not mapped!");
-        }
-
         size_t len = MIN(count - i, ARCH_PAGE_GRAN - offset);
-        memcpy(dest, (void *)(phys + HHDM), len);
+        if (!copy_user_page(src_as, src + i, (uint8_t *)dest + i, NULL, len))
+            break;
         i += len;
-        dest = (void *)((uintptr_t)dest + len);
     }
     return i;
 }
@@ -324,15 +1245,9 @@ size_t vm_zero_out_user(vm_addrspace_t *dest_as, uintptr_t dest, size_t count)
     while (i < count)
     {
         size_t offset = (dest + i) % ARCH_PAGE_GRAN;
-        uintptr_t phys;
-        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys))
-        {
-            // TODO: Handle this
-            panic("Not mapped!");
-        }
-
         size_t len = MIN(count - i, ARCH_PAGE_GRAN - offset);
-        memset((void*)(phys + HHDM), 0, len);
+        if (!copy_user_page(dest_as, dest + i, NULL, NULL, len))
+            break;
         i += len;
     }
     return i;
@@ -348,7 +1263,10 @@ vm_addrspace_t *vm_addrspace_create()
         .page_map = arch_paging_map_create(),
         .limit_low = 0,
         .limit_high = HHDM,
-        .slock = SPINLOCK_INIT
+        .lock = RWLOCK_INIT,
+        .pt_slock = SPINLOCK_INIT_NAMED("vm_pt"),
+        .swap_map = XARRAY_INIT,
+        .cpus = {}
     };
 
     return map;
@@ -356,13 +1274,12 @@ vm_addrspace_t *vm_addrspace_create()
 
 void vm_addrspace_destroy(vm_addrspace_t *as)
 {
-    vm_segment_t *seg = LIST_GET_CONTAINER(&as->segments, vm_segment_t, list_node);
-    while (seg)
+    prefault_cancel(as);
+
+    while (!list_is_empty(&as->segments))
     {
-        vm_segment_t *next = LIST_GET_CONTAINER(seg->list_node.next, vm_segment_t, list_node);
+        vm_segment_t *seg = LIST_GET_CONTAINER(LIST_FIRST(&as->segments), vm_segment_t, list_node);
         vm_unmap(as, seg->start, seg->length);
-        heap_free(seg);
-        seg = next;
     }
 
     arch_paging_map_destroy(as->page_map);
@@ -413,6 +1330,9 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
 
 void vm_addrspace_load(vm_addrspace_t *as)
 {
+    // Joined before the tables are loaded: a shootdown that does not see the
+    // CPU yet changed them before it reads them.
+    cpumask_set_atomic(&as->cpus, this_cpu_read(id));
     arch_paging_map_load(as->page_map);
 }
 
@@ -518,6 +1438,28 @@ void vm_init()
         );
     }
 
+    // Reserve the kernel arena window so `vm_map` never hands it out.
+    uintptr_t arena_base = HHDM + KERNEL_ARENA_OFFSET;
+    ASSERT(!check_collision(vm_kernel_as, arena_base, KERNEL_ARENA_SIZE));
+    vm_segment_t *arena_seg = heap_alloc(sizeof(vm_segment_t));
+    *arena_seg = (vm_segment_t) {
+        .start = arena_base,
+        .length = KERNEL_ARENA_SIZE,
+        .prot = MM_PROT_WRITE | MM_PROT_EXEC,
+        .flags = VM_MAP_ANON | VM_MAP_FIXED
+    };
+    insert_seg(vm_kernel_as, arena_seg);
+    vmem_init(&vm_kernel_arena, "kernel-va", arena_base, KERNEL_ARENA_SIZE,
+              ARCH_PAGE_GRAN, VMEM_QCACHE_MAX * ARCH_PAGE_GRAN);
+
+    zero_page = pm_alloc(0);
+    if (!zero_page)
+        panic("Could not allocate the zero page!");
+    memset((void *)(zero_page->addr + HHDM), 0, ARCH_PAGE_GRAN);
+
+    prefault_wq = WAITQUEUE_INIT;
+    prefault_done_wq = WAITQUEUE_INIT;
+
     vm_addrspace_load(vm_kernel_as);
 
     log(LOG_INFO, "Virtual memory initialized.");
@@ -0,0 +1,367 @@
+#include "mm/vmem.h"
+
+#include "arch/types.h"
+#include "assert.h"
+#include "hhdm.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "panic.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+/*
+ * Boundary tag pool
+ *
+ * Tags are carved directly out of physical pages instead of coming from the
+ * heap, so the arena can be used by anything that sits below the heap.
+ */
+
+static list_t btag_pool = LIST_INIT;
+static spinlock_t btag_slock = SPINLOCK_INIT_NAMED("vmem_btag");
+
+static vmem_btag_t *btag_alloc()
+{
+    spinlock_acquire(&btag_slock);
+
+    if (list_is_empty(&btag_pool))
+    {
+        page_t *page = pm_alloc(0);
+        if (!page)
+        {
+            spinlock_release(&btag_slock);
+            return NULL;
+        }
+
+        vmem_btag_t *tags = (vmem_btag_t *)(page->addr + HHDM);
+        for (size_t i = 0; i < ARCH_PAGE_GRAN / sizeof(vmem_btag_t); i++)
+            list_append(&btag_pool, &tags[i].list_node);
+    }
+
+    vmem_btag_t *tag = LIST_GET_CONTAINER(list_pop_head(&btag_pool), vmem_btag_t, list_node);
+
+    spinlock_release(&btag_slock);
+    return tag;
+}
+
+static void btag_free(vmem_btag_t *tag)
+{
+    spinlock_acquire(&btag_slock);
+    list_append(&btag_pool, &tag->list_node);
+    spinlock_release(&btag_slock);
+}
+
+// Helpers
+
+static inline size_t floor_log2(size_t value)
+{
+    return 63 - __builtin_clzll(value);
+}
+
+static inline size_t ceil_log2(size_t value)
+{
+    size_t log = floor_log2(value);
+    return (value & (value - 1)) ? log + 1 : log;
+}
+
+static inline size_t hash_index(vmem_t *arena, uintptr_t base)
+{
+    return (base / arena->quantum) % VMEM_HASH_SIZE;
+}
+
+static void freelist_insert(vmem_t *arena, vmem_btag_t *tag)
+{
+    size_t idx = floor_log2(tag->size);
+
+    tag->type = VMEM_BTAG_FREE;
+    list_append(&arena->freelists[idx], &tag->list_node);
+    arena->freemap |= 1ull << idx;
+}
+
+static void freelist_remove(vmem_t *arena, vmem_btag_t *tag)
+{
+    size_t idx = floor_log2(tag->size);
+
+    list_remove(&arena->freelists[idx], &tag->list_node);
+    if (list_is_empty(&arena->freelists[idx]))
+        arena->freemap &= ~(1ull << idx);
+}
+
+static vmem_btag_t *hash_find(vmem_t *arena, uintptr_t base)
+{
+    FOREACH(n, arena->hash[hash_index(arena, base)])
+    {
+        vmem_btag_t *tag = LIST_GET_CONTAINER(n, vmem_btag_t, list_node);
+        if (tag->base == base)
+            return tag;
+    }
+
+    return NULL;
+}
+
+// Arena operations. The arena lock must be held.
+
+static uintptr_t arena_alloc(vmem_t *arena, size_t size)
+{
+    size_t idx = ceil_log2(size);
+    if (idx >= VMEM_FREELISTS)
+        return 0;
+
+    vmem_btag_t *tag = NULL;
+
+    // Instant fit: every segment on freelist N is at least 2^N bytes long,
+    // so the first non-empty list at or above ceil(log2(size)) always fits.
+    uint64_t candidates = arena->freemap & ~((1ull << idx) - 1);
+    if (candidates)
+        tag = LIST_GET_CONTAINER(LIST_FIRST(&arena->freelists[__builtin_ctzll(candidates)]), vmem_btag_t, list_node);
+    else if (idx > 0 && floor_log2(size) != idx)
+    {
+        // Last resort for sizes that are not a power of two: the list just
+        // below may still hold a segment that is large enough.
+        FOREACH(n, arena->freelists[idx - 1])
+        {
+            vmem_btag_t *i = LIST_GET_CONTAINER(n, vmem_btag_t, list_node);
+            if (i->size >= size)
+            {
+                tag = i;
+                break;
+            }
+        }
+    }
+
+    if (!tag)
+        return 0;
+
+    freelist_remove(arena, tag);
+
+    if (tag->size > size)
+    {
+        vmem_btag_t *rest = btag_alloc();
+        if (!rest)
+        {
+            freelist_insert(arena, tag);
+            return 0;
+        }
+
+        *rest = (vmem_btag_t) {
+            .base = tag->base + size,
+            .size = tag->size - size,
+            .seg_node = LIST_NODE_INIT,
+            .list_node = LIST_NODE_INIT
+        };
+        list_insert_after(&arena->segments, &tag->seg_node, &rest->seg_node);
+        freelist_insert(arena, rest);
+
+        tag->size = size;
+    }
+
+    tag->type = VMEM_BTAG_ALLOC;
+    list_append(&arena->hash[hash_index(arena, tag->base)], &tag->list_node);
+    arena->in_use += size;
+
+    return tag->base;
+}
+
+static void arena_free(vmem_t *arena, uintptr_t base, size_t size)
+{
+    vmem_btag_t *tag = hash_find(arena, base);
+    ASSERT_C(tag && tag->size == size, "vmem: bad free of %#lx (%#lx bytes) in arena `%s`!", base, size, arena->name);
+
+    list_remove(&arena->hash[hash_index(arena, base)], &tag->list_node);
+    arena->in_use -= size;
+
+    // Coalesce with the following segment. Span tags are never free, so
+    // segments of different spans are never merged.
+    if (tag->seg_node.next)
+    {
+        vmem_btag_t *next = LIST_GET_CONTAINER(tag->seg_node.next, vmem_btag_t, seg_node);
+        if (next->type == VMEM_BTAG_FREE)
+        {
+            freelist_remove(arena, next);
+            list_remove(&arena->segments, &next->seg_node);
+            tag->size += next->size;
+            btag_free(next);
+        }
+    }
+
+    // Coalesce with the preceding segment.
+    if (tag->seg_node.prev)
+    {
+        vmem_btag_t *prev = LIST_GET_CONTAINER(tag->seg_node.prev, vmem_btag_t, seg_node);
+        if (prev->type == VMEM_BTAG_FREE)
+        {
+            freelist_remove(arena, prev);
+            list_remove(&arena->segments, &tag->seg_node);
+            prev->size += tag->size;
+            btag_free(tag);
+            tag = prev;
+        }
+    }
+
+    freelist_insert(arena, tag);
+}
+
+// Quantum caches
+
+static vmem_qcache_t *qcache_get(vmem_t *arena, size_t size)
+{
+    return &arena->qcache[this_cpu_read(id)][size / arena->quantum - 1];
+}
+
+// API
+
+void vmem_init(vmem_t *arena, const char *name, uintptr_t base, size_t size,
+               size_t quantum, size_t qcache_max)
+{
+    ASSERT(quantum && (quantum & (quantum - 1)) == 0);
+
+    // The per-CPU quantum caches make the arena too large for a compound
+    // literal on a kernel stack.
+    memset(arena, 0, sizeof(vmem_t));
+    arena->name = name;
+    arena->quantum = quantum;
+    arena->qcache_max = MIN(FLOOR(qcache_max, quantum), VMEM_QCACHE_MAX * quantum);
+    arena->segments = LIST_INIT;
+    arena->slock = SPINLOCK_INIT_NAMED("vmem_arena");
+
+    for (size_t i = 0; i < VMEM_FREELISTS; i++)
+        arena->freelists[i] = LIST_INIT;
+    for (size_t i = 0; i < VMEM_HASH_SIZE; i++)
+        arena->hash[i] = LIST_INIT;
+
+    if (size && !vmem_add(arena, base, size))
+        panic("vmem: could not add the initial span of arena `%s`!", name);
+}
+
+bool vmem_add(vmem_t *arena, uintptr_t base, size_t size)
+{
+    ASSERT(base % arena->quantum == 0 && size % arena->quantum == 0);
+
+    vmem_btag_t *span = btag_alloc();
+    vmem_btag_t *seg = btag_alloc();
+    if (!span || !seg)
+    {
+        if (span)
+            btag_free(span);
+        if (seg)
+            btag_free(seg);
+        return false;
+    }
+
+    *span = (vmem_btag_t) {
+        .type = VMEM_BTAG_SPAN,
+        .base = base,
+        .size = size,
+        .seg_node = LIST_NODE_INIT,
+        .list_node = LIST_NODE_INIT
+    };
+    *seg = (vmem_btag_t) {
+        .base = base,
+        .size = size,
+        .seg_node = LIST_NODE_INIT,
+        .list_node = LIST_NODE_INIT
+    };
+
+    spinlock_acquire(&arena->slock);
+
+    // Keep the segment list sorted: the new span goes after the last segment
+    // that starts below it.
+    list_node_t *pos = NULL;
+    FOREACH(n, arena->segments)
+    {
+        if (LIST_GET_CONTAINER(n, vmem_btag_t, seg_node)->base < base)
+            pos = n;
+        else
+            break;
+    }
+
+    if (pos)
+        list_insert_after(&arena->segments, pos, &span->seg_node);
+    else
+        list_prepend(&arena->segments, &span->seg_node);
+    list_insert_after(&arena->segments, &span->seg_node, &seg->seg_node);
+    freelist_insert(arena, seg);
+    arena->total += size;
+
+    spinlock_release(&arena->slock);
+    return true;
+}
+
+uintptr_t vmem_alloc(vmem_t *arena, size_t size)
+{
+    size = CEIL(size, arena->quantum);
+    if (size == 0)
+        return 0;
+
+    if (size <= arena->qcache_max)
+    {
+        // Masked so the thread stays on this CPU while using its cache.
+        smp_int_mask_push();
+
+        vmem_qcache_t *qc = qcache_get(arena, size);
+        if (qc->count == 0)
+        {
+            // Refill half of the cache at once so the arena lock is amortised
+            // over several allocations.
+            spinlock_acquire(&arena->slock);
+            while (qc->count < VMEM_QCACHE_SIZE / 2)
+            {
+                uintptr_t range = arena_alloc(arena, size);
+                if (!range)
+                    break;
+                qc->ranges[qc->count++] = range;
+            }
+            spinlock_release(&arena->slock);
+        }
+
+        uintptr_t base = qc->count > 0 ? qc->ranges[--qc->count] : 0;
+        smp_int_mask_pop();
+        return base;
+    }
+
+    spinlock_acquire(&arena->slock);
+    uintptr_t base = arena_alloc(arena, size);
+    spinlock_release(&arena->slock);
+
+    return base;
+}
+
+void vmem_free(vmem_t *arena, uintptr_t base, size_t size)
+{
+    size = CEIL(size, arena->quantum);
+
+    if (size <= arena->qcache_max)
+    {
+        smp_int_mask_push();
+
+        vmem_qcache_t *qc = qcache_get(arena, size);
+        if (qc->count == VMEM_QCACHE_SIZE)
+        {
+            // The cache is full, give half of it back to the arena.
+            spinlock_acquire(&arena->slock);
+            while (qc->count > VMEM_QCACHE_SIZE / 2)
+                arena_free(arena, qc->ranges[--qc->count], size);
+            spinlock_release(&arena->slock);
+        }
+
+        qc->ranges[qc->count++] = base;
+
+        smp_int_mask_pop();
+        return;
+    }
+
+    spinlock_acquire(&arena->slock);
+    arena_free(arena, base, size);
+    spinlock_release(&arena->slock);
+}
+
+size_t vmem_size(vmem_t *arena, uintptr_t base)
+{
+    spinlock_acquire(&arena->slock);
+    vmem_btag_t *tag = hash_find(arena, base);
+    size_t size = tag ? tag->size : 0;
+    spinlock_release(&arena->slock);
+
+    return size;
+}
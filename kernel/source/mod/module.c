@@ -80,42 +80,31 @@ int module_load(vnode_t *file, module_t **out)
 
         if (section->sh_type == SHT_PROGBITS)
         {
-            uint64_t size = CEIL(section->sh_size, ARCH_PAGE_GRAN);
-            uintptr_t mem;
-            vm_map(
-                vm_kernel_as,
-                0,
-                size,
-                MM_PROT_WRITE | MM_PROT_EXEC,
-                VM_MAP_ANON,
-                NULL,
-                0,
-                &mem
-            );
-            if (vfs_read(file, (void *)mem, section->sh_offset, section->sh_size, &count) != EOK
+            void *mem = vm_alloc_prot(section->sh_size, MM_PROT_WRITE | MM_PROT_EXEC);
+            if (!mem)
+            {
+                log(LOG_ERROR, "Could not allocate memory for a section!");
+                return ENOMEM;
+            }
+            if (vfs_read(file, mem, section->sh_offset, section->sh_size, &count) != EOK
             ||  count != section->sh_size)
             {
                 log(LOG_ERROR, "Could not load section header from file!");
                 return ENOEXEC;
             }
-            section_addr[i] = mem;
+            section_addr[i] = (uintptr_t)mem;
         }
         else if (section->sh_type == SHT_NOBITS) // Global data.
         {
-            uint64_t size = CEIL(section->sh_size, ARCH_PAGE_GRAN);
-            uintptr_t mem;
-            vm_map(
-                vm_kernel_as,
-                0,
-                size,
-                MM_PROT_WRITE | MM_PROT_EXEC,
-                VM_MAP_ANON,
-                NULL,
-                0,
-                &mem
-            );
-
-            section_addr[i] = mem;
+            void *mem = vm_alloc_prot(section->sh_size, MM_PROT_WRITE | MM_PROT_EXEC);
+            if (!mem)
+            {
+                log(LOG_ERROR, "Could not allocate memory for a section!");
+                return ENOMEM;
+            }
+            memset(mem, 0, section->sh_size);
+
+            section_addr[i] = (uintptr_t)mem;
         }
     }
 
@@ -3,7 +3,7 @@
 #include "fs/vfs.h"
 #include "mm/heap.h"
 #include "panic.h"
-#include "sync/spinlock.h"
+#include "sync/mutex.h"
 #include <stdatomic.h>
 
 // FD lifetime
@@ -35,7 +35,7 @@ void fd_table_init(fd_table_t *table)
 {
     table->fds = heap_alloc(sizeof(fd_entry_t) * MAX_FD_COUNT);
     table->capacity = MAX_FD_COUNT;
-    table->lock = SPINLOCK_INIT;
+    table->lock = MUTEX_INIT;
 
     for (size_t i = 0; i < table->capacity; i++)
     {
@@ -46,7 +46,7 @@ void fd_table_init(fd_table_t *table)
 
 void fd_table_destroy(fd_table_t *table)
 {
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     for (size_t i = 0; i < table->capacity; i++)
     {
@@ -56,12 +56,12 @@ void fd_table_destroy(fd_table_t *table)
     }
     heap_free(table->fds);
 
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
 }
 
 bool fd_alloc(fd_table_t *table, vnode_t *vnode, fd_acc_mode_t acc_mode, int *out_fd)
 {
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     for (size_t i = 0; i < table->capacity; i++)
     {
@@ -76,14 +76,14 @@ bool fd_alloc(fd_table_t *table, vnode_t *vnode, fd_acc_mode_t acc_mode, int *ou
             entry->acc_mode = acc_mode;
 
             *out_fd = (int)i;
-            spinlock_release(&table->lock);
+            mutex_release(&table->lock);
             return true;
         }
     }
 
     if (table->capacity >= MAX_FD_COUNT)
     {
-        spinlock_release(&table->lock);
+        mutex_release(&table->lock);
         return false;
     }
 
@@ -92,7 +92,7 @@ bool fd_alloc(fd_table_t *table, vnode_t *vnode, fd_acc_mode_t acc_mode, int *ou
     if (new_capacity > MAX_FD_COUNT)
         new_capacity = MAX_FD_COUNT;
 
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
 
     fd_entry_t *new_fds = heap_realloc(
         table->fds,
@@ -110,11 +110,11 @@ bool fd_alloc(fd_table_t *table, vnode_t *vnode, fd_acc_mode_t acc_mode, int *ou
             .refcount = 0
         };
 
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     if (table->capacity != old_capacity)
     {
-        spinlock_release(&table->lock);
+        mutex_release(&table->lock);
         return fd_alloc(table, vnode, acc_mode, out_fd);
     }
 
@@ -129,7 +129,7 @@ bool fd_alloc(fd_table_t *table, vnode_t *vnode, fd_acc_mode_t acc_mode, int *ou
     entry->acc_mode = acc_mode;
 
     *out_fd = (int)old_capacity;
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
     return true;
 }
 
@@ -139,7 +139,7 @@ fd_table_t *fd_table_clone(fd_table_t *parent)
     if (!child) return NULL;
 
     fd_table_init(child);
-    spinlock_acquire(&parent->lock);
+    mutex_acquire(&parent->lock);
 
     if (child->capacity < parent->capacity)
     {
@@ -149,7 +149,7 @@ fd_table_t *fd_table_clone(fd_table_t *parent)
 
         if (!child->fds)
         {
-            spinlock_release(&parent->lock);
+            mutex_release(&parent->lock);
             heap_free(child);
             return NULL;
         }
@@ -166,47 +166,47 @@ fd_table_t *fd_table_clone(fd_table_t *parent)
         }
     }
 
-    spinlock_release(&parent->lock);
+    mutex_release(&parent->lock);
     return child;
 }
 
 bool fd_free(fd_table_t *table, int fd)
 {
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     if (fd >= 0 && (size_t)fd < table->capacity && table->fds[fd].vnode != NULL)
     {
         fd_unref(&table->fds[fd]);
-        spinlock_release(&table->lock);
+        mutex_release(&table->lock);
         return true;
     }
 
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
     return false;
 }
 
 fd_entry_t fd_get(fd_table_t *table, int fd)
 {
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     if (fd >= 0 && (size_t)fd < table->capacity && table->fds[fd].vnode != NULL)
     {
         fd_entry_t *entry = &table->fds[fd];
         fd_ref(entry);
-        spinlock_release(&table->lock);
+        mutex_release(&table->lock);
         return *entry;
     }
 
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
     return (fd_entry_t) {NULL, 0, (fd_acc_mode_t) {false, false, false, false}, 0};
 }
 
 void fd_put(fd_table_t *table, int fd)
 {
-    spinlock_acquire(&table->lock);
+    mutex_acquire(&table->lock);
 
     fd_entry_t *entry = &table->fds[fd];
     fd_unref(entry);
 
-    spinlock_release(&table->lock);
+    mutex_release(&table->lock);
 }
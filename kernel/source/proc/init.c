@@ -105,6 +105,10 @@ proc_t *init_load(vnode_t *file)
         }
     }
 
-    thread_create(proc, ehdr.e_entry);
+    if (!thread_create(proc, ehdr.e_entry))
+    {
+        log(LOG_ERROR, "Could not create the initial thread!");
+        return NULL;
+    }
     return proc;
 }
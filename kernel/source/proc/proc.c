@@ -5,24 +5,27 @@
 #include "mm/vm.h"
 #include "proc/fd.h"
 #include "proc/thread.h"
+#include "sync/percpu_rwlock.h"
 #include "utils/list.h"
 #include "utils/string.h"
 
 static uint64_t next_pid = 0;
+// Guarded by `SMP_RWLOCK_PROCS`.
 static list_t proc_list = LIST_INIT;
-static spinlock_t slock = SPINLOCK_INIT;
 
 proc_t *proc_create(const char *name, bool user)
 {
     proc_t *proc = heap_alloc(sizeof(proc_t));
 
     *proc = (proc_t) {
-        .pid = next_pid,
+        .pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED),
         .name = strdup(name),
         .status = PROC_STATE_NEW,
         .user = user,
         .as = user ? vm_addrspace_create() : vm_kernel_as,
         .threads = LIST_INIT,
+        .sched_policy = SCHED_POLICY_MLFQ,
+        .sched_param = 0,
         .proc_list_node = LIST_NODE_INIT,
         .slock = SPINLOCK_INIT,
         .ref_count = 1,
@@ -31,10 +34,9 @@ proc_t *proc_create(const char *name, bool user)
 
     fd_table_init(proc->fd_table);
 
-    spinlock_acquire(&slock);
-    next_pid++;
+    percpu_rwlock_acquire_write(SMP_RWLOCK_PROCS);
     list_append(&proc_list, &proc->proc_list_node);
-    spinlock_release(&slock);
+    percpu_rwlock_release_write(SMP_RWLOCK_PROCS);
 
     return proc;
 }
@@ -65,8 +67,9 @@ void proc_destroy(proc_t *proc)
         */
     }
 
+    percpu_rwlock_acquire_write(SMP_RWLOCK_PROCS);
     list_remove(&proc_list, &proc->proc_list_node);
+    percpu_rwlock_release_write(SMP_RWLOCK_PROCS);
 
-    spinlock_release(&proc->slock);
     heap_free(proc);
 }
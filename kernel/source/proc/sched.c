@@ -2,88 +2,1111 @@
 
 #include "arch/lcpu.h"
 #include "arch/timer.h"
+#include "arch/types.h"
+#include "fs/devfs.h"
+#include "hhdm.h"
 #include "log.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "proc/percpu.h"
 #include "proc/smp.h"
 #include "proc/thread.h"
+#include "proc/workqueue.h"
+#include "sync/rcu.h"
 #include "sync/spinlock.h"
+#include "uapi/errno.h"
 #include "utils/list.h"
+#include "utils/math.h"
+#include "utils/printf.h"
 
-#define MLFQ_LEVELS 16
 
-static list_t ready_queues[MLFQ_LEVELS] = { [0 ... MLFQ_LEVELS - 1] = LIST_INIT };
-static spinlock_t slock = SPINLOCK_INIT;
+/*
+ * Every CPU has its own run queue in `smp_cpu_t`, and threads go back to the
+ * queue of the CPU they last ran on. A CPU that has nothing to run takes a
+ * thread from the longest queue; queue lengths are read without locking and
+ * the victim's lock is only tried, so busy CPUs never wait on idle ones.
+ *
+ * What runs next is up to the scheduling classes (`proc/sched_class.h`), asked
+ * in order of rank. The time a thread runs is charged to its class whenever it
+ * stops running, and a one-shot timer preempts it once the class says its
+ * slice is over. A thread of a higher class becoming ready preempts a lower
+ * one right away, through an IPI on other CPUs.
+ *
+ * Classes of the same rank take turns at the end of each slice. Each one's
+ * time is divided by the threads it has ready and the class that is behind
+ * goes next, so every thread of the rank gets about the same share. A class
+ * that had nothing queued comes back level with the others rather than with
+ * the time it saved up meanwhile.
+ *
+ * Threads only run on the CPUs their affinity mask allows. Placement and
+ * stealing weigh queue lengths against the topology, so that threads stay
+ * with the caches they warmed unless moving pays off.
+ *
+ * Sleeping threads are kept off the run queues in a per-CPU heap ordered by
+ * wake-up time. The timer is armed for whichever comes first, the end of the
+ * slice or the earliest wake-up, and left off while neither is pending.
+ *
+ * Blocked threads are off the run queues until `sched_wake`, or their
+ * deadline if they have one, which puts them in the same heap. Every wait is
+ * numbered and whoever ends it first, the waker or the timer, moves its stage
+ * to woken; heap entries of waits that ended early are left in place and
+ * skipped once due. A thread woken before it got off its CPU is queued again
+ * by `sched_drop` rather than by the waker, so that it never runs on two CPUs.
+ *
+ * CPUs without work halt in `sched_idle`. Whoever queues a thread on an idle
+ * CPU, or leaves one waiting where an idle CPU could steal it, sets that CPU's
+ * wake flag, and only interrupts it if it is actually halted. CPUs that are
+ * busy are never sent anything unless they have to be preempted.
+ */
 
-// Private API
+// By rank, at their ids.
+static const sched_class_t *const classes[SCHED_CLASS_COUNT] = {
+    &sched_class_rt,
+    &sched_class_mlfq,
+    &sched_class_fair
+};
+
+#define ALL_CLASSES SIZE_MAX
+
+// Threads enqueued before the CPUs are known wait here for `sched_init`.
+static list_t boot_queue = LIST_INIT;
+static spinlock_t boot_slock = SPINLOCK_INIT;
+static bool started = false;
+
+static const sched_class_t *class_of(proc_t *proc)
+{
+    switch (proc->sched_policy)
+    {
+        case SCHED_POLICY_RT:   return &sched_class_rt;
+        case SCHED_POLICY_FAIR: return &sched_class_fair;
+        default:                return &sched_class_mlfq;
+    }
+}
+
+// The class threads boosted to `rank` run in, the first ranked that high.
+static const sched_class_t *class_of_rank(size_t rank)
+{
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; i++)
+        if (classes[i]->rank >= rank)
+            return classes[i];
+    return classes[SCHED_CLASS_COUNT - 1];
+}
+
+// Placement
+
+// How much two CPUs are apart, 0 for the same CPU.
+static size_t cpu_distance(smp_cpu_t *a, smp_cpu_t *b)
+{
+    if (a == b)
+        return 0;
+    if (a->topology.l2 == b->topology.l2)
+        return 1;
+    if (a->topology.llc == b->topology.llc)
+        return 2;
+    if (a->topology.package == b->topology.package)
+        return 3;
+    return 4;
+}
+
+// Threads a CPU must have waiting before one at `distance` takes one away.
+static inline size_t steal_threshold(size_t distance)
+{
+    return distance > 2 ? 2 : 1;
+}
+
+// Threads a CPU has to get through, counting the running one.
+static size_t cpu_load(smp_cpu_t *cpu)
+{
+    size_t load = __atomic_load_n(&cpu->runqueue.length, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED) != cpu->idle_thread)
+        load++;
+    return load;
+}
+
+// The CPU `t` should be queued on. Each level of the topology between a CPU
+// and `near` counts as half a thread of load, so a thread waits for one or
+// two others rather than leave its cache, and ties go to `near`.
+static smp_cpu_t *select_cpu(thread_t *t, smp_cpu_t *near)
+{
+    smp_cpu_t *best = NULL;
+    size_t best_cost = SIZE_MAX;
+    if (cpumask_test(&t->affinity, near->id))
+    {
+        best = near;
+        best_cost = 2 * cpu_load(near);
+    }
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (cpu == near || !cpumask_test(&t->affinity, cpu->id))
+            continue;
+
+        size_t cost = 2 * cpu_load(cpu) + cpu_distance(cpu, near);
+        if (cost < best_cost)
+        {
+            best = cpu;
+            best_cost = cost;
+        }
+    }
+
+    // Masks are checked against the CPUs when set, but `near` keeps the
+    // thread running should that ever fail.
+    return best ? best : near;
+}
+
+// Run queues. The queue lock must be held.
+
+// Bring `cls`, which had nothing queued, level with the classes of its rank.
+static void rq_level_class(smp_runqueue_t *rq, const sched_class_t *cls)
+{
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; i++)
+        if (classes[i]->rank == cls->rank)
+            rq->class_vtime[cls->id] = MAX(rq->class_vtime[cls->id], rq->class_vtime[i]);
+}
+
+static void rq_enqueue(smp_runqueue_t *rq, thread_t *t, bool wakeup)
+{
+    // A policy change or boost takes effect the next time the thread is
+    // queued.
+    const sched_class_t *cls = class_of(t->owner);
+    if (t->boost_rank < cls->rank)
+        cls = class_of_rank(t->boost_rank);
+    if (t->sched_class != cls)
+    {
+        t->sched_class = cls;
+        wakeup = true;
+    }
+
+    if (rq->class_length[cls->id]++ == 0)
+        rq_level_class(rq, cls);
+    cls->enqueue(rq, t, wakeup);
+    t->on_rq = true;
+    __atomic_store_n(&rq->length, rq->length + 1, __ATOMIC_RELAXED);
+
+    // The running thread itself may be gone by now if it is on another CPU,
+    // only its rank is looked at.
+    size_t curr_rank = __atomic_load_n(&rq->curr_rank, __ATOMIC_RELAXED);
+    if (curr_rank != SIZE_MAX && cls->rank < curr_rank)
+        rq->need_resched = true;
+}
+
+static void rq_dequeue(smp_runqueue_t *rq, thread_t *t)
+{
+    t->sched_class->dequeue(rq, t);
+    rq->class_length[t->sched_class->id]--;
+    t->on_rq = false;
+    __atomic_store_n(&rq->length, rq->length - 1, __ATOMIC_RELAXED);
+}
+
+// Queue `t` on `cpu`, taking the queue lock. Returns whether the thread
+// running there has to make way for it.
+static bool rq_insert(smp_cpu_t *cpu, thread_t *t, bool wakeup)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    spinlock_acquire(&rq->slock);
+
+    if (t->assigned_cpu && t->assigned_cpu != cpu)
+    {
+        rq->migrations++;
+        wakeup = true;
+    }
+    t->assigned_cpu = cpu;
+
+    bool pending = rq->need_resched;
+    rq_enqueue(rq, t, wakeup);
+    bool preempt = !pending && rq->need_resched;
+
+    spinlock_release(&rq->slock);
+    return preempt;
+}
+
+// Lock the run queue `t` is assigned to, which stealing may change until it
+// is held. Returns the CPU, or NULL if `t` was never queued. Interrupts must be
+// masked.
+static smp_cpu_t *rq_lock_thread(thread_t *t)
+{
+    while (true)
+    {
+        smp_cpu_t *cpu = __atomic_load_n(&t->assigned_cpu, __ATOMIC_ACQUIRE);
+        if (!cpu)
+            return NULL;
+
+        spinlock_acquire(&cpu->runqueue.slock);
+        if (__atomic_load_n(&t->assigned_cpu, __ATOMIC_RELAXED) == cpu)
+            return cpu;
+        spinlock_release(&cpu->runqueue.slock);
+    }
+}
+
+// Idle CPUs
+
+// Get `cpu` out of `sched_idle` if it is in there. Work must have been queued
+// before, which it looks for once its wake flag is set.
+static void kick(smp_cpu_t *cpu)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    if (__atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED) != cpu->idle_thread
+    ||  __atomic_load_n(&rq->wake, __ATOMIC_RELAXED))
+        return;
+
+    bool halted = __atomic_load_n(&rq->idle, __ATOMIC_ACQUIRE);
+    if (halted)
+        __atomic_store_n(&rq->wake_sent, arch_timer_get_uptime_ns(), __ATOMIC_RELAXED);
+    if (!__atomic_exchange_n(&rq->wake, true, __ATOMIC_SEQ_CST) && halted)
+        arch_lcpu_wake(cpu);
+}
+
+// Kick the closest idle CPU that would steal from `cpu`, which has `t` waiting.
+static void kick_stealer(smp_cpu_t *cpu, thread_t *t)
+{
+    size_t length = __atomic_load_n(&cpu->runqueue.length, __ATOMIC_RELAXED);
+
+    smp_cpu_t *best = NULL;
+    size_t best_distance = SIZE_MAX;
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *other = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (other == cpu
+        ||  __atomic_load_n(&other->curr_thread, __ATOMIC_RELAXED) != other->idle_thread
+        ||  !cpumask_test(&t->affinity, other->id))
+            continue;
+
+        size_t distance = cpu_distance(cpu, other);
+        if (length >= steal_threshold(distance) && distance < best_distance)
+        {
+            best = other;
+            best_distance = distance;
+        }
+    }
+
+    if (best)
+        kick(best);
+}
+
+// Leave the idle state on `cpu`, accounting for the time spent halted.
+static void idle_exit(smp_cpu_t *cpu, uint64_t now)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    if (!rq->idle)
+        return;
+    __atomic_store_n(&rq->idle, false, __ATOMIC_RELAXED);
+    rq->idle_ns += now - rq->idle_start;
+
+    // The flag may have been set before the CPU halted, then nobody waited.
+    uint64_t sent = __atomic_load_n(&rq->wake_sent, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&rq->wake, __ATOMIC_ACQUIRE) && sent >= rq->idle_start && sent <= now)
+    {
+        rq->wakeups++;
+        rq->wake_latency_ns += now - sent;
+        rq->wake_latency_max_ns = MAX(rq->wake_latency_max_ns, now - sent);
+    }
+}
+
+// Queue `t` on `cpu` and see that it runs: preempt a lower class there, wake
+// the CPU up if it idles, or else wake one that can steal it.
+static void rq_place(smp_cpu_t *cpu, thread_t *t, bool wakeup)
+{
+    bool preempt = rq_insert(cpu, t, wakeup);
+    // Pairs with the fence in `sched_idle`, either the idle CPU sees the
+    // thread or this sees the CPU halted.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-static thread_t *pick_next_thread()
+    if (cpu != this_cpu_ptr())
+    {
+        if (preempt)
+        {
+            arch_lcpu_send_ipi(cpu);
+            return;
+        }
+        kick(cpu);
+    }
+
+    if (__atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED) != cpu->idle_thread)
+        kick_stealer(cpu, t);
+}
+
+// Take the thread to run next from the classes ranked up to `max_rank`. Of
+// the classes of a rank, the one that ran the least per thread goes first.
+static thread_t *rq_take(smp_runqueue_t *rq, size_t max_rank)
 {
-    for (size_t lvl = 0; lvl < MLFQ_LEVELS; lvl++)
-        FOREACH(n, ready_queues[lvl])
+    size_t i = 0;
+    while (i < SCHED_CLASS_COUNT && classes[i]->rank <= max_rank)
+    {
+        size_t rank = classes[i]->rank;
+        thread_t *best = NULL;
+        for (; i < SCHED_CLASS_COUNT && classes[i]->rank == rank; i++)
+        {
+            thread_t *t = classes[i]->pick_next(rq);
+            if (t && (!best || rq->class_vtime[i] < rq->class_vtime[best->sched_class->id]))
+                best = t;
+        }
+
+        if (best)
         {
-            thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
-            if (t->sleep_until < arch_timer_get_uptime_ns())
-            {
-                list_pop_head(&ready_queues[lvl]);
-                t->status = THREAD_STATE_RUNNING;
-                return t;
-            }
+            rq_dequeue(rq, best);
+            return best;
         }
+    }
+
+    return NULL;
+}
+
+// Sleepers. Interrupts must be masked.
+
+static inline bool sleeps_less(const smp_sleeper_t *a, const smp_sleeper_t *b)
+{
+    return a->until < b->until;
+}
+
+// Add wait number `wait` of `t`, due at `t->sleep_until`.
+static bool sleepers_push(smp_runqueue_t *rq, thread_t *t, uint64_t wait)
+{
+    // The heap is a block of pages, twice as large each time it fills up; a
+    // page already holds more entries than the kernel heap could.
+    if (rq->sleeper_count == rq->sleeper_capacity)
+    {
+        page_t *old = rq->sleepers ? pm_phys_to_page((uintptr_t)rq->sleepers - HHDM) : NULL;
+        uint8_t order = old ? old->order + 1 : 0;
+        page_t *page = order <= PM_MAX_PAGE_ORDER ? pm_alloc(order) : NULL;
+        if (!page)
+            return false;
+
+        smp_sleeper_t *sleepers = (smp_sleeper_t *)(page->addr + HHDM);
+        if (old)
+        {
+            memcpy(sleepers, rq->sleepers, rq->sleeper_count * sizeof(smp_sleeper_t));
+            pm_free(old);
+        }
+        rq->sleepers = sleepers;
+        rq->sleeper_capacity = pm_order_to_pagecount(order) * ARCH_PAGE_GRAN / sizeof(smp_sleeper_t);
+    }
+
+    smp_sleeper_t s = { .until = t->sleep_until, .thread = t, .wait = wait };
+    thread_ref(t);
+
+    // Sift up.
+    size_t i = rq->sleeper_count++;
+    while (i > 0 && sleeps_less(&s, &rq->sleepers[(i - 1) / 2]))
+    {
+        rq->sleepers[i] = rq->sleepers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    rq->sleepers[i] = s;
+
+    return true;
+}
+
+// Take the earliest entry, whose thread reference goes to the caller.
+static smp_sleeper_t sleepers_pop(smp_runqueue_t *rq)
+{
+    smp_sleeper_t top = rq->sleepers[0];
+    smp_sleeper_t last = rq->sleepers[--rq->sleeper_count];
+
+    // Sift the last element down from the root.
+    size_t i = 0;
+    while (true)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= rq->sleeper_count)
+            break;
+        if (child + 1 < rq->sleeper_count && sleeps_less(&rq->sleepers[child + 1], &rq->sleepers[child]))
+            child++;
+        if (!sleeps_less(&rq->sleepers[child], &last))
+            break;
+
+        rq->sleepers[i] = rq->sleepers[child];
+        i = child;
+    }
+    if (rq->sleeper_count > 0)
+        rq->sleepers[i] = last;
+
+    return top;
+}
+
+// Waits
+
+// Start a new wait of `t`, the calling thread. Only `t` changes the number.
+static void begin_wait(thread_t *t)
+{
+    uint64_t wait = THREAD_WAIT_NUMBER(t->wait_state) + 1;
+    __atomic_store_n(&t->wait_state, (wait << 2) | THREAD_WAIT_BLOCKING, __ATOMIC_RELEASE);
+}
+
+// End wait number `wait` of `t`. Returns the stage it was at, or
+// `THREAD_WAIT_WOKEN` if it had ended already or the thread moved on.
+static uint64_t end_wait(thread_t *t, uint64_t wait)
+{
+    uint64_t state = __atomic_load_n(&t->wait_state, __ATOMIC_ACQUIRE);
+    while (THREAD_WAIT_NUMBER(state) == wait && THREAD_WAIT_STAGE(state) != THREAD_WAIT_WOKEN)
+        if (__atomic_compare_exchange_n(&t->wait_state, &state, (wait << 2) | THREAD_WAIT_WOKEN,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return THREAD_WAIT_STAGE(state);
+
+    return THREAD_WAIT_WOKEN;
+}
+
+// Queue the threads whose wake-up time has passed, on this CPU unless a less
+// busy one nearby suits them better.
+static void wake_sleepers(smp_cpu_t *cpu, uint64_t now)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    while (rq->sleeper_count > 0 && rq->sleepers[0].until <= now)
+    {
+        smp_sleeper_t s = sleepers_pop(rq);
+        if (end_wait(s.thread, s.wait) == THREAD_WAIT_PARKED)
+        {
+            s.thread->status = THREAD_STATE_READY;
+            rq_place(select_cpu(s.thread, cpu), s.thread, true);
+        }
+        thread_unref(s.thread);
+    }
+}
+
+// Work stealing
+
+// Move a thread of a class ranked up to `max_rank` to the queue of `cpu`,
+// from the longest queue among the closest CPUs that have work. Threads are
+// only taken across last-level caches from CPUs with more than one waiting.
+static bool steal_thread(smp_cpu_t *cpu, size_t max_rank)
+{
+    smp_cpu_t *victim = NULL;
+    size_t victim_distance = SIZE_MAX;
+    size_t victim_length = 0;
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *other = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        size_t length = __atomic_load_n(&other->runqueue.length, __ATOMIC_RELAXED);
+        size_t distance = cpu_distance(cpu, other);
+        if (other == cpu || length < steal_threshold(distance))
+            continue;
+
+        if (distance < victim_distance || (distance == victim_distance && length > victim_length))
+        {
+            victim = other;
+            victim_distance = distance;
+            victim_length = length;
+        }
+    }
+
+    // Someone else is at it, try again on the next pass.
+    if (!victim || !spinlock_try_acquire(&victim->runqueue.slock))
+        return false;
+
+    thread_t *t = NULL;
+    for (size_t i = 0; i < SCHED_CLASS_COUNT && classes[i]->rank <= max_rank && !t; i++)
+        if ((t = classes[i]->pick_steal(&victim->runqueue, cpu->id)))
+            rq_dequeue(&victim->runqueue, t);
+    spinlock_release(&victim->runqueue.slock);
+
+    if (!t)
+        return false;
+
+    // Queued here rather than run directly, so that the class can place it
+    // among the threads of this CPU.
+    rq_insert(cpu, t, true);
+    cpu->runqueue.steals++;
+
+    return true;
+}
+
+// Timer
+
+// Charge the time since the last call to `t`, the thread running on `cpu`.
+static void charge(smp_cpu_t *cpu, thread_t *t, uint64_t now)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    uint64_t ran = now - rq->run_start;
+    rq->run_start = now;
+
+    if (t == cpu->idle_thread)
+        return;
+
+    spinlock_acquire(&rq->slock);
+    t->sched_class->tick(rq, t, ran);
+    rq->class_vtime[t->sched_class->id] += ran / (rq->class_length[t->sched_class->id] + 1);
+    spinlock_release(&rq->slock);
+}
+
+// Tell the class of `t`, the thread running on `cpu`, that it stops running.
+static void put_prev(smp_cpu_t *cpu, thread_t *t, bool stays)
+{
+    if (t == cpu->idle_thread || !t->sched_class->yield)
+        return;
+
+    spinlock_acquire(&cpu->runqueue.slock);
+    t->sched_class->yield(&cpu->runqueue, t, stays);
+    spinlock_release(&cpu->runqueue.slock);
+}
+
+// Start the time slice of `next` with what its class allows, unless nothing
+// else could run meanwhile. `requeue` tells whether the outgoing thread goes
+// back on the queue. The running thread must have been charged.
+static void start_slice(smp_cpu_t *cpu, thread_t *next, bool requeue, uint64_t now)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    rq->slice_end = UINT64_MAX;
 
-    return sched_get_curr_thread()->assigned_cpu->idle_thread;
+    bool contended = requeue || __atomic_load_n(&rq->length, __ATOMIC_RELAXED) > 0;
+    if (next == cpu->idle_thread || !contended)
+        return;
+
+    spinlock_acquire(&rq->slock);
+    uint64_t left = next->sched_class->tick(rq, next, 0);
+    spinlock_release(&rq->slock);
+
+    if (left != UINT64_MAX)
+        rq->slice_end = now + left;
+}
+
+// Arm the timer for the end of the slice or the next wake-up, whichever
+// comes first, or stop it if there is neither. A pending reschedule fires it
+// right away.
+static void arm_timer(smp_cpu_t *cpu)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    uint64_t now = arch_timer_get_uptime_ns();
+
+    uint64_t deadline = rq->need_resched ? now : rq->slice_end;
+    if (rq->sleeper_count > 0)
+        deadline = MIN(deadline, rq->sleepers[0].until);
+
+    if (deadline != UINT64_MAX)
+    {
+        arch_timer_oneshot(deadline > now ? MAX((deadline - now) / 1000, 1) : 1);
+        rq->ticking = true;
+    }
+    else if (rq->ticking)
+    {
+        arch_timer_stop();
+        rq->ticking = false;
+    }
+}
+
+// Private API
+
+static thread_t *pick_next_thread(smp_cpu_t *cpu, size_t max_rank)
+{
+    smp_runqueue_t *rq = &cpu->runqueue;
+    wake_sleepers(cpu, arch_timer_get_uptime_ns());
+
+    spinlock_acquire(&rq->slock);
+    rq->need_resched = false;
+    thread_t *t = rq_take(rq, max_rank);
+    spinlock_release(&rq->slock);
+
+    if (!t && steal_thread(cpu, max_rank))
+    {
+        spinlock_acquire(&rq->slock);
+        t = rq_take(rq, max_rank);
+        spinlock_release(&rq->slock);
+    }
+    if (!t)
+        return cpu->idle_thread;
+
+    // Queued here while its affinity was being changed, send it on.
+    if (!cpumask_test(&t->affinity, cpu->id))
+    {
+        rq_place(select_cpu(t, cpu), t, true);
+        return pick_next_thread(cpu, max_rank);
+    }
+
+    t->status = THREAD_STATE_RUNNING;
+    // Per-CPU caches (kmem, vmem) are indexed through this.
+    t->assigned_cpu = cpu;
+    return t;
+}
+
+static void switch_to(smp_cpu_t *cpu, thread_t *old, thread_t *new)
+{
+    // Threads are not preempted in read-side sections and must not block in
+    // them, so `old` is outside of any. Callbacks wait for an interrupt.
+    rcu_quiescent();
+
+    __atomic_store_n(&cpu->curr_thread, new, __ATOMIC_RELAXED);
+    __atomic_store_n(&cpu->runqueue.curr_rank,
+                     new == cpu->idle_thread ? SIZE_MAX : new->sched_class->rank, __ATOMIC_RELAXED);
+
+    vm_addrspace_load(new->owner->as);
+    arch_thread_context_switch(&old->context, &new->context);
 }
 
 // This function will be called from the assembly function `__thread_context_switch`.
 void sched_drop(thread_t *t)
 {
-    if (t == t->assigned_cpu->idle_thread)
+    smp_cpu_t *cpu = t->assigned_cpu;
+    if (t == cpu->idle_thread)
+        return;
+
+    // Its stack is no longer in use.
+    if (t->status == THREAD_STATE_TERMINATED)
+    {
+        thread_reap(t);
         return;
+    }
 
-    spinlock_acquire(&slock);
-    list_append(&ready_queues[t->priority], &t->sched_thread_list_node);
-    spinlock_release(&slock);
+    // Waiting threads only come back once woken or due, unless that happened
+    // before they got off the CPU. Should the heap not grow, a timed wait
+    // simply ends early.
+    if (t->status == THREAD_STATE_SLEEPING || t->status == THREAD_STATE_BLOCKED)
+    {
+        uint64_t wait = THREAD_WAIT_NUMBER(__atomic_load_n(&t->wait_state, __ATOMIC_ACQUIRE));
+        if (t->sleep_until == UINT64_MAX || sleepers_push(&cpu->runqueue, t, wait))
+        {
+            uint64_t blocking = (wait << 2) | THREAD_WAIT_BLOCKING;
+            if (__atomic_compare_exchange_n(&t->wait_state, &blocking, (wait << 2) | THREAD_WAIT_PARKED,
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return;
+        }
+        else
+            end_wait(t, wait);
+
+        t->status = THREAD_STATE_READY;
+    }
+
+    // A changed affinity may send the thread elsewhere.
+    if (!cpumask_test(&t->affinity, cpu->id))
+        cpu = select_cpu(t, cpu);
+    rq_place(cpu, t, false);
+}
+
+// Queue `t`, which is not running, close to `near` or, if NULL, to the calling
+// thread. Interrupts must be masked.
+static void wake_up(thread_t *t, smp_cpu_t *near)
+{
+    thread_t *curr = sched_get_curr_thread();
+    smp_cpu_t *cpu = this_cpu_ptr();
+    rq_place(select_cpu(t, near ? near : cpu), t, true);
+
+    // The running thread either has the CPU to itself so far and gets a slice
+    // now that it has company, or must make way for the queued one. Other
+    // CPUs were sent an IPI if they had to.
+    smp_runqueue_t *rq = &cpu->runqueue;
+    if (t->assigned_cpu == cpu && curr != cpu->idle_thread
+    &&  (rq->need_resched || rq->slice_end == UINT64_MAX))
+    {
+        uint64_t now = arch_timer_get_uptime_ns();
+        charge(cpu, curr, now);
+        start_slice(cpu, curr, true, now);
+        arm_timer(cpu);
+    }
 }
 
 // Public API
 
 void sched_enqueue(thread_t *t)
 {
-    spinlock_acquire(&slock);
     t->last_ran = 0;
     t->sleep_until = 0;
     t->status = THREAD_STATE_READY;
-    list_append(&ready_queues[0], &t->sched_thread_list_node);
-    spinlock_release(&slock);
+
+    spinlock_acquire(&boot_slock);
+    if (!started)
+    {
+        list_append(&boot_queue, &t->sched_thread_list_node);
+        spinlock_release(&boot_slock);
+        return;
+    }
+    spinlock_release(&boot_slock);
+
+    // New threads start close to the one that created them.
+    smp_int_mask_push();
+    wake_up(t, t->assigned_cpu);
+    smp_int_mask_pop();
+}
+
+void sched_prepare_block()
+{
+    begin_wait(sched_get_curr_thread());
+}
+
+void sched_block(uint64_t deadline)
+{
+    sched_get_curr_thread()->sleep_until = deadline;
+    sched_yield(THREAD_STATE_BLOCKED);
+}
+
+bool sched_wake(thread_t *t)
+{
+    uint64_t wait = THREAD_WAIT_NUMBER(__atomic_load_n(&t->wait_state, __ATOMIC_ACQUIRE));
+    uint64_t stage = end_wait(t, wait);
+
+    // Threads still on their CPU are queued by `sched_drop`.
+    if (stage == THREAD_WAIT_PARKED)
+    {
+        t->status = THREAD_STATE_READY;
+        smp_int_mask_push();
+        wake_up(t, t->assigned_cpu);
+        smp_int_mask_pop();
+    }
+
+    return stage != THREAD_WAIT_WOKEN;
+}
+
+
+void sched_boost(thread_t *t, size_t rank)
+{
+    smp_int_mask_push();
+
+    // A mutex owner has run, so it has a queue.
+    smp_cpu_t *cpu = rq_lock_thread(t);
+
+    bool requeue = false;
+    if (rank < t->boost_rank && rank < class_of(t->owner)->rank)
+    {
+        t->boost_rank = rank;
+        // Waiting in a lower class would defeat the purpose, move it now.
+        // Running and blocked threads change class when queued next.
+        if (t->on_rq)
+        {
+            rq_dequeue(&cpu->runqueue, t);
+            requeue = true;
+        }
+    }
+    spinlock_release(&cpu->runqueue.slock);
+
+    if (requeue)
+        rq_place(cpu, t, true);
+
+    smp_int_mask_pop();
+}
+
+void sched_unboost()
+{
+    thread_t *t = sched_get_curr_thread();
+    if (t->boost_rank == SIZE_MAX)
+        return;
+
+    smp_runqueue_t *rq = &t->assigned_cpu->runqueue;
+    spinlock_acquire(&rq->slock);
+    t->boost_rank = SIZE_MAX;
+    spinlock_release(&rq->slock);
+
+    // Back in its own class, where others may be ahead.
+    if (t->sched_class != class_of(t->owner))
+        sched_yield(THREAD_STATE_READY);
+}
+
+int sched_set_policy(proc_t *proc, sched_policy_t policy, int64_t param)
+{
+    switch (policy)
+    {
+        case SCHED_POLICY_MLFQ:
+            param = 0;
+            break;
+        case SCHED_POLICY_FAIR:
+            if (param < -20 || param > 19)
+                return EINVAL;
+            break;
+        case SCHED_POLICY_RT:
+            if (param < 0)
+                return EINVAL;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    spinlock_acquire(&proc->slock);
+    proc->sched_policy = policy;
+    proc->sched_param = param;
+    spinlock_release(&proc->slock);
+
+    return EOK;
 }
 
-thread_t *sched_get_curr_thread()
+int sched_set_affinity(thread_t *t, const cpumask_t *mask)
 {
-    return (thread_t *)arch_lcpu_thread_reg_read();
+    bool any = false;
+    FOREACH(n, smp_cpus)
+        if (cpumask_test(mask, LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node)->id))
+            any = true;
+    if (!any)
+        return EINVAL;
+
+    // Placement reads the mask without the lock and may see it half written,
+    // which at worst queues the thread on a CPU that sends it on once picked.
+    smp_int_mask_push();
+    smp_cpu_t *cpu = rq_lock_thread(t);
+    t->affinity = *mask;
+    bool move = cpu && t->on_rq && !cpumask_test(mask, cpu->id);
+    if (move)
+        rq_dequeue(&cpu->runqueue, t);
+    if (cpu)
+        spinlock_release(&cpu->runqueue.slock);
+
+    if (move)
+        rq_place(select_cpu(t, cpu), t, true);
+    smp_int_mask_pop();
+
+    // Running threads move the next time they stop running.
+    if (t == sched_get_curr_thread() && !cpumask_test(mask, t->assigned_cpu->id))
+        sched_yield(THREAD_STATE_READY);
+
+    return EOK;
 }
 
+void sched_get_affinity(thread_t *t, cpumask_t *out)
+{
+    smp_int_mask_push();
+    smp_cpu_t *cpu = rq_lock_thread(t);
+    *out = t->affinity;
+    if (cpu)
+        spinlock_release(&cpu->runqueue.slock);
+    smp_int_mask_pop();
+}
+
+// Switch away from a thread that used up its slice or must make way for a
+// higher class, or from the idle thread once something woke up. Interrupts
+// must be masked.
 void sched_preemt()
 {
-    spinlock_acquire(&slock);
     thread_t *old = sched_get_curr_thread();
-    old->last_ran = arch_timer_get_uptime_ns();
-    old->status = THREAD_STATE_READY;
-    if (old->priority < MLFQ_LEVELS - 1)
-        old->priority++;
-    thread_t *new = pick_next_thread();
-    spinlock_release(&slock);
+    smp_cpu_t *cpu = this_cpu_ptr();
+    bool idle = old == cpu->idle_thread;
 
-    vm_addrspace_load(new->owner->as);
-    arch_thread_context_switch(&old->context, &new->context);
+    // Readers are not preempted, or they would hold up grace periods for as
+    // long as they wait to run again.
+    if (!idle && old->rcu_nesting > 0)
+    {
+        old->rcu_resched = true;
+        return;
+    }
+
+    uint64_t now = arch_timer_get_uptime_ns();
+
+    // Only threads of the same class or above take over from a running one.
+    charge(cpu, old, now);
+    thread_t *new = pick_next_thread(cpu, idle ? ALL_CLASSES : old->sched_class->rank);
+    if (new == cpu->idle_thread)
+    {
+        // Nothing else is ready, keep going.
+        start_slice(cpu, old, false, now);
+        arm_timer(cpu);
+        return;
+    }
+
+    if (!idle)
+    {
+        old->last_ran = now;
+        old->status = THREAD_STATE_READY;
+        put_prev(cpu, old, cpumask_test(&old->affinity, cpu->id));
+    }
+    start_slice(cpu, new, !idle, now);
+    arm_timer(cpu);
+
+    switch_to(cpu, old, new);
+}
+
+void sched_resched_deferred()
+{
+    smp_int_mask_push();
+
+    thread_t *curr = sched_get_curr_thread();
+    smp_cpu_t *cpu = this_cpu_ptr();
+    curr->rcu_resched = false;
+    // Fires the timer right away, or as soon as interrupts are unmasked.
+    __atomic_store_n(&cpu->runqueue.need_resched, true, __ATOMIC_RELAXED);
+    arm_timer(cpu);
+
+    smp_int_mask_pop();
 }
 
 void sched_yield(thread_status_t status)
 {
-    spinlock_acquire(&slock);
+    // A workqueue worker that blocks in a work item lets another one of its
+    // pool take over.
+    bool worker_waits = sched_get_curr_thread()->worker
+                     && (status == THREAD_STATE_BLOCKED || status == THREAD_STATE_SLEEPING);
+    if (worker_waits)
+        workqueue_worker_sleeping(sched_get_curr_thread());
+
+    // Unmasked again by `__thread_context_switch` once the next thread runs.
+    arch_lcpu_int_mask();
+
     thread_t *old = sched_get_curr_thread();
-    old->last_ran = arch_timer_get_uptime_ns();
+    smp_cpu_t *cpu = this_cpu_ptr();
+    uint64_t now = arch_timer_get_uptime_ns();
+    bool requeue = old != cpu->idle_thread
+                && status != THREAD_STATE_SLEEPING
+                && status != THREAD_STATE_BLOCKED
+                && status != THREAD_STATE_TERMINATED;
+
+    // Sleeping is a wait that only the timer ends.
+    if (status == THREAD_STATE_SLEEPING)
+        begin_wait(old);
+
+    charge(cpu, old, now);
+    put_prev(cpu, old, requeue && cpumask_test(&old->affinity, cpu->id));
+    old->last_ran = now;
     old->status = status;
-    thread_t *new = pick_next_thread();
-    spinlock_release(&slock);
+    thread_t *new = pick_next_thread(cpu, ALL_CLASSES);
 
-    vm_addrspace_load(new->owner->as);
-    arch_thread_context_switch(&old->context, &new->context);
+    start_slice(cpu, new, requeue, now);
+    arm_timer(cpu);
+
+    switch_to(cpu, old, new);
+
+    if (worker_waits)
+        workqueue_worker_running(old);
+}
+
+// RCU work of both interrupts: report a quiescent state, or have the outermost
+// `rcu_read_unlock` come back to report it, and run the callbacks that are due.
+static void rcu_interrupt(smp_cpu_t *cpu, thread_t *curr)
+{
+    if (curr->rcu_nesting == 0)
+        rcu_quiescent();
+    else if (__atomic_load_n(&cpu->rcu.need_qs, __ATOMIC_RELAXED))
+        curr->rcu_resched = true;
+
+    rcu_run_callbacks();
+}
+
+// Timer interrupt: wake the sleepers that are due, and switch threads if the
+// slice is over, a higher class is waiting or the CPU was idling.
+static void timer_tick()
+{
+    thread_t *curr = sched_get_curr_thread();
+    smp_cpu_t *cpu = this_cpu_ptr();
+    cpu->runqueue.ticking = false;
+    rcu_interrupt(cpu, curr);
+
+    uint64_t now = arch_timer_get_uptime_ns();
+    idle_exit(cpu, now);
+    wake_sleepers(cpu, now);
+
+    if (curr == cpu->idle_thread || now >= cpu->runqueue.slice_end || cpu->runqueue.need_resched)
+    {
+        sched_preemt();
+        return;
+    }
+
+    // Woken threads wait for the end of the slice, which only starts now if
+    // the running thread had the CPU to itself.
+    if (cpu->runqueue.slice_end == UINT64_MAX)
+    {
+        charge(cpu, curr, now);
+        start_slice(cpu, curr, false, now);
+    }
+    arm_timer(cpu);
+}
+
+// Reschedule IPI: a thread was queued for this CPU while it was halted, or
+// one of a higher class than the running thread.
+static void resched_ipi()
+{
+    thread_t *curr = sched_get_curr_thread();
+    smp_cpu_t *cpu = this_cpu_ptr();
+    idle_exit(cpu, arch_timer_get_uptime_ns());
+    // Also sent to ask for a quiescent state or to run RCU callbacks.
+    rcu_interrupt(cpu, curr);
+
+    if (curr == cpu->idle_thread || cpu->runqueue.need_resched)
+        sched_preemt();
+}
+
+void sched_idle()
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+    smp_runqueue_t *rq = &cpu->runqueue;
+
+    while (true)
+    {
+        // Anything queued from here on sets the flag, run or steal what there
+        // is before.
+        __atomic_store_n(&rq->wake, false, __ATOMIC_SEQ_CST);
+        sched_yield(THREAD_STATE_READY);
+
+        arch_lcpu_int_mask();
+        rq->idle_start = arch_timer_get_uptime_ns();
+        __atomic_store_n(&rq->idle, true, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Sleepers are due on the timer, which is armed.
+        if (__atomic_load_n(&rq->length, __ATOMIC_RELAXED) == 0)
+            arch_lcpu_wait(&rq->wake);
+        else
+            arch_lcpu_int_unmask();
+
+        arch_lcpu_int_mask();
+        idle_exit(cpu, arch_timer_get_uptime_ns());
+        arch_lcpu_int_unmask();
+    }
+}
+
+// Statistics
+
+#define STAT_LINE_LEN 224 // Ten 64-bit numbers in decimal, with separators.
+
+static int stat_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
+                     uint64_t *out_bytes_read)
+{
+    // Past a few CPUs this outgrows the heap.
+    uint8_t order = pm_pagecount_to_order(CEIL((smp_cpus.length + 1) * STAT_LINE_LEN, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
+    page_t *text_page = pm_alloc(order);
+    if (!text_page)
+        return ENOMEM;
+    char *text = (char *)(text_page->addr + HHDM);
+    size_t size = pm_order_to_pagecount(order) * ARCH_PAGE_GRAN;
+
+    // `snprintf` returns what it would have written, keep `len` in bounds.
+    size_t len = snprintf(text, size, "cpu queued sleeping steals migrations boosts "
+                                      "idle_ms wakeups wake_avg_us wake_max_us\n");
+    len = MIN(len, size - 1);
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        smp_runqueue_t *rq = &cpu->runqueue;
+        size_t wakeups = __atomic_load_n(&rq->wakeups, __ATOMIC_RELAXED);
+        uint64_t latency = __atomic_load_n(&rq->wake_latency_ns, __ATOMIC_RELAXED);
+        len += snprintf(text + len, size - len, "%lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", cpu->id,
+                        __atomic_load_n(&rq->length, __ATOMIC_RELAXED),
+                        __atomic_load_n(&rq->sleeper_count, __ATOMIC_RELAXED),
+                        __atomic_load_n(&rq->steals, __ATOMIC_RELAXED),
+                        __atomic_load_n(&rq->migrations, __ATOMIC_RELAXED),
+                        __atomic_load_n(&rq->mlfq.boosts, __ATOMIC_RELAXED),
+                        __atomic_load_n(&rq->idle_ns, __ATOMIC_RELAXED) / 1000000,
+                        wakeups,
+                        wakeups ? latency / wakeups / 1000 : 0,
+                        __atomic_load_n(&rq->wake_latency_max_ns, __ATOMIC_RELAXED) / 1000);
+        len = MIN(len, size - 1);
+    }
+
+    size_t to_read = offset < len ? MIN(count, len - offset) : 0;
+    memcpy(buffer, text + offset, to_read);
+    pm_free(text_page);
+
+    *out_bytes_read = to_read;
+    return EOK;
+}
+
+static vnode_ops_t stat_ops = {
+    .read = stat_read
+};
+
+// Initialization
+
+void sched_init()
+{
+    spinlock_acquire(&boot_slock);
+
+    started = true;
+
+    list_node_t *n;
+    while ((n = list_pop_head(&boot_queue)))
+    {
+        thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+        smp_cpu_t *first = LIST_GET_CONTAINER(LIST_FIRST(&smp_cpus), smp_cpu_t, cpu_list_node);
+        rq_place(select_cpu(t, first), t, true);
+    }
+
+    spinlock_release(&boot_slock);
+
+    arch_timer_set_handler_per_cpu(timer_tick);
+    arch_lcpu_set_ipi_handler(resched_ipi);
+
+    if (!devfs_register_device("/dev/schedstat", VCHR, &stat_ops, NULL))
+        log(LOG_WARN, "Could not register /dev/schedstat.");
+
+    log(LOG_INFO, "Scheduler started with %lu run queues.", smp_cpus.length);
 }
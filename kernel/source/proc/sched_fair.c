@@ -0,0 +1,182 @@
+#include "proc/sched_class.h"
+
+#include "proc/proc.h"
+#include "proc/smp.h"
+#include "proc/thread.h"
+#include "utils/math.h"
+
+/*
+ * Weighted fair share, picking by earliest eligible virtual deadline.
+ *
+ * A thread's virtual runtime grows with the time it runs divided by its
+ * weight. A thread is eligible while its virtual runtime is at most the
+ * weighted average of the queue, that is while it received no more than its
+ * share; of those, the one whose slice is due first runs. Threads leaving the
+ * queue remember how far they were from the average (their lag) and are
+ * placed at the same distance when they come back, so sleeping neither earns
+ * nor costs CPU time beyond a couple of slices.
+ *
+ * The average is kept as a weighted sum relative to `base`, which follows the
+ * average, so that it does not overflow as virtual time grows. Virtual times
+ * are compared through signed differences.
+ */
+
+#define SLICE_NS (3 * 1000 * 1000)
+#define NICE_0_WEIGHT 1024
+
+// Weight of nice values -20 to 19; each step is about 10% of CPU time.
+static const uint32_t nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15
+};
+
+static inline uint64_t to_virtual(uint64_t ns, uint64_t weight)
+{
+    return ns * NICE_0_WEIGHT / weight;
+}
+
+static inline bool before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+static uint64_t avg_vruntime(sched_fair_rq_t *q)
+{
+    if (q->load == 0)
+        return q->base;
+    return q->base + q->vsum / (int64_t)q->load;
+}
+
+static bool eligible(sched_fair_rq_t *q, thread_t *t)
+{
+    return (int64_t)(t->vruntime - q->base) * (int64_t)q->load <= q->vsum;
+}
+
+static int64_t lag_of(sched_fair_rq_t *q, thread_t *t)
+{
+    if (q->load == 0)
+        return 0;
+
+    int64_t limit = to_virtual(2 * SLICE_NS, t->weight);
+    int64_t lag = (int64_t)(avg_vruntime(q) - t->vruntime);
+    return MIN(MAX(lag, -limit), limit);
+}
+
+static void fair_enqueue(smp_runqueue_t *rq, thread_t *t, bool wakeup)
+{
+    sched_fair_rq_t *q = &rq->fair;
+
+    if (wakeup)
+    {
+        int64_t nice = MIN(MAX(t->owner->sched_param, -20), 19);
+        t->weight = nice_to_weight[nice + 20];
+        t->vruntime = avg_vruntime(q) - t->lag;
+        t->vdeadline = t->vruntime + to_virtual(SLICE_NS, t->weight);
+    }
+
+    if (q->load == 0)
+    {
+        q->base = t->vruntime;
+        q->vsum = 0;
+    }
+    else
+    {
+        // Move the base up to the average.
+        uint64_t avg = avg_vruntime(q);
+        q->vsum -= (int64_t)(avg - q->base) * (int64_t)q->load;
+        q->base = avg;
+    }
+    q->vsum += (int64_t)(t->vruntime - q->base) * (int64_t)t->weight;
+    q->load += t->weight;
+
+    list_t *queue = &q->queue;
+    for (list_node_t *n = LIST_LAST(queue); n; n = n->prev)
+        if (!before(t->vdeadline, LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node)->vdeadline))
+        {
+            list_insert_after(queue, n, &t->sched_thread_list_node);
+            return;
+        }
+    list_prepend(queue, &t->sched_thread_list_node);
+}
+
+static void fair_dequeue(smp_runqueue_t *rq, thread_t *t)
+{
+    sched_fair_rq_t *q = &rq->fair;
+
+    t->lag = lag_of(q, t);
+
+    list_remove(&q->queue, &t->sched_thread_list_node);
+    q->vsum -= (int64_t)(t->vruntime - q->base) * (int64_t)t->weight;
+    q->load -= t->weight;
+}
+
+// The eligible thread with the earliest deadline.
+static thread_t *fair_pick_next(smp_runqueue_t *rq)
+{
+    sched_fair_rq_t *q = &rq->fair;
+
+    FOREACH(n, q->queue)
+    {
+        thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+        if (eligible(q, t))
+            return t;
+    }
+
+    // Rounding in the average can leave nobody eligible.
+    list_node_t *n = LIST_FIRST(&q->queue);
+    return n ? LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node) : NULL;
+}
+
+// The thread due last.
+static thread_t *fair_pick_steal(smp_runqueue_t *rq, size_t cpu)
+{
+    for (list_node_t *n = LIST_LAST(&rq->fair.queue); n; n = n->prev)
+    {
+        thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+        if (cpumask_test(&t->affinity, cpu))
+            return t;
+    }
+
+    return NULL;
+}
+
+static uint64_t fair_tick(smp_runqueue_t *rq, thread_t *t, uint64_t ran)
+{
+    sched_fair_rq_t *q = &rq->fair;
+
+    t->vruntime += to_virtual(ran, t->weight);
+    // Alone on the CPU, the running thread is what the average would be.
+    if (q->load == 0)
+        q->base = t->vruntime;
+
+    if (before(t->vruntime, t->vdeadline))
+        return (t->vdeadline - t->vruntime) * t->weight / NICE_0_WEIGHT;
+
+    // The slice is used up, start a new request.
+    t->vdeadline = t->vruntime + to_virtual(SLICE_NS, t->weight);
+    return 0;
+}
+
+static void fair_yield(smp_runqueue_t *rq, thread_t *t, bool stays)
+{
+    if (!stays)
+        t->lag = lag_of(&rq->fair, t);
+}
+
+const sched_class_t sched_class_fair = {
+    .name = "fair",
+    .id = 2,
+    .rank = 1,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_pick_next,
+    .pick_steal = fair_pick_steal,
+    .tick = fair_tick,
+    .yield = fair_yield
+};
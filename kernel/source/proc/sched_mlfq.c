@@ -0,0 +1,146 @@
+#include "proc/sched_class.h"
+
+#include "arch/timer.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
+#include "proc/thread.h"
+
+/*
+ * Multilevel feedback queue.
+ *
+ * Each level has a quantum, longer further down. The time a thread runs is
+ * charged to its level whenever it stops running, and once it has used up the
+ * quantum it moves down a level; threads that block early keep their level and
+ * the rest of their quantum. Every `BOOST_PERIOD_NS` all threads of a CPU go
+ * back to the top level, so demoted threads that turn interactive recover and
+ * batch threads are not starved.
+ */
+
+#define BOOST_PERIOD_NS (1000ull * 1000 * 1000)
+
+// Quantum of each level, in microseconds.
+static const uint32_t quantum_us[SCHED_MLFQ_LEVELS] = {
+    2000,  2000,  4000,  4000,  8000,  8000,  16000, 16000,
+    32000, 32000, 32000, 32000, 64000, 64000, 64000, 64000
+};
+
+static inline uint64_t quantum_ns(thread_t *t)
+{
+    return quantum_us[t->priority] * 1000ull;
+}
+
+static inline void reset_level(thread_t *t)
+{
+    t->priority = 0;
+    t->slice_used = 0;
+}
+
+static void boost(smp_runqueue_t *rq)
+{
+    sched_mlfq_rq_t *q = &rq->mlfq;
+
+    for (size_t lvl = 1; lvl < SCHED_MLFQ_LEVELS; lvl++)
+    {
+        list_node_t *n;
+        while ((n = list_pop_head(&q->levels[lvl])))
+        {
+            reset_level(LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node));
+            list_append(&q->levels[0], n);
+        }
+    }
+    q->level_mask = q->level_mask ? 1 : 0;
+
+    // Boosting does not change wake-up times, the heap stays in order.
+    for (size_t i = 0; i < rq->sleeper_count; i++)
+    {
+        thread_t *t = rq->sleepers[i].thread;
+        if (thread_in_wait(t, rq->sleepers[i].wait) && t->sched_class == &sched_class_mlfq)
+            reset_level(t);
+    }
+
+    thread_t *curr = sched_get_curr_thread();
+    if (curr->sched_class == &sched_class_mlfq)
+        reset_level(curr);
+
+    q->boosts++;
+}
+
+static void mlfq_enqueue(smp_runqueue_t *rq, thread_t *t, bool wakeup)
+{
+    sched_mlfq_rq_t *q = &rq->mlfq;
+
+    list_append(&q->levels[t->priority], &t->sched_thread_list_node);
+    q->level_mask |= 1u << t->priority;
+}
+
+static void mlfq_dequeue(smp_runqueue_t *rq, thread_t *t)
+{
+    sched_mlfq_rq_t *q = &rq->mlfq;
+
+    list_remove(&q->levels[t->priority], &t->sched_thread_list_node);
+    if (list_is_empty(&q->levels[t->priority]))
+        q->level_mask &= ~(1u << t->priority);
+}
+
+// The thread queued first on the highest level.
+static thread_t *mlfq_pick_next(smp_runqueue_t *rq)
+{
+    sched_mlfq_rq_t *q = &rq->mlfq;
+
+    uint64_t now = arch_timer_get_uptime_ns();
+    if (now >= q->next_boost)
+    {
+        boost(rq);
+        q->next_boost = now + BOOST_PERIOD_NS;
+    }
+
+    if (!q->level_mask)
+        return NULL;
+
+    list_t *level = &q->levels[__builtin_ctz(q->level_mask)];
+    return LIST_GET_CONTAINER(LIST_FIRST(level), thread_t, sched_thread_list_node);
+}
+
+// The thread queued last on the highest level, whose cache is the coldest.
+static thread_t *mlfq_pick_steal(smp_runqueue_t *rq, size_t cpu)
+{
+    uint32_t mask = rq->mlfq.level_mask;
+    while (mask)
+    {
+        size_t lvl = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        for (list_node_t *n = LIST_LAST(&rq->mlfq.levels[lvl]); n; n = n->prev)
+        {
+            thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+            if (cpumask_test(&t->affinity, cpu))
+                return t;
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t mlfq_tick(smp_runqueue_t *rq, thread_t *t, uint64_t ran)
+{
+    t->slice_used += ran;
+    if (t->slice_used < quantum_ns(t))
+        return quantum_ns(t) - t->slice_used;
+
+    t->slice_used = 0;
+    if (t->priority < SCHED_MLFQ_LEVELS - 1)
+        t->priority++;
+    return 0;
+}
+
+const sched_class_t sched_class_mlfq = {
+    .name = "mlfq",
+    .id = 1,
+    .rank = 1,
+    .enqueue = mlfq_enqueue,
+    .dequeue = mlfq_dequeue,
+    .pick_next = mlfq_pick_next,
+    .pick_steal = mlfq_pick_steal,
+    .tick = mlfq_tick,
+    .yield = NULL
+};
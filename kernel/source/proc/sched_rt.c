@@ -0,0 +1,74 @@
+#include "proc/sched_class.h"
+
+#include "arch/timer.h"
+#include "proc/proc.h"
+#include "proc/smp.h"
+#include "proc/thread.h"
+
+/*
+ * Real-time FIFO.
+ *
+ * Threads run until they block or yield, without a time slice. A process may
+ * give its threads a relative deadline, which is set from every wake-up; the
+ * queue runs the earliest deadline first and threads without one after those,
+ * in the order they were queued. Meant for few threads, queueing is linear.
+ */
+
+static void rt_enqueue(smp_runqueue_t *rq, thread_t *t, bool wakeup)
+{
+    if (wakeup)
+    {
+        int64_t relative = t->owner->sched_param;
+        t->rt_deadline = relative > 0 ? arch_timer_get_uptime_ns() + relative : UINT64_MAX;
+    }
+
+    list_t *queue = &rq->rt.queue;
+    for (list_node_t *n = LIST_LAST(queue); n; n = n->prev)
+        if (LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node)->rt_deadline <= t->rt_deadline)
+        {
+            list_insert_after(queue, n, &t->sched_thread_list_node);
+            return;
+        }
+    list_prepend(queue, &t->sched_thread_list_node);
+}
+
+static void rt_dequeue(smp_runqueue_t *rq, thread_t *t)
+{
+    list_remove(&rq->rt.queue, &t->sched_thread_list_node);
+}
+
+static thread_t *rt_pick_next(smp_runqueue_t *rq)
+{
+    list_node_t *n = LIST_FIRST(&rq->rt.queue);
+    return n ? LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node) : NULL;
+}
+
+// The most urgent thread, it would have to wait here anyway.
+static thread_t *rt_pick_steal(smp_runqueue_t *rq, size_t cpu)
+{
+    FOREACH(n, rq->rt.queue)
+    {
+        thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+        if (cpumask_test(&t->affinity, cpu))
+            return t;
+    }
+
+    return NULL;
+}
+
+static uint64_t rt_tick(smp_runqueue_t *rq, thread_t *t, uint64_t ran)
+{
+    return UINT64_MAX;
+}
+
+const sched_class_t sched_class_rt = {
+    .name = "rt",
+    .id = 0,
+    .rank = 0,
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick_next = rt_pick_next,
+    .pick_steal = rt_pick_steal,
+    .tick = rt_tick,
+    .yield = NULL
+};
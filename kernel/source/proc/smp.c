@@ -1,32 +1,102 @@
 #include "proc/smp.h"
 
 #include "arch/lcpu.h"
+#include "arch/types.h"
+#include "assert.h"
 #include "bootreq.h"
+#include "hhdm.h"
 #include "log.h"
-#include "mm/heap.h"
+#include "mm/kmem.h"
+#include "mm/pm.h"
 #include "panic.h"
+#include "proc/percpu.h"
 #include "proc/proc.h"
 #include "proc/sched.h"
 #include "proc/thread.h"
+#include "proc/workqueue.h"
+#include "sync/rcu.h"
+#include "utils/math.h"
 
 list_t smp_cpus = LIST_INIT;
 static proc_t *idle_proc;
 
 static spinlock_t slock;
 
+// CPU IDs index the per-CPU caches of kmem and vmem, and CPU masks.
+_Static_assert(MAX_CPUS <= CPUMASK_MAX_CPUS, "CPU IDs must fit in a CPU mask");
+
+static bool is_bsp(struct limine_mp_info *mp_info)
+{
+#if defined(__x86_64__)
+    return mp_info->lapic_id == bootreq_mp.response->bsp_lapic_id;
+#elif defined(__aarch64__)
+    return mp_info->mpidr == bootreq_mp.response->bsp_mpidr;
+#endif
+}
+
 [[noreturn]] [[gnu::noinline]] static void thread_idle_func(struct limine_mp_info *mp_info)
 {
+    // Before anything else, spinlocks already find their per-CPU state there.
+    arch_lcpu_percpu_init((smp_cpu_t *)mp_info->extra_argument);
+
     // Sequentially initializing CPU cores allows for easier debugging.
     spinlock_acquire(&slock);
 
-    arch_lcpu_thread_reg_write((size_t)mp_info->extra_argument);
     arch_lcpu_init();
-    log(LOG_INFO, "CPU #%02d initialized. Idling...", ((thread_t *)mp_info->extra_argument)->assigned_cpu->id);
+    rcu_cpu_online();
+    log(LOG_INFO, "CPU #%02d initialized. Idling...", this_cpu_read(id));
 
     spinlock_release(&slock);
 
-    while (true)
-        sched_yield(THREAD_STATE_READY);
+    sched_idle();
+}
+
+void smp_int_mask_push()
+{
+    bool enabled = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    // Safe to look up only now: with interrupts masked the thread can not
+    // be moved to another CPU.
+    smp_cpu_t *cpu = this_cpu_ptr();
+    if (cpu->int_mask_depth++ == 0)
+        cpu->int_mask_prev = enabled;
+}
+
+void smp_int_mask_pop()
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+    ASSERT(cpu->int_mask_depth > 0);
+
+    if (--cpu->int_mask_depth == 0 && cpu->int_mask_prev)
+        arch_lcpu_int_unmask();
+}
+
+uintptr_t smp_page_cache_alloc(smp_page_cache_id_t id, uint8_t order)
+{
+    smp_int_mask_push();
+    smp_page_cache_t *cache = &this_cpu_ptr()->page_caches[id];
+    uintptr_t addr = cache->count > 0 ? cache->blocks[--cache->count] : 0;
+    smp_int_mask_pop();
+
+    if (addr)
+        return addr;
+
+    page_t *page = pm_alloc(order);
+    return page ? page->addr + HHDM : 0;
+}
+
+void smp_page_cache_free(smp_page_cache_id_t id, uintptr_t addr, uint8_t order)
+{
+    smp_int_mask_push();
+    smp_page_cache_t *cache = &this_cpu_ptr()->page_caches[id];
+    bool kept = cache->count < SMP_PAGE_CACHE_SIZE;
+    if (kept)
+        cache->blocks[cache->count++] = addr;
+    smp_int_mask_pop();
+
+    if (!kept)
+        pm_free(pm_phys_to_page(addr - HHDM));
 }
 
 void smp_init()
@@ -36,34 +106,110 @@ void smp_init()
 
     idle_proc = proc_create("System Idle Process", false);
 
+    // CPUs past `MAX_CPUS` are left parked, the bootstrap processor is always
+    // among the ones brought up.
+    size_t count = MIN(bootreq_mp.response->cpu_count, MAX_CPUS);
+    if (bootreq_mp.response->cpu_count > MAX_CPUS)
+        log(LOG_WARN, "Only %d of %lu CPUs are brought up.", MAX_CPUS, bootreq_mp.response->cpu_count);
+
+    size_t id = 0;
+    size_t others = 0;
     for (size_t i = 0; i < bootreq_mp.response->cpu_count; i++)
     {
         struct limine_mp_info *mp_info = bootreq_mp.response->cpus[i];
+        mp_info->extra_argument = 0;
+        if (!is_bsp(mp_info) && others++ >= count - 1)
+            continue;
 
         thread_t *idle_thread = thread_create(idle_proc, (uintptr_t)&thread_idle_func);
-        smp_cpu_t *cpu = heap_alloc(sizeof(smp_cpu_t));
+        if (!idle_thread)
+            panic("Could not create the idle thread of CPU #%lu!", id);
+
+        // Each area gets pages of its own, so that no two CPUs write to the
+        // same cache line.
+        page_t *page = pm_alloc(pm_pagecount_to_order(CEIL(sizeof(smp_cpu_t), ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN));
+        if (!page)
+            panic("Could not allocate the per-CPU data of CPU #%lu!", id);
+        smp_cpu_t *cpu = (smp_cpu_t *)(page->addr + HHDM);
         *cpu = (smp_cpu_t) {
-            .id = i,
-            .idle_thread = idle_thread,
+            .self = cpu,
             .curr_thread = idle_thread,
+            .kernel_stack = 0,
+            .user_sp = 0,
+            .id = id++,
+            .idle_thread = idle_thread,
+            .runqueue = {
+                .rt = {
+                    .queue = LIST_INIT
+                },
+                .mlfq = {
+                    .levels = { [0 ... SCHED_MLFQ_LEVELS - 1] = LIST_INIT },
+                    .level_mask = 0,
+                    .next_boost = 0,
+                    .boosts = 0
+                },
+                .fair = {
+                    .queue = LIST_INIT,
+                    .load = 0,
+                    .base = 0,
+                    .vsum = 0
+                },
+                .length = 0,
+                .class_length = {},
+                .class_vtime = {},
+                .steals = 0,
+                .migrations = 0,
+                .curr_rank = SIZE_MAX,
+                .need_resched = false,
+                .slock = SPINLOCK_INIT_NAMED("runqueue"),
+                .sleepers = NULL,
+                .sleeper_count = 0,
+                .sleeper_capacity = 0,
+                .ticking = false,
+                .run_start = 0,
+                .slice_end = 0,
+                .idle = false,
+                .wake = false,
+                .idle_start = 0,
+                .wake_sent = 0,
+                .idle_ns = 0,
+                .wakeups = 0,
+                .wake_latency_ns = 0,
+                .wake_latency_max_ns = 0
+            },
+            .topology = { 0 },
+            .int_mask_depth = 0,
+            .int_mask_prev = false,
+            .spin_node = { .next = NULL, .head = false },
+            .page_caches = { [0 ... SMP_PAGE_CACHE_COUNT - 1] = { .count = 0 } },
+            .rwlock_readers = { 0 },
+            .rcu = {
+                .online = false,
+                .need_qs = false,
+                .next = LIST_INIT,
+                .wait = LIST_INIT,
+                .wait_gp = 0
+            },
+            .wq_pool = NULL,
             .cpu_list_node = LIST_NODE_INIT
         };
         list_append(&smp_cpus, &cpu->cpu_list_node);
         idle_thread->assigned_cpu = cpu;
 
-        mp_info->extra_argument = (uint64_t)idle_thread;
+        mp_info->extra_argument = (uint64_t)cpu;
     }
 
+    workqueue_init_cpus();
+    sched_init();
+
     struct limine_mp_info *bsp_mp_info;
     for (size_t i = 0; i < bootreq_mp.response->cpu_count; i++)
     {
         struct limine_mp_info *mp_info = bootreq_mp.response->cpus[i];
+        if (!mp_info->extra_argument)
+            continue;
 
-#if defined(__x86_64__)
-        if (mp_info->lapic_id == bootreq_mp.response->bsp_lapic_id)
-#elif defined(__aarch64__)
-        if (mp_info->mpidr == bootreq_mp.response->bsp_mpidr)
-#endif
+        if (is_bsp(mp_info))
         {
             bsp_mp_info = mp_info;
             continue;
@@ -3,6 +3,15 @@
 #include "proc/thread.h"
 
 #include "mm/heap.h"
+#include "proc/sched.h"
+
+/*
+ * A thread is referenced by the scheduler until it exits, and by whoever took
+ * a reference to join it or look at it. Once an exited thread has stopped
+ * running, the scheduler reaps it: its kernel stack and FPU area go back to
+ * the per-CPU caches right away, and the `thread_t` itself, which comes from
+ * the heap's per-CPU magazines, is freed with the last reference.
+ */
 
 static uint64_t next_tid = 0;
 static spinlock_t slock = SPINLOCK_INIT;
@@ -10,17 +19,42 @@ static spinlock_t slock = SPINLOCK_INIT;
 thread_t *thread_create(proc_t *proc, uintptr_t entry)
 {
     thread_t *thread = heap_alloc(sizeof(thread_t));
+    if (!thread)
+        return NULL;
+
     *thread = (thread_t) {
         .tid = next_tid,
         .owner = proc,
-        .priority = 0,
         .status = THREAD_STATE_NEW,
+        .wait_state = THREAD_WAIT_WOKEN,
         .assigned_cpu = NULL,
+        .affinity = CPUMASK_ALL,
+        .sched_class = NULL,
+        .priority = 0,
+        .slice_used = 0,
+        .weight = 0,
+        .vruntime = 0,
+        .vdeadline = 0,
+        .lag = 0,
+        .rt_deadline = UINT64_MAX,
+        .boost_rank = SIZE_MAX,
+        .pi_held = 0,
+        .on_rq = false,
+        .rcu_nesting = 0,
+        .rcu_resched = false,
+        .worker = NULL,
         .proc_thread_list_node = LIST_NODE_INIT,
         .sched_thread_list_node = LIST_NODE_INIT,
+        .reaped = false,
+        .join_slock = SPINLOCK_INIT,
+        .joiners = WAITQUEUE_INIT,
         .ref_count = 1
     };
-    arch_thread_context_init(&thread->context, proc->as, proc->user, entry);
+    if (!arch_thread_context_init(&thread->context, proc->as, proc->user, entry))
+    {
+        heap_free(thread);
+        return NULL;
+    }
 
     spinlock_acquire(&slock);
     next_tid++;
@@ -33,8 +67,48 @@ thread_t *thread_create(proc_t *proc, uintptr_t entry)
     return thread;
 }
 
+void thread_ref(thread_t *thread)
+{
+    __atomic_fetch_add(&thread->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+void thread_unref(thread_t *thread)
+{
+    if (__atomic_sub_fetch(&thread->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+        thread_destroy(thread);
+}
+
+void thread_reap(thread_t *thread)
+{
+    ASSERT(thread->status == THREAD_STATE_TERMINATED && !thread->reaped);
+
+    spinlock_acquire(&thread->owner->slock);
+    list_remove(&thread->owner->threads, &thread->proc_thread_list_node);
+    spinlock_release(&thread->owner->slock);
+
+    arch_thread_context_fini(&thread->context);
+
+    spinlock_acquire(&thread->join_slock);
+    __atomic_store_n(&thread->reaped, true, __ATOMIC_RELEASE);
+    waitqueue_wake_all(&thread->joiners);
+    spinlock_release(&thread->join_slock);
+
+    thread_unref(thread);
+}
+
+void thread_join(thread_t *thread)
+{
+    spinlock_acquire(&thread->join_slock);
+    while (!thread->reaped)
+        waitqueue_wait(&thread->joiners, &thread->join_slock, UINT64_MAX);
+    spinlock_release(&thread->join_slock);
+
+    thread_unref(thread);
+}
+
 void thread_destroy(thread_t *thread)
 {
-    ASSERT(thread && thread->status == THREAD_STATE_TERMINATED);
+    ASSERT(thread && thread->reaped && thread->ref_count == 0);
 
+    heap_free(thread);
 }
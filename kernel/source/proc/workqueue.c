@@ -0,0 +1,405 @@
+#include "proc/workqueue.h"
+
+#include "arch/lcpu.h"
+#include "arch/timer.h"
+#include "log.h"
+#include "mm/heap.h"
+#include "panic.h"
+#include "proc/cpumask.h"
+#include "proc/percpu.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
+#include "proc/thread.h"
+
+/*
+ * Each pool counts the workers running work and not blocked. The scheduler
+ * tells the pool when a worker inside a work item blocks and when it runs
+ * again, and the pool wakes an idle worker as long as fewer than
+ * `max_running` run and there is work. A worker that takes work while no
+ * other one idles adds a worker first, so that the next one to block can be
+ * covered. Workers idle for `IDLE_RETIRE_NS` exit, down to one per pool.
+ *
+ * Delayed work waits in a list by due time. One idle worker of the pool waits
+ * on `timer_wq` until the first item is due, the others on `idle_wq` with no
+ * deadline but their retirement. Every worker moves what is due over to the
+ * work list before it looks for work.
+ */
+
+#define MAX_WORKERS 32
+#define IDLE_RETIRE_NS (5ull * 1000 * 1000 * 1000)
+
+struct workqueue_pool
+{
+    smp_cpu_t *cpu;       // CPU the workers are bound to, NULL if unbound.
+    list_t worklist;      // Work to run, in the order it was queued.
+    list_t delayed;       // Delayed work by due time.
+    size_t max_running;   // Workers that may run work at once.
+    size_t running;       // Workers inside a work item and not blocked.
+    size_t workers;       // All workers, including the ones starting.
+    size_t idle;          // Workers waiting on `idle_wq` or `timer_wq`.
+    size_t starting;      // Workers created that did not run yet.
+    bool timer_armed;     // A worker waits on `timer_wq`.
+    spinlock_t slock;
+    waitqueue_t idle_wq;
+    waitqueue_t timer_wq;
+};
+
+typedef struct workqueue_worker
+{
+    workqueue_pool_t *pool;
+    bool busy;     // Inside a work item.
+    bool sleeping; // Blocked inside a work item, not counted as running.
+}
+worker_t;
+
+workqueue_t workqueue_system;
+workqueue_t workqueue_unbound;
+
+static proc_t *worker_proc;
+static workqueue_pool_t unbound_pool;
+
+// Pools. The lock must be held.
+
+// Get work going: wake a worker if there is room for one more to run.
+static void kick(workqueue_pool_t *pool)
+{
+    if (pool->running >= pool->max_running || list_is_empty(&pool->worklist))
+        return;
+
+    if (!waitqueue_wake_one(&pool->idle_wq))
+        waitqueue_wake_one(&pool->timer_wq);
+}
+
+static void promote_delayed(workqueue_pool_t *pool, uint64_t now)
+{
+    list_node_t *n;
+    while ((n = LIST_FIRST(&pool->delayed))
+    &&     LIST_GET_CONTAINER(n, work_t, list_node)->due <= now)
+    {
+        list_pop_head(&pool->delayed);
+        LIST_GET_CONTAINER(n, work_t, list_node)->due = 0;
+        list_append(&pool->worklist, n);
+    }
+}
+
+static void insert_delayed(workqueue_pool_t *pool, work_t *work)
+{
+    list_node_t *pos = LIST_FIRST(&pool->delayed);
+    while (pos && LIST_GET_CONTAINER(pos, work_t, list_node)->due <= work->due)
+        pos = pos->next;
+
+    if (pos)
+        list_insert_before(&pool->delayed, pos, &work->list_node);
+    else
+        list_append(&pool->delayed, &work->list_node);
+
+    // The timer worker waits for something later, or there is none yet.
+    if (LIST_FIRST(&pool->delayed) == &work->list_node
+    &&  !waitqueue_wake_one(&pool->timer_wq))
+        waitqueue_wake_one(&pool->idle_wq);
+}
+
+// Workers
+
+[[noreturn]] static void worker_main();
+
+// Start a worker already counted in `workers` and `starting`. Takes it off the
+// counts again and returns false if out of memory.
+static bool create_worker(workqueue_pool_t *pool)
+{
+    worker_t *w = heap_alloc(sizeof(worker_t));
+    thread_t *t = w ? thread_create(worker_proc, (uintptr_t)&worker_main) : NULL;
+    if (!t)
+    {
+        if (w)
+            heap_free(w);
+
+        spinlock_acquire(&pool->slock);
+        pool->workers--;
+        pool->starting--;
+        spinlock_release(&pool->slock);
+        return false;
+    }
+
+    *w = (worker_t) {
+        .pool = pool,
+        .busy = false,
+        .sleeping = false
+    };
+    t->worker = w;
+    if (pool->cpu)
+    {
+        cpumask_t mask = { 0 };
+        cpumask_set(&mask, pool->cpu->id);
+        sched_set_affinity(t, &mask);
+    }
+    sched_enqueue(t);
+    return true;
+}
+
+static void work_done(workqueue_t *wq)
+{
+    spinlock_acquire(&wq->slock);
+    if (--wq->in_flight == 0)
+        waitqueue_wake_all(&wq->flushers);
+    spinlock_release(&wq->slock);
+}
+
+[[noreturn]] static void worker_main()
+{
+    thread_t *self = sched_get_curr_thread();
+    worker_t *w = self->worker;
+    workqueue_pool_t *pool = w->pool;
+
+    spinlock_acquire(&pool->slock);
+    pool->starting--;
+    while (true)
+    {
+        promote_delayed(pool, arch_timer_get_uptime_ns());
+
+        list_node_t *n = LIST_FIRST(&pool->worklist);
+        if (n && pool->running < pool->max_running)
+        {
+            list_pop_head(&pool->worklist);
+            work_t *work = LIST_GET_CONTAINER(n, work_t, list_node);
+            workqueue_t *wq = work->wq;
+            work->pool = NULL;
+            __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+
+            pool->running++;
+            w->busy = true;
+            bool grow = pool->idle + pool->starting == 0 && pool->workers < MAX_WORKERS;
+            if (grow)
+            {
+                pool->workers++;
+                pool->starting++;
+            }
+            // There may be room for more, with `max_running` above one.
+            kick(pool);
+            spinlock_release(&pool->slock);
+
+            // Should that fail, the next item taken tries again.
+            if (grow)
+                create_worker(pool);
+
+            // `work` may be freed or queued again from here on.
+            work->func(work);
+            work_done(wq);
+
+            spinlock_acquire(&pool->slock);
+            w->busy = false;
+            pool->running--;
+            continue;
+        }
+
+        // Nothing to do: wait for work, or for the first delayed item.
+        bool timer = !pool->timer_armed && !list_is_empty(&pool->delayed);
+        uint64_t deadline;
+        if (timer)
+        {
+            pool->timer_armed = true;
+            deadline = LIST_GET_CONTAINER(LIST_FIRST(&pool->delayed), work_t, list_node)->due;
+        }
+        else
+            deadline = arch_timer_get_uptime_ns() + IDLE_RETIRE_NS;
+
+        pool->idle++;
+        bool woken = waitqueue_wait(timer ? &pool->timer_wq : &pool->idle_wq, &pool->slock, deadline);
+        pool->idle--;
+        if (timer)
+        {
+            pool->timer_armed = false;
+            continue;
+        }
+
+        if (!woken && pool->workers > 1 && list_is_empty(&pool->worklist))
+            break;
+    }
+
+    pool->workers--;
+    spinlock_release(&pool->slock);
+
+    self->worker = NULL;
+    heap_free(w);
+    sched_yield(THREAD_STATE_TERMINATED);
+    unreachable();
+}
+
+void workqueue_worker_sleeping(thread_t *t)
+{
+    worker_t *w = t->worker;
+    if (!w->busy)
+        return;
+
+    workqueue_pool_t *pool = w->pool;
+    spinlock_acquire(&pool->slock);
+    w->sleeping = true;
+    pool->running--;
+    kick(pool);
+    spinlock_release(&pool->slock);
+}
+
+void workqueue_worker_running(thread_t *t)
+{
+    worker_t *w = t->worker;
+    if (!w->sleeping)
+        return;
+
+    workqueue_pool_t *pool = w->pool;
+    spinlock_acquire(&pool->slock);
+    w->sleeping = false;
+    pool->running++;
+    spinlock_release(&pool->slock);
+}
+
+// API
+
+// Claim `work` for `wq` and pick its pool. Interrupts must be masked, so that
+// the pool is the one of the CPU the thread is on.
+static workqueue_pool_t *claim(workqueue_t *wq, work_t *work)
+{
+    if (__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    spinlock_acquire(&wq->slock);
+    wq->in_flight++;
+    spinlock_release(&wq->slock);
+    work->wq = wq;
+
+    workqueue_pool_t *pool = wq->unbound ? NULL : this_cpu_read(wq_pool);
+    return pool ? pool : &unbound_pool;
+}
+
+bool workqueue_queue(workqueue_t *wq, work_t *work)
+{
+    smp_int_mask_push();
+    workqueue_pool_t *pool = claim(wq, work);
+    if (pool)
+    {
+        spinlock_acquire(&pool->slock);
+        __atomic_store_n(&work->pool, pool, __ATOMIC_RELAXED);
+        work->due = 0;
+        list_append(&pool->worklist, &work->list_node);
+        kick(pool);
+        spinlock_release(&pool->slock);
+    }
+    smp_int_mask_pop();
+
+    return pool != NULL;
+}
+
+bool workqueue_queue_delayed(workqueue_t *wq, work_t *work, uint64_t delay_ns)
+{
+    if (delay_ns == 0)
+        return workqueue_queue(wq, work);
+
+    smp_int_mask_push();
+    workqueue_pool_t *pool = claim(wq, work);
+    if (pool)
+    {
+        spinlock_acquire(&pool->slock);
+        __atomic_store_n(&work->pool, pool, __ATOMIC_RELAXED);
+        work->due = arch_timer_get_uptime_ns() + delay_ns;
+        insert_delayed(pool, work);
+        spinlock_release(&pool->slock);
+    }
+    smp_int_mask_pop();
+
+    return pool != NULL;
+}
+
+bool workqueue_cancel(work_t *work)
+{
+    // Between being claimed and put on its pool, the work has no pool yet.
+    while (__atomic_load_n(&work->pending, __ATOMIC_ACQUIRE))
+    {
+        workqueue_pool_t *pool = __atomic_load_n(&work->pool, __ATOMIC_RELAXED);
+        if (!pool)
+        {
+            arch_lcpu_relax();
+            continue;
+        }
+
+        spinlock_acquire(&pool->slock);
+        bool queued = work->pool == pool;
+        workqueue_t *wq = work->wq;
+        if (queued)
+        {
+            list_remove(work->due ? &pool->delayed : &pool->worklist, &work->list_node);
+            work->pool = NULL;
+            work->due = 0;
+            __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+        }
+        spinlock_release(&pool->slock);
+
+        if (queued)
+        {
+            work_done(wq);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void workqueue_flush(workqueue_t *wq)
+{
+    spinlock_acquire(&wq->slock);
+    while (wq->in_flight > 0)
+        waitqueue_wait(&wq->flushers, &wq->slock, UINT64_MAX);
+    spinlock_release(&wq->slock);
+}
+
+// Initialization
+
+static void pool_init(workqueue_pool_t *pool, smp_cpu_t *cpu, size_t max_running)
+{
+    *pool = (workqueue_pool_t) {
+        .cpu = cpu,
+        .worklist = LIST_INIT,
+        .delayed = LIST_INIT,
+        .max_running = max_running,
+        .running = 0,
+        .workers = 1,
+        .idle = 0,
+        .starting = 1,
+        .timer_armed = false,
+        .slock = SPINLOCK_INIT_NAMED("workqueue_pool"),
+        .idle_wq = WAITQUEUE_INIT,
+        .timer_wq = WAITQUEUE_INIT
+    };
+    if (!create_worker(pool))
+        panic("Could not create the first worker of a workqueue pool!");
+}
+
+void workqueue_init()
+{
+    workqueue_system = WORKQUEUE_INIT("system", false);
+    workqueue_unbound = WORKQUEUE_INIT("unbound", true);
+
+    worker_proc = proc_create("kworker", false);
+    pool_init(&unbound_pool, NULL, 1);
+}
+
+void workqueue_init_cpus()
+{
+    size_t count = 0;
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        workqueue_pool_t *pool = heap_alloc(sizeof(workqueue_pool_t));
+        if (!pool)
+            panic("Could not allocate the workqueue pool of CPU #%lu!", cpu->id);
+        pool_init(pool, cpu, 1);
+        __atomic_store_n(&cpu->wq_pool, pool, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    spinlock_acquire(&unbound_pool.slock);
+    unbound_pool.max_running = count;
+    kick(&unbound_pool);
+    spinlock_release(&unbound_pool.slock);
+
+    log(LOG_INFO, "Workqueues started with %lu per-CPU pools.", count);
+}
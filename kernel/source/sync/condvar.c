@@ -0,0 +1,43 @@
+#include "sync/condvar.h"
+
+/*
+ * The mutex is released before the queue's lock is taken, since releasing it
+ * may yield. A signal in between bumps the sequence number, which the waiter
+ * read while holding the mutex, and the waiter then does not block at all.
+ */
+
+bool condvar_wait_until(condvar_t *cv, mutex_t *mutex, uint64_t deadline)
+{
+    uint64_t seq = __atomic_load_n(&cv->seq, __ATOMIC_ACQUIRE);
+    mutex_release(mutex);
+
+    bool signaled = true;
+    spinlock_acquire(&cv->slock);
+    if (cv->seq == seq)
+        signaled = waitqueue_wait(&cv->waiters, &cv->slock, deadline);
+    spinlock_release(&cv->slock);
+
+    mutex_acquire(mutex);
+    return signaled;
+}
+
+void condvar_wait(condvar_t *cv, mutex_t *mutex)
+{
+    condvar_wait_until(cv, mutex, UINT64_MAX);
+}
+
+void condvar_signal(condvar_t *cv)
+{
+    spinlock_acquire(&cv->slock);
+    __atomic_store_n(&cv->seq, cv->seq + 1, __ATOMIC_RELEASE);
+    waitqueue_wake_one(&cv->waiters);
+    spinlock_release(&cv->slock);
+}
+
+void condvar_broadcast(condvar_t *cv)
+{
+    spinlock_acquire(&cv->slock);
+    __atomic_store_n(&cv->seq, cv->seq + 1, __ATOMIC_RELEASE);
+    waitqueue_wake_all(&cv->waiters);
+    spinlock_release(&cv->slock);
+}
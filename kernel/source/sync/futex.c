@@ -0,0 +1,272 @@
+#include "sync/futex.h"
+
+#include "arch/timer.h"
+#include "proc/sched.h"
+#include "proc/thread.h"
+#include "sync/spinlock.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+
+/*
+ * Waiters are kept in a fixed table of buckets by hash of their key, each a
+ * list under its own lock, so that waking only goes through the waiters that
+ * share a bucket. The word is compared under the same lock, which is what
+ * keeps a wake-up between the comparison and the waiter blocking from being
+ * lost. The word is read again under the lock without faulting; should its
+ * page have gone in the meantime, or a shared futex's page have changed, the
+ * key is made again.
+ *
+ * A waiter lives on the stack of its thread and points at the bucket it is
+ * queued in. Wakers clear the pointer once they are done with the waiter, and
+ * from then on the thread may return: a thread that finds itself still queued
+ * after blocking timed out. Requeueing moves waiters to another bucket, which
+ * is why the pointer is checked again once its lock is held.
+ */
+
+#define BUCKET_BITS 8
+#define BUCKET_COUNT (1 << BUCKET_BITS)
+
+typedef struct
+{
+    vm_addrspace_t *as; // NULL for shared futexes.
+    uintptr_t addr;     // Virtual address, or physical for shared futexes.
+}
+futex_key_t;
+
+typedef struct
+{
+    spinlock_t slock;
+    list_t waiters; // In the order they started waiting.
+}
+bucket_t;
+
+typedef struct
+{
+    futex_key_t key;
+    thread_t *thread;
+    bucket_t *bucket; // NULL once woken.
+    list_node_t list_node;
+}
+waiter_t;
+
+static bucket_t buckets[BUCKET_COUNT];
+
+static inline bool key_equal(futex_key_t a, futex_key_t b)
+{
+    return a.as == b.as && a.addr == b.addr;
+}
+
+static bucket_t *bucket_of(futex_key_t key)
+{
+    uint64_t hash = ((uint64_t)key.addr >> 2) ^ ((uint64_t)(uintptr_t)key.as >> 4);
+    hash *= 0x9E3779B97F4A7C15ull;
+    return &buckets[hash >> (64 - BUCKET_BITS)];
+}
+
+// Futexes are faulted in for writing, so that the word is in the page it stays
+// in rather than the zero page or a page about to be copied, which for shared
+// futexes is the key.
+static int get_key(vm_addrspace_t *as, uintptr_t uaddr, bool shared, futex_key_t *out_key)
+{
+    if (uaddr % sizeof(uint32_t) != 0)
+        return EINVAL;
+
+    uintptr_t phys;
+    if (!vm_user_to_phys(as, uaddr, true, &phys))
+        return EFAULT;
+
+    *out_key = shared ? (futex_key_t) { .as = NULL, .addr = phys }
+                      : (futex_key_t) { .as = as, .addr = uaddr };
+    return EOK;
+}
+
+// Read the word at `uaddr` under the lock of the bucket of `key`. Returns false
+// if it is no longer mapped where the key was made.
+static bool load_word(vm_addrspace_t *as, uintptr_t uaddr, futex_key_t key, uint32_t *out)
+{
+    uintptr_t phys;
+    return vm_user_load_u32(as, uaddr, out, &phys) && (key.as || phys == key.addr);
+}
+
+// Locks of two buckets, taken in address order.
+
+static void lock_pair(bucket_t *a, bucket_t *b)
+{
+    if (a > b)
+    {
+        bucket_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    spinlock_acquire(&a->slock);
+    if (b != a)
+        spinlock_acquire(&b->slock);
+}
+
+static void unlock_pair(bucket_t *a, bucket_t *b)
+{
+    if (a > b)
+    {
+        bucket_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    if (b != a)
+        spinlock_release(&b->slock);
+    spinlock_release(&a->slock);
+}
+
+// Wake the first `count` waiters on `key`. The lock of `b` must be held.
+static size_t wake_locked(bucket_t *b, futex_key_t key, size_t count)
+{
+    size_t woken = 0;
+    list_node_t *n = LIST_FIRST(&b->waiters);
+    while (n && woken < count)
+    {
+        list_node_t *next = n->next;
+        waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+        if (key_equal(w->key, key))
+        {
+            list_remove(&b->waiters, n);
+            sched_wake(w->thread);
+            // The waiter may be gone as soon as this is seen.
+            __atomic_store_n(&w->bucket, NULL, __ATOMIC_RELEASE);
+            woken++;
+        }
+        n = next;
+    }
+
+    return woken;
+}
+
+int futex_wait(vm_addrspace_t *as, uintptr_t uaddr, uint32_t val, uint64_t timeout_ns, bool shared)
+{
+    futex_key_t key;
+    bucket_t *b;
+    uint32_t word;
+    while (true)
+    {
+        int err = get_key(as, uaddr, shared, &key);
+        if (err != EOK)
+            return err;
+
+        b = bucket_of(key);
+        spinlock_acquire(&b->slock);
+        if (load_word(as, uaddr, key, &word))
+            break;
+        spinlock_release(&b->slock);
+    }
+
+    uint64_t deadline = UINT64_MAX;
+    if (timeout_ns != UINT64_MAX)
+    {
+        uint64_t now = arch_timer_get_uptime_ns();
+        deadline = timeout_ns < UINT64_MAX - now ? now + timeout_ns : UINT64_MAX;
+    }
+
+    if (word != val)
+    {
+        spinlock_release(&b->slock);
+        return EAGAIN;
+    }
+
+    waiter_t w = {
+        .key = key,
+        .thread = sched_get_curr_thread(),
+        .bucket = b,
+        .list_node = LIST_NODE_INIT
+    };
+    list_append(&b->waiters, &w.list_node);
+    sched_prepare_block();
+    spinlock_release(&b->slock);
+
+    sched_block(deadline);
+
+    while ((b = __atomic_load_n(&w.bucket, __ATOMIC_ACQUIRE)))
+    {
+        spinlock_acquire(&b->slock);
+        if (w.bucket == b)
+        {
+            list_remove(&b->waiters, &w.list_node);
+            spinlock_release(&b->slock);
+            return ETIMEDOUT;
+        }
+        spinlock_release(&b->slock);
+    }
+
+    return EOK;
+}
+
+int futex_wake(vm_addrspace_t *as, uintptr_t uaddr, size_t count, bool shared, size_t *out_woken)
+{
+    futex_key_t key;
+    int err = get_key(as, uaddr, shared, &key);
+    if (err != EOK)
+        return err;
+
+    bucket_t *b = bucket_of(key);
+    spinlock_acquire(&b->slock);
+    *out_woken = wake_locked(b, key, count);
+    spinlock_release(&b->slock);
+
+    return EOK;
+}
+
+int futex_requeue(vm_addrspace_t *as, uintptr_t uaddr, size_t count, uintptr_t uaddr2, size_t requeue,
+                  uint32_t val, bool shared, size_t *out_moved)
+{
+    futex_key_t key, key2;
+    bucket_t *b, *b2;
+    uint32_t word, word2;
+    while (true)
+    {
+        int err = get_key(as, uaddr, shared, &key);
+        if (err == EOK)
+            err = get_key(as, uaddr2, shared, &key2);
+        if (err != EOK)
+            return err;
+
+        b = bucket_of(key);
+        b2 = bucket_of(key2);
+        lock_pair(b, b2);
+        // The second word is only read to see that its key still holds.
+        if (load_word(as, uaddr, key, &word) && load_word(as, uaddr2, key2, &word2))
+            break;
+        unlock_pair(b, b2);
+    }
+
+    if (word != val)
+    {
+        unlock_pair(b, b2);
+        return EAGAIN;
+    }
+
+    size_t moved = wake_locked(b, key, count);
+
+    size_t requeued = 0;
+    list_node_t *n = LIST_FIRST(&b->waiters);
+    while (n && requeued < requeue)
+    {
+        list_node_t *next = n->next;
+        waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+        if (key_equal(w->key, key))
+        {
+            w->key = key2;
+            if (b2 != b)
+            {
+                list_remove(&b->waiters, n);
+                list_append(&b2->waiters, n);
+                __atomic_store_n(&w->bucket, b2, __ATOMIC_RELAXED);
+            }
+            requeued++;
+        }
+        n = next;
+    }
+
+    unlock_pair(b, b2);
+
+    *out_moved = moved + requeued;
+    return EOK;
+}
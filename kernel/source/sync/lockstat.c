@@ -0,0 +1,190 @@
+#include "sync/lockstat.h"
+
+#ifdef LOCKSTAT
+
+#include "arch/lcpu.h"
+#include "arch/types.h"
+#include "fs/devfs.h"
+#include "hhdm.h"
+#include "log.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "proc/cpumask.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
+#include "uapi/errno.h"
+#include "utils/math.h"
+#include "utils/printf.h"
+#include "utils/string.h"
+
+/*
+ * Each CPU has a row of counters, indexed by CPU ID, so no two CPUs write to
+ * the same cache line. A lock looks its name up on its first acquisition and
+ * keeps the index; names past `LOCKSTAT_MAX_NAMES` are not counted.
+ */
+
+#define REPORT_TOP 32
+
+#define ID_FULL UINT32_MAX
+
+typedef struct
+{
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spin_cycles;
+    uint64_t hold_max_cycles;
+}
+counters_t;
+
+static spinlock_t names_slock = SPINLOCK_INIT;
+static const char *names[LOCKSTAT_MAX_NAMES];
+static size_t name_count = 0;
+
+static counters_t counters[CPUMASK_MAX_CPUS][LOCKSTAT_MAX_NAMES];
+
+static uint32_t lookup_id(volatile spinlock_t *slock)
+{
+    uint32_t id = __atomic_load_n(&slock->stat_id, __ATOMIC_RELAXED);
+    if (id)
+        return id;
+
+    const char *name = slock->stat_name;
+
+    spinlock_primitive_acquire(&names_slock);
+    size_t i = 0;
+    while (i < name_count && strcmp(names[i], name) != 0)
+        i++;
+    if (i == name_count && name_count < LOCKSTAT_MAX_NAMES)
+        names[name_count++] = name;
+    spinlock_primitive_release(&names_slock);
+
+    id = i < LOCKSTAT_MAX_NAMES ? i + 1 : ID_FULL;
+    __atomic_store_n(&slock->stat_id, id, __ATOMIC_RELAXED);
+    return id;
+}
+
+// Only the owning CPU writes, readers may see counters of different moments.
+static inline void add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline counters_t *cpu_counters(uint32_t id)
+{
+    return &counters[this_cpu_read(id)][id - 1];
+}
+
+void lockstat_acquired(volatile spinlock_t *slock, bool contended, uint64_t spin_cycles)
+{
+    uint32_t id = lookup_id(slock);
+    slock->stat_since = arch_lcpu_cycles();
+    if (id == ID_FULL)
+        return;
+
+    counters_t *c = cpu_counters(id);
+    add(&c->acquisitions, 1);
+    if (contended)
+    {
+        add(&c->contended, 1);
+        add(&c->spin_cycles, spin_cycles);
+    }
+}
+
+void lockstat_released(volatile spinlock_t *slock)
+{
+    // Released on the CPU that took it, interrupts were masked since.
+    uint32_t id = slock->stat_id;
+    if (id == ID_FULL)
+        return;
+
+    uint64_t held = arch_lcpu_cycles() - slock->stat_since;
+    counters_t *c = cpu_counters(id);
+    if (held > c->hold_max_cycles)
+        __atomic_store_n(&c->hold_max_cycles, held, __ATOMIC_RELAXED);
+}
+
+// Report
+
+typedef struct
+{
+    const char *name;
+    counters_t sum;
+}
+entry_t;
+
+static bool ranks_before(const entry_t *a, const entry_t *b)
+{
+    if (a->sum.contended != b->sum.contended)
+        return a->sum.contended > b->sum.contended;
+    return a->sum.spin_cycles > b->sum.spin_cycles;
+}
+
+static int report_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
+                       uint64_t *out_bytes_read)
+{
+    page_t *entries_page = pm_alloc(0);
+    page_t *text_page = pm_alloc(0);
+    if (!entries_page || !text_page)
+    {
+        if (entries_page)
+            pm_free(entries_page);
+        if (text_page)
+            pm_free(text_page);
+        return ENOMEM;
+    }
+    entry_t *entries = (entry_t *)(entries_page->addr + HHDM);
+    char *text = (char *)(text_page->addr + HHDM);
+
+    size_t n = __atomic_load_n(&name_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++)
+    {
+        entry_t e = { .name = names[i], .sum = { 0 } };
+        FOREACH(node, smp_cpus)
+        {
+            counters_t *c = &counters[LIST_GET_CONTAINER(node, smp_cpu_t, cpu_list_node)->id][i];
+            e.sum.acquisitions += __atomic_load_n(&c->acquisitions, __ATOMIC_RELAXED);
+            e.sum.contended += __atomic_load_n(&c->contended, __ATOMIC_RELAXED);
+            e.sum.spin_cycles += __atomic_load_n(&c->spin_cycles, __ATOMIC_RELAXED);
+            e.sum.hold_max_cycles = MAX(e.sum.hold_max_cycles,
+                                        __atomic_load_n(&c->hold_max_cycles, __ATOMIC_RELAXED));
+        }
+
+        size_t j = i;
+        for (; j > 0 && ranks_before(&e, &entries[j - 1]); j--)
+            entries[j] = entries[j - 1];
+        entries[j] = e;
+    }
+
+    // `snprintf` returns what it would have written, keep `len` in bounds.
+    size_t len = snprintf(text, ARCH_PAGE_GRAN, "name acquisitions contended spin_cycles "
+                                                "avg_spin_cycles hold_max_cycles\n");
+    len = MIN(len, ARCH_PAGE_GRAN - 1);
+    for (size_t i = 0; i < MIN(n, REPORT_TOP); i++)
+    {
+        counters_t *s = &entries[i].sum;
+        len += snprintf(text + len, ARCH_PAGE_GRAN - len, "%s %lu %lu %lu %lu %lu\n", entries[i].name,
+                        s->acquisitions, s->contended, s->spin_cycles,
+                        s->contended ? s->spin_cycles / s->contended : 0, s->hold_max_cycles);
+        len = MIN(len, ARCH_PAGE_GRAN - 1);
+    }
+
+    size_t to_read = offset < len ? MIN(count, len - offset) : 0;
+    memcpy(buffer, text + offset, to_read);
+    pm_free(entries_page);
+    pm_free(text_page);
+
+    *out_bytes_read = to_read;
+    return EOK;
+}
+
+static vnode_ops_t report_ops = {
+    .read = report_read
+};
+
+void lockstat_init()
+{
+    if (!devfs_register_device("/dev/lockstat", VCHR, &report_ops, NULL))
+        log(LOG_WARN, "Could not register /dev/lockstat.");
+}
+
+#endif
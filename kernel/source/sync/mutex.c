@@ -0,0 +1,123 @@
+#include "sync/mutex.h"
+
+#include "arch/lcpu.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
+#include "proc/thread.h"
+
+/*
+ * The owner word is taken with a compare-and-swap while nobody sleeps on the
+ * mutex. Sleepers set `MUTEX_WAITERS` under the lock before queueing, which
+ * sends the owner through the lock on release, to hand the mutex straight to
+ * the first sleeper. Spinners stop as soon as the owner is off its CPU or
+ * someone sleeps, so they never overtake a sleeper for long.
+ */
+
+#define SPIN_LIMIT 4096
+
+static inline bool try_take(mutex_t *mutex, thread_t *self)
+{
+    uintptr_t free = 0;
+    return __atomic_compare_exchange_n(&mutex->owner, &free, (uintptr_t)self,
+                                       false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void taken(mutex_t *mutex, thread_t *self)
+{
+    __atomic_store_n(&mutex->owner_cpu, self->assigned_cpu, __ATOMIC_RELAXED);
+    if (mutex->pi)
+        self->pi_held++;
+}
+
+// Whether the owner seen as `owner` is running, as far as a spinner can tell.
+static bool owner_running(mutex_t *mutex, uintptr_t owner)
+{
+    smp_cpu_t *cpu = __atomic_load_n(&mutex->owner_cpu, __ATOMIC_RELAXED);
+    return cpu && (uintptr_t)__atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED) == owner;
+}
+
+void mutex_acquire(mutex_t *mutex)
+{
+    thread_t *self = sched_get_curr_thread();
+    if (try_take(mutex, self))
+    {
+        taken(mutex, self);
+        return;
+    }
+
+    for (size_t i = 0; i < SPIN_LIMIT; i++)
+    {
+        uintptr_t owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+        if (owner == 0)
+        {
+            if (try_take(mutex, self))
+            {
+                taken(mutex, self);
+                return;
+            }
+            continue;
+        }
+        if (owner & MUTEX_WAITERS || !owner_running(mutex, owner))
+            break;
+        arch_lcpu_relax();
+    }
+
+    spinlock_acquire(&mutex->slock);
+    while (true)
+    {
+        uintptr_t owner = __atomic_load_n(&mutex->owner, __ATOMIC_ACQUIRE);
+        // Handed over while sleeping.
+        if ((owner & ~MUTEX_WAITERS) == (uintptr_t)self)
+            break;
+        if (owner == 0)
+        {
+            if (try_take(mutex, self))
+                break;
+            continue;
+        }
+        if (!(owner & MUTEX_WAITERS)
+        &&  !__atomic_compare_exchange_n(&mutex->owner, &owner, owner | MUTEX_WAITERS,
+                                         false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+
+        // The owner can not release, and go away, without the lock.
+        if (mutex->pi)
+            sched_boost((thread_t *)(owner & ~MUTEX_WAITERS), self->sched_class->rank);
+
+        waitqueue_wait(&mutex->waiters, &mutex->slock, UINT64_MAX);
+    }
+    spinlock_release(&mutex->slock);
+
+    taken(mutex, self);
+}
+
+bool mutex_try_acquire(mutex_t *mutex)
+{
+    thread_t *self = sched_get_curr_thread();
+    if (!try_take(mutex, self))
+        return false;
+
+    taken(mutex, self);
+    return true;
+}
+
+void mutex_release(mutex_t *mutex)
+{
+    thread_t *self = sched_get_curr_thread();
+    bool unboost = mutex->pi && --self->pi_held == 0;
+
+    uintptr_t owner = (uintptr_t)self;
+    if (!__atomic_compare_exchange_n(&mutex->owner, &owner, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        spinlock_acquire(&mutex->slock);
+        thread_t *next = waitqueue_wake_one(&mutex->waiters);
+        owner = next ? (uintptr_t)next : 0;
+        if (!waitqueue_empty(&mutex->waiters))
+            owner |= MUTEX_WAITERS;
+        __atomic_store_n(&mutex->owner, owner, __ATOMIC_RELEASE);
+        spinlock_release(&mutex->slock);
+    }
+
+    if (unboost)
+        sched_unboost();
+}
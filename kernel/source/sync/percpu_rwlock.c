@@ -0,0 +1,77 @@
+#include "sync/percpu_rwlock.h"
+
+#include "arch/lcpu.h"
+#include "proc/percpu.h"
+#include "sync/spinlock.h"
+
+/*
+ * A reader publishes itself before it looks at the flag, and a writer raises
+ * the flag before it looks at the counts, with a full fence in between on
+ * both sides: either the writer sees the reader, or the reader sees the flag
+ * and backs off.
+ */
+
+static bool writers[SMP_RWLOCK_COUNT];
+static spinlock_t writer_slocks[SMP_RWLOCK_COUNT] = { [0 ... SMP_RWLOCK_COUNT - 1] = SPINLOCK_INIT };
+
+static inline size_t *cpu_readers(smp_rwlock_id_t id)
+{
+    return &this_cpu_ptr()->rwlock_readers[id];
+}
+
+void percpu_rwlock_acquire_read(smp_rwlock_id_t id)
+{
+    smp_int_mask_push();
+
+    size_t *readers = cpu_readers(id);
+    size_t count = __atomic_load_n(readers, __ATOMIC_RELAXED);
+    // A writer is waiting for this CPU already, it can not get in.
+    if (count > 0)
+    {
+        __atomic_store_n(readers, count + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    while (true)
+    {
+        __atomic_store_n(readers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&writers[id], __ATOMIC_ACQUIRE))
+            return;
+
+        __atomic_store_n(readers, 0, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&writers[id], __ATOMIC_RELAXED))
+            arch_lcpu_relax();
+    }
+}
+
+void percpu_rwlock_release_read(smp_rwlock_id_t id)
+{
+    size_t *readers = cpu_readers(id);
+    __atomic_store_n(readers, __atomic_load_n(readers, __ATOMIC_RELAXED) - 1, __ATOMIC_RELEASE);
+
+    smp_int_mask_pop();
+}
+
+void percpu_rwlock_acquire_write(smp_rwlock_id_t id)
+{
+    spinlock_acquire(&writer_slocks[id]);
+
+    __atomic_store_n(&writers[id], true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Before `smp_init`, only the boot CPU runs and nobody reads concurrently.
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        while (__atomic_load_n(&cpu->rwlock_readers[id], __ATOMIC_ACQUIRE))
+            arch_lcpu_relax();
+    }
+}
+
+void percpu_rwlock_release_write(smp_rwlock_id_t id)
+{
+    __atomic_store_n(&writers[id], false, __ATOMIC_RELEASE);
+
+    spinlock_release(&writer_slocks[id]);
+}
@@ -0,0 +1,201 @@
+#include "sync/rcu.h"
+
+#include "arch/lcpu.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+
+/*
+ * A CPU that switches threads, or takes an interrupt, outside a read-side
+ * section can not hold a reference from before: it passed a quiescent state.
+ * A grace period ends once every CPU that was busy when it started passed one
+ * since; halted CPUs are quiescent already, and busy ones get an IPI so that
+ * they report soon even without a timer running.
+ *
+ * Each CPU batches its callbacks: `next` collects new ones while `wait` waits
+ * for its grace period. Only one grace period runs at a time; batches that
+ * come during one wait for the next, which starts as soon as it ends.
+ *
+ * Callbacks run from the scheduler's timer and reschedule interrupts, never in
+ * the middle of a context switch. Whoever ends a grace period sends an IPI to
+ * every CPU whose batch it was waiting for, itself included.
+ */
+
+static spinlock_t gp_slock = SPINLOCK_INIT_NAMED("rcu_gp");
+static uint64_t gp_started = 0;   // Latest grace period started.
+static uint64_t gp_completed = 0; // Latest grace period over, `gp_started` if none runs.
+static bool gp_requested = false; // Another one is needed once the current one is over.
+static size_t gp_pending = 0;     // CPUs that still have to report for `gp_started`.
+
+static void start_gp(smp_cpu_t *self);
+
+// Grace periods, under `gp_slock`
+
+static void end_gp(smp_cpu_t *self)
+{
+    __atomic_store_n(&gp_completed, gp_started, __ATOMIC_RELEASE);
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (cpu->rcu.online
+        &&  __atomic_load_n(&cpu->rcu.wait.head, __ATOMIC_RELAXED)
+        &&  __atomic_load_n(&cpu->rcu.wait_gp, __ATOMIC_RELAXED) <= gp_started)
+            arch_lcpu_send_ipi(cpu);
+    }
+
+    if (gp_requested)
+    {
+        gp_requested = false;
+        start_gp(self);
+    }
+}
+
+static void start_gp(smp_cpu_t *self)
+{
+    __atomic_store_n(&gp_started, gp_started + 1, __ATOMIC_RELEASE);
+    gp_pending = 0;
+
+    // Whatever was unpublished before is out of sight of a CPU seen halted.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (!cpu->rcu.online
+        ||  (cpu != self && __atomic_load_n(&cpu->runqueue.idle, __ATOMIC_ACQUIRE)))
+            continue;
+
+        __atomic_store_n(&cpu->rcu.need_qs, true, __ATOMIC_RELAXED);
+        gp_pending++;
+        if (cpu != self)
+            arch_lcpu_send_ipi(cpu);
+    }
+
+    if (gp_pending == 0)
+        end_gp(self);
+}
+
+// Get a grace period going that starts after this call, return its number.
+static uint64_t request_gp(smp_cpu_t *self)
+{
+    spinlock_acquire(&gp_slock);
+
+    uint64_t gp = gp_started + 1;
+    if (gp_started == gp_completed)
+        start_gp(self);
+    else
+        gp_requested = true;
+
+    spinlock_release(&gp_slock);
+    return gp;
+}
+
+// Callbacks, with interrupts masked
+
+static void advance(smp_cpu_t *cpu)
+{
+    smp_rcu_t *rcu = &cpu->rcu;
+    if (list_is_empty(&rcu->next))
+        return;
+
+    rcu->wait = rcu->next;
+    rcu->next = LIST_INIT;
+    rcu->wait_gp = request_gp(cpu);
+}
+
+// API
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head))
+{
+    head->func = func;
+    head->list_node = LIST_NODE_INIT;
+
+    smp_int_mask_push();
+    smp_cpu_t *cpu = this_cpu_ptr();
+
+    list_append(&cpu->rcu.next, &head->list_node);
+    if (list_is_empty(&cpu->rcu.wait))
+        advance(cpu);
+
+    smp_int_mask_pop();
+}
+
+typedef struct
+{
+    rcu_head_t head;
+    spinlock_t slock;
+    waitqueue_t waiters;
+    bool done;
+}
+sync_waiter_t;
+
+static void sync_done(rcu_head_t *head)
+{
+    sync_waiter_t *w = LIST_GET_CONTAINER(head, sync_waiter_t, head);
+
+    spinlock_acquire(&w->slock);
+    w->done = true;
+    waitqueue_wake_all(&w->waiters);
+    spinlock_release(&w->slock);
+}
+
+void synchronize_rcu()
+{
+    sync_waiter_t w = {
+        .slock = SPINLOCK_INIT,
+        .waiters = WAITQUEUE_INIT,
+        .done = false
+    };
+    call_rcu(&w.head, sync_done);
+
+    spinlock_acquire(&w.slock);
+    while (!w.done)
+        waitqueue_wait(&w.waiters, &w.slock, UINT64_MAX);
+    spinlock_release(&w.slock);
+}
+
+void rcu_quiescent()
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+
+    if (__atomic_load_n(&cpu->rcu.need_qs, __ATOMIC_RELAXED))
+    {
+        spinlock_acquire(&gp_slock);
+        if (cpu->rcu.need_qs)
+        {
+            cpu->rcu.need_qs = false;
+            if (--gp_pending == 0)
+                end_gp(cpu);
+        }
+        spinlock_release(&gp_slock);
+    }
+}
+
+void rcu_run_callbacks()
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+    smp_rcu_t *rcu = &cpu->rcu;
+    if (list_is_empty(&rcu->wait) || rcu->wait_gp > __atomic_load_n(&gp_completed, __ATOMIC_ACQUIRE))
+        return;
+
+    list_t done = rcu->wait;
+    rcu->wait = LIST_INIT;
+    advance(cpu);
+
+    list_node_t *n;
+    while ((n = list_pop_head(&done)))
+    {
+        rcu_head_t *head = LIST_GET_CONTAINER(n, rcu_head_t, list_node);
+        head->func(head);
+    }
+}
+
+void rcu_cpu_online()
+{
+    smp_cpu_t *cpu = this_cpu_ptr();
+
+    spinlock_acquire(&gp_slock);
+    cpu->rcu.online = true;
+    spinlock_release(&gp_slock);
+}
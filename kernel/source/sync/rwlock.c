@@ -0,0 +1,75 @@
+#include "sync/rwlock.h"
+
+#include "arch/lcpu.h"
+#include "proc/smp.h"
+
+void rwlock_acquire_read(volatile rwlock_t *rwlock)
+{
+    smp_int_mask_push();
+
+    while (true)
+    {
+        while (__atomic_load_n(&rwlock->writers_waiting, __ATOMIC_RELAXED)
+        ||     __atomic_load_n(&rwlock->state, __ATOMIC_RELAXED) & RWLOCK_WRITER)
+            arch_lcpu_relax();
+
+        uint32_t prev = __atomic_fetch_add(&rwlock->state, 1, __ATOMIC_ACQUIRE);
+        if (!(prev & RWLOCK_WRITER))
+            return;
+
+        // A writer got in between the check and the increment, back off.
+        __atomic_fetch_sub(&rwlock->state, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool rwlock_try_acquire_read(volatile rwlock_t *rwlock)
+{
+    smp_int_mask_push();
+
+    if (!__atomic_load_n(&rwlock->writers_waiting, __ATOMIC_RELAXED)
+    &&  !(__atomic_load_n(&rwlock->state, __ATOMIC_RELAXED) & RWLOCK_WRITER))
+    {
+        uint32_t prev = __atomic_fetch_add(&rwlock->state, 1, __ATOMIC_ACQUIRE);
+        if (!(prev & RWLOCK_WRITER))
+            return true;
+
+        __atomic_fetch_sub(&rwlock->state, 1, __ATOMIC_RELAXED);
+    }
+
+    smp_int_mask_pop();
+    return false;
+}
+
+void rwlock_release_read(volatile rwlock_t *rwlock)
+{
+    __atomic_fetch_sub(&rwlock->state, 1, __ATOMIC_RELEASE);
+
+    smp_int_mask_pop();
+}
+
+void rwlock_acquire_write(volatile rwlock_t *rwlock)
+{
+    smp_int_mask_push();
+
+    __atomic_fetch_add(&rwlock->writers_waiting, 1, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&rwlock->state, &expected, RWLOCK_WRITER, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        while (__atomic_load_n(&rwlock->state, __ATOMIC_RELAXED))
+            arch_lcpu_relax();
+    }
+
+    __atomic_fetch_sub(&rwlock->writers_waiting, 1, __ATOMIC_RELAXED);
+}
+
+void rwlock_release_write(volatile rwlock_t *rwlock)
+{
+    __atomic_fetch_and(&rwlock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+
+    smp_int_mask_pop();
+}
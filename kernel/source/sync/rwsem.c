@@ -0,0 +1,41 @@
+#include "sync/rwsem.h"
+
+void rwsem_down_read(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    while (sem->writer || sem->writers_waiting > 0)
+        waitqueue_wait(&sem->read_waiters, &sem->slock, UINT64_MAX);
+    sem->readers++;
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_up_read(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    if (--sem->readers == 0)
+        waitqueue_wake_one(&sem->write_waiters);
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_down_write(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->writers_waiting++;
+    while (sem->writer || sem->readers > 0)
+        waitqueue_wait(&sem->write_waiters, &sem->slock, UINT64_MAX);
+    sem->writers_waiting--;
+    sem->writer = true;
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_up_write(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->writer = false;
+    // Readers only get in once no writer waits.
+    if (sem->writers_waiting > 0)
+        waitqueue_wake_one(&sem->write_waiters);
+    else
+        waitqueue_wake_all(&sem->read_waiters);
+    spinlock_release(&sem->slock);
+}
@@ -0,0 +1,29 @@
+#include "sync/semaphore.h"
+
+void semaphore_down(semaphore_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    while (sem->count == 0)
+        waitqueue_wait(&sem->waiters, &sem->slock, UINT64_MAX);
+    sem->count--;
+    spinlock_release(&sem->slock);
+}
+
+bool semaphore_try_down(semaphore_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    bool taken = sem->count > 0;
+    if (taken)
+        sem->count--;
+    spinlock_release(&sem->slock);
+
+    return taken;
+}
+
+void semaphore_up(semaphore_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->count++;
+    waitqueue_wake_one(&sem->waiters);
+    spinlock_release(&sem->slock);
+}
@@ -1,44 +1,108 @@
 #include "sync/spinlock.h"
 
 #include "arch/lcpu.h"
+#include "proc/percpu.h"
+#include "proc/smp.h"
+#include "sync/lockstat.h"
 
-void spinlock_acquire(volatile spinlock_t *slock)
+/*
+ * Every CPU has one queue node, in `smp_cpu_t`. A node is only in use while
+ * its CPU waits for a lock, with interrupts masked, so nothing else on the
+ * CPU can need it meanwhile. The CPU at the head of the queue takes the lock
+ * as soon as it is free and hands the head over to its successor right away,
+ * which frees its node before the lock is even released.
+ *
+ * Interrupts are masked while waiting as well as while holding the lock:
+ * handlers could otherwise find the lock queued up behind the CPU they
+ * interrupted and never get it.
+ */
+
+static inline bool try_lock(volatile spinlock_t *slock)
+{
+    return !__atomic_test_and_set(&slock->lock, __ATOMIC_ACQUIRE);
+}
+
+static void acquire_queued(volatile spinlock_t *slock)
 {
-    while (true)
+    spinlock_node_t *node = &this_cpu_ptr()->spin_node;
+    node->next = NULL;
+    node->head = false;
+
+    spinlock_node_t *prev = __atomic_exchange_n(&slock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev)
     {
-        if (!__atomic_test_and_set(&slock->lock, __ATOMIC_ACQUIRE))
-        {
-            slock->prev_int_state = arch_lcpu_int_enabled();
-                arch_lcpu_int_mask();
-            return;
-        }
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&node->head, __ATOMIC_ACQUIRE))
+            arch_lcpu_relax();
+    }
 
+    while (!try_lock(slock))
         while (__atomic_load_n(&slock->lock, __ATOMIC_RELAXED))
             arch_lcpu_relax();
-    }
-}
 
-void spinlock_release(volatile spinlock_t *slock)
-{
-    bool prev_int_state = slock->prev_int_state;
-    __atomic_clear(&slock->lock, __ATOMIC_RELEASE);
-    if (prev_int_state)
-        arch_lcpu_int_unmask();
+    // Leave the queue, or make the next CPU its head.
+    spinlock_node_t *expected = node;
+    if (__atomic_compare_exchange_n(&slock->tail, &expected, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+
+    spinlock_node_t *next;
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+        arch_lcpu_relax();
+    __atomic_store_n(&next->head, true, __ATOMIC_RELEASE);
 }
 
 void spinlock_primitive_acquire(volatile spinlock_t *slock)
 {
-    while (true)
+    // Free and nobody waiting: no need to queue.
+    if (!__atomic_load_n(&slock->tail, __ATOMIC_RELAXED) && try_lock(slock))
     {
-        if (!__atomic_test_and_set(&slock->lock, __ATOMIC_ACQUIRE))
-            return;
+        if (LOCKSTAT_TRACKED(slock))
+            lockstat_acquired(slock, false, 0);
+        return;
+    }
 
-        while (__atomic_load_n(&slock->lock, __ATOMIC_RELAXED))
-            arch_lcpu_relax();
+    if (!LOCKSTAT_TRACKED(slock))
+    {
+        acquire_queued(slock);
+        return;
     }
+
+    uint64_t start = arch_lcpu_cycles();
+    acquire_queued(slock);
+    lockstat_acquired(slock, true, arch_lcpu_cycles() - start);
 }
 
 void spinlock_primitive_release(volatile spinlock_t *slock)
 {
+    if (LOCKSTAT_TRACKED(slock))
+        lockstat_released(slock);
     __atomic_clear(&slock->lock, __ATOMIC_RELEASE);
 }
+
+void spinlock_acquire(volatile spinlock_t *slock)
+{
+    smp_int_mask_push();
+    spinlock_primitive_acquire(slock);
+}
+
+bool spinlock_try_acquire(volatile spinlock_t *slock)
+{
+    smp_int_mask_push();
+
+    // Queued CPUs are ahead.
+    if (!__atomic_load_n(&slock->tail, __ATOMIC_RELAXED) && try_lock(slock))
+    {
+        if (LOCKSTAT_TRACKED(slock))
+            lockstat_acquired(slock, false, 0);
+        return true;
+    }
+
+    smp_int_mask_pop();
+    return false;
+}
+
+void spinlock_release(volatile spinlock_t *slock)
+{
+    spinlock_primitive_release(slock);
+    smp_int_mask_pop();
+}
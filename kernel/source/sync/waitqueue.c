@@ -0,0 +1,69 @@
+#include "sync/waitqueue.h"
+
+#include "proc/sched.h"
+#include "proc/thread.h"
+
+/*
+ * Waiters live on the stack of their thread. Wakers take them off the queue
+ * and mark them woken under the queue's lock, which the thread takes again
+ * before it returns, so the waiter is never gone while a waker still looks
+ * at it. A thread that is still queued once it runs again timed out.
+ */
+
+typedef struct
+{
+    thread_t *thread;
+    bool woken;
+    list_node_t list_node;
+}
+waiter_t;
+
+bool waitqueue_wait(waitqueue_t *wq, spinlock_t *lock, uint64_t deadline)
+{
+    waiter_t w = {
+        .thread = sched_get_curr_thread(),
+        .woken = false,
+        .list_node = LIST_NODE_INIT
+    };
+    list_append(&wq->waiters, &w.list_node);
+
+    sched_prepare_block();
+    spinlock_release(lock);
+    sched_block(deadline);
+    spinlock_acquire(lock);
+
+    if (!w.woken)
+        list_remove(&wq->waiters, &w.list_node);
+    return w.woken;
+}
+
+static void wake(waitqueue_t *wq, waiter_t *w)
+{
+    list_remove(&wq->waiters, &w->list_node);
+    w->woken = true;
+    sched_wake(w->thread);
+}
+
+thread_t *waitqueue_wake_one(waitqueue_t *wq)
+{
+    list_node_t *n = LIST_FIRST(&wq->waiters);
+    if (!n)
+        return NULL;
+
+    waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+    wake(wq, w);
+    return w->thread;
+}
+
+size_t waitqueue_wake_all(waitqueue_t *wq)
+{
+    size_t woken = 0;
+    list_node_t *n;
+    while ((n = LIST_FIRST(&wq->waiters)))
+    {
+        wake(wq, LIST_GET_CONTAINER(n, waiter_t, list_node));
+        woken++;
+    }
+
+    return woken;
+}
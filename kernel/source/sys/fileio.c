@@ -142,3 +142,16 @@ sys_ret_t syscall_write(int fd, void *buf, uint64_t count)
         return (sys_ret_t) {0, err};
     return (sys_ret_t) {written_bytes, EOK};
 }
+
+sys_ret_t syscall_ftruncate(int fd, uint64_t length)
+{
+    fd_entry_t fd_entry = fd_get(sys_curr_proc()->fd_table, fd);
+    if (fd_entry.vnode == NULL)
+        return (sys_ret_t) {0, EBADF};
+
+    int err = vfs_truncate(fd_entry.vnode, length);
+
+    fd_put(sys_curr_proc()->fd_table, fd);
+
+    return (sys_ret_t) {0, err};
+}
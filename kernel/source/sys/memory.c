@@ -3,6 +3,8 @@
 #include "fs/vfs.h"
 #include "log.h"
 #include "mm/mm.h"
+#include "mm/shm.h"
+#include "proc/fd.h"
 #include "proc/proc.h"
 #include "proc/sched.h"
 #include "proc/thread.h"
@@ -21,16 +23,143 @@
 #define MAP_FIXED    0x10
 #define MAP_ANON     0x20
 
+#define MREMAP_MAYMOVE 0x01
+
+#define MFD_CLOEXEC 0x01
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_HUGEPAGE   14
+#define MADV_NOHUGEPAGE 15
+
 sys_ret_t syscall_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, size_t offset)
 {
     proc_t *proc = sched_get_curr_thread()->owner;
     vm_addrspace_t *as = proc->as;
 
+    if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+        return (sys_ret_t) {0, EINVAL};
+
+    // User mappings are always readable, PROT_NONE maps read-only.
+    int vm_prot = MM_PROT_USER;
+    if (prot & PROT_WRITE)
+        vm_prot |= MM_PROT_WRITE;
+    if (prot & PROT_EXEC)
+        vm_prot |= MM_PROT_EXEC;
+
+    int vm_flags = (flags & MAP_SHARED) ? VM_MAP_SHARED : VM_MAP_PRIVATE;
+    if (flags & MAP_FIXED)
+        vm_flags |= VM_MAP_FIXED;
+
+    // File mappings are served from the page cache.
+    vnode_t *vn = NULL;
+    if (flags & MAP_ANON)
+    {
+        vm_flags |= VM_MAP_ANON;
+        offset = 0;
+    }
+    else
+    {
+        fd_entry_t entry = fd_get(proc->fd_table, fd);
+        vn = entry.vnode;
+        if (vn == NULL)
+            return (sys_ret_t) {0, EBADF};
+
+        // Stores through a shared mapping reach the file.
+        if (!entry.acc_mode.read
+        ||  ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !entry.acc_mode.write))
+        {
+            fd_put(proc->fd_table, fd);
+            return (sys_ret_t) {0, EACCES};
+        }
+    }
+
     size_t value, err;
-    err = vm_map(as, addr, length, MM_PROT_WRITE | MM_PROT_USER, VM_MAP_ANON | VM_MAP_PRIVATE, NULL, 0, &value);
+    err = vm_map(as, addr, length, vm_prot, vm_flags, vn, offset, &value);
+
+    if (vn)
+        fd_put(proc->fd_table, fd);
 
     return (sys_ret_t) {
         value,
         err
     };
 }
+
+sys_ret_t syscall_mremap(uintptr_t old_addr, size_t old_size, size_t new_size, int flags)
+{
+    if (flags & ~MREMAP_MAYMOVE)
+        return (sys_ret_t) {0, EINVAL};
+
+    uintptr_t value;
+    int err = vm_remap(sys_curr_as(), old_addr, old_size, new_size,
+                       (flags & MREMAP_MAYMOVE) ? VM_REMAP_MAYMOVE : 0, &value);
+
+    return (sys_ret_t) {err == EOK ? value : 0, err};
+}
+
+sys_ret_t syscall_madvise(uintptr_t addr, size_t length, int advice)
+{
+    int vm_advice;
+    switch (advice)
+    {
+        case MADV_NORMAL:     vm_advice = VM_ADVICE_NORMAL;     break;
+        case MADV_RANDOM:     vm_advice = VM_ADVICE_RANDOM;     break;
+        case MADV_SEQUENTIAL: vm_advice = VM_ADVICE_SEQUENTIAL; break;
+        case MADV_WILLNEED:   vm_advice = VM_ADVICE_WILLNEED;   break;
+        case MADV_DONTNEED:   vm_advice = VM_ADVICE_DONTNEED;   break;
+        case MADV_HUGEPAGE:   vm_advice = VM_ADVICE_HUGEPAGE;   break;
+        case MADV_NOHUGEPAGE: vm_advice = VM_ADVICE_NOHUGEPAGE; break;
+        default:
+            return (sys_ret_t) {0, EINVAL};
+    }
+
+    return (sys_ret_t) {0, vm_advise(sys_curr_as(), addr, length, vm_advice)};
+}
+
+sys_ret_t syscall_memfd_create(const char *name, int flags)
+{
+    // There is no exec yet, so close-on-exec has nothing to do.
+    if (flags & ~MFD_CLOEXEC)
+        return (sys_ret_t) {0, EINVAL};
+
+    // Copy a page at a time, the string may end right before unmapped memory.
+    // Names too long are cut short.
+    char kname[VNODE_MAX_NAME_LEN + 1];
+    size_t len = 0;
+    bool terminated = false;
+    while (!terminated && len < sizeof(kname) - 1)
+    {
+        uintptr_t src = (uintptr_t)name + len;
+        size_t chunk = MIN(sizeof(kname) - 1 - len, ARCH_PAGE_GRAN - src % ARCH_PAGE_GRAN);
+        size_t copied = vm_copy_from_user(sys_curr_as(), kname + len, src, chunk);
+        if (copied == 0)
+            return (sys_ret_t) {0, EFAULT};
+
+        for (size_t i = len; i < len + copied; i++)
+            if (kname[i] == '\0')
+            {
+                terminated = true;
+                copied = i - len;
+                break;
+            }
+        len += copied;
+    }
+    kname[len] = '\0';
+
+    vnode_t *vn = shm_create(kname);
+    if (!vn)
+        return (sys_ret_t) {0, ENOMEM};
+
+    int fd;
+    bool ok = fd_alloc(sys_curr_proc()->fd_table, vn, (fd_acc_mode_t) {true, true, false, false}, &fd);
+
+    // The descriptor holds its own reference, if any.
+    vnode_unref(vn);
+    if (!ok)
+        return (sys_ret_t) {0, EMFILE};
+    return (sys_ret_t) {fd, EOK};
+}
@@ -5,10 +5,23 @@
 #include "arch/misc.h"
 #include "arch/timer.h"
 #include "log.h"
+#include "mm/mm.h"
 #include "proc/sched.h"
+#include "sync/futex.h"
 #include "uapi/errno.h"
+#include "utils/math.h"
 #include <stdint.h>
 
+#define SCHED_MLFQ 0
+#define SCHED_FAIR 1
+#define SCHED_RT   2
+
+#define FUTEX_WAIT    0
+#define FUTEX_WAKE    1
+#define FUTEX_REQUEUE 2
+
+#define FUTEX_PRIVATE 0x80
+
 sys_ret_t syscall_exit(int code)
 {
     log(LOG_DEBUG, "Process exited with code: %i.", code);
@@ -25,6 +38,83 @@ sys_ret_t syscall_tcb_set(void *ptr)
     return (sys_ret_t) {0, EOK};
 }
 
+sys_ret_t syscall_sched_setpolicy(int policy, int64_t param)
+{
+    sched_policy_t sched_policy;
+    switch (policy)
+    {
+        case SCHED_MLFQ: sched_policy = SCHED_POLICY_MLFQ; break;
+        case SCHED_FAIR: sched_policy = SCHED_POLICY_FAIR; break;
+        case SCHED_RT:   sched_policy = SCHED_POLICY_RT;   break;
+        default:
+            return (sys_ret_t) {0, EINVAL};
+    }
+
+    return (sys_ret_t) {0, sched_set_policy(sys_curr_proc(), sched_policy, param)};
+}
+
+// Masks are bitmaps of CPU IDs. CPUs past the end of a shorter mask are left
+// out when setting, and past the end of a longer one ignored. Getting fills a
+// mask no longer than the kernel's, and returns how much it filled.
+
+sys_ret_t syscall_sched_setaffinity(const void *mask, size_t size)
+{
+    cpumask_t cpus = { 0 };
+    size_t count = MIN(size, sizeof(cpumask_t));
+    if (vm_copy_from_user(sys_curr_as(), &cpus, (uintptr_t)mask, count) != count)
+        return (sys_ret_t) {0, EFAULT};
+
+    return (sys_ret_t) {0, sched_set_affinity(sys_curr_thread(), &cpus)};
+}
+
+sys_ret_t syscall_sched_getaffinity(void *mask, size_t size)
+{
+    if (size > sizeof(cpumask_t))
+        return (sys_ret_t) {0, EINVAL};
+
+    cpumask_t cpus;
+    sched_get_affinity(sys_curr_thread(), &cpus);
+
+    if (vm_copy_to_user(sys_curr_as(), (uintptr_t)mask, &cpus, size) != size)
+        return (sys_ret_t) {0, EFAULT};
+
+    return (sys_ret_t) {size, EOK};
+}
+
+// `arg` is a pointer to the relative timeout in ns for FUTEX_WAIT, NULL to wait
+// until woken, and the number of waiters to move for FUTEX_REQUEUE, which only
+// proceeds if `uaddr` holds `val3`. `val` is the expected value for FUTEX_WAIT
+// and the number of waiters to wake otherwise.
+sys_ret_t syscall_futex(uint32_t *uaddr, int op, uint32_t val, uintptr_t arg, uint32_t *uaddr2, uint32_t val3)
+{
+    vm_addrspace_t *as = sys_curr_as();
+    bool shared = !(op & FUTEX_PRIVATE);
+    size_t count = 0;
+    int err;
+
+    switch (op & ~FUTEX_PRIVATE)
+    {
+        case FUTEX_WAIT:
+        {
+            uint64_t timeout_ns = UINT64_MAX;
+            if (arg && vm_copy_from_user(as, &timeout_ns, arg, sizeof(uint64_t)) != sizeof(uint64_t))
+                return (sys_ret_t) {0, EFAULT};
+            err = futex_wait(as, (uintptr_t)uaddr, val, timeout_ns, shared);
+            break;
+        }
+        case FUTEX_WAKE:
+            err = futex_wake(as, (uintptr_t)uaddr, val, shared, &count);
+            break;
+        case FUTEX_REQUEUE:
+            err = futex_requeue(as, (uintptr_t)uaddr, val, (uintptr_t)uaddr2, arg, val3, shared, &count);
+            break;
+        default:
+            return (sys_ret_t) {0, EINVAL};
+    }
+
+    return (sys_ret_t) {count, err};
+}
+
 // sleep in microseconds
 sys_ret_t syscall_sleep(unsigned us)
 {
@@ -12,6 +12,14 @@ const void* syscall_table[] = {
     (void *)syscall_mmap,
     (void *)syscall_exit,
     (void *)syscall_tcb_set,
+    (void *)syscall_madvise,
+    (void *)syscall_memfd_create,
+    (void *)syscall_ftruncate,
+    (void *)syscall_mremap,
+    (void *)syscall_sched_setpolicy,
+    (void *)syscall_sched_setaffinity,
+    (void *)syscall_sched_getaffinity,
+    (void *)syscall_futex,
 };
 
 const uint64_t syscall_table_length = sizeof(syscall_table) / sizeof(void*);
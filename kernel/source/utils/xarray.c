@@ -76,9 +76,9 @@ bool xa_insert(xarray_t *xa, size_t index, void *value)
 
     // leaf
     size_t slot = index & XA_MASK;
+    n->not_null_count += n->slots[slot] == NULL ? 1 : 0;
     n->slots[slot] = value;
     n->bitmap |= 1ull << slot;
-    n->not_null_count += n->slots[slot] == NULL ? 1 : 0;
 
     return true;
 }
@@ -216,6 +216,9 @@ void xa_clear_mark(xarray_t *xa, size_t index, xa_mark_t mark)
 
 static void *xa_find_core(xarray_t *xa, size_t *index, size_t max, xa_mark_t mark)
 {
+    if (!xa->root)
+        return NULL;
+
     size_t curr_idx = *index;
     while (curr_idx <= max)
     {
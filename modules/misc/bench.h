@@ -0,0 +1,83 @@
+#pragma once
+
+#include "assert.h"
+#include "log.h"
+#include "proc/cpumask.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/thread.h"
+
+/*
+ * Harness shared by the benchmark modules.
+ *
+ * Every benchmark runs in a process of its own, driven by a controller thread.
+ * The controller spawns the threads of a run with `bench_spawn` and blocks in
+ * `bench_join` until all of them have exited, rather than polling for them.
+ * Should a spawn fail, the threads spawned before it are let go and joined,
+ * and the run is not reported.
+ */
+
+#define BENCH_MAX_THREADS 1024
+
+static const char *bench_name;
+static proc_t *bench_proc;
+static thread_t *bench_threads[BENCH_MAX_THREADS];
+static size_t bench_thread_count;
+
+/**
+ * @brief Start a thread of the benchmark process at `entry`, bound to
+ * `affinity` unless NULL. It is joined by the next `bench_join`.
+ *
+ * @return false if the thread could not be created.
+ */
+static inline bool bench_spawn(void (*entry)(), const cpumask_t *affinity)
+{
+    ASSERT(bench_thread_count < BENCH_MAX_THREADS);
+
+    thread_t *t = thread_create(bench_proc, (uintptr_t)entry);
+    if (!t)
+    {
+        log(LOG_ERROR, "%s: could not create a thread.", bench_name);
+        return false;
+    }
+    if (affinity)
+        sched_set_affinity(t, affinity);
+    thread_ref(t);
+    bench_threads[bench_thread_count++] = t;
+    sched_enqueue(t);
+    return true;
+}
+
+/**
+ * @brief Wait for every thread spawned since the last call to exit.
+ */
+static inline void bench_join()
+{
+    for (size_t i = 0; i < bench_thread_count; i++)
+        thread_join(bench_threads[i]);
+    bench_thread_count = 0;
+}
+
+[[noreturn]] static inline void bench_exit()
+{
+    sched_yield(THREAD_STATE_TERMINATED);
+    unreachable();
+}
+
+/**
+ * @brief Create the benchmark process and its controller thread. Modules are
+ * installed before the scheduler starts, the controller runs once it does.
+ */
+static inline void bench_start(const char *name, void (*controller)())
+{
+    bench_name = name;
+    bench_proc = proc_create(name, false);
+
+    thread_t *t = thread_create(bench_proc, (uintptr_t)controller);
+    if (!t)
+    {
+        log(LOG_ERROR, "%s: could not create the controller.", name);
+        return;
+    }
+    sched_enqueue(t);
+}
@@ -0,0 +1,142 @@
+#include "../bench.h"
+#include "arch/timer.h"
+#include "arch/types.h"
+#include "log.h"
+#include "mm/mm.h"
+#include "mm/vm.h"
+#include "mod/module.h"
+#include "proc/sched.h"
+#include "uapi/errno.h"
+
+/*
+ * Page fault storm.
+ *
+ * N threads fault in disjoint pages of one shared anonymous mapping at the same
+ * time, optionally while another thread keeps mapping and unmapping in the same
+ * address space. Faults are raised by calling `vm_page_fault` directly, so the
+ * numbers reflect the locking in the fault path rather than trap overhead.
+ */
+
+#define MAX_WORKERS 8
+#define PAGES_PER_WORKER 1024
+
+static vm_addrspace_t *bench_as;
+static uintptr_t region;
+
+static size_t worker_count;
+static size_t next_worker_id;
+static size_t workers_started;
+static size_t workers_done;
+static size_t failed_faults;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static size_t mapper_ops;
+
+[[noreturn]] static void worker()
+{
+    size_t id = __atomic_fetch_add(&next_worker_id, 1, __ATOMIC_RELAXED);
+    uintptr_t base = region + id * PAGES_PER_WORKER * ARCH_PAGE_GRAN;
+
+    // Start barrier. Threads are not preempted, so yield instead of spinning.
+    if (__atomic_add_fetch(&workers_started, 1, __ATOMIC_ACQ_REL) == worker_count)
+        start_ns = arch_timer_get_uptime_ns();
+    while (__atomic_load_n(&workers_started, __ATOMIC_ACQUIRE) < worker_count)
+        sched_yield(THREAD_STATE_READY);
+
+    for (size_t i = 0; i < PAGES_PER_WORKER; i++)
+        if (!vm_page_fault(bench_as, base + i * ARCH_PAGE_GRAN, true))
+            __atomic_fetch_add(&failed_faults, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&workers_done, 1, __ATOMIC_ACQ_REL) == worker_count)
+        end_ns = arch_timer_get_uptime_ns();
+
+    bench_exit();
+}
+
+// Keeps taking the address space lock exclusively while the workers fault.
+[[noreturn]] static void mapper()
+{
+    while (__atomic_load_n(&workers_done, __ATOMIC_ACQUIRE) < worker_count)
+    {
+        uintptr_t addr;
+        if (vm_map(bench_as, 0, ARCH_PAGE_GRAN, MM_PROT_WRITE, VM_MAP_ANON | VM_MAP_PRIVATE, NULL, 0, &addr) == EOK)
+            vm_unmap(bench_as, addr, ARCH_PAGE_GRAN);
+
+        if (++mapper_ops % 64 == 0)
+            sched_yield(THREAD_STATE_READY);
+    }
+
+    bench_exit();
+}
+
+static void run(size_t workers, bool with_mapper)
+{
+    bench_as = vm_addrspace_create();
+    if (vm_map(bench_as, 0, workers * PAGES_PER_WORKER * ARCH_PAGE_GRAN,
+               MM_PROT_WRITE | MM_PROT_USER, VM_MAP_ANON | VM_MAP_PRIVATE,
+               NULL, 0, &region) != EOK)
+    {
+        log(LOG_ERROR, "fault_bench: could not map the test region.");
+        vm_addrspace_destroy(bench_as);
+        return;
+    }
+
+    worker_count = workers;
+    next_worker_id = 0;
+    workers_started = 0;
+    workers_done = 0;
+    failed_faults = 0;
+    mapper_ops = 0;
+
+    bool spawned = !with_mapper || bench_spawn(mapper, NULL);
+    size_t started = 0;
+    while (spawned && started < workers)
+    {
+        spawned = bench_spawn(worker, NULL);
+        started += spawned;
+    }
+    // Let the barriers go by the workers there are.
+    if (!spawned)
+        __atomic_store_n(&worker_count, started, __ATOMIC_RELEASE);
+    bench_join();
+    if (!spawned)
+    {
+        vm_addrspace_destroy(bench_as);
+        return;
+    }
+
+    uint64_t elapsed_ns = end_ns - start_ns;
+    size_t faults = workers * PAGES_PER_WORKER;
+    log(LOG_INFO, "fault_bench: %lu thread(s)%s: %lu faults in %llu us (%llu faults/ms, %lu failed, %lu map/unmap)",
+        workers, with_mapper ? " + mapper" : "", faults, elapsed_ns / 1000,
+        elapsed_ns ? faults * 1000000ull / elapsed_ns : 0, failed_faults, mapper_ops);
+
+    vm_addrspace_destroy(bench_as);
+}
+
+[[noreturn]] static void controller()
+{
+    for (size_t workers = 1; workers <= MAX_WORKERS; workers *= 2)
+    {
+        run(workers, false);
+        run(workers, true);
+    }
+
+    log(LOG_INFO, "fault_bench: done.");
+    bench_exit();
+}
+
+void __module_install()
+{
+    bench_start("fault_bench", controller);
+}
+
+void __module_destroy()
+{
+}
+
+MODULE_NAME("fault_bench")
+MODULE_VERSION("0.1")
+MODULE_DESCRIPTION("Concurrent page fault throughput benchmark.")
+MODULE_AUTHOR("LykOS team")
@@ -0,0 +1,155 @@
+#include "../bench.h"
+#include "arch/lcpu.h"
+#include "arch/timer.h"
+#include "log.h"
+#include "mod/module.h"
+#include "proc/smp.h"
+#include "sync/spinlock.h"
+#include "utils/math.h"
+
+/*
+ * Spinlock contention.
+ *
+ * One thread per CPU, for growing numbers of CPUs, takes the same lock over
+ * and over for `DURATION_NS`, holding it for a short critical section. The
+ * queued `spinlock_t` runs against a plain test-and-set lock for comparison.
+ * Reported are the acquisitions per millisecond over all CPUs, and fairness,
+ * the fewest acquisitions of a thread as a percentage of the most.
+ */
+
+#define DURATION_NS (200 * 1000 * 1000)
+#define BATCH 64
+#define HOLD_SPINS 8
+#define MAX_THREADS 64
+
+static spinlock_t queued_lock = SPINLOCK_INIT;
+static uint8_t tas_lock = 0;
+static bool use_tas;
+
+static size_t thread_count;
+static size_t next_id;
+static size_t running;
+static uint64_t stop_at;
+static size_t counts[MAX_THREADS];
+static volatile size_t shared_counter;
+
+static void tas_acquire()
+{
+    smp_int_mask_push();
+    while (__atomic_test_and_set(&tas_lock, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&tas_lock, __ATOMIC_RELAXED))
+            arch_lcpu_relax();
+}
+
+static void tas_release()
+{
+    __atomic_clear(&tas_lock, __ATOMIC_RELEASE);
+    smp_int_mask_pop();
+}
+
+[[noreturn]] static void worker()
+{
+    size_t id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    // Start once every thread is on its CPU, the last one sets the end.
+    if (__atomic_add_fetch(&running, 1, __ATOMIC_RELAXED) == thread_count)
+        __atomic_store_n(&stop_at, arch_timer_get_uptime_ns() + DURATION_NS, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&stop_at, __ATOMIC_ACQUIRE))
+        sched_yield(THREAD_STATE_READY);
+
+    size_t count = 0;
+    do
+    {
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            if (use_tas)
+                tas_acquire();
+            else
+                spinlock_acquire(&queued_lock);
+
+            shared_counter++;
+            for (size_t j = 0; j < HOLD_SPINS; j++)
+                arch_lcpu_relax();
+
+            if (use_tas)
+                tas_release();
+            else
+                spinlock_release(&queued_lock);
+        }
+        count += BATCH;
+    }
+    while (arch_timer_get_uptime_ns() < stop_at);
+
+    counts[id] = count;
+    bench_exit();
+}
+
+static void run(size_t cpus, bool tas)
+{
+    use_tas = tas;
+    thread_count = cpus;
+    next_id = 0;
+    running = 0;
+    stop_at = 0;
+
+    size_t i = 0;
+    bool spawned = true;
+    FOREACH(n, smp_cpus)
+    {
+        if (i == cpus)
+            break;
+
+        cpumask_t mask = { 0 };
+        cpumask_set(&mask, LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node)->id);
+
+        if (!(spawned = bench_spawn(worker, &mask)))
+            break;
+        i++;
+    }
+    // Release the threads waiting for the others.
+    if (!spawned)
+        __atomic_store_n(&stop_at, arch_timer_get_uptime_ns(), __ATOMIC_RELEASE);
+    bench_join();
+    if (!spawned)
+        return;
+
+    size_t total = 0, least = SIZE_MAX, most = 0;
+    for (i = 0; i < cpus; i++)
+    {
+        total += counts[i];
+        least = MIN(least, counts[i]);
+        most = MAX(most, counts[i]);
+    }
+
+    log(LOG_INFO, "lock_bench: %s, %lu CPU(s): %lu acquisitions/ms, fairness %lu%%",
+        tas ? "test-and-set" : "queued", cpus, total / (DURATION_NS / 1000000), least * 100 / most);
+}
+
+[[noreturn]] static void controller()
+{
+    size_t max = MIN(smp_cpus.length, MAX_THREADS);
+    for (size_t cpus = 1; ; cpus = MIN(cpus * 2, max))
+    {
+        run(cpus, true);
+        run(cpus, false);
+        if (cpus == max)
+            break;
+    }
+
+    log(LOG_INFO, "lock_bench: done.");
+    bench_exit();
+}
+
+void __module_install()
+{
+    bench_start("lock_bench", controller);
+}
+
+void __module_destroy()
+{
+}
+
+MODULE_NAME("lock_bench")
+MODULE_VERSION("0.1")
+MODULE_DESCRIPTION("Spinlock throughput and fairness under contention.")
+MODULE_AUTHOR("LykOS team")
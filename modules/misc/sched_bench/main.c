@@ -0,0 +1,131 @@
+#include "../bench.h"
+#include "arch/timer.h"
+#include "log.h"
+#include "mod/module.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
+#include "utils/math.h"
+
+/*
+ * Interactive latency under batch load.
+ *
+ * A few interactive threads repeatedly sleep for a short while and do a little
+ * work, while batch threads spin on every CPU without ever yielding. For each
+ * wake-up the time from the requested wake-up time until the thread actually
+ * runs is recorded, and the percentiles are reported with and without load.
+ */
+
+#define INTERACTIVE_THREADS 4
+#define SAMPLES_PER_THREAD 256
+#define SLEEP_NS (1000 * 1000)
+#define BATCH_PER_CPU 2
+
+static uint64_t samples[INTERACTIVE_THREADS * SAMPLES_PER_THREAD];
+static size_t next_interactive_id;
+static size_t interactive_done;
+
+static bool batch_stop;
+static uint64_t batch_loops;
+
+[[noreturn]] static void interactive()
+{
+    size_t id = __atomic_fetch_add(&next_interactive_id, 1, __ATOMIC_RELAXED);
+    uint64_t *out = &samples[id * SAMPLES_PER_THREAD];
+
+    for (size_t i = 0; i < SAMPLES_PER_THREAD; i++)
+    {
+        // Stagger the threads so that they do not all wake up together.
+        thread_t *self = sched_get_curr_thread();
+        self->sleep_until = arch_timer_get_uptime_ns() + SLEEP_NS + id * SLEEP_NS / INTERACTIVE_THREADS;
+        uint64_t due = self->sleep_until;
+        sched_yield(THREAD_STATE_SLEEPING);
+
+        uint64_t now = arch_timer_get_uptime_ns();
+        out[i] = now > due ? now - due : 0;
+
+        // A short burst of work, well within the top level's quantum.
+        for (volatile size_t j = 0; j < 1000; j++)
+            ;
+    }
+
+    // The last one to finish ends the load.
+    if (__atomic_add_fetch(&interactive_done, 1, __ATOMIC_RELAXED) == INTERACTIVE_THREADS)
+        __atomic_store_n(&batch_stop, true, __ATOMIC_RELAXED);
+    bench_exit();
+}
+
+[[noreturn]] static void batch()
+{
+    uint64_t loops = 0;
+    while (!__atomic_load_n(&batch_stop, __ATOMIC_RELAXED))
+        loops++;
+
+    __atomic_fetch_add(&batch_loops, loops, __ATOMIC_RELAXED);
+    bench_exit();
+}
+
+static void sort(uint64_t *values, size_t count)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        uint64_t v = values[i];
+        size_t j = i;
+        for (; j > 0 && values[j - 1] > v; j--)
+            values[j] = values[j - 1];
+        values[j] = v;
+    }
+}
+
+static uint64_t percentile(uint64_t *sorted, size_t count, size_t pct)
+{
+    return sorted[(count - 1) * pct / 100];
+}
+
+static void run(size_t batch_threads)
+{
+    next_interactive_id = 0;
+    interactive_done = 0;
+    batch_stop = false;
+    batch_loops = 0;
+
+    bool spawned = true;
+    for (size_t i = 0; spawned && i < batch_threads; i++)
+        spawned = bench_spawn(batch, NULL);
+    for (size_t i = 0; spawned && i < INTERACTIVE_THREADS; i++)
+        spawned = bench_spawn(interactive, NULL);
+    if (!spawned)
+        __atomic_store_n(&batch_stop, true, __ATOMIC_RELAXED);
+    bench_join();
+    if (!spawned)
+        return;
+
+    size_t count = INTERACTIVE_THREADS * SAMPLES_PER_THREAD;
+    sort(samples, count);
+    log(LOG_INFO, "sched_bench: %lu batch thread(s): wake-up latency p50 %llu us, p90 %llu us, p99 %llu us, max %llu us (%llu batch loops)",
+        batch_threads,
+        percentile(samples, count, 50) / 1000, percentile(samples, count, 90) / 1000,
+        percentile(samples, count, 99) / 1000, samples[count - 1] / 1000, batch_loops);
+}
+
+[[noreturn]] static void controller()
+{
+    run(0);
+    run(MIN(BATCH_PER_CPU * smp_cpus.length, BENCH_MAX_THREADS - INTERACTIVE_THREADS));
+
+    log(LOG_INFO, "sched_bench: done.");
+    bench_exit();
+}
+
+void __module_install()
+{
+    bench_start("sched_bench", controller);
+}
+
+void __module_destroy()
+{
+}
+
+MODULE_NAME("sched_bench")
+MODULE_VERSION("0.1")
+MODULE_DESCRIPTION("Wake-up latency of interactive threads under batch load.")
+MODULE_AUTHOR("LykOS team")
@@ -0,0 +1,111 @@
+#include "../bench.h"
+#include "arch/timer.h"
+#include "log.h"
+#include "mod/module.h"
+#include "proc/sched.h"
+#include "proc/smp.h"
+
+/*
+ * Context switch latency.
+ *
+ * Two threads pinned to the same CPU hand it to each other with
+ * `sched_yield` and the average time per switch is reported. The pair runs
+ * with neither thread, one or both touching SIMD registers between switches,
+ * which shows what saving and restoring the FPU state costs.
+ */
+
+#define ROUNDS 100000
+
+static cpumask_t bench_cpu;
+
+static size_t simd_threads;
+static size_t next_id;
+static size_t running;
+static size_t finished;
+static uint64_t start, end;
+
+static inline void touch_simd(uint64_t *v)
+{
+#if defined(__x86_64__)
+    asm volatile("movdqu %0, %%xmm0\n"
+                 "paddq %%xmm0, %%xmm0\n"
+                 "movdqu %%xmm0, %0" : "+m"(*(uint64_t (*)[2])v));
+#endif
+}
+
+[[noreturn]] static void pinger()
+{
+    bool simd = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) < simd_threads;
+    uint64_t v[2] = { 1, 1 };
+
+    // Start once both threads are on the CPU.
+    __atomic_fetch_add(&running, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED) < 2)
+        sched_yield(THREAD_STATE_READY);
+
+    uint64_t now = arch_timer_get_uptime_ns();
+    uint64_t expected = 0;
+    __atomic_compare_exchange_n(&start, &expected, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < ROUNDS; i++)
+    {
+        if (simd)
+            touch_simd(v);
+        sched_yield(THREAD_STATE_READY);
+    }
+
+    if (__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED) == 2)
+        end = arch_timer_get_uptime_ns();
+
+    bench_exit();
+}
+
+static void run(size_t simd)
+{
+    simd_threads = simd;
+    next_id = 0;
+    running = 0;
+    finished = 0;
+    start = end = 0;
+
+    bool spawned = bench_spawn(pinger, &bench_cpu) && bench_spawn(pinger, &bench_cpu);
+    // Stand in for the missing thread at the start.
+    if (!spawned)
+        __atomic_fetch_add(&running, 1, __ATOMIC_RELAXED);
+    bench_join();
+    if (!spawned)
+        return;
+
+    log(LOG_INFO, "switch_bench: %lu of 2 thread(s) using SIMD: %llu ns per switch",
+        simd, (end - start) / (2 * ROUNDS));
+}
+
+[[noreturn]] static void controller()
+{
+    smp_cpu_t *cpu = LIST_GET_CONTAINER(LIST_FIRST(&smp_cpus), smp_cpu_t, cpu_list_node);
+    bench_cpu = (cpumask_t) { 0 };
+    cpumask_set(&bench_cpu, cpu->id);
+
+    run(0);
+#if defined(__x86_64__)
+    run(1);
+    run(2);
+#endif
+
+    log(LOG_INFO, "switch_bench: done.");
+    bench_exit();
+}
+
+void __module_install()
+{
+    bench_start("switch_bench", controller);
+}
+
+void __module_destroy()
+{
+}
+
+MODULE_NAME("switch_bench")
+MODULE_VERSION("0.1")
+MODULE_DESCRIPTION("Context switch latency with and without SIMD-using threads.")
+MODULE_AUTHOR("LykOS team")
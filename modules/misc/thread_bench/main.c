@@ -0,0 +1,72 @@
+#include "../bench.h"
+#include "arch/timer.h"
+#include "log.h"
+#include "mm/pm.h"
+#include "mod/module.h"
+#include "proc/smp.h"
+#include "utils/math.h"
+
+/*
+ * Thread create/join throughput.
+ *
+ * Batches of threads that exit right away are created and joined until
+ * `THREADS` have run, one at a time and with a batch per CPU's worth, and the
+ * rate is reported. Free pages are counted before and after each run, so
+ * that a leak in thread exit shows up as a growing difference; the per-CPU
+ * caches account for a small constant one.
+ */
+
+#define THREADS 20000
+#define MAX_BATCH 64
+
+[[noreturn]] static void worker()
+{
+    bench_exit();
+}
+
+static void run(size_t batch_size)
+{
+    size_t free_before = pm_free_page_count();
+    uint64_t start = arch_timer_get_uptime_ns();
+
+    for (size_t done = 0; done < THREADS; done += batch_size)
+    {
+        bool spawned = true;
+        for (size_t i = 0; spawned && i < batch_size; i++)
+            spawned = bench_spawn(worker, NULL);
+        bench_join();
+        if (!spawned)
+            return;
+    }
+
+    uint64_t elapsed = arch_timer_get_uptime_ns() - start;
+    size_t free_after = pm_free_page_count();
+    log(LOG_INFO, "thread_bench: batches of %lu: %llu threads/s, %llu ns per create+join, %ld pages not returned",
+        batch_size, THREADS * 1000000000ull / elapsed, elapsed / THREADS,
+        (long)free_before - (long)free_after);
+}
+
+[[noreturn]] static void controller()
+{
+    run(1);
+    run(MIN(2 * smp_cpus.length, MAX_BATCH));
+    // Once more, with the caches warm.
+    run(1);
+
+    log(LOG_INFO, "thread_bench: done.");
+    bench_exit();
+}
+
+void __module_install()
+{
+    bench_start("thread_bench", controller);
+}
+
+void __module_destroy()
+{
+}
+
+MODULE_NAME("thread_bench")
+MODULE_VERSION("0.1")
+MODULE_DESCRIPTION("Thread create/join throughput and exit leak check.")
+MODULE_AUTHOR("LykOS team")